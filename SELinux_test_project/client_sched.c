@@ -0,0 +1,457 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <sys/socket.h>
+
+#include "client_sched.h"
+#include "service_log.h"
+
+#define SCHED_BUCKETS 64                  // 客户端哈希表的桶数，2的幂
+#define SCHED_MAX_WEIGHTS 64              // --client-weights中的项数上限
+#define SCHED_QUANTUM (1024 * 1024)       // 每轮按权重给客户端增加的额度
+#define SCHED_BASE_COST (64 * 1024)       // 每个请求的固定开销(打开、落盘等)，按字节折算
+#define SCHED_MAX_COST (16 * SCHED_QUANTUM)  // 单个请求的开销上限，避免为大文件空转很多轮
+
+struct sched_client {
+    struct sched_client *hash_next;
+    struct sched_client *ring_prev;   // 有排队请求的客户端组成的环
+    struct sched_client *ring_next;
+    uid_t uid;
+    pid_t pid;
+    unsigned int weight;
+    unsigned int refs;                // 连接数
+    sched_job *queue_head;            // 普通请求的队列
+    sched_job *queue_tail;
+    sched_job *priority_head;         // 廉价请求的队列，轮到该客户端时先于普通请求执行
+    sched_job *priority_tail;
+    sched_job *parked_head;           // 暂停接收的连接，按暂停的顺序交还
+    sched_job *parked_tail;
+    uint32_t reading;                 // 已占用名额、正在接收请求头的连接数
+    uint32_t queued;                  // 排队的请求数，包括廉价请求
+    uint32_t running;
+    uint32_t parked_count;
+    uint64_t running_bytes;
+    uint64_t deficit;                 // 轮转中尚未用完的额度
+    uint64_t served;
+    uint64_t throttled;
+    char label[SCHED_LABEL_LEN];
+};
+
+typedef struct {
+    uid_t uid;
+    unsigned int weight;
+} sched_weight;
+
+static sched_weight weights[SCHED_MAX_WEIGHTS];
+static size_t weight_count;
+static int queue_capacity;
+static uint32_t max_client_requests;
+static uint64_t max_client_bytes;
+
+// 以下由sched_mutex保护
+static pthread_mutex_t sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t not_full = PTHREAD_COND_INITIALIZER;
+static sched_client *buckets[SCHED_BUCKETS];
+static size_t client_count;
+static sched_client *cursor;          // 轮转的当前位置，没有排队的请求时为NULL
+static size_t active_count;           // 环中的客户端数
+static int depth;                     // 排队的请求总数
+
+static int parse_weights(const char *spec) {
+    weight_count = 0;
+    if (!spec || !*spec) {
+        return 0;
+    }
+    char *copy = strdup(spec);
+    if (!copy) {
+        return -1;
+    }
+    int ret = 0;
+    char *save;
+    for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        if (!eq || eq == item || weight_count == SCHED_MAX_WEIGHTS) {
+            ret = -1;
+            break;
+        }
+        *eq = '\0';
+        char *end;
+        unsigned long weight = strtoul(eq + 1, &end, 10);
+        if (*end != '\0' || weight == 0 || weight > 1000) {
+            ret = -1;
+            break;
+        }
+        unsigned long uid = strtoul(item, &end, 10);
+        if (*end != '\0') {
+            // 用户名
+            struct passwd *pw = getpwnam(item);
+            if (!pw) {
+                ret = -1;
+                break;
+            }
+            uid = pw->pw_uid;
+        }
+        weights[weight_count].uid = (uid_t)uid;
+        weights[weight_count].weight = (unsigned int)weight;
+        weight_count++;
+    }
+    free(copy);
+    if (ret != 0) {
+        errno = EINVAL;
+    }
+    return ret;
+}
+
+int client_sched_init(int capacity, int max_requests, uint64_t max_bytes, const char *spec) {
+    queue_capacity = capacity;
+    max_client_requests = (uint32_t)max_requests;
+    max_client_bytes = max_bytes;
+    return parse_weights(spec);
+}
+
+static unsigned int weight_of(uid_t uid) {
+    for (size_t i = 0; i < weight_count; i++) {
+        if (weights[i].uid == uid) {
+            return weights[i].weight;
+        }
+    }
+    return 1;
+}
+
+static size_t bucket_of(uid_t uid, const char *label) {
+    uint64_t h = 14695981039346656037ULL ^ uid;
+    for (const unsigned char *p = (const unsigned char *)label; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h & (SCHED_BUCKETS - 1);
+}
+
+sched_client *client_sched_attach(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+        return NULL;
+    }
+    // 没有启用LSM时SO_PEERSEC返回ENOPROTOOPT，此时只按uid区分
+    char label[SCHED_LABEL_LEN];
+    len = sizeof(label) - 1;
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERSEC, label, &len) != 0) {
+        len = 0;
+    }
+    label[len] = '\0';
+
+    size_t bucket = bucket_of(cred.uid, label);
+    pthread_mutex_lock(&sched_mutex);
+    sched_client *client = buckets[bucket];
+    while (client && (client->uid != cred.uid || strcmp(client->label, label) != 0)) {
+        client = client->hash_next;
+    }
+    if (!client) {
+        client = calloc(1, sizeof(sched_client));
+        if (!client) {
+            pthread_mutex_unlock(&sched_mutex);
+            errno = ENOMEM;
+            return NULL;
+        }
+        client->uid = cred.uid;
+        client->weight = weight_of(cred.uid);
+        memcpy(client->label, label, len + 1);
+        client->hash_next = buckets[bucket];
+        buckets[bucket] = client;
+        client_count++;
+    }
+    client->pid = cred.pid;
+    client->refs++;
+    pthread_mutex_unlock(&sched_mutex);
+    return client;
+}
+
+// 没有连接和请求时删除客户端，调用者持有sched_mutex
+static void release_if_idle(sched_client *client) {
+    if (client->refs > 0 || client->reading > 0 || client->queued > 0 || client->running > 0) {
+        return;
+    }
+    sched_client **p = &buckets[bucket_of(client->uid, client->label)];
+    while (*p != client) {
+        p = &(*p)->hash_next;
+    }
+    *p = client->hash_next;
+    client_count--;
+    free(client);
+}
+
+static int over_limit(const sched_client *client) {
+    return client->reading + client->queued + client->running >= max_client_requests;
+}
+
+// 占用一个名额，调用者持有sched_mutex
+static void admit(sched_job *job) {
+    job->admitted = 1;
+    job->client->reading++;
+}
+
+// 客户端降到上限以下时按空出的名额数取出最早暂停的连接，并为其占用名额，
+// 使暂停的连接先于之后才要接收请求的连接，调用者持有sched_mutex
+static sched_job *take_parked(sched_client *client) {
+    sched_job *resumed = NULL;
+    sched_job **tail = &resumed;
+    while (client->parked_head && !over_limit(client)) {
+        sched_job *job = client->parked_head;
+        client->parked_head = job->next;
+        client->parked_count--;
+        admit(job);
+        *tail = job;
+        tail = &job->next;
+    }
+    *tail = NULL;
+    if (!client->parked_head) {
+        client->parked_tail = NULL;
+    }
+    return resumed;
+}
+
+sched_job *client_sched_detach(sched_job *job) {
+    sched_client *client = job->client;
+    if (!client) {
+        return NULL;
+    }
+    sched_job *resumed = NULL;
+    pthread_mutex_lock(&sched_mutex);
+    client->refs--;
+    if (job->admitted) {
+        job->admitted = 0;
+        client->reading--;
+        resumed = take_parked(client);
+    }
+    release_if_idle(client);
+    pthread_mutex_unlock(&sched_mutex);
+    return resumed;
+}
+
+int client_sched_admit(sched_job *job) {
+    pthread_mutex_lock(&sched_mutex);
+    int admitted = !over_limit(job->client);
+    if (admitted) {
+        admit(job);
+    }
+    pthread_mutex_unlock(&sched_mutex);
+    return admitted;
+}
+
+int client_sched_park(sched_job *job) {
+    sched_client *client = job->client;
+    pthread_mutex_lock(&sched_mutex);
+    if (!over_limit(client)) {
+        admit(job);
+        pthread_mutex_unlock(&sched_mutex);
+        return 0;
+    }
+    job->next = NULL;
+    if (client->parked_tail) {
+        client->parked_tail->next = job;
+    } else {
+        client->parked_head = job;
+    }
+    client->parked_tail = job;
+    client->parked_count++;
+    client->throttled++;
+    if (client->parked_count == 1) {
+        slog(SLOG_CONN, LOG_INFO, "客户端(uid %u，pid %d，%s)有 %u 个请求未完成，暂停接收其请求",
+             (unsigned int)client->uid, (int)client->pid, client->label[0] ? client->label : "无上下文",
+             client->reading + client->queued + client->running);
+    }
+    pthread_mutex_unlock(&sched_mutex);
+    return 1;
+}
+
+// 把客户端加入轮转的环，排在当前位置之前(即本轮的最后)
+static void ring_insert(sched_client *client) {
+    if (!cursor) {
+        client->ring_prev = client->ring_next = client;
+        cursor = client;
+    } else {
+        client->ring_next = cursor;
+        client->ring_prev = cursor->ring_prev;
+        cursor->ring_prev->ring_next = client;
+        cursor->ring_prev = client;
+    }
+    active_count++;
+}
+
+static void ring_remove(sched_client *client) {
+    if (client->ring_next == client) {
+        cursor = NULL;
+    } else {
+        client->ring_prev->ring_next = client->ring_next;
+        client->ring_next->ring_prev = client->ring_prev;
+        if (cursor == client) {
+            cursor = client->ring_next;
+        }
+    }
+    client->ring_prev = client->ring_next = NULL;
+    client->deficit = 0;
+    active_count--;
+}
+
+static uint64_t job_cost(uint64_t bytes) {
+    return bytes < SCHED_MAX_COST - SCHED_BASE_COST ? SCHED_BASE_COST + bytes : SCHED_MAX_COST;
+}
+
+void client_sched_push(sched_job *job) {
+    sched_client *client = job->client;
+    job->next = NULL;
+    job->cost = job_cost(job->bytes);
+
+    pthread_mutex_lock(&sched_mutex);
+    while (depth >= queue_capacity) {
+        pthread_cond_wait(&not_full, &sched_mutex);
+    }
+    if (!client->queue_head && !client->priority_head) {
+        ring_insert(client);
+    }
+    sched_job **head = job->priority ? &client->priority_head : &client->queue_head;
+    sched_job **tail = job->priority ? &client->priority_tail : &client->queue_tail;
+    if (*tail) {
+        (*tail)->next = job;
+    } else {
+        *head = job;
+    }
+    *tail = job;
+    job->admitted = 0;
+    client->reading--;
+    client->queued++;
+    depth++;
+    pthread_cond_signal(&not_empty);
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+// 执行中的字节数已达上限；没有执行中的请求时总是可以执行，否则超过上限的大请求永远不会执行
+static int bytes_blocked(const sched_client *client, const sched_job *job) {
+    return client->running > 0 && client->running_bytes + job->bytes > max_client_bytes;
+}
+
+// 选出下一个请求并移出队列，调用者持有sched_mutex
+static sched_job *pick_job(void) {
+    // 差额轮转：额度够执行队首请求的客户端执行它，否则增加额度后轮到下一个客户端。
+    // 客户端的廉价请求排在它的普通请求之前，同样消耗额度，不受字节数上限限制
+    sched_client *client = cursor;
+    size_t blocked = 0;
+    while (client && blocked < active_count) {
+        int priority = client->priority_head != NULL;
+        sched_job *job = priority ? client->priority_head : client->queue_head;
+        if (!priority && bytes_blocked(client, job)) {
+            blocked++;
+            client = client->ring_next;
+            continue;
+        }
+        blocked = 0;
+        if (client->deficit >= job->cost) {
+            client->deficit -= job->cost;
+            if (priority) {
+                client->priority_head = job->next;
+                if (!client->priority_head) {
+                    client->priority_tail = NULL;
+                }
+            } else {
+                client->queue_head = job->next;
+                if (!client->queue_head) {
+                    client->queue_tail = NULL;
+                }
+            }
+            if (!client->queue_head && !client->priority_head) {
+                ring_remove(client);
+            } else {
+                cursor = client;
+            }
+            return job;
+        }
+        client->deficit += (uint64_t)SCHED_QUANTUM * client->weight;
+        client = client->ring_next;
+    }
+    return NULL;
+}
+
+sched_job *client_sched_pop(void) {
+    pthread_mutex_lock(&sched_mutex);
+    sched_job *job;
+    while (!(job = pick_job())) {
+        pthread_cond_wait(&not_empty, &sched_mutex);
+    }
+    sched_client *client = job->client;
+    client->queued--;
+    client->running++;
+    client->running_bytes += job->bytes;
+    client->served++;
+    depth--;
+    pthread_cond_signal(&not_full);
+    pthread_mutex_unlock(&sched_mutex);
+    return job;
+}
+
+void client_sched_charge(sched_job *job, uint64_t bytes) {
+    sched_client *client = job->client;
+    uint64_t cost = job_cost(bytes);
+
+    pthread_mutex_lock(&sched_mutex);
+    client->running_bytes = client->running_bytes - job->bytes + bytes;
+    job->bytes = bytes;
+    if (cost > job->cost) {
+        uint64_t extra = cost - job->cost;
+        client->deficit = client->deficit > extra ? client->deficit - extra : 0;
+    }
+    job->cost = cost;
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+sched_job *client_sched_done(sched_job *job) {
+    sched_client *client = job->client;
+    sched_job *resumed = NULL;
+
+    pthread_mutex_lock(&sched_mutex);
+    client->running--;
+    client->running_bytes -= job->bytes;
+    // 可能有工作线程因该客户端的字节数上限在等待
+    if (client->queue_head) {
+        pthread_cond_broadcast(&not_empty);
+    }
+    resumed = take_parked(client);
+    pthread_mutex_unlock(&sched_mutex);
+    return resumed;
+}
+
+int client_sched_depth(void) {
+    pthread_mutex_lock(&sched_mutex);
+    int count = depth;
+    pthread_mutex_unlock(&sched_mutex);
+    return count;
+}
+
+size_t client_sched_snapshot(sched_client_stats *stats, size_t max) {
+    size_t n = 0;
+    pthread_mutex_lock(&sched_mutex);
+    for (size_t i = 0; i < SCHED_BUCKETS && n < max; i++) {
+        for (const sched_client *c = buckets[i]; c && n < max; c = c->hash_next) {
+            sched_client_stats *s = &stats[n++];
+            s->uid = c->uid;
+            s->pid = c->pid;
+            memcpy(s->label, c->label, sizeof(s->label));
+            s->weight = c->weight;
+            s->connections = c->refs;
+            s->queued = c->queued;
+            s->running = c->running;
+            s->parked = c->parked_count;
+            s->running_bytes = c->running_bytes;
+            s->served = c->served;
+            s->throttled = c->throttled;
+        }
+    }
+    size_t total = client_count;
+    pthread_mutex_unlock(&sched_mutex);
+    return total;
+}
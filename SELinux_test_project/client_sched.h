@@ -0,0 +1,140 @@
+#ifndef CLIENT_SCHED_H
+#define CLIENT_SCHED_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// 按客户端调度请求：连接按对端的uid和SELinux上下文(SO_PEERCRED、SO_PEERSEC)归入客户端，
+// 每个客户端有自己的请求队列，工作线程按权重以差额轮转(DRR)在客户端之间选取请求，
+// 请求的开销为固定部分加上要写入的字节数。查询保留期限等廉价的请求在所属客户端的
+// 另一个队列中，轮到该客户端时先于它的普通请求执行，同样消耗额度。
+// 每个客户端排队和执行中的请求数、执行中的请求要写入的字节数有上限，超过时事件循环
+// 暂停接收该客户端的新请求，请求留在socket中由客户端等待，不挤占其他客户端。
+
+#define SCHED_LABEL_LEN 256
+
+// 一个客户端，连接持有引用
+typedef struct sched_client sched_client;
+
+// 一个请求，嵌在连接中，不另外分配
+typedef struct sched_job {
+    struct sched_job *next;
+    sched_client *client;
+    uint64_t bytes;      // 要写入的字节数，计入客户端执行中的字节数；可在执行时由client_sched_charge修正
+    uint64_t cost;       // 轮转中的开销，由client_sched_push按bytes计算
+    int priority;        // 廉价请求，排在客户端的普通请求之前
+    int admitted;        // 已占用客户端的名额，尚未放入队列
+} sched_job;
+
+// 一个客户端的状态，用于统计
+typedef struct {
+    uid_t uid;
+    pid_t pid;                   // 最近一个连接的进程
+    char label[SCHED_LABEL_LEN]; // SELinux上下文，取不到时为空
+    unsigned int weight;
+    uint32_t connections;
+    uint32_t queued;             // 排队的请求数
+    uint32_t running;            // 工作线程正在执行的请求数
+    uint32_t parked;             // 因超过上限暂停接收的连接数
+    uint64_t running_bytes;
+    uint64_t served;             // 已交给工作线程的请求数
+    uint64_t throttled;          // 超过上限的次数
+} sched_client_stats;
+
+/**
+ * 初始化调度器
+ *
+ * @param capacity 所有客户端排队的请求数上限，满时client_sched_push阻塞
+ * @param max_requests 每个客户端排队和执行中的请求数上限
+ * @param max_bytes 每个客户端执行中的请求要写入的字节数上限，单个请求超过时仍可执行
+ * @param weights 以逗号分隔的"uid=权重"，其他客户端权重为1，NULL或空串为都是1
+ * @return 成功返回 0；weights格式错误时返回 -1，errno为EINVAL
+ */
+int client_sched_init(int capacity, int max_requests, uint64_t max_bytes, const char *weights);
+
+/**
+ * 按连接的对端身份取得客户端，没有时新建
+ *
+ * @param fd 已接受的Unix域socket
+ * @return 客户端；取不到对端身份或内存不足时返回NULL，errno为原因
+ */
+sched_client *client_sched_attach(int fd);
+
+/**
+ * 连接关闭时释放对客户端的引用，没有连接和请求的客户端被删除
+ *
+ * @param job 连接中的请求，job->client为NULL时不做任何事
+ * @return 因释放名额而恢复接收的连接，见client_sched_done
+ */
+sched_job *client_sched_detach(sched_job *job);
+
+/**
+ * 事件循环开始接收连接的下一个请求之前为其占用客户端的一个名额，放入队列时转为排队的请求
+ *
+ * @param job 连接中的请求，job->client为所属的客户端
+ * @return 已占用返回 1；客户端排队和执行中的请求数已达上限时返回 0，调用者应暂停接收
+ */
+int client_sched_admit(sched_job *job);
+
+/**
+ * client_sched_admit返回0后暂停接收job所在连接的请求，直到客户端有请求执行完
+ *
+ * 调用者应先停止监听该连接，暂停的连接由client_sched_done或client_sched_detach交还。
+ *
+ * @param job 连接中的请求
+ * @return 已暂停返回 1；客户端已降到上限以下时占用名额并返回 0，调用者应继续接收
+ */
+int client_sched_park(sched_job *job);
+
+/**
+ * 把收齐请求头的请求放入客户端的普通队列或廉价请求的队列，所有客户端排队的请求数达到上限时阻塞
+ *
+ * @param job 已占用名额并设置了bytes和priority的请求
+ */
+void client_sched_push(sched_job *job);
+
+/**
+ * 取出下一个要执行的请求，没有可执行的请求时阻塞
+ *
+ * 按权重在客户端之间轮转，轮到的客户端先执行其廉价请求；执行中的字节数已达上限的客户端
+ * 只能执行廉价请求，没有时跳过。
+ *
+ * @return 请求，之后须调用client_sched_done
+ */
+sched_job *client_sched_pop(void);
+
+/**
+ * 修正执行中的请求要写入的字节数
+ *
+ * 内容不随请求发送的请求(传递文件、增量同步)入队时只知道固定开销，执行时按源文件的大小补计：
+ * 计入客户端执行中的字节数，多出的开销从客户端在轮转中的额度中扣除(最多扣到0)。
+ *
+ * @param job client_sched_pop返回、尚未client_sched_done的请求
+ * @param bytes 要写入的字节数
+ */
+void client_sched_charge(sched_job *job, uint64_t bytes);
+
+/**
+ * 请求执行完，返回因此恢复接收的连接
+ *
+ * @param job client_sched_pop返回的请求
+ * @return 暂停的连接中的请求组成的链表(以next连接)，调用者应重新监听这些连接；没有时返回NULL
+ */
+sched_job *client_sched_done(sched_job *job);
+
+/**
+ * @return 所有客户端排队的请求数
+ */
+int client_sched_depth(void);
+
+/**
+ * 复制各客户端的状态
+ *
+ * @param stats 输出数组，可以为NULL
+ * @param max 数组长度
+ * @return 客户端总数，可能大于max
+ */
+size_t client_sched_snapshot(sched_client_stats *stats, size_t max);
+
+#endif /* CLIENT_SCHED_H */
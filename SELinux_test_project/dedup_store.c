@@ -0,0 +1,573 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <syslog.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+#include "immutable_service.h"
+#include "dedup_store.h"
+#include "integrity.h"
+#include "dir_cache.h"
+#include "service_log.h"
+
+#define DIGEST_XATTR "trusted.immutable.sha256"   // 内容的哈希，所有硬链接共用
+#define TMP_NAME "tmp"                             // 内容库中正在写入的临时文件为.tmp.XXXXXX
+
+static char store_dir[MAX_PATH_LEN];
+static dev_t store_dev;
+static int store_enabled = 0;
+static unsigned long link_counter = 0;           // 生成链接临时名
+
+// ---- SHA-256 ----
+
+typedef struct {
+#ifdef HAVE_OPENSSL
+    EVP_MD_CTX *md;
+#else
+    uint32_t state[8];
+    uint64_t total;
+    unsigned char buf[64];
+    size_t buf_len;
+#endif
+} digest_ctx;
+
+#ifdef HAVE_OPENSSL
+
+static int digest_init(digest_ctx *ctx) {
+    ctx->md = EVP_MD_CTX_new();
+    if (!ctx->md || EVP_DigestInit_ex(ctx->md, EVP_sha256(), NULL) != 1) {
+        EVP_MD_CTX_free(ctx->md);
+        ctx->md = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+static void digest_update(digest_ctx *ctx, const void *data, size_t len) {
+    EVP_DigestUpdate(ctx->md, data, len);
+}
+
+static void digest_final(digest_ctx *ctx, unsigned char *out) {
+    EVP_DigestFinal_ex(ctx->md, out, NULL);
+    EVP_MD_CTX_free(ctx->md);
+    ctx->md = NULL;
+}
+
+static void digest_free(digest_ctx *ctx) {
+    EVP_MD_CTX_free(ctx->md);
+    ctx->md = NULL;
+}
+
+#else
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t ror32(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_block(uint32_t *state, const unsigned char *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+               (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) + ((e & f) ^ (~e & g)) +
+                      sha256_k[i] + w[i];
+        uint32_t t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+static int digest_init(digest_ctx *ctx) {
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(ctx->state, init, sizeof(init));
+    ctx->total = 0;
+    ctx->buf_len = 0;
+    return 0;
+}
+
+static void digest_update(digest_ctx *ctx, const void *data, size_t len) {
+    const unsigned char *p = data;
+    ctx->total += len;
+    if (ctx->buf_len > 0) {
+        size_t n = 64 - ctx->buf_len < len ? 64 - ctx->buf_len : len;
+        memcpy(ctx->buf + ctx->buf_len, p, n);
+        ctx->buf_len += n;
+        p += n;
+        len -= n;
+        if (ctx->buf_len < 64) {
+            return;
+        }
+        sha256_block(ctx->state, ctx->buf);
+        ctx->buf_len = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64) {
+        sha256_block(ctx->state, p);
+    }
+    memcpy(ctx->buf, p, len);
+    ctx->buf_len = len;
+}
+
+static void digest_final(digest_ctx *ctx, unsigned char *out) {
+    uint64_t bits = ctx->total * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t pad_len = (ctx->buf_len < 56 ? 56 : 120) - ctx->buf_len;
+    for (int i = 0; i < 8; i++) {
+        pad[pad_len + i] = bits >> (56 - 8 * i);
+    }
+    digest_update(ctx, pad, pad_len + 8);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = ctx->state[i] >> 24;
+        out[4 * i + 1] = ctx->state[i] >> 16;
+        out[4 * i + 2] = ctx->state[i] >> 8;
+        out[4 * i + 3] = ctx->state[i];
+    }
+}
+
+static void digest_free(digest_ctx *ctx) {
+    (void)ctx;
+}
+
+#endif
+
+// ---- 内容库 ----
+
+struct dedup_writer {
+    int fd;
+    char tmp_path[MAX_PATH_LEN];
+    digest_ctx digest;
+};
+
+// 内容在库中的路径: store_dir/ab/abcd...，create为真时创建所在的子目录
+static int blob_path(const unsigned char *digest, char *path, size_t len, int create) {
+    char hex[2 * DEDUP_DIGEST_LEN + 1];
+    for (int i = 0; i < DEDUP_DIGEST_LEN; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+    }
+    if (snprintf(path, len, "%s/%.2s", store_dir, hex) >= (int)len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (create && mkdir(path, 0700) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    size_t dir_len = strlen(path);
+    snprintf(path + dir_len, len - dir_len, "/%s", hex);
+    return 0;
+}
+
+int dedup_store_init(const char *dir) {
+    if (snprintf(store_dir, sizeof(store_dir), "%s", dir) >= (int)sizeof(store_dir) - 2 * DEDUP_DIGEST_LEN - 4) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (mkdir(store_dir, 0700) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    struct stat st;
+    if (stat(store_dir, &st) != 0) {
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+    store_dev = st.st_dev;
+
+    // 上次运行中断时留下的临时文件
+    DIR *d = opendir(store_dir);
+    if (d) {
+        struct dirent *ent;
+        while ((ent = readdir(d)) != NULL) {
+            if (strncmp(ent->d_name, "." TMP_NAME ".", strlen(TMP_NAME) + 2) == 0) {
+                unlinkat(dirfd(d), ent->d_name, 0);
+            }
+        }
+        closedir(d);
+    }
+
+    store_enabled = 1;
+    slog(SLOG_INFO, LOG_NOTICE, "内容去重已启用，内容库: %s", store_dir);
+    return 0;
+}
+
+int dedup_store_usable(const char *path) {
+    if (!store_enabled) {
+        return 0;
+    }
+    const char *name;
+    dir_ref *dir = dir_cache_parent(path, 0, &name);
+    if (!dir) {
+        return 0;
+    }
+    struct stat st;
+    int usable = fstat(dir_ref_fd(dir), &st) == 0 && st.st_dev == store_dev;
+    dir_cache_release(dir);
+    return usable;
+}
+
+// 读取dir_fd中name的内容哈希，不跟随符号链接
+static int ref_at(int dir_fd, const char *name, unsigned char *digest) {
+    int fd = openat(dir_fd, name, O_RDONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        return 0;
+    }
+    int ret = fgetxattr(fd, DIGEST_XATTR, digest, DEDUP_DIGEST_LEN) == DEDUP_DIGEST_LEN;
+    close(fd);
+    return ret;
+}
+
+int dedup_store_ref(const char *path, unsigned char *digest) {
+    if (!store_enabled) {
+        return 0;
+    }
+    const char *name;
+    dir_ref *dir = dir_cache_parent(path, 0, &name);
+    if (!dir) {
+        return 0;
+    }
+    int ret = ref_at(dir_ref_fd(dir), name, digest);
+    dir_cache_release(dir);
+    return ret;
+}
+
+// 库中的链接是唯一的链接时内容已不被引用。与同时进行的链接可能交错：对方在stat之后链接，
+// 删除的只是库中的名字，对方的文件不受影响，之后同样的内容会重新存入；对方在删除之后链接
+// 会失败(ENOENT)，由对方重新存入
+void dedup_store_unref(const unsigned char *digest) {
+    if (!store_enabled) {
+        return;
+    }
+    char path[MAX_PATH_LEN];
+    struct stat st;
+    if (blob_path(digest, path, sizeof(path), 0) == 0 && stat(path, &st) == 0 && st.st_nlink == 1) {
+        unlink(path);
+    }
+}
+
+// 在dir_fd中为blob建立硬链接，再原子地替换其中的name
+static int link_into(const char *blob, int dir_fd, const char *name) {
+    char tmp_name[NAME_MAX + 1];
+    for (int attempt = 0; attempt < 100; attempt++) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        unsigned long n = __atomic_add_fetch(&link_counter, 1, __ATOMIC_RELAXED);
+        if (snprintf(tmp_name, sizeof(tmp_name), ".%s.%lx%lx", name, (unsigned long)ts.tv_nsec, n) >=
+            (int)sizeof(tmp_name)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        if (linkat(AT_FDCWD, blob, dir_fd, tmp_name, 0) == 0) {
+            if (renameat(dir_fd, tmp_name, dir_fd, name) != 0) {
+                int err = errno;
+                unlinkat(dir_fd, tmp_name, 0);
+                errno = err;
+                return -1;
+            }
+            return 0;
+        }
+        if (errno != EEXIST) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+static int writer_open(dedup_writer *w) {
+    char name[MAX_PATH_LEN];
+    if (snprintf(name, sizeof(name), "%s/%s", store_dir, TMP_NAME) >= (int)sizeof(name)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    w->fd = create_temp_file(name, w->tmp_path, sizeof(w->tmp_path));
+    return w->fd == -1 ? -1 : 0;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    for (size_t off = 0; off < len; ) {
+        ssize_t n = write(fd, (const char *)data + off, len - off);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+static void writer_discard(dedup_writer *w) {
+    if (w->fd != -1) {
+        close(w->fd);
+        unlink(w->tmp_path);
+        w->fd = -1;
+    }
+}
+
+// 按哈希存入内容并链接到path。w为NULL或尚未打开临时文件时，内容不在库中才写入data
+static int store_commit(const unsigned char *digest, dedup_writer *w, const void *data, size_t len,
+                        const char *path, int *unchanged) {
+    char blob[MAX_PATH_LEN];
+    dedup_writer local = { .fd = -1 };
+    if (!w) {
+        w = &local;
+    }
+    *unchanged = 0;
+    if (blob_path(digest, blob, sizeof(blob), 1) != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法创建内容库的目录: %s", strerror(errno));
+        writer_discard(w);
+        return -1;
+    }
+
+    // path所在的目录经由目录缓存打开，之后的检查和链接都相对于它进行，设置了根目录时不会离开根目录
+    const char *name;
+    dir_ref *dir = dir_cache_parent(path, 0, &name);
+    if (!dir) {
+        slog(SLOG_ERROR, LOG_ERR, "无法打开 %s 所在的目录: %s", path, strerror(errno));
+        writer_discard(w);
+        return -1;
+    }
+    int dir_fd = dir_ref_fd(dir);
+
+    unsigned char old[DEDUP_DIGEST_LEN];
+    int has_old = ref_at(dir_fd, name, old);
+    int ret = -1;
+    for (int attempt = 0; attempt < 3; attempt++) {
+        struct stat bst, pst;
+        if (stat(blob, &bst) == 0) {
+            if (fstatat(dir_fd, name, &pst, AT_SYMLINK_NOFOLLOW) == 0 &&
+                pst.st_dev == bst.st_dev && pst.st_ino == bst.st_ino) {
+                *unchanged = 1;
+                ret = 0;
+                break;
+            }
+            if (link_into(blob, dir_fd, name) == 0) {
+                ret = 0;
+                break;
+            }
+            if (errno != ENOENT) {
+                slog(SLOG_ERROR, LOG_ERR, "无法将 %s 链接到内容库: %s", path, strerror(errno));
+                break;
+            }
+            continue;  // 内容刚被回收，重新存入
+        }
+
+        // 内容不在库中：写入临时文件，落盘后以哈希为名加入库中
+        if (w->fd == -1 && (writer_open(w) != 0 || write_all(w->fd, data, len) != 0)) {
+            slog(SLOG_ERROR, LOG_ERR, "无法写入内容库: %s", strerror(errno));
+            break;
+        }
+        fchmod(w->fd, 0644);
+        if (fsetxattr(w->fd, DIGEST_XATTR, digest, DEDUP_DIGEST_LEN, 0) != 0) {
+            slog(SLOG_ERROR, LOG_WARNING, "无法记录 %s 的内容哈希: %s", w->tmp_path, strerror(errno));
+        }
+        integrity_record_fd(w->fd, w->tmp_path);
+        if (fsync(w->fd) != 0) {
+            slog(SLOG_ERROR, LOG_ERR, "无法将 %s 写入磁盘: %s", w->tmp_path, strerror(errno));
+            break;
+        }
+        if (link(w->tmp_path, blob) != 0) {
+            if (errno == EEXIST) {
+                continue;  // 同样的内容刚被其他请求存入
+            }
+            slog(SLOG_ERROR, LOG_ERR, "无法将内容加入内容库: %s", strerror(errno));
+            break;
+        }
+        // 临时文件的链接在path链接上之后才删除，期间回收线程不会认为内容无人引用
+        ret = link_into(blob, dir_fd, name);
+        if (ret != 0) {
+            slog(SLOG_ERROR, LOG_ERR, "无法将 %s 链接到内容库: %s", path, strerror(errno));
+        }
+        break;
+    }
+
+    int err = errno;
+    dir_cache_release(dir);
+    writer_discard(w);
+    if (ret == 0 && has_old && memcmp(old, digest, DEDUP_DIGEST_LEN) != 0) {
+        dedup_store_unref(old);
+    }
+    errno = err;
+    return ret;
+}
+
+int dedup_store_data(const char *path, const void *data, size_t len, int *unchanged) {
+    digest_ctx ctx;
+    unsigned char digest[DEDUP_DIGEST_LEN];
+    if (digest_init(&ctx) != 0) {
+        return -1;
+    }
+    digest_update(&ctx, data, len);
+    digest_final(&ctx, digest);
+    return store_commit(digest, NULL, data, len, path, unchanged);
+}
+
+dedup_writer *dedup_writer_begin(void) {
+    dedup_writer *w = malloc(sizeof(*w));
+    if (!w) {
+        return NULL;
+    }
+    if (digest_init(&w->digest) != 0) {
+        free(w);
+        return NULL;
+    }
+    if (writer_open(w) != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法在内容库中创建临时文件: %s", strerror(errno));
+        digest_free(&w->digest);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+int dedup_writer_write(dedup_writer *w, const void *data, size_t len) {
+    digest_update(&w->digest, data, len);
+    if (write_all(w->fd, data, len) != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "写入文件 %s 时出错: %s", w->tmp_path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int dedup_writer_commit(dedup_writer *w, const char *path, int *unchanged) {
+    unsigned char digest[DEDUP_DIGEST_LEN];
+    digest_final(&w->digest, digest);
+    int ret = store_commit(digest, w, NULL, 0, path, unchanged);
+    int err = errno;
+    free(w);
+    errno = err;
+    return ret;
+}
+
+void dedup_writer_abort(dedup_writer *w) {
+    writer_discard(w);
+    digest_free(&w->digest);
+    free(w);
+}
+
+// 删除库中只剩一个链接的内容
+static void collect_unreferenced(void) {
+    DIR *d = opendir(store_dir);
+    if (!d) {
+        slog(SLOG_ERROR, LOG_ERR, "无法读取内容库 %s: %s", store_dir, strerror(errno));
+        return;
+    }
+    size_t removed = 0;
+    uint64_t bytes = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.' || strlen(ent->d_name) != 2) {
+            continue;
+        }
+        int sub_fd = openat(dirfd(d), ent->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR *sub = sub_fd == -1 ? NULL : fdopendir(sub_fd);
+        if (!sub) {
+            if (sub_fd != -1) {
+                close(sub_fd);
+            }
+            continue;
+        }
+        struct dirent *blob;
+        while ((blob = readdir(sub)) != NULL) {
+            struct stat st;
+            if (blob->d_name[0] == '.' ||
+                fstatat(sub_fd, blob->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+                !S_ISREG(st.st_mode) || st.st_nlink != 1) {
+                continue;
+            }
+            if (unlinkat(sub_fd, blob->d_name, 0) == 0) {
+                removed++;
+                bytes += st.st_size;
+            }
+        }
+        closedir(sub);
+    }
+    closedir(d);
+
+    if (removed > 0) {
+        slog(SLOG_INFO, LOG_NOTICE, "内容库回收了 %zu 份不再被引用的内容 (%lu 字节)", removed,
+             (unsigned long)bytes);
+    }
+}
+
+static void *collector_thread(void *arg) {
+    int interval = *(int *)arg;
+    free(arg);
+
+    while (1) {
+        sleep(interval);
+        collect_unreferenced();
+    }
+    return NULL;
+}
+
+int dedup_store_start_collector(int interval_seconds) {
+    if (!store_enabled) {
+        return 0;
+    }
+    collect_unreferenced();
+
+    int *arg = malloc(sizeof(int));
+    if (!arg) {
+        return -1;
+    }
+    *arg = interval_seconds;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, collector_thread, arg) != 0) {
+        free(arg);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,96 @@
+#ifndef DEDUP_STORE_H
+#define DEDUP_STORE_H
+
+#include <stddef.h>
+
+#define DEDUP_DIGEST_LEN 32   // SHA-256
+
+// 边接收边计算哈希的内容写入器
+typedef struct dedup_writer dedup_writer;
+
+/**
+ * 启用按内容寻址的内容库
+ *
+ * 每份内容按SHA-256存放一次(dir/ab/abcd...)，不可变文件是内容的硬链接，
+ * 内容的引用计数就是inode的链接数。未调用本函数时其他函数都不做任何事。
+ *
+ * @param dir 内容库目录，不存在时创建；其中残留的临时文件会被删除
+ * @return 成功返回 0，失败返回 -1
+ */
+int dedup_store_init(const char *dir);
+
+/**
+ * 检查文件能否使用内容库：已启用，且所在目录与内容库在同一文件系统(硬链接不能跨文件系统)
+ *
+ * @param path 目标文件路径，所在目录必须已存在
+ * @return 可以使用返回 1，否则返回 0
+ */
+int dedup_store_usable(const char *path);
+
+/**
+ * 将内存中的内容存入内容库，并原子地使path成为它的硬链接
+ *
+ * 内容已在库中时不写入数据；path已经指向同样的内容时什么都不做。
+ * path原来指向的内容不再被引用时从库中删除。
+ *
+ * @param path 目标文件路径
+ * @param data 内容
+ * @param len 内容长度
+ * @param unchanged 输出path是否已经是这份内容
+ * @return 成功返回 0，失败返回 -1
+ */
+int dedup_store_data(const char *path, const void *data, size_t len, int *unchanged);
+
+/**
+ * 开始写入一份长度事先不能放入内存的内容，数据先写入内容库中的临时文件
+ *
+ * @return 成功返回写入器，失败返回NULL
+ */
+dedup_writer *dedup_writer_begin(void);
+
+/**
+ * 追加内容
+ *
+ * @return 成功返回 0，失败返回 -1
+ */
+int dedup_writer_write(dedup_writer *w, const void *data, size_t len);
+
+/**
+ * 写完内容后存入内容库并使path成为它的硬链接，语义同dedup_store_data，无论成功与否都释放w
+ *
+ * @return 成功返回 0，失败返回 -1
+ */
+int dedup_writer_commit(dedup_writer *w, const char *path, int *unchanged);
+
+/**
+ * 放弃写入，删除临时文件并释放w
+ */
+void dedup_writer_abort(dedup_writer *w);
+
+/**
+ * 取得path指向的内容的哈希，在删除或替换path之前调用
+ *
+ * @param path 文件路径
+ * @param digest 输出DEDUP_DIGEST_LEN字节的哈希
+ * @return path指向库中的内容返回 1，否则返回 0
+ */
+int dedup_store_ref(const char *path, unsigned char *digest);
+
+/**
+ * 删除或替换path之后调用：内容不再被任何文件引用时从库中删除
+ *
+ * @param digest dedup_store_ref取得的哈希
+ */
+void dedup_store_unref(const unsigned char *digest);
+
+/**
+ * 启动定期回收的线程，删除库中不再被引用的内容
+ *
+ * 删除目录树、批量请求等不经过dedup_store_unref替换或删除的文件，由它回收。
+ *
+ * @param interval_seconds 检查间隔(秒)
+ * @return 成功返回 0，失败返回 -1
+ */
+int dedup_store_start_collector(int interval_seconds);
+
+#endif /* DEDUP_STORE_H */
@@ -0,0 +1,742 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "immutable_service.h"
+#include "selinux_label.h"
+#include "delta_sync.h"
+#include "service_log.h"
+#include "integrity.h"
+
+#define MIN_BLOCK_SIZE 2048
+#define MAX_BLOCK_SIZE (128 * 1024)
+#define WINDOW_SIZE (8 * 1024 * 1024)   // 源文件读缓冲大小
+#define MIN_HOLE_SIZE (64 * 1024)       // 小于此大小的空洞按普通数据处理
+#define COPY_BUFFER_SIZE (1024 * 1024)
+
+typedef enum {
+    OP_MATCH,      // 复用目标文件中的数据
+    OP_LITERAL,    // 从源文件复制
+    OP_HOLE        // 空洞，不写入数据
+} delta_op_type;
+
+typedef struct {
+    delta_op_type type;
+    uint64_t offset;       // 在新文件中的偏移，即源文件中的偏移
+    uint64_t dst_offset;   // OP_MATCH: 在目标文件中的偏移
+    uint64_t len;
+} delta_op;
+
+// 目标文件按块建立的弱校验和索引，链表中存放块号+1
+typedef struct {
+    uint32_t *heads;
+    uint32_t *next;
+    uint32_t *weak;
+    uint32_t shift;
+    uint64_t nblocks;
+} block_index;
+
+// 顺序读取源文件的滑动窗口
+typedef struct {
+    int fd;
+    unsigned char *buf;
+    size_t cap;
+    uint64_t start;    // buf[0]在文件中的偏移
+    size_t len;
+} src_window;
+
+typedef struct {
+    int src_fd;
+    int dst_fd;                // 目标文件不存在时为-1
+    uint64_t src_size;
+    uint64_t dst_size;
+    uint32_t block_size;
+    uint64_t dst_blocks;       // 目标文件中完整块的数量
+    int index_ready;           // 块索引只在需要滚动查找时才建立
+    block_index index;
+    src_window window;
+    unsigned char *cmp_buf;    // 读取目标文件块用于比较
+    delta_op *ops;
+    size_t op_count;
+    size_t op_cap;
+} delta_ctx;
+
+static uint64_t isqrt(uint64_t n) {
+    uint64_t x = n, y = (x + 1) / 2;
+    while (y < x) {
+        x = y;
+        y = (x + n / x) / 2;
+    }
+    return x;
+}
+
+// 块大小取文件大小的平方根，使块数与每块的大小相当
+static uint32_t choose_block_size(uint64_t size) {
+    uint64_t bs = (isqrt(size) + 1023) & ~(uint64_t)1023;
+    if (bs < MIN_BLOCK_SIZE) {
+        bs = MIN_BLOCK_SIZE;
+    }
+    if (bs > MAX_BLOCK_SIZE) {
+        bs = MAX_BLOCK_SIZE;
+    }
+    return (uint32_t)bs;
+}
+
+// rsync的滚动弱校验和，a为字节和，b为加权和
+static void weak_init(const unsigned char *p, size_t len, uint32_t *a, uint32_t *b) {
+    uint32_t s1 = 0, s2 = 0;
+    for (size_t i = 0; i < len; i++) {
+        s1 += p[i];
+        s2 += (uint32_t)(len - i) * p[i];
+    }
+    *a = s1;
+    *b = s2;
+}
+
+static inline uint32_t weak_value(uint32_t a, uint32_t b) {
+    return (a & 0xffff) | (b << 16);
+}
+
+static inline uint32_t weak_bucket(const block_index *idx, uint32_t weak) {
+    return (uint32_t)(weak * 2654435761u) >> idx->shift;
+}
+
+static int op_append(delta_ctx *ctx, delta_op_type type, uint64_t offset,
+                     uint64_t dst_offset, uint64_t len) {
+    if (len == 0) {
+        return 0;
+    }
+
+    // 合并连续的同类操作
+    if (ctx->op_count > 0) {
+        delta_op *last = &ctx->ops[ctx->op_count - 1];
+        if (last->type == type && last->offset + last->len == offset &&
+            (type != OP_MATCH || last->dst_offset + last->len == dst_offset)) {
+            last->len += len;
+            return 0;
+        }
+    }
+
+    if (ctx->op_count == ctx->op_cap) {
+        size_t cap = ctx->op_cap ? ctx->op_cap * 2 : 256;
+        delta_op *ops = realloc(ctx->ops, cap * sizeof(delta_op));
+        if (!ops) {
+            return -1;
+        }
+        ctx->ops = ops;
+        ctx->op_cap = cap;
+    }
+
+    ctx->ops[ctx->op_count++] = (delta_op){ type, offset, dst_offset, len };
+    return 0;
+}
+
+// 读取一整块，文件被截断时返回-1
+static int read_full(int fd, void *buf, size_t len, uint64_t offset) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int build_index(delta_ctx *ctx) {
+    block_index *idx = &ctx->index;
+    idx->nblocks = ctx->dst_blocks;
+    ctx->index_ready = 1;
+    if (idx->nblocks >= UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    uint32_t bits = 1;
+    while (((uint64_t)1 << bits) < idx->nblocks * 2) {
+        bits++;
+    }
+    idx->shift = 32 - bits;
+    idx->heads = calloc((size_t)1 << bits, sizeof(uint32_t));
+    idx->next = malloc(idx->nblocks * sizeof(uint32_t));
+    idx->weak = malloc(idx->nblocks * sizeof(uint32_t));
+    size_t per_read = WINDOW_SIZE / ctx->block_size * ctx->block_size;
+    unsigned char *buf = malloc(per_read);
+    if (!idx->heads || !idx->next || !idx->weak || !buf) {
+        free(buf);
+        return -1;
+    }
+
+    for (uint64_t blk = 0; blk < idx->nblocks; ) {
+        uint64_t count = per_read / ctx->block_size;
+        if (count > idx->nblocks - blk) {
+            count = idx->nblocks - blk;
+        }
+        if (read_full(ctx->dst_fd, buf, count * ctx->block_size, blk * ctx->block_size) != 0) {
+            free(buf);
+            return -1;
+        }
+        for (uint64_t i = 0; i < count; i++, blk++) {
+            uint32_t a, b;
+            weak_init(buf + i * ctx->block_size, ctx->block_size, &a, &b);
+            uint32_t weak = weak_value(a, b);
+            uint32_t bucket = weak_bucket(idx, weak);
+            idx->weak[blk] = weak;
+            idx->next[blk] = idx->heads[bucket];
+            idx->heads[bucket] = (uint32_t)(blk + 1);
+        }
+    }
+
+    free(buf);
+    return 0;
+}
+
+// 返回源文件[off, off+len)在窗口中的位置，数据不足时返回NULL
+static const unsigned char *window_get(src_window *w, uint64_t off, size_t len) {
+    if (off >= w->start && off + len <= w->start + w->len) {
+        return w->buf + (off - w->start);
+    }
+
+    // 保留窗口中off之后的数据，其余部分重新读取
+    if (off >= w->start && off < w->start + w->len) {
+        size_t keep = w->start + w->len - off;
+        memmove(w->buf, w->buf + (off - w->start), keep);
+        w->len = keep;
+    } else {
+        w->len = 0;
+    }
+    w->start = off;
+
+    while (w->len < w->cap) {
+        ssize_t n = pread(w->fd, w->buf + w->len, w->cap - w->len, w->start + w->len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return NULL;
+        }
+        if (n == 0) {
+            break;
+        }
+        w->len += n;
+    }
+
+    if (w->len < len) {
+        errno = EIO;    // 源文件在同步过程中被截断
+        return NULL;
+    }
+    return w->buf;
+}
+
+static int dst_equals(delta_ctx *ctx, uint64_t dst_offset, const unsigned char *data, size_t len) {
+    if (ctx->dst_fd == -1 || dst_offset + len > ctx->dst_size) {
+        return 0;
+    }
+    if (read_full(ctx->dst_fd, ctx->cmp_buf, len, dst_offset) != 0) {
+        return 0;
+    }
+    return memcmp(ctx->cmp_buf, data, len) == 0;
+}
+
+// 在目标文件索引中查找与data相同的块，候选块逐字节比较确认
+static int64_t find_block(delta_ctx *ctx, uint32_t weak, const unsigned char *data, int64_t skip) {
+    block_index *idx = &ctx->index;
+    for (uint32_t e = idx->heads[weak_bucket(idx, weak)]; e; e = idx->next[e - 1]) {
+        int64_t blk = (int64_t)e - 1;
+        if (blk == skip || idx->weak[blk] != weak) {
+            continue;
+        }
+        if (dst_equals(ctx, (uint64_t)blk * ctx->block_size, data, ctx->block_size)) {
+            return blk;
+        }
+    }
+    return -1;
+}
+
+// 对源文件的一段数据区生成匹配/字面量操作
+static int scan_segment(delta_ctx *ctx, uint64_t start, uint64_t end) {
+    const size_t bs = ctx->block_size;
+    uint64_t pos = start;
+    uint64_t literal = start;
+    // 优先尝试与上一个匹配块相邻的块，对齐时即同一偏移的块
+    int64_t expect = (start % bs == 0) ? (int64_t)(start / bs) : -1;
+    int rolling = 0;
+    uint32_t a = 0, b = 0;
+
+    if (ctx->dst_blocks == 0 && end - start >= bs) {
+        return op_append(ctx, OP_LITERAL, start, 0, end - start);
+    }
+
+    while (pos + bs <= end) {
+        // 多取一块用于原地修改的判断，至少多取一个字节用于滚动
+        size_t want = end - pos < 2 * bs ? end - pos : 2 * bs;
+        const unsigned char *p = window_get(&ctx->window, pos, want);
+        if (!p) {
+            return -1;
+        }
+
+        int64_t found = -1;
+        if (expect >= 0 && (uint64_t)expect < ctx->dst_blocks &&
+            dst_equals(ctx, (uint64_t)expect * bs, p, bs)) {
+            found = expect;
+        } else if (expect >= 0 && (uint64_t)expect + 1 < ctx->dst_blocks && want == 2 * bs &&
+                   dst_equals(ctx, ((uint64_t)expect + 1) * bs, p + bs, bs)) {
+            // 原地修改：当前块不同但下一块仍在原来的位置，当前块作为字面量
+            pos += bs;
+            expect++;
+            rolling = 0;
+            continue;
+        } else {
+            if (!ctx->index_ready && build_index(ctx) != 0) {
+                return -1;
+            }
+            if (!rolling) {
+                weak_init(p, bs, &a, &b);
+                rolling = 1;
+            }
+            found = find_block(ctx, weak_value(a, b), p, expect);
+        }
+
+        if (found >= 0) {
+            if (op_append(ctx, OP_LITERAL, literal, 0, pos - literal) != 0 ||
+                op_append(ctx, OP_MATCH, pos, (uint64_t)found * bs, bs) != 0) {
+                return -1;
+            }
+            pos += bs;
+            literal = pos;
+            expect = found + 1;
+            rolling = 0;
+            continue;
+        }
+
+        expect = -1;
+        if (pos + bs == end) {
+            break;
+        }
+
+        // 向后滚动一个字节
+        uint32_t out = p[0], in = p[bs];
+        a = a - out + in;
+        b = b - (uint32_t)bs * out + a;
+        pos++;
+    }
+
+    // 不足一块的尾部只与目标文件同一偏移处比较
+    if (end - pos < bs && pos < end) {
+        const unsigned char *p = window_get(&ctx->window, pos, end - pos);
+        if (!p) {
+            return -1;
+        }
+        if (dst_equals(ctx, pos, p, end - pos)) {
+            if (op_append(ctx, OP_LITERAL, literal, 0, pos - literal) != 0 ||
+                op_append(ctx, OP_MATCH, pos, pos, end - pos) != 0) {
+                return -1;
+            }
+            literal = end;
+        }
+    }
+
+    return op_append(ctx, OP_LITERAL, literal, 0, end - literal);
+}
+
+// 按SEEK_DATA/SEEK_HOLE划分源文件，空洞直接记录，数据区逐段扫描
+static int generate_ops(delta_ctx *ctx) {
+    uint64_t off = 0;
+    uint64_t seg_start = 0;
+
+    while (off < ctx->src_size) {
+        off_t data = lseek(ctx->src_fd, off, SEEK_DATA);
+        if (data == -1) {
+            if (errno != ENXIO) {
+                break;     // 文件系统不支持时整个文件按数据处理
+            }
+            data = ctx->src_size;
+        }
+        if ((uint64_t)data > ctx->src_size) {
+            data = ctx->src_size;
+        }
+
+        if ((uint64_t)data - off >= MIN_HOLE_SIZE || (uint64_t)data == ctx->src_size) {
+            if (off > seg_start && scan_segment(ctx, seg_start, off) != 0) {
+                return -1;
+            }
+            if (op_append(ctx, OP_HOLE, off, 0, data - off) != 0) {
+                return -1;
+            }
+            seg_start = data;
+        }
+        if ((uint64_t)data >= ctx->src_size) {
+            return 0;
+        }
+
+        off_t hole = lseek(ctx->src_fd, data, SEEK_HOLE);
+        if (hole == -1 || (uint64_t)hole > ctx->src_size) {
+            hole = ctx->src_size;
+        }
+        off = hole;
+    }
+
+    if (ctx->src_size > seg_start) {
+        return scan_segment(ctx, seg_start, ctx->src_size);
+    }
+    return 0;
+}
+
+// 优先使用copy_file_range在内核中复制，不支持时退回pread/pwrite
+static int copy_range(int in_fd, uint64_t in_off, int out_fd, uint64_t out_off, uint64_t len) {
+    while (len > 0) {
+        loff_t in_pos = in_off, out_pos = out_off;
+        ssize_t n = copy_file_range(in_fd, &in_pos, out_fd, &out_pos, len, 0);
+        if (n > 0) {
+            in_off += n;
+            out_off += n;
+            len -= n;
+            continue;
+        }
+        if (n == 0) {
+            errno = EIO;
+            return -1;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) {
+            return -1;
+        }
+        break;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    char *buf = malloc(COPY_BUFFER_SIZE);
+    if (!buf) {
+        return -1;
+    }
+    while (len > 0) {
+        size_t chunk = len < COPY_BUFFER_SIZE ? len : COPY_BUFFER_SIZE;
+        if (read_full(in_fd, buf, chunk, in_off) != 0) {
+            free(buf);
+            return -1;
+        }
+        for (size_t done = 0; done < chunk; ) {
+            ssize_t n = pwrite(out_fd, buf + done, chunk - done, out_off + done);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                free(buf);
+                return -1;
+            }
+            done += n;
+        }
+        in_off += chunk;
+        out_off += chunk;
+        len -= chunk;
+    }
+    free(buf);
+    return 0;
+}
+
+static int write_zeros(int fd, uint64_t offset, uint64_t len) {
+    static const char zeros[64 * 1024];
+    while (len > 0) {
+        size_t chunk = len < sizeof(zeros) ? len : sizeof(zeros);
+        ssize_t n = pwrite(fd, zeros, chunk, offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// 按操作列表生成新文件；cloned表示tmp_fd已是目标文件的reflink副本
+static int apply_ops(delta_ctx *ctx, int tmp_fd, int cloned) {
+    for (size_t i = 0; i < ctx->op_count; i++) {
+        const delta_op *op = &ctx->ops[i];
+        switch (op->type) {
+            case OP_MATCH:
+                if (cloned && op->dst_offset == op->offset) {
+                    break;  // 副本中已是相同的数据
+                }
+                if (copy_range(ctx->dst_fd, op->dst_offset, tmp_fd, op->offset, op->len) != 0) {
+                    return -1;
+                }
+                break;
+
+            case OP_LITERAL:
+                if (copy_range(ctx->src_fd, op->offset, tmp_fd, op->offset, op->len) != 0) {
+                    return -1;
+                }
+                break;
+
+            case OP_HOLE:
+                if (cloned &&
+                    fallocate(tmp_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                              op->offset, op->len) != 0 &&
+                    write_zeros(tmp_fd, op->offset, op->len) != 0) {
+                    return -1;
+                }
+                break;
+        }
+    }
+
+    return ftruncate(tmp_fd, ctx->src_size);
+}
+
+// 与rsync -a一样保留权限、属主和修改时间
+static void copy_metadata(int fd, const struct stat *st) {
+    if (fchown(fd, st->st_uid, st->st_gid) != 0 && errno != EPERM) {
+        slog(SLOG_ERROR, LOG_WARNING, "无法设置文件属主: %s", strerror(errno));
+    }
+    fchmod(fd, st->st_mode & 07777);
+
+    struct timespec times[2] = {
+        { .tv_sec = 0, .tv_nsec = UTIME_OMIT },
+        st->st_mtim
+    };
+    futimens(fd, times);
+}
+
+static int is_unchanged(const delta_ctx *ctx) {
+    if (ctx->dst_fd == -1 || ctx->src_size != ctx->dst_size) {
+        return 0;
+    }
+    for (size_t i = 0; i < ctx->op_count; i++) {
+        const delta_op *op = &ctx->ops[i];
+        if (op->type == OP_HOLE) {
+            // 目标文件同一区间也是空洞
+            off_t data = lseek(ctx->dst_fd, op->offset, SEEK_DATA);
+            if (data != -1 && (uint64_t)data < op->offset + op->len) {
+                return 0;
+            }
+            continue;
+        }
+        if (op->type != OP_MATCH || op->dst_offset != op->offset) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// 长度和修改时间都相同、目标文件有记录的校验和时只读源文件计算校验和，
+// 与记录相同即认为内容未变化，不必逐块读取目标文件
+static int matches_record(const delta_ctx *ctx, const struct stat *src_st, const struct stat *dst_st) {
+    integrity_record rec;
+    if (ctx->dst_fd == -1 || ctx->src_size != ctx->dst_size ||
+        !integrity_get(ctx->dst_fd, &rec) || rec.size != ctx->dst_size ||
+        src_st->st_mtim.tv_sec != dst_st->st_mtim.tv_sec ||
+        src_st->st_mtim.tv_nsec != dst_st->st_mtim.tv_nsec) {
+        return 0;
+    }
+    uint32_t crc = 0;
+    uint64_t size;
+    return integrity_hash_fd(ctx->src_fd, 0, &crc, &size) == 0 && size == rec.size && crc == rec.crc;
+}
+
+static void ctx_free(delta_ctx *ctx) {
+    if (ctx->src_fd != -1) {
+        close(ctx->src_fd);
+    }
+    if (ctx->dst_fd != -1) {
+        close(ctx->dst_fd);
+    }
+    free(ctx->index.heads);
+    free(ctx->index.next);
+    free(ctx->index.weak);
+    free(ctx->window.buf);
+    free(ctx->cmp_buf);
+    free(ctx->ops);
+}
+
+// 比较源文件与目标文件target，有变化时把新内容写入tmp_path(不落盘)
+// 返回 1 表示已写入临时文件并关闭，0 表示内容未变化(只同步了元数据)，-1 表示失败
+static int delta_sync_prepare(const char *src, const char *target, char *tmp_path, size_t tmp_len,
+                              delta_stats *stats, int *tmp_fd_out) {
+    delta_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.src_fd = ctx.dst_fd = -1;
+
+    struct stat src_st, dst_st;
+    int tmp_fd = -1;
+
+    ctx.src_fd = open(src, O_RDONLY | O_CLOEXEC);
+    if (ctx.src_fd == -1 || fstat(ctx.src_fd, &src_st) != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法打开源文件 %s: %s", src, strerror(errno));
+        goto fail;
+    }
+    if (!S_ISREG(src_st.st_mode)) {
+        slog(SLOG_ERROR, LOG_ERR, "源文件不是普通文件: %s", src);
+        errno = EINVAL;
+        goto fail;
+    }
+    ctx.src_size = src_st.st_size;
+
+    // 只能追加的文件不能被整个替换
+    if (file_append_only(target)) {
+        goto fail;
+    }
+
+    ctx.dst_fd = open_path(target, O_RDONLY);
+    if (ctx.dst_fd != -1) {
+        if (fstat(ctx.dst_fd, &dst_st) != 0 || !S_ISREG(dst_st.st_mode)) {
+            close(ctx.dst_fd);
+            ctx.dst_fd = -1;
+        } else {
+            ctx.dst_size = dst_st.st_size;
+        }
+    }
+
+    delta_stats result;
+    memset(&result, 0, sizeof(result));
+    result.bytes_total = ctx.src_size;
+    if (matches_record(&ctx, &src_st, &dst_st)) {
+        copy_metadata(ctx.dst_fd, &src_st);
+        selinux_label_fd(ctx.dst_fd);
+        result.bytes_reused = ctx.src_size;
+        result.unchanged = 1;
+        if (stats) {
+            *stats = result;
+        }
+        *tmp_fd_out = -1;
+        ctx_free(&ctx);
+        return 0;
+    }
+
+    ctx.block_size = choose_block_size(ctx.dst_size > ctx.src_size ? ctx.dst_size : ctx.src_size);
+    // 小文件不需要完整的读缓冲
+    ctx.window.fd = ctx.src_fd;
+    ctx.window.cap = ctx.src_size + ctx.block_size < WINDOW_SIZE ?
+                     ctx.src_size + ctx.block_size : WINDOW_SIZE;
+    ctx.window.buf = malloc(ctx.window.cap);
+    ctx.cmp_buf = malloc(ctx.block_size);
+    if (!ctx.window.buf || !ctx.cmp_buf) {
+        slog(SLOG_ERROR, LOG_ERR, "增量同步无法分配内存");
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    if (ctx.dst_fd != -1) {
+        ctx.dst_blocks = ctx.dst_size / ctx.block_size;
+    }
+    if (generate_ops(&ctx) != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "增量同步 %s -> %s 时读取失败: %s", src, target, strerror(errno));
+        goto fail;
+    }
+
+    result.block_size = ctx.block_size;
+    for (size_t i = 0; i < ctx.op_count; i++) {
+        switch (ctx.ops[i].type) {
+            case OP_MATCH:   result.bytes_reused += ctx.ops[i].len; break;
+            case OP_LITERAL: result.bytes_literal += ctx.ops[i].len; break;
+            case OP_HOLE:    result.bytes_sparse += ctx.ops[i].len; break;
+        }
+    }
+
+    int ret = 0;
+    if (is_unchanged(&ctx)) {
+        // 内容相同时只同步元数据，不重写文件；目标文件还没有校验和时补上，下次可以直接比较
+        copy_metadata(ctx.dst_fd, &src_st);
+        selinux_label_fd(ctx.dst_fd);
+        integrity_record rec;
+        if (!integrity_get(ctx.dst_fd, &rec) || rec.size != ctx.dst_size) {
+            integrity_record_fd(ctx.dst_fd, target);
+        }
+        result.unchanged = 1;
+    } else {
+        tmp_fd = create_temp_file(target, tmp_path, tmp_len);
+        if (tmp_fd == -1) {
+            slog(SLOG_ERROR, LOG_ERR, "无法为 %s 创建临时文件: %s", target, strerror(errno));
+            goto fail;
+        }
+
+        int cloned = ctx.dst_fd != -1 && ctx.dst_blocks > 0 &&
+                     ioctl(tmp_fd, FICLONE, ctx.dst_fd) == 0;
+        if (apply_ops(&ctx, tmp_fd, cloned) != 0) {
+            int err = errno;
+            slog(SLOG_ERROR, LOG_ERR, "写入 %s 失败: %s", tmp_path, strerror(errno));
+            close(tmp_fd);
+            unlink_path(tmp_path);
+            errno = err;
+            goto fail;
+        }
+        copy_metadata(tmp_fd, &src_st);
+        selinux_label_fd(tmp_fd);
+        integrity_record_fd(tmp_fd, tmp_path);
+        ret = 1;
+    }
+
+    if (stats) {
+        *stats = result;
+    }
+    *tmp_fd_out = tmp_fd;
+    ctx_free(&ctx);
+    return ret;
+
+fail:
+    {
+        int err = errno;
+        ctx_free(&ctx);
+        errno = err;
+    }
+    return -1;
+}
+
+int delta_sync_file(const char *src, const char *dst, delta_stats *stats) {
+    char target[MAX_PATH_LEN];
+    char tmp_path[MAX_PATH_LEN];
+    struct stat dst_st;
+
+    // 与rsync一样，目标为已存在的目录时同步到其中的同名文件
+    int n;
+    if (stat_path(dst, &dst_st, 0) == 0 && S_ISDIR(dst_st.st_mode)) {
+        const char *base = strrchr(src, '/');
+        n = snprintf(target, sizeof(target), "%s/%s", dst, base ? base + 1 : src);
+    } else {
+        n = snprintf(target, sizeof(target), "%s", dst);
+    }
+    if (n < 0 || (size_t)n >= sizeof(target)) {
+        slog(SLOG_ERROR, LOG_ERR, "目标路径过长: %s", dst);
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int tmp_fd;
+    int ret = delta_sync_prepare(src, target, tmp_path, sizeof(tmp_path), stats, &tmp_fd);
+    if (ret == 1) {
+        return commit_temp_file(tmp_fd, tmp_path, target);
+    }
+    return ret;
+}
+
+int delta_sync_file_deferred(const char *src, const char *target, char *tmp_path, size_t tmp_len,
+                             delta_stats *stats) {
+    int tmp_fd;
+    int ret = delta_sync_prepare(src, target, tmp_path, tmp_len, stats, &tmp_fd);
+    if (ret == 1) {
+        close(tmp_fd);
+    }
+    return ret;
+}
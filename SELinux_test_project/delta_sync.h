@@ -0,0 +1,48 @@
+#ifndef DELTA_SYNC_H
+#define DELTA_SYNC_H
+
+#include <stdint.h>
+
+// 一次增量同步的统计
+typedef struct {
+    uint64_t bytes_total;      // 源文件大小
+    uint64_t bytes_literal;    // 从源文件复制的字节数
+    uint64_t bytes_reused;     // 复用目标文件原有内容的字节数
+    uint64_t bytes_sparse;     // 源文件中的空洞字节数，不写入数据
+    uint32_t block_size;       // 使用的块大小
+    int unchanged;             // 内容没有变化，目标文件未被重写
+} delta_stats;
+
+/**
+ * 将源文件增量同步到目标文件
+ * 
+ * 先按同一偏移逐块比较源文件与目标文件；出现插入或删除导致数据错位时，
+ * 按块对目标文件建立弱校验和索引，用滚动校验和在源文件中查找相同的块。
+ * 候选块与目标文件逐字节比较确认，只从源文件复制变化的部分。新内容写入同目录下的临时文件后原子地替换目标文件；
+ * 支持reflink的文件系统上临时文件由目标文件克隆，只重写变化的区间。
+ * 与rsync -a一样保留源文件的权限、属主和修改时间。
+ * 
+ * @param src 源文件路径(普通文件)
+ * @param dst 目标文件路径，为已存在的目录时同步到其中的同名文件
+ * @param stats 输出统计信息，可以为NULL
+ * @return 成功返回 0，失败返回 -1
+ */
+int delta_sync_file(const char *src, const char *dst, delta_stats *stats);
+
+/**
+ * 与delta_sync_file相同地比较和生成新内容，但不替换目标文件，供调用者统一提交
+ * 
+ * 内容有变化时新内容写入目标文件同目录下的临时文件，不落盘；调用者应在落盘后
+ * 用rename把临时文件替换为target，放弃时删除临时文件。内容未变化时只同步元数据。
+ * 
+ * @param src 源文件路径(普通文件)
+ * @param target 目标文件路径，不做目录展开
+ * @param tmp_path 输出临时文件路径
+ * @param tmp_len tmp_path缓冲区长度
+ * @param stats 输出统计信息，可以为NULL
+ * @return 写入了临时文件返回 1，内容未变化返回 0，失败返回 -1
+ */
+int delta_sync_file_deferred(const char *src, const char *target, char *tmp_path, size_t tmp_len,
+                             delta_stats *stats);
+
+#endif /* DELTA_SYNC_H */
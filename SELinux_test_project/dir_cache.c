@@ -0,0 +1,433 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "immutable_service.h"
+#include "dir_cache.h"
+
+#define DIR_CACHE_CAPACITY 256       // 缓存的目录描述符数上限
+#define DIR_CACHE_BUCKETS 512        // 哈希表的桶数，2的幂
+#define DIR_CACHE_MAX_ROOTS 16
+#define DIR_REVALIDATE_MS 1000       // 超过这个时间未确认的目录，使用前确认路径仍指向它；
+                                     // 其他程序改名或替换的目录在这段时间内仍可能被使用
+#define DIR_MODE 0755                // 逐级创建的目录的权限
+
+struct dir_ref {
+    struct dir_ref *hash_next;
+    struct dir_ref *lru_prev;
+    struct dir_ref *lru_next;
+    uint64_t hash;
+    uint64_t checked;        // 上次确认路径仍指向该目录的时间(毫秒)
+    int fd;
+    unsigned int refs;       // 正在使用的调用者数
+    int cached;              // 仍在缓存中；被淘汰后由最后一个使用者关闭
+    char path[];             // 规范化后的目录路径
+};
+
+typedef struct {
+    char path[MAX_PATH_LEN];
+    size_t len;
+    int fd;
+} dir_root;
+
+static dir_root roots[DIR_CACHE_MAX_ROOTS];
+static size_t root_count;    // 为0时不限制路径
+
+// 以下由cache_mutex保护
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static dir_ref *buckets[DIR_CACHE_BUCKETS];
+static dir_ref lru = { .lru_prev = &lru, .lru_next = &lru };  // 链表头，之后是最近使用的目录
+static size_t cached_count;
+
+static int openat2_unsupported;  // 5.6以前的内核没有openat2
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// 合并多余的'/'并去掉末尾的'/'，空路径为"."
+static int normalize(const char *in, size_t len, char *out) {
+    if (len >= MAX_PATH_LEN) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (in[i] == '/' && n > 0 && out[n - 1] == '/') {
+            continue;
+        }
+        out[n++] = in[i];
+    }
+    while (n > 1 && out[n - 1] == '/') {
+        n--;
+    }
+    if (n == 0) {
+        out[n++] = '.';
+    }
+    out[n] = '\0';
+    return 0;
+}
+
+// dir等于prefix或位于其下
+static int path_under(const char *dir, const char *prefix, size_t len) {
+    return strncmp(dir, prefix, len) == 0 &&
+           (dir[len] == '\0' || dir[len] == '/' || (len == 1 && prefix[0] == '/'));
+}
+
+// 包含dir的最深的根目录，没有时返回NULL
+static const dir_root *find_root(const char *dir) {
+    const dir_root *found = NULL;
+    for (size_t i = 0; i < root_count; i++) {
+        if (path_under(dir, roots[i].path, roots[i].len) && (!found || roots[i].len > found->len)) {
+            found = &roots[i];
+        }
+    }
+    return found;
+}
+
+int dir_cache_init(const char *list) {
+    char *copy = strdup(list);
+    if (!copy) {
+        return -1;
+    }
+    char *save;
+    int unrestricted = 0;
+    for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        dir_root *root = &roots[root_count];
+        if (item[0] != '/' || root_count == DIR_CACHE_MAX_ROOTS ||
+            normalize(item, strlen(item), root->path) != 0) {
+            free(copy);
+            errno = EINVAL;
+            return -1;
+        }
+        if (strcmp(root->path, "/") == 0) {
+            unrestricted = 1;
+            continue;
+        }
+        root->len = strlen(root->path);
+        root->fd = open(root->path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (root->fd == -1) {
+            free(copy);
+            return -1;
+        }
+        root_count++;
+    }
+    free(copy);
+
+    if (unrestricted) {
+        while (root_count > 0) {
+            close(roots[--root_count].fd);
+        }
+    }
+    return 0;
+}
+
+int dir_cache_path_allowed(const char *path, int allow_root) {
+    // 只拒绝".."这一级，"a..b"这样的文件名不受影响
+    for (const char *p = path; *p; ) {
+        const char *end = strchrnul(p, '/');
+        if (end - p == 2 && p[0] == '.' && p[1] == '.') {
+            errno = EINVAL;
+            return 0;
+        }
+        p = *end ? end + 1 : end;
+    }
+    if (root_count == 0) {
+        return 1;
+    }
+
+    char norm[MAX_PATH_LEN];
+    const dir_root *root;
+    if (path[0] != '/' || normalize(path, strlen(path), norm) != 0 || !(root = find_root(norm)) ||
+        (norm[root->len] == '\0' && !allow_root)) {
+        errno = EACCES;
+        return 0;
+    }
+    return 1;
+}
+
+// 用openat2打开目录，内核不支持时返回-1且errno为ENOSYS
+static int openat2_dir(int base, const char *rel, uint64_t resolve) {
+    if (__atomic_load_n(&openat2_unsupported, __ATOMIC_RELAXED)) {
+        errno = ENOSYS;
+        return -1;
+    }
+    struct open_how how = {
+        .flags = O_PATH | O_DIRECTORY | O_CLOEXEC,
+        .resolve = resolve,
+    };
+    int fd = syscall(SYS_openat2, base, rel, &how, sizeof(how));
+    if (fd == -1 && errno == ENOSYS) {
+        __atomic_store_n(&openat2_unsupported, 1, __ATOMIC_RELAXED);
+    }
+    return fd;
+}
+
+// 逐级打开目录，每一级都相对于上一级的描述符，create时先创建；
+// 没有openat2时在根目录之下不跟随符号链接
+static int walk_dirs(int base, const char *rel, uint64_t resolve, int create) {
+    char buf[MAX_PATH_LEN];
+    snprintf(buf, sizeof(buf), "%s", rel);
+    int fd;
+    if (buf[0] == '/') {
+        fd = open("/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    } else if (base == AT_FDCWD) {
+        fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    } else {
+        fd = fcntl(base, F_DUPFD_CLOEXEC, 0);
+    }
+
+    char *save;
+    for (char *name = strtok_r(buf, "/", &save); fd != -1 && name; name = strtok_r(NULL, "/", &save)) {
+        int next = -1;
+        if (!create || mkdirat(fd, name, DIR_MODE) == 0 || errno == EEXIST) {
+            next = openat2_dir(fd, name, resolve);
+            if (next == -1 && errno == ENOSYS) {
+                next = openat(fd, name, O_PATH | O_DIRECTORY | O_CLOEXEC |
+                              ((resolve & RESOLVE_BENEATH) ? O_NOFOLLOW : 0));
+            }
+        }
+        int err = errno;
+        close(fd);
+        errno = err;
+        fd = next;
+    }
+    return fd;
+}
+
+// 打开规范化后的目录，根目录之下的目录从根目录的描述符开始解析
+static int open_dir(const char *dir, int create) {
+    const dir_root *root = find_root(dir);
+    int base = AT_FDCWD;
+    const char *rel = dir;
+    uint64_t resolve = RESOLVE_NO_MAGICLINKS;
+    if (root) {
+        base = root->fd;
+        rel = dir + root->len;
+        while (*rel == '/') {
+            rel++;
+        }
+        if (*rel == '\0') {
+            rel = ".";
+        }
+        resolve |= RESOLVE_BENEATH;
+    }
+
+    int fd = openat2_dir(base, rel, resolve);
+    if (fd == -1 && errno == ENOSYS) {
+        fd = walk_dirs(base, rel, resolve, 0);
+    }
+    if (fd == -1 && errno == ENOENT && create) {
+        fd = walk_dirs(base, rel, resolve, 1);
+    }
+    return fd;
+}
+
+// 目录已被删除，不需要解析路径
+static int entry_removed(const dir_ref *e) {
+    struct stat st;
+    return fstat(e->fd, &st) != 0 || st.st_nlink == 0;
+}
+
+// 确认路径仍指向打开时的目录(可能已被其他程序改名或替换)
+static int entry_valid(const dir_ref *e) {
+    struct stat a, b;
+    return stat(e->path, &a) == 0 && fstat(e->fd, &b) == 0 &&
+           a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+// 以下几个函数调用时持有cache_mutex
+static dir_ref *entry_find(const char *dir, uint64_t hash) {
+    for (dir_ref *e = buckets[hash & (DIR_CACHE_BUCKETS - 1)]; e; e = e->hash_next) {
+        if (e->hash == hash && strcmp(e->path, dir) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void lru_unlink(dir_ref *e) {
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void lru_push(dir_ref *e) {
+    e->lru_prev = &lru;
+    e->lru_next = lru.lru_next;
+    lru.lru_next->lru_prev = e;
+    lru.lru_next = e;
+}
+
+static void entry_put(dir_ref *e) {
+    if (--e->refs == 0 && !e->cached) {
+        close(e->fd);
+        free(e);
+    }
+}
+
+// 从缓存中移除，仍在使用时由最后一个使用者关闭
+static void entry_drop(dir_ref *e) {
+    dir_ref **pp = &buckets[e->hash & (DIR_CACHE_BUCKETS - 1)];
+    while (*pp != e) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = e->hash_next;
+    lru_unlink(e);
+    e->cached = 0;
+    cached_count--;
+    if (e->refs == 0) {
+        close(e->fd);
+        free(e);
+    }
+}
+
+static dir_ref *acquire(const char *dir, int create) {
+    uint64_t hash = hash_path(dir);
+    uint64_t now = now_ms();
+
+    pthread_mutex_lock(&cache_mutex);
+    dir_ref *e = entry_find(dir, hash);
+    if (e) {
+        e->refs++;
+        lru_unlink(e);
+        lru_push(e);
+        pthread_mutex_unlock(&cache_mutex);
+
+        // 确认需要stat整个路径，在锁外进行
+        if (now - __atomic_load_n(&e->checked, __ATOMIC_RELAXED) < DIR_REVALIDATE_MS) {
+            if (!entry_removed(e)) {
+                return e;
+            }
+        } else if (entry_valid(e)) {
+            __atomic_store_n(&e->checked, now, __ATOMIC_RELAXED);
+            return e;
+        }
+        pthread_mutex_lock(&cache_mutex);
+        if (e->cached) {
+            entry_drop(e);
+        }
+        entry_put(e);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    int fd = open_dir(dir, create);
+    if (fd == -1) {
+        return NULL;
+    }
+    size_t len = strlen(dir);
+    e = malloc(sizeof(*e) + len + 1);
+    if (!e) {
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    e->hash = hash;
+    e->checked = now;
+    e->fd = fd;
+    e->refs = 1;
+    e->cached = 1;
+    memcpy(e->path, dir, len + 1);
+
+    pthread_mutex_lock(&cache_mutex);
+    dir_ref *other = entry_find(dir, hash);
+    if (other) {
+        // 其他线程同时打开了同一个目录
+        other->refs++;
+        pthread_mutex_unlock(&cache_mutex);
+        close(fd);
+        free(e);
+        return other;
+    }
+    dir_ref **bucket = &buckets[hash & (DIR_CACHE_BUCKETS - 1)];
+    e->hash_next = *bucket;
+    *bucket = e;
+    lru_push(e);
+    cached_count++;
+    while (cached_count > DIR_CACHE_CAPACITY) {
+        entry_drop(lru.lru_prev);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return e;
+}
+
+dir_ref *dir_cache_open(const char *dir, int create) {
+    char norm[MAX_PATH_LEN];
+    if (normalize(dir, strlen(dir), norm) != 0) {
+        return NULL;
+    }
+    return acquire(norm, create);
+}
+
+dir_ref *dir_cache_parent(const char *path, int create, const char **name) {
+    // 末尾的'/'属于最后一级("src/"为当前目录中的"src/")，不作为分隔
+    size_t end = strlen(path);
+    while (end > 1 && path[end - 1] == '/') {
+        end--;
+    }
+    const char *slash = memrchr(path, '/', end);
+    size_t len = 0;
+    if (slash) {
+        len = slash == path ? 1 : (size_t)(slash - path);
+    }
+    *name = slash ? slash + 1 : path;
+    if (**name == '\0') {
+        *name = ".";  // 路径为"/"
+    }
+
+    char norm[MAX_PATH_LEN];
+    if (normalize(path, len, norm) != 0) {
+        return NULL;
+    }
+    return acquire(norm, create);
+}
+
+int dir_ref_fd(const dir_ref *ref) {
+    return ref->fd;
+}
+
+void dir_cache_release(dir_ref *ref) {
+    pthread_mutex_lock(&cache_mutex);
+    entry_put(ref);
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void dir_cache_forget(dir_ref *ref) {
+    pthread_mutex_lock(&cache_mutex);
+    if (ref->cached) {
+        entry_drop(ref);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void dir_cache_invalidate(const char *dir) {
+    char norm[MAX_PATH_LEN];
+    if (normalize(dir, strlen(dir), norm) != 0) {
+        return;
+    }
+    size_t len = strlen(norm);
+
+    // 目录树很少被删除，遍历整个缓存即可
+    pthread_mutex_lock(&cache_mutex);
+    for (size_t i = 0; i < DIR_CACHE_BUCKETS; i++) {
+        dir_ref *e = buckets[i];
+        while (e) {
+            dir_ref *next = e->hash_next;
+            if (path_under(e->path, norm, len)) {
+                entry_drop(e);
+            }
+            e = next;
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
@@ -0,0 +1,71 @@
+#ifndef DIR_CACHE_H
+#define DIR_CACHE_H
+
+// 目录描述符缓存：请求中的文件在其所在目录的描述符上用openat等操作，
+// 不必每次从根开始解析整个路径。缓存有上限，按最近使用淘汰。
+
+// 缓存中的一个目录，使用期间不会被关闭
+typedef struct dir_ref dir_ref;
+
+/**
+ * 设置不可变文件的根目录，之后请求中的路径必须位于某个根目录之下
+ *
+ * 根目录之下的目录用openat2(RESOLVE_BENEATH)打开，经由符号链接等离开根目录的路径会被拒绝。
+ * 不调用本函数或roots为"/"时不限制。
+ *
+ * @param roots 以逗号分隔的绝对路径，必须已存在
+ * @return 成功返回 0，失败返回 -1
+ */
+int dir_cache_init(const char *roots);
+
+/**
+ * 检查请求中的路径：不能有".."这一级，设置了根目录时必须是某个根目录之下的绝对路径
+ *
+ * @param path 文件路径
+ * @param allow_root 为真时根目录本身也允许，供只读取的请求使用；删除、修改等请求不能作用于根目录
+ * @return 允许返回 1；否则返回 0，errno为EINVAL(有"..")或EACCES(不在根目录之下)
+ */
+int dir_cache_path_allowed(const char *path, int allow_root);
+
+/**
+ * 取得目录的描述符(O_PATH)，用完后调用dir_cache_release
+ *
+ * @param dir 目录路径，多余的'/'不影响结果
+ * @param create 不存在时是否逐级创建(相当于mkdir -p)
+ * @return 成功返回目录，失败返回NULL
+ */
+dir_ref *dir_cache_open(const char *dir, int create);
+
+/**
+ * 取得文件所在目录的描述符，之后用openat(dir_ref_fd(ref), *name, ...)等操作该文件
+ *
+ * @param path 文件路径，没有'/'时为当前目录中的文件；末尾的'/'属于文件名
+ * @param create 目录不存在时是否创建
+ * @param name 输出文件名，指向path中最后一级的开头(path为"/"时为".")
+ * @return 成功返回目录，失败返回NULL
+ */
+dir_ref *dir_cache_parent(const char *path, int create, const char **name);
+
+/**
+ * @return 目录的描述符，只能作为*at系统调用的目录参数
+ */
+int dir_ref_fd(const dir_ref *ref);
+
+/**
+ * 用完目录；已被淘汰的目录在最后一个使用者用完时关闭
+ */
+void dir_cache_release(dir_ref *ref);
+
+/**
+ * 目录上的操作返回ENOENT时调用：目录已被其他程序删除，下次重新打开
+ */
+void dir_cache_forget(dir_ref *ref);
+
+/**
+ * 删除或移走目录后调用，丢弃该目录及其下所有目录的描述符
+ *
+ * @param dir 目录路径
+ */
+void dir_cache_invalidate(const char *dir);
+
+#endif /* DIR_CACHE_H */
@@ -0,0 +1,771 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <getopt.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "immutable_client.h"
+
+// 对运行中的服务施加负载，统计各类操作的吞吐量和延迟分布
+
+#define DEFAULT_CONCURRENCY 4
+#define DEFAULT_DURATION 10                 // 默认运行时间(秒)
+#define DEFAULT_FILES 64                    // 每个线程修改和删除的文件数
+#define DEFAULT_RETENTION_ENTRIES 10000     // 预先写入保留表的记录数
+#define DEFAULT_RSYNC_SIZE (1024 * 1024)
+#define DEFAULT_MIX "modify=40,rsync=5,setretention=10,getretention=35,delete=10"
+#define DEFAULT_SIZES "1k,16k,256k"
+#define RETENTION_SECONDS 3600              // 预先写入和setretention使用的保留期限
+#define PREPARE_BATCH 4096                  // 预先写入保留表时每个批量请求的项数
+#define SERVICE_START_TIMEOUT 5             // 等待启动的服务开始监听的时间(秒)
+#define WORK_DIR_MAX 200                    // 工作目录路径的长度上限，socket也放在其中
+
+typedef enum {
+    OP_MODIFY,
+    OP_RSYNC,
+    OP_SET_RETENTION,
+    OP_GET_RETENTION,
+    OP_DELETE,
+    OP_COUNT
+} bench_op;
+
+static const char *op_names[OP_COUNT] = {
+    "modify", "rsync", "setretention", "getretention", "delete"
+};
+
+typedef struct {
+    const char *dir;             // 在其中新建工作目录
+    const char *socket_path;     // 服务的socket，为NULL时启动service
+    const char *service;         // 服务程序
+    int concurrency;
+    int duration;
+    uint64_t total_ops;          // 不为0时执行这么多次操作后结束，忽略duration
+    int mix[OP_COUNT];           // 各操作的权重
+    size_t sizes[16];            // modify随机选择的内容大小
+    int size_count;
+    size_t rsync_size;
+    int files;
+    size_t retention_entries;
+    const char *json_path;       // JSON结果的输出文件，"-"为标准输出
+    int keep;                    // 结束后保留工作目录
+} bench_config;
+
+// 一类操作的延迟样本(纳秒)
+typedef struct {
+    uint64_t *lat;
+    size_t count;
+    size_t cap;
+    uint64_t errors;
+} op_samples;
+
+typedef struct {
+    int id;
+    pthread_t tid;
+    unsigned int seed;
+    op_samples samples[OP_COUNT];
+    unsigned char *exists;       // 各文件是否存在，用于选择删除的文件
+    char *data;                  // modify的内容
+    int rsync_fd;                // 每个线程自己的rsync源文件
+    char rsync_src[PATH_MAX];
+} bench_worker;
+
+static bench_config config = {
+    .dir = "/tmp",
+    .concurrency = DEFAULT_CONCURRENCY,
+    .duration = DEFAULT_DURATION,
+    .rsync_size = DEFAULT_RSYNC_SIZE,
+    .files = DEFAULT_FILES,
+    .retention_entries = DEFAULT_RETENTION_ENTRIES,
+};
+static char work_dir[WORK_DIR_MAX];
+static volatile int stop_flag = 0;
+static uint64_t ops_claimed = 0;
+static int mix_total = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// 解析带k/m/g后缀的大小
+static int parse_size(const char *s, size_t *out) {
+    char *end;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (end == s) {
+        return -1;
+    }
+    switch (*end) {
+        case 'k': case 'K': v <<= 10; end++; break;
+        case 'm': case 'M': v <<= 20; end++; break;
+        case 'g': case 'G': v <<= 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0' && *end != ',') {
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+static int parse_sizes(const char *arg) {
+    config.size_count = 0;
+    for (const char *p = arg; *p; ) {
+        if (config.size_count == (int)(sizeof(config.sizes) / sizeof(config.sizes[0]))) {
+            return -1;
+        }
+        size_t size;
+        if (parse_size(p, &size) != 0 || size == 0) {
+            return -1;
+        }
+        config.sizes[config.size_count++] = size;
+        p = strchr(p, ',');
+        if (!p) {
+            break;
+        }
+        p++;
+    }
+    return config.size_count > 0 ? 0 : -1;
+}
+
+// 解析操作比例，如 modify=40,getretention=60
+static int parse_mix(const char *arg) {
+    memset(config.mix, 0, sizeof(config.mix));
+    char *copy = strdup(arg);
+    if (!copy) {
+        return -1;
+    }
+    int ret = 0;
+    char *save = NULL;
+    for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        int found = 0;
+        if (eq) {
+            *eq = '\0';
+            for (int i = 0; i < OP_COUNT; i++) {
+                if (strcmp(item, op_names[i]) == 0) {
+                    config.mix[i] = atoi(eq + 1);
+                    found = config.mix[i] >= 0;
+                }
+            }
+        }
+        if (!found) {
+            ret = -1;
+            break;
+        }
+    }
+    free(copy);
+
+    mix_total = 0;
+    for (int i = 0; i < OP_COUNT; i++) {
+        mix_total += config.mix[i];
+    }
+    return ret == 0 && mix_total > 0 ? 0 : -1;
+}
+
+static int samples_add(op_samples *s, uint64_t lat) {
+    if (s->count == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 4096;
+        uint64_t *p = realloc(s->lat, cap * sizeof(*p));
+        if (!p) {
+            return -1;
+        }
+        s->lat = p;
+        s->cap = cap;
+    }
+    s->lat[s->count++] = lat;
+    return 0;
+}
+
+static void worker_path(char *buf, size_t len, int worker, int index) {
+    snprintf(buf, len, "%s/w%d/f%d", work_dir, worker, index);
+}
+
+static void retention_path(char *buf, size_t len, size_t index) {
+    snprintf(buf, len, "%s/ret/e%zu", work_dir, index);
+}
+
+// 领取下一次操作，达到总次数或时间到时返回0
+static int claim_op(void) {
+    if (stop_flag) {
+        return 0;
+    }
+    if (config.total_ops > 0) {
+        return __atomic_add_fetch(&ops_claimed, 1, __ATOMIC_RELAXED) <= config.total_ops;
+    }
+    return 1;
+}
+
+static bench_op pick_op(bench_worker *w) {
+    int r = rand_r(&w->seed) % mix_total;
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (r < config.mix[i]) {
+            return i;
+        }
+        r -= config.mix[i];
+    }
+    return OP_MODIFY;
+}
+
+// 发出一次操作的请求，返回请求id(0表示发送失败)；start输出开始计时的时间，不含准备工作
+static uint32_t send_op(bench_worker *w, immutable_session *session, bench_op *op, int *index,
+                        uint64_t *start) {
+    char path[PATH_MAX];
+    *index = rand_r(&w->seed) % config.files;
+
+    if (*op == OP_DELETE) {
+        // 选择一个存在的文件，没有时改为修改
+        int i;
+        for (i = 0; i < config.files && !w->exists[(*index + i) % config.files]; i++) {
+        }
+        if (i == config.files) {
+            *op = OP_MODIFY;
+        } else {
+            *index = (*index + i) % config.files;
+        }
+    }
+
+    *start = now_ns();
+    switch (*op) {
+        case OP_MODIFY: {
+            size_t size = config.sizes[rand_r(&w->seed) % config.size_count];
+            worker_path(path, sizeof(path), w->id, *index);
+            return immutable_session_modify(session, path, w->data, size);
+        }
+        case OP_DELETE:
+            worker_path(path, sizeof(path), w->id, *index);
+            return immutable_session_delete(session, path);
+        case OP_RSYNC: {
+            // 修改源文件中的一个字节，使每次同步都有少量变化
+            unsigned char byte = rand_r(&w->seed);
+            off_t off = rand_r(&w->seed) % config.rsync_size;
+            if (pwrite(w->rsync_fd, &byte, 1, off) != 1) {
+                return 0;
+            }
+            snprintf(path, sizeof(path), "%s/w%d/rsync_dst", work_dir, w->id);
+            *start = now_ns();
+            return immutable_session_rsync(session, w->rsync_src, path);
+        }
+        case OP_SET_RETENTION:
+            retention_path(path, sizeof(path), rand_r(&w->seed) % config.retention_entries);
+            return immutable_session_set_retention(session, path, RETENTION_SECONDS);
+        case OP_GET_RETENTION:
+            retention_path(path, sizeof(path), rand_r(&w->seed) % config.retention_entries);
+            return immutable_session_get_retention(session, path);
+        default:
+            return 0;
+    }
+}
+
+static void *worker_thread(void *arg) {
+    bench_worker *w = arg;
+    immutable_session *session = immutable_session_open();
+
+    while (session && claim_op()) {
+        bench_op op = pick_op(w);
+        int index;
+        uint64_t start;
+        uint32_t id = send_op(w, session, &op, &index, &start);
+        immutable_reply reply;
+        if (id == 0 || immutable_session_wait(session, id, &reply) != 0) {
+            // 连接出错时重新打开会话
+            w->samples[op].errors++;
+            immutable_session_close(session);
+            session = immutable_session_open();
+            continue;
+        }
+        uint64_t lat = now_ns() - start;
+
+        if (reply.status != IMMUTABLE_OK) {
+            w->samples[op].errors++;
+            continue;
+        }
+        samples_add(&w->samples[op], lat);
+        if (op == OP_MODIFY) {
+            w->exists[index] = 1;
+        } else if (op == OP_DELETE) {
+            w->exists[index] = 0;
+        }
+    }
+
+    immutable_session_close(session);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const op_samples *s, double p) {
+    if (s->count == 0) {
+        return 0;
+    }
+    size_t i = (size_t)(p * (s->count - 1) + 0.5);
+    return s->lat[i] / 1000.0;
+}
+
+// 尝试连接服务，不打印错误
+static int service_ready(const char *socket_path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return 0;
+    }
+    struct sockaddr_un addr;
+    size_t len = strlen(socket_path);
+    if (len >= sizeof(addr.sun_path)) {
+        close(fd);
+        return 0;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, socket_path, len);
+    int ok = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    close(fd);
+    return ok;
+}
+
+// 启动一个只服务于本次测试的服务进程，socket和保留表都在工作目录中
+static pid_t start_service(const char *socket_path) {
+    char meta[PATH_MAX];
+    char workers[16];
+    snprintf(meta, sizeof(meta), "%s/meta", work_dir);
+    snprintf(workers, sizeof(workers), "%d", config.concurrency > 8 ? config.concurrency : 8);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd != -1) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        execl(config.service, config.service, "--socket", socket_path, "--metadata-dir", meta,
+              "--workers", workers, (char *)NULL);
+        _exit(127);
+    }
+
+    uint64_t deadline = now_ns() + SERVICE_START_TIMEOUT * 1000000000ULL;
+    while (!service_ready(socket_path)) {
+        int status;
+        if (waitpid(pid, &status, WNOHANG) == pid || now_ns() > deadline) {
+            fprintf(stderr, "服务 %s 没有启动\n", config.service);
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+            return -1;
+        }
+        usleep(10000);
+    }
+    return pid;
+}
+
+static int create_empty_file(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// 建立保留表：创建文件后用批量请求设置保留期限
+static int prepare_retention(void) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/ret", work_dir);
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+
+    immutable_batch_op *ops = calloc(PREPARE_BATCH, sizeof(*ops));
+    if (!ops) {
+        return -1;
+    }
+
+    int ret = 0;
+    for (size_t base = 0; ret == 0 && base < config.retention_entries; base += PREPARE_BATCH) {
+        size_t n = config.retention_entries - base;
+        if (n > PREPARE_BATCH) {
+            n = PREPARE_BATCH;
+        }
+        char path[PATH_MAX];
+        size_t count = 0;
+        for (; count < n; count++) {
+            retention_path(path, sizeof(path), base + count);
+            memset(&ops[count], 0, sizeof(ops[count]));
+            ops[count].cmd = IMMUTABLE_OP_SET_RETENTION;
+            ops[count].path = strdup(path);
+            ops[count].retention_seconds = RETENTION_SECONDS;
+            if (!ops[count].path || create_empty_file(path) != 0) {
+                perror(path);
+                free((char *)ops[count].path);
+                ret = -1;
+                break;
+            }
+        }
+        if (ret == 0 && immutable_batch(ops, count) != 0) {
+            fprintf(stderr, "无法建立保留表\n");
+            ret = -1;
+        }
+        for (size_t i = 0; i < count; i++) {
+            free((char *)ops[i].path);
+        }
+    }
+    free(ops);
+    return ret;
+}
+
+static int prepare_worker(bench_worker *w) {
+    char path[PATH_MAX];
+    w->seed = (unsigned int)now_ns() ^ (w->id * 2654435761u);
+    w->exists = calloc(config.files, 1);
+
+    size_t max_size = 0;
+    for (int i = 0; i < config.size_count; i++) {
+        if (config.sizes[i] > max_size) {
+            max_size = config.sizes[i];
+        }
+    }
+    w->data = malloc(max_size);
+    if (!w->exists || !w->data) {
+        return -1;
+    }
+    for (size_t i = 0; i < max_size; i++) {
+        w->data[i] = 'a' + rand_r(&w->seed) % 26;
+    }
+
+    snprintf(path, sizeof(path), "%s/w%d", work_dir, w->id);
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        perror(path);
+        return -1;
+    }
+
+    if (config.mix[OP_RSYNC] > 0) {
+        snprintf(w->rsync_src, sizeof(w->rsync_src), "%s/w%d/rsync_src", work_dir, w->id);
+        w->rsync_fd = open(w->rsync_src, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (w->rsync_fd == -1) {
+            perror(w->rsync_src);
+            return -1;
+        }
+        char buf[65536];
+        for (size_t done = 0; done < config.rsync_size; ) {
+            size_t n = config.rsync_size - done < sizeof(buf) ? config.rsync_size - done : sizeof(buf);
+            for (size_t i = 0; i < n; i++) {
+                buf[i] = rand_r(&w->seed);
+            }
+            if (write(w->rsync_fd, buf, n) != (ssize_t)n) {
+                perror(w->rsync_src);
+                return -1;
+            }
+            done += n;
+        }
+    }
+    return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)ftw;
+    if (type == FTW_DP) {
+        rmdir(path);
+    } else {
+        unlink(path);
+    }
+    return 0;
+}
+
+static void print_results(bench_worker *workers, double elapsed) {
+    op_samples merged[OP_COUNT + 1];
+    memset(merged, 0, sizeof(merged));
+    op_samples *all = &merged[OP_COUNT];
+
+    for (int op = 0; op < OP_COUNT; op++) {
+        for (int t = 0; t < config.concurrency; t++) {
+            op_samples *s = &workers[t].samples[op];
+            for (size_t i = 0; i < s->count; i++) {
+                samples_add(&merged[op], s->lat[i]);
+                samples_add(all, s->lat[i]);
+            }
+            merged[op].errors += s->errors;
+            all->errors += s->errors;
+        }
+        qsort(merged[op].lat, merged[op].count, sizeof(uint64_t), cmp_u64);
+    }
+    qsort(all->lat, all->count, sizeof(uint64_t), cmp_u64);
+
+    printf("\n并发 %d，运行 %.2f 秒，保留表 %zu 条记录\n", config.concurrency, elapsed,
+           config.retention_entries);
+    // 每个汉字占3个字节、显示为2列，表头的宽度按此加宽
+    printf("%-16s %12s %10s %10s %10s %10s %10s %12s\n", "操作", "次数", "失败", "ops/s",
+           "p50(us)", "p99(us)", "p999(us)", "最大(us)");
+    for (int op = 0; op <= OP_COUNT; op++) {
+        op_samples *s = &merged[op];
+        if (op < OP_COUNT && s->count == 0 && s->errors == 0) {
+            continue;
+        }
+        printf("%-14s %10zu %8lu %10.0f %10.1f %10.1f %10.1f %10.1f\n",
+               op < OP_COUNT ? op_names[op] : "total", s->count, (unsigned long)s->errors,
+               s->count / elapsed, percentile_us(s, 0.50), percentile_us(s, 0.99),
+               percentile_us(s, 0.999), percentile_us(s, 1.0));
+    }
+
+    if (config.json_path) {
+        FILE *out = strcmp(config.json_path, "-") == 0 ? stdout : fopen(config.json_path, "w");
+        if (!out) {
+            perror(config.json_path);
+        } else {
+            fprintf(out, "{\n  \"concurrency\": %d,\n  \"elapsed_s\": %.3f,\n"
+                    "  \"retention_entries\": %zu,\n  \"operations\": {\n",
+                    config.concurrency, elapsed, config.retention_entries);
+            int first = 1;
+            for (int op = 0; op <= OP_COUNT; op++) {
+                op_samples *s = &merged[op];
+                if (op < OP_COUNT && s->count == 0 && s->errors == 0) {
+                    continue;
+                }
+                fprintf(out, "%s    \"%s\": {\"count\": %zu, \"errors\": %lu, \"ops_per_sec\": %.1f, "
+                        "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}",
+                        first ? "" : ",\n", op < OP_COUNT ? op_names[op] : "total", s->count,
+                        (unsigned long)s->errors, s->count / elapsed, percentile_us(s, 0.50),
+                        percentile_us(s, 0.99), percentile_us(s, 0.999), percentile_us(s, 1.0));
+                first = 0;
+            }
+            fprintf(out, "\n  }\n}\n");
+            if (out != stdout) {
+                fclose(out);
+            }
+        }
+    }
+
+    for (int op = 0; op <= OP_COUNT; op++) {
+        free(merged[op].lat);
+    }
+}
+
+static void print_usage(const char *prog) {
+    printf("用法: %s [选项]\n", prog);
+    printf("  -c, --concurrency <数量>  并发的会话数 (默认 %d)\n", DEFAULT_CONCURRENCY);
+    printf("  -d, --duration <秒>       运行时间 (默认 %d)\n", DEFAULT_DURATION);
+    printf("  -n, --ops <次数>          执行这么多次操作后结束，代替--duration\n");
+    printf("  -m, --mix <比例>          操作比例 (默认 %s)\n", DEFAULT_MIX);
+    printf("  -z, --sizes <大小,...>    modify的内容大小，随机选择 (默认 %s)\n", DEFAULT_SIZES);
+    printf("  -y, --rsync-size <大小>   rsync源文件大小 (默认 1m)\n");
+    printf("  -f, --files <数量>        每个会话修改和删除的文件数 (默认 %d)\n", DEFAULT_FILES);
+    printf("  -r, --retention-entries <数量> 预先写入保留表的记录数 (默认 %d)\n",
+           DEFAULT_RETENTION_ENTRIES);
+    printf("  -D, --dir <目录>          在其中新建工作目录 (默认 /tmp)\n");
+    printf("  -S, --socket <路径>       使用已运行的服务，不启动新的服务\n");
+    printf("  -s, --service <程序>      要启动的服务程序 (默认 ./immutable_service)\n");
+    printf("  -j, --json <文件>         把结果以JSON格式写入文件，- 为标准输出\n");
+    printf("  -k, --keep                结束后保留工作目录\n");
+    printf("  -h, --help                显示帮助\n");
+}
+
+static int parse_options(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "concurrency", required_argument, NULL, 'c' },
+        { "duration", required_argument, NULL, 'd' },
+        { "ops", required_argument, NULL, 'n' },
+        { "mix", required_argument, NULL, 'm' },
+        { "sizes", required_argument, NULL, 'z' },
+        { "rsync-size", required_argument, NULL, 'y' },
+        { "files", required_argument, NULL, 'f' },
+        { "retention-entries", required_argument, NULL, 'r' },
+        { "dir", required_argument, NULL, 'D' },
+        { "socket", required_argument, NULL, 'S' },
+        { "service", required_argument, NULL, 's' },
+        { "json", required_argument, NULL, 'j' },
+        { "keep", no_argument, NULL, 'k' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    const char *mix = DEFAULT_MIX;
+    const char *sizes = DEFAULT_SIZES;
+    config.service = "./immutable_service";
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:d:n:m:z:y:f:r:D:S:s:j:kh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'c': config.concurrency = atoi(optarg); break;
+            case 'd': config.duration = atoi(optarg); break;
+            case 'n': config.total_ops = strtoull(optarg, NULL, 10); break;
+            case 'm': mix = optarg; break;
+            case 'z': sizes = optarg; break;
+            case 'y':
+                if (parse_size(optarg, &config.rsync_size) != 0) {
+                    config.rsync_size = 0;
+                }
+                break;
+            case 'f': config.files = atoi(optarg); break;
+            case 'r': config.retention_entries = strtoull(optarg, NULL, 10); break;
+            case 'D': config.dir = optarg; break;
+            case 'S': config.socket_path = optarg; break;
+            case 's': config.service = optarg; break;
+            case 'j': config.json_path = optarg; break;
+            case 'k': config.keep = 1; break;
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (parse_mix(mix) != 0) {
+        fprintf(stderr, "无效的操作比例: %s\n", mix);
+        return -1;
+    }
+    if (parse_sizes(sizes) != 0) {
+        fprintf(stderr, "无效的内容大小: %s\n", sizes);
+        return -1;
+    }
+    if (config.concurrency <= 0 || config.duration <= 0 || config.files <= 0 ||
+        config.rsync_size == 0) {
+        fprintf(stderr, "concurrency、duration、files和rsync-size必须为正数\n");
+        return -1;
+    }
+    if (config.retention_entries == 0 &&
+        (config.mix[OP_SET_RETENTION] > 0 || config.mix[OP_GET_RETENTION] > 0)) {
+        fprintf(stderr, "操作比例中有setretention或getretention时retention-entries必须为正数\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int ret = 0;
+    bench_worker *workers = NULL;
+    
+    if (parse_options(argc, argv) != 0) {
+        return 1;
+    }
+
+    // 工作目录总是新建的，结束后整个删除
+    char resolved[PATH_MAX];
+    if (!realpath(config.dir, resolved)) {
+        perror(config.dir);
+        return 1;
+    }
+    if (strlen(resolved) + sizeof("/immutable_bench.XXXXXX") > sizeof(work_dir)) {
+        fprintf(stderr, "目录路径过长: %s\n", resolved);
+        return 1;
+    }
+    snprintf(work_dir, sizeof(work_dir), "%s/immutable_bench.XXXXXX", resolved);
+    if (!mkdtemp(work_dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    // 启动自己的服务实例，或者使用已运行的服务
+    pid_t service_pid = -1;
+    char socket_path[PATH_MAX];
+    if (config.socket_path) {
+        snprintf(socket_path, sizeof(socket_path), "%s", config.socket_path);
+    } else {
+        snprintf(socket_path, sizeof(socket_path), "%s/service.sock", work_dir);
+        if (strlen(socket_path) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+            fprintf(stderr, "工作目录路径过长，无法在其中创建socket\n");
+            ret = 1;
+            goto out;
+        }
+        service_pid = start_service(socket_path);
+        if (service_pid == -1) {
+            ret = 1;
+            goto out;
+        }
+    }
+    setenv("IMMUTABLE_SOCKET", socket_path, 1);
+
+    workers = calloc(config.concurrency, sizeof(*workers));
+    if (!workers) {
+        ret = 1;
+        goto out;
+    }
+
+    printf("工作目录 %s，服务 %s\n", work_dir, socket_path);
+    if (config.retention_entries > 0) {
+        uint64_t start = now_ns();
+        if (prepare_retention() != 0) {
+            ret = 1;
+            goto out;
+        }
+        printf("已写入 %zu 条保留记录 (%.2f 秒)\n", config.retention_entries,
+               (now_ns() - start) / 1e9);
+    }
+    for (int i = 0; i < config.concurrency; i++) {
+        workers[i].rsync_fd = -1;
+    }
+    for (int i = 0; i < config.concurrency; i++) {
+        workers[i].id = i;
+        if (prepare_worker(&workers[i]) != 0) {
+            ret = 1;
+            goto out;
+        }
+    }
+
+    uint64_t start = now_ns();
+    int started = 0;
+    for (; started < config.concurrency; started++) {
+        if (pthread_create(&workers[started].tid, NULL, worker_thread, &workers[started]) != 0) {
+            perror("pthread_create");
+            stop_flag = 1;
+            ret = 1;
+            break;
+        }
+    }
+    if (config.total_ops == 0) {
+        uint64_t end = start + (uint64_t)config.duration * 1000000000ULL;
+        while (!stop_flag && now_ns() < end) {
+            usleep(10000);
+        }
+        stop_flag = 1;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].tid, NULL);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    if (ret == 0) {
+        print_results(workers, elapsed);
+    }
+
+out:
+    if (workers) {
+        for (int i = 0; i < config.concurrency; i++) {
+            for (int op = 0; op < OP_COUNT; op++) {
+                free(workers[i].samples[op].lat);
+            }
+            free(workers[i].exists);
+            free(workers[i].data);
+            if (workers[i].rsync_fd != -1) {
+                close(workers[i].rsync_fd);
+            }
+        }
+        free(workers);
+    }
+    if (service_pid > 0) {
+        kill(service_pid, SIGTERM);
+        waitpid(service_pid, NULL, 0);
+    }
+    if (!config.keep) {
+        nftw(work_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    return ret;
+}
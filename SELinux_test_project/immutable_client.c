@@ -2,96 +2,516 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <errno.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <stdint.h>
+
+#include "immutable_client.h"
+#include "immutable_protocol.h"
 
 #define SOCKET_PATH "/var/run/immutable_service.sock"
-#define MAX_PATH_LEN 4096
+#define SOCKET_PATH_ENV "IMMUTABLE_SOCKET"  // 设置时使用其中的socket路径，用于测试和基准测试
 #define AUTH_TOKEN "test_token_change_me_in_production"  // 需与服务端一致
+#define SESSION_MAX_INFLIGHT 64  // 会话中未收到回应的请求数上限，超过时先接收回应
+#define RETENTION_SHM_ENV "IMMUTABLE_RETENTION_SHM"  // 设置时使用其中的共享内存保留表，off为不使用
+#define SHM_READ_RETRIES 1000    // 槽位一直在修改中(服务在修改时退出)时改用socket
 
-typedef enum {
-    CMD_MODIFY = 1,     // 修改文件内容
-    CMD_DELETE = 2,     // 删除文件
-    CMD_RSYNC = 3,      // 使用rsync增量更新
-    CMD_SET_RETENTION = 4,  // 设置保留期限
-    CMD_GET_RETENTION = 5   // 获取保留期限
-} command_type;
-
-typedef struct {
-    command_type cmd;
-    char path[MAX_PATH_LEN];
-    char token[128];
-    char src_path[MAX_PATH_LEN]; // 用于rsync源路径
-    time_t retention_time;       // 保留期限 (秒)
-    size_t data_len;
-} request_header;
-
-// 连接到服务
-int connect_to_service() {
-    int sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+// 打开到服务的连接，不打印错误，flags可以是SOCK_NONBLOCK
+static int open_service_socket(int flags) {
+    int sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | flags, 0);
     if (sock_fd == -1) {
-        perror("无法创建socket");
         return -1;
     }
     
+    const char *path = getenv(SOCKET_PATH_ENV);
+    if (!path || path[0] == '\0') {
+        path = SOCKET_PATH;
+    }
+    
     struct sockaddr_un addr;
     memset(&addr, 0, sizeof(addr));
     addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path) - 1);
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
     
+    // Unix socket的connect要么立即完成，要么(非阻塞且listen队列满时)以EAGAIN失败
     if (connect(sock_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
-        perror("无法连接到服务");
+        int err = errno;
         close(sock_fd);
+        errno = err;
         return -1;
     }
-    
     return sock_fd;
 }
 
-// 修改不可变文件
-int modify_immutable_file(const char *path, const char *data, size_t data_len) {
-    int sock_fd = connect_to_service();
+// 连接到服务
+int connect_to_service() {
+    int sock_fd = open_service_socket(0);
     if (sock_fd == -1) {
+        perror("无法连接到服务");
+    }
+    return sock_fd;
+}
+
+// 完整发送缓冲区内容
+int send_all(int sock_fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(sock_fd, p, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// 一个请求的内容，由session_send编码为版本3的请求
+typedef struct {
+    command_type cmd;
+    const char *path;
+    const char *src_path;   // 只有CMD_RSYNC使用
+    time_t retention_time;
+    uint64_t offset;        // 只有CMD_PWRITE使用
+    uint32_t flags;         // 只有CMD_APPEND使用
+    const void *data;       // 文件内容；data_fd不为-1时改为从data_fd开头发送
+    int data_fd;
+    size_t data_len;
+    int pass_fd;            // 随请求传给服务的文件描述符，没有时为-1
+} client_request;
+
+// 会话：一个连接上连续发送多个请求
+typedef struct pending_reply {
+    struct pending_reply *next;
+    immutable_reply reply;
+} pending_reply;
+
+struct immutable_session {
+    int fd;
+    uint32_t next_id;
+    unsigned int inflight;       // 已发送但尚未收到回应的请求数
+    pending_reply *stash_head;   // 已收到但尚未被取走的回应，按到达顺序
+    pending_reply *stash_tail;
+};
+
+static const char *ingest_method_names[] = {
+    [INGEST_REFLINK] = "reflink",
+    [INGEST_COPY_FILE_RANGE] = "copy_file_range",
+    [INGEST_SENDFILE] = "sendfile",
+};
+
+immutable_session *immutable_session_open(void) {
+    immutable_session *session = calloc(1, sizeof(*session));
+    if (!session) {
+        return NULL;
+    }
+    session->fd = connect_to_service();
+    if (session->fd == -1) {
+        free(session);
+        return NULL;
+    }
+    session->next_id = 1;
+    return session;
+}
+
+void immutable_session_close(immutable_session *session) {
+    if (!session) {
+        return;
+    }
+    while (session->stash_head) {
+        pending_reply *p = session->stash_head;
+        session->stash_head = p->next;
+        free(p);
+    }
+    close(session->fd);
+    free(session);
+}
+
+// 完整接收指定长度的数据
+static int recv_all(int sock_fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(sock_fd, p, len, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// 解码版本3的回应，buf为帧头之后的frame->length字节
+static void decode_reply(const frame_header *frame, const unsigned char *buf,
+                         immutable_reply *reply) {
+    reply_v2 head;
+    memcpy(&head, buf, sizeof(head));
+    const unsigned char *result = buf + sizeof(head);
+    size_t result_len = frame->length - sizeof(head);
+    
+    memset(reply, 0, sizeof(*reply));
+    reply->request_id = frame->request_id;
+    reply->status = head.status;
+    reply->error = head.error;
+    
+    if (head.result == RESULT_REMAINING && result_len == sizeof(int64_t)) {
+        int64_t remaining;
+        memcpy(&remaining, result, sizeof(remaining));
+        reply->remaining = remaining;
+    } else if (head.result == RESULT_RSYNC && result_len == sizeof(reply_rsync)) {
+        reply_rsync stats;
+        memcpy(&stats, result, sizeof(stats));
+        reply->bytes_total = stats.bytes_total;
+        reply->bytes_literal = stats.bytes_literal;
+        reply->bytes_reused = stats.bytes_reused;
+    } else if (head.result == RESULT_INGEST && result_len == sizeof(uint32_t)) {
+        uint32_t method;
+        memcpy(&method, result, sizeof(method));
+        if (method >= INGEST_REFLINK && method <= INGEST_SENDFILE) {
+            reply->ingest_method = ingest_method_names[method];
+        }
+    } else if (head.result == RESULT_DELETE && result_len == sizeof(reply_delete)) {
+        reply_delete stats;
+        memcpy(&stats, result, sizeof(stats));
+        reply->entries_deleted = stats.deleted;
+        reply->entries_retained = stats.retained;
+        reply->entries_failed = stats.failed;
+    } else if (head.result == RESULT_VERIFY && result_len == sizeof(reply_verify)) {
+        reply_verify stats;
+        memcpy(&stats, result, sizeof(stats));
+        reply->files_verified = stats.verified;
+        reply->files_mismatched = stats.mismatched;
+        reply->files_unrecorded = stats.unrecorded;
+        reply->verify_failed = stats.failed;
+        reply->bytes_verified = stats.bytes;
+    }
+}
+
+// 检查回应的帧头
+static int valid_reply_frame(const frame_header *frame) {
+    return frame->magic == PROTOCOL_MAGIC && frame->version == PROTOCOL_VERSION &&
+           frame->length >= sizeof(reply_v2) && frame->length <= MAX_REPLY_V2_LEN;
+}
+
+// 从连接上读取下一个回应
+static int session_read_reply(immutable_session *session, immutable_reply *reply) {
+    frame_header frame;
+    unsigned char buf[MAX_REPLY_V2_LEN];
+    if (recv_all(session->fd, &frame, sizeof(frame)) != 0 || !valid_reply_frame(&frame) ||
+        recv_all(session->fd, buf, frame.length) != 0) {
         return -1;
     }
+    session->inflight--;
+    decode_reply(&frame, buf, reply);
+    return 0;
+}
+
+// 暂存一个回应，供之后的immutable_session_wait取走
+static int session_stash_reply(immutable_session *session, const immutable_reply *reply) {
+    pending_reply *p = malloc(sizeof(*p));
+    if (!p) {
+        return -1;
+    }
+    p->reply = *reply;
+    p->next = NULL;
+    if (session->stash_tail) {
+        session->stash_tail->next = p;
+    } else {
+        session->stash_head = p;
+    }
+    session->stash_tail = p;
+    return 0;
+}
+
+// 完整发送iovec中的数据，pass_fd不为-1时随第一个字节一起传给服务
+static int send_iov(int sock_fd, struct iovec *iov, int count, int pass_fd) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    
+    while (count > 0) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count };
+        if (pass_fd != -1) {
+            memset(&control, 0, sizeof(control));
+            msg.msg_control = control.buf;
+            msg.msg_controllen = sizeof(control.buf);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+        }
+        
+        ssize_t n = sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        pass_fd = -1;
+        
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// 将请求编码为帧头加版本3的请求(不含文件内容)，buf至少为REQUEST_BUF_LEN字节
+// 返回编码后的长度，路径过长时返回0
+#define REQUEST_BUF_LEN (sizeof(frame_header) + MAX_REQUEST_V2_LEN)
+static size_t encode_request(const client_request *r, uint32_t id, char *buf) {
+    size_t token_len = strlen(AUTH_TOKEN);
+    size_t path_len = strlen(r->path);
+    size_t src_len = r->src_path ? strlen(r->src_path) : 0;
+    if (path_len >= MAX_PATH_LEN || src_len >= MAX_PATH_LEN) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    
+    request_v2 head = {
+        .cmd = r->cmd,
+        .token_len = token_len,
+        .path_len = path_len,
+        .src_len = src_len,
+        .retention_time = r->retention_time,
+        .data_len = r->data_len,
+        .offset = r->offset,
+        .flags = r->flags
+    };
+    frame_header frame = {
+        .magic = PROTOCOL_MAGIC,
+        .version = PROTOCOL_VERSION,
+        .request_id = id,
+        .length = sizeof(head) + token_len + path_len + src_len
+    };
+    char *p = buf;
+    memcpy(p, &frame, sizeof(frame));
+    p += sizeof(frame);
+    memcpy(p, &head, sizeof(head));
+    p += sizeof(head);
+    memcpy(p, AUTH_TOKEN, token_len);
+    p += token_len;
+    memcpy(p, r->path, path_len);
+    p += path_len;
+    if (src_len > 0) {
+        memcpy(p, r->src_path, src_len);
+        p += src_len;
+    }
+    return p - buf;
+}
+
+// 发送一个请求，不等待回应，返回请求id，失败返回0
+static uint32_t session_send(immutable_session *session, const client_request *r) {
+    // 帧头、定长部分和各字段连续放在一个缓冲区中
+    char buf[REQUEST_BUF_LEN];
+    size_t len = encode_request(r, session->next_id, buf);
+    if (len == 0) {
+        return 0;
+    }
+    
+    // 限制未收到回应的请求数，避免双方都阻塞在发送上
+    while (session->inflight >= SESSION_MAX_INFLIGHT) {
+        immutable_reply reply;
+        if (session_read_reply(session, &reply) != 0 ||
+            session_stash_reply(session, &reply) != 0) {
+            return 0;
+        }
+    }
+    
+    uint32_t id = session->next_id++;
+    if (session->next_id == 0) {
+        session->next_id = 1;  // 0表示失败
+    }
     
-    // 准备请求头
-    request_header req;
-    memset(&req, 0, sizeof(req));
-    req.cmd = CMD_MODIFY;
-    strncpy(req.path, path, MAX_PATH_LEN - 1);
-    strncpy(req.token, AUTH_TOKEN, sizeof(req.token) - 1);
-    req.data_len = data_len;
+    struct iovec iov[2] = {
+        { .iov_base = buf, .iov_len = len },
+        { .iov_base = (void *)r->data, .iov_len = r->data_len }
+    };
+    int with_data = r->data_len > 0 && r->data_fd == -1;
+    if (send_iov(session->fd, iov, with_data ? 2 : 1, r->pass_fd) != 0) {
+        return 0;
+    }
+    
+    // 内容来自文件时由内核直接发送，不经过用户态缓冲区
+    if (r->data_len > 0 && r->data_fd != -1) {
+        off_t offset = 0;
+        while ((size_t)offset < r->data_len) {
+            ssize_t n = sendfile(session->fd, r->data_fd, &offset, r->data_len - offset);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return 0;
+            }
+        }
+    }
+    
+    session->inflight++;
+    return id;
+}
+
+static void init_request(client_request *r, command_type cmd, const char *path) {
+    memset(r, 0, sizeof(*r));
+    r->cmd = cmd;
+    r->path = path;
+    r->data_fd = -1;
+    r->pass_fd = -1;
+}
+
+// 用临时连接发送一个请求并打印结果，供不使用会话的API调用
+static int call_service(const client_request *r, immutable_reply *reply) {
+    immutable_session *session = immutable_session_open();
+    if (!session) {
+        return -1;
+    }
     
-    // 发送请求头
-    if (send(sock_fd, &req, sizeof(req), 0) != sizeof(req)) {
+    uint32_t id = session_send(session, r);
+    if (id == 0) {
         perror("发送请求失败");
-        close(sock_fd);
+        immutable_session_close(session);
         return -1;
     }
+    if (immutable_session_wait(session, id, reply) != 0) {
+        fprintf(stderr, "接收回应失败\n");
+        immutable_session_close(session);
+        return -1;
+    }
+    immutable_session_close(session);
     
-    // 发送数据
-    if (send(sock_fd, data, data_len, 0) != data_len) {
-        perror("发送数据失败");
-        close(sock_fd);
+    int tree = r->cmd == CMD_DELETE &&
+               reply->entries_deleted + reply->entries_retained + reply->entries_failed > 0;
+    if (r->cmd == CMD_VERIFY && reply->status != IMMUTABLE_AUTH_FAILED &&
+        reply->status != IMMUTABLE_BAD_REQUEST && reply->status != IMMUTABLE_UNSUPPORTED) {
+        printf("%s: %s (一致 %lu 个，不一致 %lu 个，无记录 %lu 个，失败 %lu 项，读取 %lu 字节)\n",
+               reply->status == IMMUTABLE_OK ? "校验通过" : "校验失败", r->path,
+               (unsigned long)reply->files_verified, (unsigned long)reply->files_mismatched,
+               (unsigned long)reply->files_unrecorded, (unsigned long)reply->verify_failed,
+               (unsigned long)reply->bytes_verified);
+        return reply->status == IMMUTABLE_OK ? 0 : -1;
+    }
+    if (reply->status != IMMUTABLE_OK) {
+        if (tree) {
+            printf("操作失败: %s (删除 %lu 项，保留期内 %lu 项，失败 %lu 项)\n", r->path,
+                   (unsigned long)reply->entries_deleted, (unsigned long)reply->entries_retained,
+                   (unsigned long)reply->entries_failed);
+        } else if (reply->status == IMMUTABLE_RETENTION_ACTIVE) {
+            printf("操作失败: %s (保留期内，剩余 %ld 秒)\n", r->path, (long)reply->remaining);
+        } else if (reply->status == IMMUTABLE_FAILED && reply->error != 0) {
+            printf("操作失败: %s (%s: %s)\n", r->path, immutable_status_string(reply->status),
+                   strerror(reply->error));
+        } else {
+            printf("操作失败: %s (%s)\n", r->path, immutable_status_string(reply->status));
+        }
         return -1;
     }
     
-    // 接收回应
-    char response[4096];
-    ssize_t recv_len = recv(sock_fd, response, sizeof(response) - 1, 0);
-    if (recv_len > 0) {
-        response[recv_len] = '\0';
-        printf("%s\n", response);
-    } else {
-        perror("接收回应失败");
+    if (r->cmd == CMD_RSYNC && reply->bytes_total > 0) {
+        printf("操作成功: %s (传输 %lu 字节, 复用 %lu 字节)\n", r->path,
+               (unsigned long)reply->bytes_literal, (unsigned long)reply->bytes_reused);
+    } else if (r->cmd == CMD_INGEST_FD && reply->ingest_method) {
+        printf("操作成功: %s (%s)\n", r->path, reply->ingest_method);
+    } else if (tree) {
+        printf("操作成功: %s (删除 %lu 项)\n", r->path, (unsigned long)reply->entries_deleted);
+    } else if (r->cmd != CMD_GET_RETENTION) {
+        printf("操作成功: %s\n", r->path);
+    }
+    return 0;
+}
+
+const char *immutable_status_string(int status) {
+    switch (status) {
+        case IMMUTABLE_OK:               return "成功";
+        case IMMUTABLE_AUTH_FAILED:      return "认证失败";
+        case IMMUTABLE_BAD_REQUEST:      return "请求无效";
+        case IMMUTABLE_RETENTION_ACTIVE: return "保留期内";
+        case IMMUTABLE_FAILED:           return "操作失败";
+        case IMMUTABLE_UNSUPPORTED:      return "服务不支持该请求";
+        default:                         return "未知状态";
+    }
+}
+
+// 修改不可变文件
+int modify_immutable_file(const char *path, const char *data, size_t data_len) {
+    client_request r;
+    immutable_reply reply;
+    init_request(&r, CMD_MODIFY, path);
+    r.data = data;
+    r.data_len = data_len;
+    return call_service(&r, &reply);
+}
+
+// 从文件描述符读取内容修改不可变文件，内容直接由内核发送，不经过用户态缓冲区
+int modify_immutable_file_from_fd(const char *path, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        fprintf(stderr, "内容来源必须是非空的普通文件\n");
+        return -1;
     }
     
-    close(sock_fd);
-    return (recv_len > 0 && strstr(response, "成功") != NULL) ? 0 : -1;
+    client_request r;
+    immutable_reply reply;
+    init_request(&r, CMD_MODIFY, path);
+    r.data_fd = fd;
+    r.data_len = st.st_size;
+    return call_service(&r, &reply);
+}
+
+// 在不可变文件末尾追加内容
+int append_immutable_file(const char *path, const char *data, size_t data_len, int flags) {
+    client_request r;
+    immutable_reply reply;
+    init_request(&r, CMD_APPEND, path);
+    r.flags = flags;
+    r.data = data;
+    r.data_len = data_len;
+    return call_service(&r, &reply);
+}
+
+// 从offset开始覆盖写入一段内容
+int pwrite_immutable_file(const char *path, const char *data, size_t data_len, uint64_t offset) {
+    if (offset > INT64_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    client_request r;
+    immutable_reply reply;
+    init_request(&r, CMD_PWRITE, path);
+    r.offset = offset;
+    r.data = data;
+    r.data_len = data_len;
+    return call_service(&r, &reply);
+}
+
+// 将已打开的文件描述符传给服务生成不可变文件，文件内容不经过socket
+int ingest_immutable_file_fd(const char *path, int fd) {
+    client_request r;
+    immutable_reply reply;
+    init_request(&r, CMD_INGEST_FD, path);
+    r.pass_fd = fd;
+    return call_service(&r, &reply);
 }
 
 // 使用rsync进行增量更新
@@ -103,169 +523,1178 @@ int rsync_immutable_file(const char *src_path, const char *dst_path) {
         return -1;
     }
     
-    int sock_fd = connect_to_service();
-    if (sock_fd == -1) {
+    client_request r;
+    immutable_reply reply;
+    init_request(&r, CMD_RSYNC, dst_path);
+    r.src_path = src_path;
+    return call_service(&r, &reply);
+}
+
+// 按记录的校验和检查文件或目录树
+int verify_immutable_file(const char *path) {
+    client_request r;
+    immutable_reply reply;
+    init_request(&r, CMD_VERIFY, path);
+    return call_service(&r, &reply);
+}
+
+// 删除不可变文件
+int delete_immutable_file(const char *path) {
+    client_request r;
+    immutable_reply reply;
+    init_request(&r, CMD_DELETE, path);
+    return call_service(&r, &reply);
+}
+
+// 设置文件保留期限
+int set_immutable_retention(const char *path, time_t retention_seconds) {
+    client_request r;
+    immutable_reply reply;
+    init_request(&r, CMD_SET_RETENTION, path);
+    r.retention_time = retention_seconds;
+    return call_service(&r, &reply);
+}
+
+// 已映射的共享内存保留表。被替换的旧表不解除映射，其他线程可能仍在读取；
+// 表只在扩容和服务重启时替换，次数很少
+static const retention_shm_header *shm_table;
+
+static const retention_shm_header *shm_map_table(void) {
+    const char *path = getenv(RETENTION_SHM_ENV);
+    if (!path || path[0] == '\0') {
+        path = RETENTION_SHM_PATH;
+    }
+    if (strcmp(path, "off") == 0) {
+        return NULL;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(retention_shm_header)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const retention_shm_header *head = map;
+    if (head->magic != RETENTION_SHM_MAGIC || head->version != RETENTION_SHM_VERSION ||
+        head->slot_count == 0 || (head->slot_count & (head->slot_count - 1)) != 0 ||
+        head->slots_offset + head->slot_count * sizeof(retention_shm_slot) > head->arena_offset ||
+        head->arena_offset + head->arena_size > (uint64_t)st.st_size ||
+        __atomic_load_n(&head->stale, __ATOMIC_ACQUIRE)) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    return head;
+}
+
+// 取得当前的共享内存保留表，旧表失效时重新映射
+static const retention_shm_header *shm_current(void) {
+    const retention_shm_header *head = __atomic_load_n(&shm_table, __ATOMIC_ACQUIRE);
+    if (head && !__atomic_load_n(&head->stale, __ATOMIC_ACQUIRE)) {
+        return head;
+    }
+    const retention_shm_header *fresh = shm_map_table();
+    if (fresh && !__atomic_compare_exchange_n(&shm_table, &head, fresh, 0,
+                                              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        // 其他线程已换上新表
+        munmap((void *)fresh, fresh->arena_offset + fresh->arena_size);
+        fresh = head;
+    }
+    return fresh;
+}
+
+// 在共享内存保留表中查询，得到结果(包括没有记录)返回1，需要改用socket查询返回0
+static int shm_lookup(const char *path, time_t *remaining) {
+    size_t len = strlen(path);
+    if (len == 0 || len >= MAX_PATH_LEN || strstr(path, "..")) {
+        return 0;  // 服务会拒绝的路径，由服务回应
+    }
+    const retention_shm_header *head = shm_current();
+    if (!head) {
+        return 0;
+    }
+
+    const retention_shm_slot *slots =
+        (const retention_shm_slot *)((const char *)head + head->slots_offset);
+    const char *arena = (const char *)head + head->arena_offset;
+    uint64_t hash = 14695981039346656037ULL;  // FNV-1a，与服务的hash_path相同
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+
+    uint64_t mask = head->slot_count - 1;
+    for (uint64_t n = 0, i = hash & mask; n <= mask; n++, i = (i + 1) & mask) {
+        const retention_shm_slot *slot = &slots[i];
+        uint32_t path_len;
+        int64_t creation_time, retention_time;
+        int match;
+        int tries = 0;
+        for (;; tries++) {
+            if (tries == SHM_READ_RETRIES) {
+                return 0;
+            }
+            uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            if (seq & 1) {
+                continue;
+            }
+            path_len = __atomic_load_n(&slot->path_len, __ATOMIC_RELAXED);
+            uint64_t slot_hash = __atomic_load_n(&slot->hash, __ATOMIC_RELAXED);
+            uint64_t offset = __atomic_load_n(&slot->path_offset, __ATOMIC_RELAXED);
+            creation_time = __atomic_load_n(&slot->creation_time, __ATOMIC_RELAXED);
+            retention_time = __atomic_load_n(&slot->retention_time, __ATOMIC_RELAXED);
+            // 路径区中的路径发布后不再修改，偏移可能是修改中的值，先检查范围
+            match = path_len == len && slot_hash == hash && offset + len <= head->arena_size &&
+                    memcmp(arena + offset, path, len) == 0;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+                break;
+            }
+        }
+
+        if (path_len == 0 || match) {
+            // 与服务的get_retention_info相同：没有记录、没有期限或已过期都为0
+            *remaining = 0;
+            if (match && retention_time > 0) {
+                time_t now = time(NULL);
+                if (now < creation_time + retention_time) {
+                    *remaining = creation_time + retention_time - now;
+                }
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// 获取文件剩余保留时间，有共享内存保留表时不经过socket
+time_t get_immutable_retention(const char *path) {
+    time_t remaining;
+    if (shm_lookup(path, &remaining)) {
+        return remaining;
+    }
+
+    client_request r;
+    immutable_reply reply;
+    init_request(&r, CMD_GET_RETENTION, path);
+    if (call_service(&r, &reply) != 0) {
         return -1;
     }
+    return reply.remaining;
+}
+
+uint32_t immutable_session_modify(immutable_session *session, const char *path,
+                                  const char *data, size_t data_len) {
+    client_request r;
+    init_request(&r, CMD_MODIFY, path);
+    r.data = data;
+    r.data_len = data_len;
+    return session_send(session, &r);
+}
+
+uint32_t immutable_session_append(immutable_session *session, const char *path,
+                                  const char *data, size_t data_len, int flags) {
+    client_request r;
+    init_request(&r, CMD_APPEND, path);
+    r.flags = flags;
+    r.data = data;
+    r.data_len = data_len;
+    return session_send(session, &r);
+}
+
+uint32_t immutable_session_pwrite(immutable_session *session, const char *path,
+                                  const char *data, size_t data_len, uint64_t offset) {
+    if (offset > INT64_MAX) {
+        errno = EINVAL;
+        return 0;
+    }
+    client_request r;
+    init_request(&r, CMD_PWRITE, path);
+    r.offset = offset;
+    r.data = data;
+    r.data_len = data_len;
+    return session_send(session, &r);
+}
+
+uint32_t immutable_session_verify(immutable_session *session, const char *path) {
+    client_request r;
+    init_request(&r, CMD_VERIFY, path);
+    return session_send(session, &r);
+}
+
+uint32_t immutable_session_delete(immutable_session *session, const char *path) {
+    client_request r;
+    init_request(&r, CMD_DELETE, path);
+    return session_send(session, &r);
+}
+
+uint32_t immutable_session_rsync(immutable_session *session, const char *src_path,
+                                 const char *dst_path) {
+    client_request r;
+    init_request(&r, CMD_RSYNC, dst_path);
+    r.src_path = src_path;
+    return session_send(session, &r);
+}
+
+uint32_t immutable_session_set_retention(immutable_session *session, const char *path,
+                                         time_t retention_seconds) {
+    client_request r;
+    init_request(&r, CMD_SET_RETENTION, path);
+    r.retention_time = retention_seconds;
+    return session_send(session, &r);
+}
+
+uint32_t immutable_session_get_retention(immutable_session *session, const char *path) {
+    client_request r;
+    init_request(&r, CMD_GET_RETENTION, path);
+    return session_send(session, &r);
+}
+
+int immutable_session_wait(immutable_session *session, uint32_t request_id,
+                           immutable_reply *reply) {
+    // 先在已收到的回应中查找
+    pending_reply *prev = NULL;
+    for (pending_reply *p = session->stash_head; p; prev = p, p = p->next) {
+        if (request_id != 0 && p->reply.request_id != request_id) {
+            continue;
+        }
+        if (prev) {
+            prev->next = p->next;
+        } else {
+            session->stash_head = p->next;
+        }
+        if (session->stash_tail == p) {
+            session->stash_tail = prev;
+        }
+        *reply = p->reply;
+        free(p);
+        return 0;
+    }
     
-    // 准备请求头
-    request_header req;
-    memset(&req, 0, sizeof(req));
-    req.cmd = CMD_RSYNC;
-    strncpy(req.path, dst_path, MAX_PATH_LEN - 1);
-    strncpy(req.src_path, src_path, MAX_PATH_LEN - 1);
-    strncpy(req.token, AUTH_TOKEN, sizeof(req.token) - 1);
-    req.data_len = 0;
+    while (session->inflight > 0) {
+        if (session_read_reply(session, reply) != 0) {
+            return -1;
+        }
+        if (request_id == 0 || reply->request_id == request_id) {
+            return 0;
+        }
+        if (session_stash_reply(session, reply) != 0) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+// 一个批量请求中能放下的项数，受项数和清单长度的限制
+static size_t batch_chunk(const immutable_batch_op *ops, size_t count) {
+    size_t len = sizeof(batch_header);
+    size_t n = 0;
+    while (n < count && n < MAX_BATCH_ITEMS) {
+        size_t item_len = sizeof(batch_item) + strlen(ops[n].path);
+        if (len + item_len > MAX_BATCH_MANIFEST_LEN) {
+            break;
+        }
+        len += item_len;
+        n++;
+    }
+    return n;
+}
+
+// 发送一个批量请求并接收各项的结果
+static int batch_call(int sock_fd, uint32_t id, immutable_batch_op *ops, size_t count) {
+    size_t token_len = strlen(AUTH_TOKEN);
+    size_t manifest_len = sizeof(batch_header);
+    uint64_t data_len = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t path_len = strlen(ops[i].path);
+        if (path_len >= MAX_PATH_LEN) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        manifest_len += sizeof(batch_item) + path_len;
+        if (ops[i].cmd == IMMUTABLE_OP_MODIFY) {
+            data_len += ops[i].data_len;
+        }
+    }
     
-    // 发送请求头
-    if (send(sock_fd, &req, sizeof(req), 0) != sizeof(req)) {
-        perror("发送请求失败");
-        close(sock_fd);
+    // 帧头、定长部分、令牌和清单连续放在一个缓冲区中
+    size_t len = sizeof(frame_header) + sizeof(request_v2) + token_len + manifest_len;
+    char *buf = malloc(len);
+    if (!buf) {
+        return -1;
+    }
+    frame_header frame = {
+        .magic = PROTOCOL_MAGIC,
+        .version = PROTOCOL_VERSION,
+        .request_id = id,
+        .length = len - sizeof(frame_header)
+    };
+    request_v2 head = {
+        .cmd = CMD_BATCH,
+        .token_len = token_len,
+        .data_len = data_len
+    };
+    batch_header header = { .count = count };
+    char *p = buf;
+    memcpy(p, &frame, sizeof(frame));
+    p += sizeof(frame);
+    memcpy(p, &head, sizeof(head));
+    p += sizeof(head);
+    memcpy(p, AUTH_TOKEN, token_len);
+    p += token_len;
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    for (size_t i = 0; i < count; i++) {
+        batch_item item = {
+            .cmd = ops[i].cmd,
+            .path_len = strlen(ops[i].path),
+            .retention_time = ops[i].retention_seconds,
+            .data_len = ops[i].cmd == IMMUTABLE_OP_MODIFY ? ops[i].data_len : 0
+        };
+        memcpy(p, &item, sizeof(item));
+        p += sizeof(item);
+        memcpy(p, ops[i].path, item.path_len);
+        p += item.path_len;
+    }
+    int ret = send_all(sock_fd, buf, len);
+    free(buf);
+    if (ret != 0) {
         return -1;
     }
     
-    // 接收回应
-    char response[4096];
-    ssize_t recv_len = recv(sock_fd, response, sizeof(response) - 1, 0);
-    if (recv_len > 0) {
-        response[recv_len] = '\0';
-        printf("%s\n", response);
-    } else {
-        perror("接收回应失败");
+    // 各修改项的内容按顺序跟在请求之后
+    struct iovec iov[64];
+    int iov_count = 0;
+    for (size_t i = 0; i <= count; i++) {
+        if (iov_count == 64 || (i == count && iov_count > 0)) {
+            if (send_iov(sock_fd, iov, iov_count, -1) != 0) {
+                return -1;
+            }
+            iov_count = 0;
+        }
+        if (i < count && ops[i].cmd == IMMUTABLE_OP_MODIFY && ops[i].data_len > 0) {
+            iov[iov_count].iov_base = (void *)ops[i].data;
+            iov[iov_count].iov_len = ops[i].data_len;
+            iov_count++;
+        }
     }
     
-    close(sock_fd);
-    return (recv_len > 0 && strstr(response, "成功") != NULL) ? 0 : -1;
+    // 回应: reply_v2 + batch_header + 每项一个batch_item_result
+    size_t max_len = sizeof(reply_v2) + sizeof(batch_header) + count * sizeof(batch_item_result);
+    if (recv_all(sock_fd, &frame, sizeof(frame)) != 0 ||
+        frame.magic != PROTOCOL_MAGIC || frame.version != PROTOCOL_VERSION ||
+        frame.request_id != id || frame.length < sizeof(reply_v2) || frame.length > max_len) {
+        errno = EPROTO;
+        return -1;
+    }
+    unsigned char *reply = malloc(frame.length);
+    if (!reply) {
+        return -1;
+    }
+    if (recv_all(sock_fd, reply, frame.length) != 0) {
+        free(reply);
+        return -1;
+    }
+    
+    reply_v2 reply_head;
+    memcpy(&reply_head, reply, sizeof(reply_head));
+    if (reply_head.result == RESULT_BATCH && frame.length == max_len) {
+        const unsigned char *r = reply + sizeof(reply_v2) + sizeof(batch_header);
+        for (size_t i = 0; i < count; i++, r += sizeof(batch_item_result)) {
+            batch_item_result result;
+            memcpy(&result, r, sizeof(result));
+            ops[i].status = result.status;
+            ops[i].error = result.error;
+            ops[i].remaining = result.remaining;
+        }
+    } else {
+        // 整个批量请求被拒绝(如认证失败)时每项的结果相同
+        for (size_t i = 0; i < count; i++) {
+            ops[i].status = reply_head.status != IMMUTABLE_OK ? reply_head.status : IMMUTABLE_FAILED;
+            ops[i].error = reply_head.error;
+        }
+    }
+    free(reply);
+    return 0;
 }
 
-// 删除不可变文件
-int delete_immutable_file(const char *path) {
+int immutable_batch(immutable_batch_op *ops, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        ops[i].status = IMMUTABLE_FAILED;
+        ops[i].error = EIO;
+        ops[i].remaining = 0;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    
     int sock_fd = connect_to_service();
     if (sock_fd == -1) {
         return -1;
     }
     
-    // 准备请求头
-    request_header req;
-    memset(&req, 0, sizeof(req));
-    req.cmd = CMD_DELETE;
-    strncpy(req.path, path, MAX_PATH_LEN - 1);
-    strncpy(req.token, AUTH_TOKEN, sizeof(req.token) - 1);
-    req.data_len = 0;
+    size_t done = 0;
+    uint32_t id = 1;
+    while (done < count) {
+        size_t n = batch_chunk(ops + done, count - done);
+        if (n == 0 || batch_call(sock_fd, id++, ops + done, n) != 0) {
+            if (n == 0) {
+                errno = ENAMETOOLONG;
+            }
+            close(sock_fd);
+            return -1;
+        }
+        done += n;
+    }
+    close(sock_fd);
+    
+    int failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        failed += ops[i].status != IMMUTABLE_OK;
+    }
+    return failed;
+}
+
+// 统计回应的最大长度，只接受与本版本相同的直方图桶数
+#define MAX_STATS_REPLY_LEN \
+    (sizeof(reply_v2) + sizeof(reply_stats) + STATS_COMMANDS * sizeof(stats_command) + \
+     sizeof(stats_clients) + STATS_MAX_CLIENTS * sizeof(stats_client))
+
+int immutable_get_stats(immutable_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    int sock_fd = open_service_socket(0);
+    if (sock_fd == -1) {
+        return -1;
+    }
     
-    // 发送请求头
-    if (send(sock_fd, &req, sizeof(req), 0) != sizeof(req)) {
-        perror("发送请求失败");
+    client_request r;
+    init_request(&r, CMD_STATS, "");
+    char buf[REQUEST_BUF_LEN];
+    size_t len = encode_request(&r, 1, buf);
+    frame_header frame;
+    unsigned char reply[MAX_STATS_REPLY_LEN];
+    if (send_all(sock_fd, buf, len) != 0 || recv_all(sock_fd, &frame, sizeof(frame)) != 0) {
+        close(sock_fd);
+        return -1;
+    }
+    if (frame.magic != PROTOCOL_MAGIC || frame.version != PROTOCOL_VERSION ||
+        frame.length < sizeof(reply_v2) || frame.length > sizeof(reply) ||
+        recv_all(sock_fd, reply, frame.length) != 0) {
         close(sock_fd);
+        errno = EPROTO;
+        return -1;
+    }
+    close(sock_fd);
+    
+    reply_v2 head;
+    memcpy(&head, reply, sizeof(head));
+    if (head.status != STATUS_OK) {
+        errno = head.status == STATUS_AUTH_FAILED ? EACCES : head.error ? head.error : EOPNOTSUPP;
+        return -1;
+    }
+    reply_stats values;
+    if (head.result != RESULT_STATS || frame.length < sizeof(head) + sizeof(values)) {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(&values, reply + sizeof(head), sizeof(values));
+    size_t commands_end = sizeof(head) + sizeof(values) + (size_t)values.command_count * sizeof(stats_command);
+    if (values.bucket_count != STATS_LATENCY_BUCKETS || frame.length < commands_end) {
+        errno = EPROTO;
         return -1;
     }
+    // 较早的服务在命令之后结束，没有客户端的部分
+    stats_clients clients = { 0 };
+    if (frame.length != commands_end) {
+        if (frame.length < commands_end + sizeof(clients)) {
+            errno = EPROTO;
+            return -1;
+        }
+        memcpy(&clients, reply + commands_end, sizeof(clients));
+        if (frame.length != commands_end + sizeof(clients) + (size_t)clients.client_count * sizeof(stats_client)) {
+            errno = EPROTO;
+            return -1;
+        }
+    }
+    stats->uptime = values.uptime;
+    stats->bytes_written = values.bytes_written;
+    stats->auth_failures = values.auth_failures;
+    stats->queue_depth = values.queue_depth;
+    stats->active_connections = values.active_connections;
+    stats->retention_entries = values.retention_entries;
+    stats->log_dropped = values.log_dropped;
     
-    // 接收回应
-    char response[4096];
-    ssize_t recv_len = recv(sock_fd, response, sizeof(response) - 1, 0);
-    if (recv_len > 0) {
-        response[recv_len] = '\0';
-        printf("%s\n", response);
-    } else {
-        perror("接收回应失败");
+    // 服务较新、命令更多时只取本版本认识的命令
+    const unsigned char *p = reply + sizeof(head) + sizeof(values);
+    for (uint32_t i = 0; i < values.command_count && i < IMMUTABLE_STATS_COMMANDS; i++) {
+        stats_command c;
+        memcpy(&c, p + i * sizeof(c), sizeof(c));
+        stats->commands[i].count = c.count;
+        stats->commands[i].errors = c.errors;
+        stats->commands[i].latency_sum_us = c.latency_sum_us;
+        memcpy(stats->commands[i].latency_buckets, c.latency_buckets, sizeof(c.latency_buckets));
     }
     
-    close(sock_fd);
-    return (recv_len > 0 && strstr(response, "成功") != NULL) ? 0 : -1;
+    stats->client_total = clients.client_total;
+    p = reply + commands_end + sizeof(clients);
+    for (uint32_t i = 0; i < clients.client_count && i < IMMUTABLE_STATS_CLIENTS; i++) {
+        stats_client c;
+        memcpy(&c, p + i * sizeof(c), sizeof(c));
+        immutable_client_stats *out = &stats->clients[stats->client_count++];
+        out->uid = c.uid;
+        out->pid = c.pid;
+        out->weight = c.weight;
+        out->connections = c.connections;
+        out->queued = c.queued;
+        out->running = c.running;
+        out->parked = c.parked;
+        out->running_bytes = c.running_bytes;
+        out->served = c.served;
+        out->throttled = c.throttled;
+        snprintf(out->label, sizeof(out->label), "%.*s", (int)sizeof(c.label), c.label);
+    }
+    return 0;
 }
 
-// 设置文件保留期限
-int set_immutable_retention(const char *path, time_t retention_seconds) {
-    int sock_fd = connect_to_service();
-    if (sock_fd == -1) {
-        return -1;
+uint64_t immutable_stats_percentile(const immutable_command_stats *stats, double quantile) {
+    if (stats->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(quantile * stats->count);
+    if (rank >= stats->count) {
+        rank = stats->count - 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < IMMUTABLE_STATS_BUCKETS; i++) {
+        seen += stats->latency_buckets[i];
+        if (seen > rank) {
+            return (uint64_t)1 << i;
+        }
+    }
+    return (uint64_t)1 << (IMMUTABLE_STATS_BUCKETS - 1);
+}
+
+// 异步接口：请求放入连接的发送队列，发送和接收都不阻塞，回应到达时调用回调
+typedef struct async_op {
+    struct async_op *next;
+    uint32_t id;
+    immutable_async_callback callback;
+    void *arg;
+    const void *data;        // 文件内容，由调用者保证在回调前有效
+    size_t data_len;
+    size_t sent;             // 已发送的字节数(编码后的请求加文件内容)
+    int pass_fd;             // 随请求传给服务的文件描述符的副本，没有时为-1
+    size_t head_len;
+    char head[];             // 编码后的帧头和请求
+} async_op;
+
+typedef struct {
+    int fd;                  // 连接出错后为-1
+    uint32_t events;         // 当前在epoll中关注的事件
+    async_op *send_head;     // 尚未发送完的请求
+    async_op *send_tail;
+    async_op *wait_head;     // 已发送、等待回应的请求，按发送顺序
+    async_op *wait_tail;
+    size_t recv_len;
+    unsigned char recv_buf[sizeof(frame_header) + MAX_REPLY_V2_LEN];
+} async_conn;
+
+struct immutable_async {
+    int epoll_fd;            // 供调用者监听的描述符，内部包含所有连接
+    unsigned int conn_count;
+    async_conn *conns;
+    uint32_t next_id;
+    size_t pending;          // 尚未完成的请求数
+};
+
+// 以请求失败结束一个请求
+static void async_fail(immutable_async *async, async_op *op, int error) {
+    immutable_reply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.request_id = op->id;
+    reply.status = IMMUTABLE_FAILED;
+    reply.error = error;
+    if (op->pass_fd != -1) {
+        close(op->pass_fd);
+    }
+    async->pending--;
+    if (op->callback) {
+        op->callback(&reply, op->arg);
+    }
+    free(op);
+}
+
+// 连接出错：关闭连接，其上所有未完成的请求以失败结束
+static void async_conn_broken(immutable_async *async, async_conn *conn, int error) {
+    if (conn->fd != -1) {
+        epoll_ctl(async->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    async_op *lists[2] = { conn->wait_head, conn->send_head };
+    conn->wait_head = conn->wait_tail = NULL;
+    conn->send_head = conn->send_tail = NULL;
+    for (int i = 0; i < 2; i++) {
+        while (lists[i]) {
+            async_op *op = lists[i];
+            lists[i] = op->next;
+            async_fail(async, op, error);
+        }
+    }
+}
+
+// 发送队列不空时才关注可写事件
+static void async_update_events(immutable_async *async, async_conn *conn) {
+    uint32_t events = EPOLLIN | (conn->send_head ? EPOLLOUT : 0);
+    if (conn->fd != -1 && events != conn->events) {
+        struct epoll_event ev = { .events = events, .data.ptr = conn };
+        if (epoll_ctl(async->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == 0) {
+            conn->events = events;
+        }
+    }
+}
+
+// 尽量发送队列中的请求，直到队列为空或socket缓冲区已满
+static int async_flush(async_conn *conn) {
+    while (conn->send_head) {
+        async_op *op = conn->send_head;
+        struct iovec iov[2];
+        int count = 0;
+        if (op->sent < op->head_len) {
+            iov[count].iov_base = op->head + op->sent;
+            iov[count].iov_len = op->head_len - op->sent;
+            count++;
+        }
+        size_t data_sent = op->sent > op->head_len ? op->sent - op->head_len : 0;
+        if (op->data_len > data_sent) {
+            iov[count].iov_base = (char *)op->data + data_sent;
+            iov[count].iov_len = op->data_len - data_sent;
+            count++;
+        }
+        
+        union {
+            char buf[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count };
+        if (op->pass_fd != -1 && op->sent == 0) {
+            memset(&control, 0, sizeof(control));
+            msg.msg_control = control.buf;
+            msg.msg_controllen = sizeof(control.buf);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &op->pass_fd, sizeof(int));
+        }
+        
+        ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        op->sent += n;
+        if (op->pass_fd != -1) {
+            close(op->pass_fd);
+            op->pass_fd = -1;
+        }
+        if (op->sent < op->head_len + op->data_len) {
+            continue;
+        }
+        
+        // 整个请求已发出，转入等待回应的队列
+        conn->send_head = op->next;
+        if (!conn->send_head) {
+            conn->send_tail = NULL;
+        }
+        op->next = NULL;
+        if (conn->wait_tail) {
+            conn->wait_tail->next = op;
+        } else {
+            conn->wait_head = op;
+        }
+        conn->wait_tail = op;
+    }
+    return 0;
+}
+
+// 接收并分发已到达的回应，返回完成的请求数，连接出错返回-1
+static int async_receive(immutable_async *async, async_conn *conn) {
+    int completed = 0;
+    for (;;) {
+        ssize_t n = recv(conn->fd, conn->recv_buf + conn->recv_len,
+                         sizeof(conn->recv_buf) - conn->recv_len, MSG_DONTWAIT);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return completed;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                errno = ECONNRESET;
+            }
+            return -1;
+        }
+        conn->recv_len += n;
+        
+        frame_header frame;
+        while (conn->recv_len >= sizeof(frame)) {
+            memcpy(&frame, conn->recv_buf, sizeof(frame));
+            if (!valid_reply_frame(&frame)) {
+                errno = EPROTO;
+                return -1;
+            }
+            size_t len = sizeof(frame) + frame.length;
+            if (conn->recv_len < len) {
+                break;
+            }
+            
+            // 同一连接上的回应按发送顺序到达，通常就是队首
+            async_op *prev = NULL, *op = conn->wait_head;
+            while (op && op->id != frame.request_id) {
+                prev = op;
+                op = op->next;
+            }
+            if (!op) {
+                errno = EPROTO;
+                return -1;
+            }
+            if (prev) {
+                prev->next = op->next;
+            } else {
+                conn->wait_head = op->next;
+            }
+            if (conn->wait_tail == op) {
+                conn->wait_tail = prev;
+            }
+            
+            immutable_reply reply;
+            decode_reply(&frame, conn->recv_buf + sizeof(frame), &reply);
+            conn->recv_len -= len;
+            memmove(conn->recv_buf, conn->recv_buf + len, conn->recv_len);
+            
+            async->pending--;
+            completed++;
+            if (op->callback) {
+                op->callback(&reply, op->arg);
+            }
+            free(op);
+        }
+    }
+}
+
+immutable_async *immutable_async_open(unsigned int connections) {
+    if (connections == 0) {
+        connections = 1;
+    }
+    immutable_async *async = calloc(1, sizeof(*async));
+    if (!async) {
+        return NULL;
+    }
+    async->conns = calloc(connections, sizeof(async_conn));
+    async->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    async->next_id = 1;
+    if (!async->conns || async->epoll_fd == -1) {
+        int err = errno;
+        immutable_async_close(async);
+        errno = err;
+        return NULL;
     }
     
-    // 准备请求头
-    request_header req;
-    memset(&req, 0, sizeof(req));
-    req.cmd = CMD_SET_RETENTION;
-    strncpy(req.path, path, MAX_PATH_LEN - 1);
-    strncpy(req.token, AUTH_TOKEN, sizeof(req.token) - 1);
-    req.retention_time = retention_seconds;
-    req.data_len = 0;
+    for (unsigned int i = 0; i < connections; i++) {
+        async_conn *conn = &async->conns[i];
+        conn->fd = open_service_socket(SOCK_NONBLOCK);
+        async->conn_count = i + 1;
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = conn };
+        if (conn->fd == -1 || epoll_ctl(async->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) != 0) {
+            int err = errno;
+            immutable_async_close(async);
+            errno = err;
+            return NULL;
+        }
+        conn->events = EPOLLIN;
+    }
+    return async;
+}
+
+void immutable_async_close(immutable_async *async) {
+    if (!async) {
+        return;
+    }
+    for (unsigned int i = 0; i < async->conn_count; i++) {
+        async_conn_broken(async, &async->conns[i], ECANCELED);
+    }
+    if (async->epoll_fd != -1) {
+        close(async->epoll_fd);
+    }
+    free(async->conns);
+    free(async);
+}
+
+int immutable_async_fd(immutable_async *async) {
+    return async->epoll_fd;
+}
+
+size_t immutable_async_pending(immutable_async *async) {
+    return async->pending;
+}
+
+int immutable_async_process(immutable_async *async) {
+    int completed = 0;
+    for (unsigned int i = 0; i < async->conn_count; i++) {
+        async_conn *conn = &async->conns[i];
+        if (conn->fd == -1) {
+            continue;
+        }
+        int n = async_flush(conn);
+        if (n == 0) {
+            n = async_receive(async, conn);
+        }
+        if (n == -1) {
+            size_t before = async->pending;
+            async_conn_broken(async, conn, errno);
+            completed += before - async->pending;
+            continue;
+        }
+        completed += n;
+        async_update_events(async, conn);
+    }
+    return completed;
+}
+
+// 编码请求并放入发送队列，同一路径的请求总是使用同一个连接，保证按提交顺序执行
+static uint32_t async_submit(immutable_async *async, const client_request *r,
+                             immutable_async_callback callback, void *arg) {
+    char buf[REQUEST_BUF_LEN];
+    size_t len = encode_request(r, async->next_id, buf);
+    if (len == 0) {
+        return 0;
+    }
     
-    // 发送请求头
-    if (send(sock_fd, &req, sizeof(req), 0) != sizeof(req)) {
-        perror("发送请求失败");
-        close(sock_fd);
-        return -1;
+    uint32_t hash = 2166136261u;
+    for (const char *p = r->path; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+    async_conn *conn = &async->conns[hash % async->conn_count];
+    if (conn->fd == -1) {
+        errno = ENOTCONN;
+        return 0;
+    }
+    
+    async_op *op = malloc(sizeof(*op) + len);
+    if (!op) {
+        return 0;
+    }
+    op->pass_fd = -1;
+    if (r->pass_fd != -1) {
+        op->pass_fd = fcntl(r->pass_fd, F_DUPFD_CLOEXEC, 0);
+        if (op->pass_fd == -1) {
+            free(op);
+            return 0;
+        }
     }
+    op->next = NULL;
+    op->id = async->next_id++;
+    if (async->next_id == 0) {
+        async->next_id = 1;  // 0表示失败
+    }
+    op->callback = callback;
+    op->arg = arg;
+    op->data = r->data;
+    op->data_len = r->data_len;
+    op->sent = 0;
+    op->head_len = len;
+    memcpy(op->head, buf, len);
     
-    // 接收回应
-    char response[4096];
-    ssize_t recv_len = recv(sock_fd, response, sizeof(response) - 1, 0);
-    if (recv_len > 0) {
-        response[recv_len] = '\0';
-        printf("%s\n", response);
+    if (conn->send_tail) {
+        conn->send_tail->next = op;
     } else {
-        perror("接收回应失败");
+        conn->send_head = op;
     }
+    conn->send_tail = op;
+    async->pending++;
     
-    close(sock_fd);
-    return (recv_len > 0 && strstr(response, "成功") != NULL) ? 0 : -1;
+    // 立即尝试发送，发不完的部分等连接可写时由immutable_async_process继续
+    uint32_t id = op->id;
+    if (async_flush(conn) != 0) {
+        async_conn_broken(async, conn, errno);
+    } else {
+        async_update_events(async, conn);
+    }
+    return id;
 }
 
-// 获取文件剩余保留时间
-time_t get_immutable_retention(const char *path) {
-    int sock_fd = connect_to_service();
-    if (sock_fd == -1) {
-        return -1;
+uint32_t immutable_async_modify(immutable_async *async, const char *path, const void *data,
+                                size_t data_len, immutable_async_callback callback, void *arg) {
+    client_request r;
+    init_request(&r, CMD_MODIFY, path);
+    r.data = data;
+    r.data_len = data_len;
+    return async_submit(async, &r, callback, arg);
+}
+
+uint32_t immutable_async_ingest_fd(immutable_async *async, const char *path, int fd,
+                                   immutable_async_callback callback, void *arg) {
+    client_request r;
+    init_request(&r, CMD_INGEST_FD, path);
+    r.pass_fd = fd;
+    return async_submit(async, &r, callback, arg);
+}
+
+uint32_t immutable_async_delete(immutable_async *async, const char *path,
+                                immutable_async_callback callback, void *arg) {
+    client_request r;
+    init_request(&r, CMD_DELETE, path);
+    return async_submit(async, &r, callback, arg);
+}
+
+uint32_t immutable_async_rsync(immutable_async *async, const char *src_path, const char *dst_path,
+                               immutable_async_callback callback, void *arg) {
+    client_request r;
+    init_request(&r, CMD_RSYNC, dst_path);
+    r.src_path = src_path;
+    return async_submit(async, &r, callback, arg);
+}
+
+uint32_t immutable_async_set_retention(immutable_async *async, const char *path,
+                                       time_t retention_seconds,
+                                       immutable_async_callback callback, void *arg) {
+    client_request r;
+    init_request(&r, CMD_SET_RETENTION, path);
+    r.retention_time = retention_seconds;
+    return async_submit(async, &r, callback, arg);
+}
+
+uint32_t immutable_async_get_retention(immutable_async *async, const char *path,
+                                       immutable_async_callback callback, void *arg) {
+    client_request r;
+    init_request(&r, CMD_GET_RETENTION, path);
+    return async_submit(async, &r, callback, arg);
+}
+
+// 使用示例主函数
+#ifdef EXAMPLE_MAIN
+static const char *batch_op_name(int cmd) {
+    switch (cmd) {
+        case IMMUTABLE_OP_MODIFY:        return "modify";
+        case IMMUTABLE_OP_DELETE:        return "delete";
+        case IMMUTABLE_OP_SET_RETENTION: return "setretention";
+        case IMMUTABLE_OP_GET_RETENTION: return "getretention";
+        default:                         return "?";
+    }
+}
+
+// 打印服务的运行统计
+static int print_stats(void) {
+    static const char *names[IMMUTABLE_STATS_COMMANDS] = {
+        "unknown", "modify", "delete", "rsync", "setretention", "getretention",
+        "ingest", "batch", "stats", "append", "pwrite", "verify"
+    };
+    immutable_stats stats;
+    if (immutable_get_stats(&stats) != 0) {
+        perror("无法获取运行统计");
+        return 1;
     }
     
-    // 准备请求头
-    request_header req;
-    memset(&req, 0, sizeof(req));
-    req.cmd = CMD_GET_RETENTION;
-    strncpy(req.path, path, MAX_PATH_LEN - 1);
-    strncpy(req.token, AUTH_TOKEN, sizeof(req.token) - 1);
-    req.data_len = 0;
+    printf("运行时间: %lu 秒\n", (unsigned long)stats.uptime);
+    printf("当前连接: %lu\n", (unsigned long)stats.active_connections);
+    printf("队列中的请求: %lu\n", (unsigned long)stats.queue_depth);
+    printf("保留表记录: %lu\n", (unsigned long)stats.retention_entries);
+    printf("写入字节数: %lu\n", (unsigned long)stats.bytes_written);
+    printf("认证失败: %lu\n", (unsigned long)stats.auth_failures);
+    printf("丢弃的日志: %lu\n", (unsigned long)stats.log_dropped);
+    // 延迟为直方图桶的上界，只精确到2倍
+    printf("\n%-14s %10s %8s %10s %10s %10s\n", "command", "count", "errors", "avg(us)",
+           "p50(us)", "p99(us)");
+    for (int i = 0; i < IMMUTABLE_STATS_COMMANDS; i++) {
+        const immutable_command_stats *c = &stats.commands[i];
+        if (c->count == 0) {
+            continue;
+        }
+        char p50[24], p99[24];
+        snprintf(p50, sizeof(p50), "<%lu", (unsigned long)immutable_stats_percentile(c, 0.5));
+        snprintf(p99, sizeof(p99), "<%lu", (unsigned long)immutable_stats_percentile(c, 0.99));
+        printf("%-14s %10lu %8lu %10lu %10s %10s\n", names[i], (unsigned long)c->count,
+               (unsigned long)c->errors, (unsigned long)(c->latency_sum_us / c->count), p50, p99);
+    }
     
-    // 发送请求头
-    if (send(sock_fd, &req, sizeof(req), 0) != sizeof(req)) {
-        perror("发送请求失败");
-        close(sock_fd);
-        return -1;
+    if (stats.client_count > 0) {
+        printf("\n%-8s %8s %6s %5s %6s %7s %6s %12s %10s %9s  %s\n", "uid", "pid", "weight", "conns",
+               "queued", "running", "parked", "bytes", "served", "throttled", "context");
+        for (uint32_t i = 0; i < stats.client_count; i++) {
+            const immutable_client_stats *c = &stats.clients[i];
+            printf("%-8u %8d %6u %5u %6u %7u %6u %12lu %10lu %9lu  %s\n", (unsigned)c->uid, (int)c->pid,
+                   c->weight, c->connections, c->queued, c->running, c->parked,
+                   (unsigned long)c->running_bytes, (unsigned long)c->served,
+                   (unsigned long)c->throttled, c->label[0] ? c->label : "-");
+        }
+        if (stats.client_total > stats.client_count) {
+            printf("(另有 %u 个客户端未列出)\n", stats.client_total - stats.client_count);
+        }
+    }
+    return 0;
+}
+
+// 执行清单中的操作，每行一项:
+//   modify <文件路径> <本地文件>
+//   delete <文件路径>
+//   setretention <文件路径> <保留秒数>
+//   getretention <文件路径>
+// 空行和#开头的行被忽略。清单为"-"时从标准输入读取
+static int run_batch(const char *manifest) {
+    FILE *fp = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if (!fp) {
+        perror("无法打开清单");
+        return 1;
     }
     
-    // 接收回应
-    char response[4096];
-    ssize_t recv_len = recv(sock_fd, response, sizeof(response) - 1, 0);
-    time_t remaining = 0;
+    immutable_batch_op *ops = NULL;
+    size_t count = 0, capacity = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    unsigned long lineno = 0;
+    int ret = 0;
     
-    if (recv_len > 0) {
-        response[recv_len] = '\0';
-        printf("%s\n", response);
+    while (getline(&line, &line_cap, fp) != -1) {
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char *save;
+        char *op = strtok_r(line, " \t", &save);
+        if (!op || op[0] == '#') {
+            continue;
+        }
+        char *path = strtok_r(NULL, " \t", &save);
+        char *arg = strtok_r(NULL, "", &save);
+        if (arg) {
+            arg += strspn(arg, " \t");
+        }
         
-        // 尝试解析剩余时间
-        const char *time_str = strstr(response, "剩余保留时间:");
-        if (time_str) {
-            time_str += strlen("剩余保留时间:");
-            sscanf(time_str, "%ld", &remaining);
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            immutable_batch_op *grown = realloc(ops, capacity * sizeof(*ops));
+            if (!grown) {
+                perror("内存不足");
+                ret = 1;
+                break;
+            }
+            ops = grown;
         }
-    } else {
-        perror("接收回应失败");
+        immutable_batch_op *o = &ops[count];
+        memset(o, 0, sizeof(*o));
+        o->path = path ? strdup(path) : NULL;
+        
+        if (!path) {
+            fprintf(stderr, "清单第 %lu 行缺少文件路径\n", lineno);
+            ret = 1;
+        } else if (strcmp(op, "modify") == 0 && arg && *arg) {
+            // 本地文件映射到内存，由immutable_batch直接发送
+            int fd = open(arg, O_RDONLY);
+            struct stat st;
+            if (fd == -1 || fstat(fd, &st) != 0 || st.st_size == 0) {
+                fprintf(stderr, "清单第 %lu 行: 无法读取本地文件 %s\n", lineno, arg);
+                ret = 1;
+            } else {
+                void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data == MAP_FAILED) {
+                    fprintf(stderr, "清单第 %lu 行: 无法映射本地文件 %s\n", lineno, arg);
+                    ret = 1;
+                } else {
+                    o->cmd = IMMUTABLE_OP_MODIFY;
+                    o->data = data;
+                    o->data_len = st.st_size;
+                }
+            }
+            if (fd != -1) {
+                close(fd);
+            }
+        } else if (strcmp(op, "setretention") == 0 && arg && *arg) {
+            o->cmd = IMMUTABLE_OP_SET_RETENTION;
+            o->retention_seconds = atol(arg);
+        } else if (strcmp(op, "delete") == 0) {
+            o->cmd = IMMUTABLE_OP_DELETE;
+        } else if (strcmp(op, "getretention") == 0) {
+            o->cmd = IMMUTABLE_OP_GET_RETENTION;
+        } else {
+            fprintf(stderr, "清单第 %lu 行无效: %s\n", lineno, op);
+            ret = 1;
+        }
+        count++;
+        if (ret != 0) {
+            break;
+        }
+    }
+    free(line);
+    if (fp != stdin) {
+        fclose(fp);
     }
     
-    close(sock_fd);
-    return remaining;
+    if (ret == 0 && count > 0) {
+        int failed = immutable_batch(ops, count);
+        if (failed == -1) {
+            perror("批量请求失败");
+            ret = 1;
+        } else {
+            for (size_t i = 0; i < count; i++) {
+                immutable_batch_op *o = &ops[i];
+                if (o->status == IMMUTABLE_OK && o->cmd == IMMUTABLE_OP_GET_RETENTION) {
+                    printf("%s %s: 剩余保留时间 %ld 秒\n", batch_op_name(o->cmd), o->path,
+                           (long)o->remaining);
+                } else if (o->status == IMMUTABLE_OK) {
+                    printf("%s %s: 成功\n", batch_op_name(o->cmd), o->path);
+                } else if (o->status == IMMUTABLE_RETENTION_ACTIVE) {
+                    printf("%s %s: 失败 (保留期内，剩余 %ld 秒)\n", batch_op_name(o->cmd), o->path,
+                           (long)o->remaining);
+                } else if (o->status == IMMUTABLE_FAILED && o->error != 0) {
+                    printf("%s %s: 失败 (%s: %s)\n", batch_op_name(o->cmd), o->path,
+                           immutable_status_string(o->status), strerror(o->error));
+                } else {
+                    printf("%s %s: 失败 (%s)\n", batch_op_name(o->cmd), o->path,
+                           immutable_status_string(o->status));
+                }
+            }
+            printf("共 %zu 项，失败 %d 项\n", count, failed);
+            ret = failed > 0;
+        }
+    }
+    
+    for (size_t i = 0; i < count; i++) {
+        if (ops[i].data) {
+            munmap((void *)ops[i].data, ops[i].data_len);
+        }
+        free((char *)ops[i].path);
+    }
+    free(ops);
+    return ret;
 }
 
-// 使用示例主函数
-#ifdef EXAMPLE_MAIN
 int main(int argc, char *argv[]) {
+    if (argc == 2 && strcmp(argv[1], "stats") == 0) {
+        return print_stats();
+    }
     if (argc < 3) {
         printf("用法:\n");
         printf("  修改文件:   %s modify <文件路径> <内容>\n", argv[0]);
+        printf("  从文件修改: %s modifyfrom <文件路径> <本地文件>\n", argv[0]);
+        printf("  传递文件:   %s ingest <文件路径> <本地文件>\n", argv[0]);
+        printf("  追加内容:   %s append <文件路径> <内容>\n", argv[0]);
+        printf("  追加并设为只能追加: %s appendonly <文件路径> <内容>\n", argv[0]);
+        printf("  覆盖写入:   %s pwrite <文件路径> <偏移> <内容>\n", argv[0]);
+        printf("  校验内容:   %s verify <文件或目录路径>\n", argv[0]);
         printf("  删除文件:   %s delete <文件路径>\n", argv[0]);
         printf("  增量更新:   %s rsync <源文件> <目标文件>\n", argv[0]);
         printf("  设置保留期: %s setretention <文件路径> <保留秒数>\n", argv[0]);
         printf("  查询保留期: %s getretention <文件路径>\n", argv[0]);
+        printf("  批量操作:   %s batch <清单文件|->\n", argv[0]);
+        printf("  运行统计:   %s stats\n", argv[0]);
         return 1;
     }
     
@@ -280,6 +1709,53 @@ int main(int argc, char *argv[]) {
         const char *content = argv[3];
         return modify_immutable_file(path, content, strlen(content));
     } 
+    else if (strcmp(cmd, "modifyfrom") == 0) {
+        if (argc < 4) {
+            printf("从文件修改命令需要提供本地文件\n");
+            return 1;
+        }
+        int fd = open(argv[3], O_RDONLY);
+        if (fd == -1) {
+            perror("无法打开本地文件");
+            return 1;
+        }
+        int ret = modify_immutable_file_from_fd(path, fd);
+        close(fd);
+        return ret;
+    }
+    else if (strcmp(cmd, "ingest") == 0) {
+        if (argc < 4) {
+            printf("传递文件命令需要提供本地文件\n");
+            return 1;
+        }
+        int fd = open(argv[3], O_RDONLY);
+        if (fd == -1) {
+            perror("无法打开本地文件");
+            return 1;
+        }
+        int ret = ingest_immutable_file_fd(path, fd);
+        close(fd);
+        return ret;
+    }
+    else if (strcmp(cmd, "append") == 0 || strcmp(cmd, "appendonly") == 0) {
+        if (argc < 4 || argv[3][0] == '\0') {
+            printf("追加命令需要提供内容\n");
+            return 1;
+        }
+        int flags = strcmp(cmd, "appendonly") == 0 ? IMMUTABLE_APPEND_ONLY : 0;
+        return append_immutable_file(path, argv[3], strlen(argv[3]), flags);
+    }
+    else if (strcmp(cmd, "pwrite") == 0) {
+        if (argc < 5 || argv[4][0] == '\0') {
+            printf("覆盖写入命令需要提供偏移和内容\n");
+            return 1;
+        }
+        uint64_t offset = strtoull(argv[3], NULL, 10);
+        return pwrite_immutable_file(path, argv[4], strlen(argv[4]), offset);
+    }
+    else if (strcmp(cmd, "verify") == 0) {
+        return verify_immutable_file(path);
+    }
     else if (strcmp(cmd, "delete") == 0) {
         return delete_immutable_file(path);
     }
@@ -299,6 +1775,9 @@ int main(int argc, char *argv[]) {
         time_t seconds = atol(argv[3]);
         return set_immutable_retention(path, seconds);
     }
+    else if (strcmp(cmd, "batch") == 0) {
+        return run_batch(path);
+    }
     else if (strcmp(cmd, "getretention") == 0) {
         time_t remaining = get_immutable_retention(path);
         if (remaining >= 0) {
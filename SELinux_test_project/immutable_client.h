@@ -4,7 +4,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <time.h>
+#include <sys/types.h>
+
+// 服务的socket默认为/var/run/immutable_service.sock，设置环境变量IMMUTABLE_SOCKET时使用其中的路径
 
 /**
  * 修改不可变文件内容
@@ -16,6 +20,72 @@
  */
 int modify_immutable_file(const char *path, const char *data, size_t data_len);
 
+/**
+ * 从文件描述符读取内容修改不可变文件
+ * 
+ * 内容由服务分块接收，全部收到后原子地替换原文件，适合大文件。
+ * 
+ * @param path 文件路径
+ * @param fd 内容来源，必须是非空的普通文件，从文件开头读取
+ * @return 成功返回 0，失败返回 -1
+ */
+int modify_immutable_file_from_fd(const char *path, int fd);
+
+// append_immutable_file的flags：之后只能追加，不能再替换或覆盖文件，不能撤销
+#define IMMUTABLE_APPEND_ONLY 0x1
+
+/**
+ * 在不可变文件末尾追加内容
+ * 
+ * 只写入新的内容，不重写整个文件；文件不存在时创建。文件的安全上下文和
+ * 保留期限不变。追加过程中服务崩溃时文件末尾可能留有部分内容。
+ * 
+ * @param path 文件路径
+ * @param data 追加的内容
+ * @param data_len 内容长度，不能为0
+ * @param flags 0或IMMUTABLE_APPEND_ONLY
+ * @return 成功返回 0，失败返回 -1
+ */
+int append_immutable_file(const char *path, const char *data, size_t data_len, int flags);
+
+/**
+ * 从offset开始覆盖写入不可变文件的一段内容
+ * 
+ * 写入可以超出原文件末尾，但不能从末尾之后开始。不是原子操作：
+ * 服务崩溃时这段内容可能只写入了一部分。只能追加的文件只允许offset等于文件长度。
+ * 
+ * @param path 文件路径
+ * @param data 写入的内容
+ * @param data_len 内容长度，不能为0
+ * @param offset 开始写入的位置
+ * @return 成功返回 0，失败返回 -1
+ */
+int pwrite_immutable_file(const char *path, const char *data, size_t data_len, uint64_t offset);
+
+/**
+ * 将已打开的文件传给服务生成不可变文件
+ * 
+ * 文件描述符通过SCM_RIGHTS传给服务，服务直接从中复制内容：
+ * 文件系统支持时使用reflink，否则使用copy_file_range或sendfile，
+ * 文件内容不经过socket。调用返回后fd仍由调用者负责关闭。
+ * 
+ * @param path 文件路径
+ * @param fd 以可读方式打开的普通文件
+ * @return 成功返回 0，失败返回 -1
+ */
+int ingest_immutable_file_fd(const char *path, int fd);
+
+/**
+ * 按服务记录的校验和检查文件或整个目录树的内容
+ * 
+ * 服务写入文件时记录内容的CRC32C，校验时重新读取比较，目录由服务并行遍历。
+ * 结果打印到标准输出，不一致的文件记录在服务的审计日志中。
+ * 
+ * @param path 文件或目录路径
+ * @return 都一致(没有记录的文件不算不一致)返回 0，否则返回 -1
+ */
+int verify_immutable_file(const char *path);
+
 /**
  * 删除不可变文件
  * 
@@ -45,9 +115,421 @@ int set_immutable_retention(const char *path, time_t retention_seconds);
 /**
  * 获取文件剩余保留时间
  * 
+ * 服务发布了共享内存保留表(默认/dev/shm/immutable_retention，环境变量
+ * IMMUTABLE_RETENTION_SHM可以指定其他路径或设为off)时直接查询，不经过socket、
+ * 不加锁，也不检查令牌；否则通过socket向服务查询。
+ * 
  * @param path 文件路径
  * @return 剩余秒数，失败返回 -1
  */
 time_t get_immutable_retention(const char *path);
 
+/**
+ * 会话：在一个连接上连续发送多个请求
+ * 
+ * 发送函数只发出请求、不等待回应，返回的请求id用于之后取回对应的回应；
+ * 服务按顺序处理同一会话中的请求。未取回的回应过多时，发送函数会先
+ * 接收回应暂存起来，因此调用者可以一次提交大量请求再统一等待。
+ * 会话不是线程安全的，多个线程应各自打开会话。
+ */
+typedef struct immutable_session immutable_session;
+
+/**
+ * 请求的处理状态
+ */
+typedef enum {
+    IMMUTABLE_OK = 0,
+    IMMUTABLE_AUTH_FAILED = 1,       // 令牌错误或路径不允许
+    IMMUTABLE_BAD_REQUEST = 2,       // 请求格式错误或缺少参数
+    IMMUTABLE_RETENTION_ACTIVE = 3,  // 保留期未到，不能删除
+    IMMUTABLE_FAILED = 4,            // 操作失败，原因见error
+    IMMUTABLE_UNSUPPORTED = 5        // 服务不支持该命令或协议版本
+} immutable_status;
+
+typedef struct {
+    uint32_t request_id;       // 对应的请求id
+    int status;                // immutable_status
+    int error;                 // 失败时服务端的errno，未知时为 0
+    time_t remaining;          // 剩余保留秒数：查询保留期限的结果，或因保留期未到而删除失败
+    uint64_t bytes_total;      // 增量更新：源文件大小
+    uint64_t bytes_literal;    // 增量更新：从源文件复制的字节数
+    uint64_t bytes_reused;     // 增量更新：复用目标文件的字节数
+    const char *ingest_method; // 传递文件描述符：服务使用的复制方式，未知时为 NULL
+    uint64_t entries_deleted;  // 删除目录：已删除的文件和目录数
+    uint64_t entries_retained; // 删除目录：保留期未到而保留的项数
+    uint64_t entries_failed;   // 删除目录：删除失败的项数
+    uint64_t files_verified;   // 校验：内容与记录一致的文件数
+    uint64_t files_mismatched; // 校验：内容或长度与记录不一致的文件数
+    uint64_t files_unrecorded; // 校验：没有记录校验和的文件数
+    uint64_t verify_failed;    // 校验：无法读取的项数
+    uint64_t bytes_verified;   // 校验：读取的字节数
+} immutable_reply;
+
+/**
+ * 获取状态的说明文字
+ * 
+ * @param status immutable_status
+ * @return 静态字符串
+ */
+const char *immutable_status_string(int status);
+
+/**
+ * 打开会话
+ * 
+ * @return 成功返回会话句柄，失败返回 NULL
+ */
+immutable_session *immutable_session_open(void);
+
+/**
+ * 关闭会话，未取回的回应被丢弃
+ * 
+ * @param session 会话句柄
+ */
+void immutable_session_close(immutable_session *session);
+
+/**
+ * 在会话中发送修改文件内容的请求
+ * 
+ * @param session 会话句柄
+ * @param path 文件路径
+ * @param data 文件内容
+ * @param data_len 内容长度
+ * @return 成功返回请求id，失败返回 0
+ */
+uint32_t immutable_session_modify(immutable_session *session, const char *path,
+                                  const char *data, size_t data_len);
+
+/**
+ * 在会话中发送追加内容的请求
+ * 
+ * @param session 会话句柄
+ * @param path 文件路径
+ * @param data 追加的内容
+ * @param data_len 内容长度
+ * @param flags 0或IMMUTABLE_APPEND_ONLY
+ * @return 成功返回请求id，失败返回 0
+ */
+uint32_t immutable_session_append(immutable_session *session, const char *path,
+                                  const char *data, size_t data_len, int flags);
+
+/**
+ * 在会话中发送覆盖写入一段内容的请求
+ * 
+ * @param session 会话句柄
+ * @param path 文件路径
+ * @param data 写入的内容
+ * @param data_len 内容长度
+ * @param offset 开始写入的位置
+ * @return 成功返回请求id，失败返回 0
+ */
+uint32_t immutable_session_pwrite(immutable_session *session, const char *path,
+                                  const char *data, size_t data_len, uint64_t offset);
+
+/**
+ * 在会话中发送校验文件或目录树的请求，结果见回应中的files_*
+ * 
+ * @param session 会话句柄
+ * @param path 文件或目录路径
+ * @return 成功返回请求id，失败返回 0
+ */
+uint32_t immutable_session_verify(immutable_session *session, const char *path);
+
+/**
+ * 在会话中发送删除文件的请求
+ * 
+ * @param session 会话句柄
+ * @param path 文件路径
+ * @return 成功返回请求id，失败返回 0
+ */
+uint32_t immutable_session_delete(immutable_session *session, const char *path);
+
+/**
+ * 在会话中发送增量更新的请求
+ * 
+ * @param session 会话句柄
+ * @param src_path 源文件路径
+ * @param dst_path 目标文件路径
+ * @return 成功返回请求id，失败返回 0
+ */
+uint32_t immutable_session_rsync(immutable_session *session, const char *src_path,
+                                 const char *dst_path);
+
+/**
+ * 在会话中发送设置保留期限的请求
+ * 
+ * @param session 会话句柄
+ * @param path 文件路径
+ * @param retention_seconds 保留期限(秒)
+ * @return 成功返回请求id，失败返回 0
+ */
+uint32_t immutable_session_set_retention(immutable_session *session, const char *path,
+                                         time_t retention_seconds);
+
+/**
+ * 在会话中发送查询保留期限的请求
+ * 
+ * @param session 会话句柄
+ * @param path 文件路径
+ * @return 成功返回请求id，失败返回 0
+ */
+uint32_t immutable_session_get_retention(immutable_session *session, const char *path);
+
+/**
+ * 等待请求的回应
+ * 
+ * 先到达的其他请求的回应会被暂存，之后仍可取回。
+ * 
+ * @param session 会话句柄
+ * @param request_id 请求id，为 0 时取回最早到达的任意回应
+ * @param reply 输出回应
+ * @return 收到回应返回 0(操作结果见reply->status)，连接出错或没有该请求返回 -1
+ */
+int immutable_session_wait(immutable_session *session, uint32_t request_id,
+                           immutable_reply *reply);
+
+/**
+ * 批量操作的类型，数值与服务的命令号一致
+ */
+typedef enum {
+    IMMUTABLE_OP_MODIFY = 1,
+    IMMUTABLE_OP_DELETE = 2,
+    IMMUTABLE_OP_SET_RETENTION = 4,
+    IMMUTABLE_OP_GET_RETENTION = 5
+} immutable_op;
+
+typedef struct {
+    int cmd;                   // immutable_op
+    const char *path;          // 文件路径
+    const void *data;          // IMMUTABLE_OP_MODIFY: 文件内容
+    size_t data_len;           // IMMUTABLE_OP_MODIFY: 内容长度
+    time_t retention_seconds;  // IMMUTABLE_OP_SET_RETENTION: 保留期限(秒)
+    
+    // 以下由immutable_batch填写
+    int status;                // immutable_status
+    int error;                 // 失败时服务端的errno，未知时为 0
+    time_t remaining;          // 查询保留期限的结果，或因保留期未到而删除失败时的剩余秒数
+} immutable_batch_op;
+
+/**
+ * 在一个请求中执行多个操作
+ * 
+ * 服务按数组顺序执行各项，后面的项能看到前面的项的结果(例如同一批中先设置
+ * 保留期再删除会因保留期未到而失败)。所有修改的内容先写入临时文件并一起落盘，
+ * 新文件的SELinux上下文整批只设置一次，保留期限在一次写入中保存。
+ * 一项失败不影响其他项，每项的结果写回对应的元素。
+ * 超过一个请求的上限(65536项或16MB清单)时自动拆成多个请求依次发送，
+ * 此时不同请求中的项不再作为一个整体落盘。
+ * 
+ * @param ops 操作数组
+ * @param count 操作数
+ * @return 所有项成功返回 0，有项失败时返回失败的项数，与服务通信失败返回 -1
+ */
+int immutable_batch(immutable_batch_op *ops, size_t count);
+
+/**
+ * 服务的运行统计
+ * 
+ * commands按命令号排列：下标0为未知命令，1至10依次为修改、删除、增量更新、设置保留期、
+ * 查询保留期、传递文件描述符、批量操作、查询统计、追加、覆盖写入和校验。延迟直方图的第i个桶为耗时小于
+ * 2^i微秒的请求数(不含更小的桶)，最后一个桶包含所有更长的请求。
+ */
+#define IMMUTABLE_STATS_COMMANDS 12
+#define IMMUTABLE_STATS_BUCKETS 24
+
+typedef struct {
+    uint64_t count;            // 请求数
+    uint64_t errors;           // 失败的请求数
+    uint64_t latency_sum_us;   // 耗时总和(微秒)
+    uint64_t latency_buckets[IMMUTABLE_STATS_BUCKETS];
+} immutable_command_stats;
+
+/**
+ * 一个客户端(对端的uid和SELinux上下文)在服务调度中的状态，服务最多列出IMMUTABLE_STATS_CLIENTS个
+ */
+#define IMMUTABLE_STATS_CLIENTS 64
+
+typedef struct {
+    uid_t uid;
+    pid_t pid;                 // 最近一个连接的进程
+    unsigned int weight;       // 调度中的权重
+    uint32_t connections;      // 连接数
+    uint32_t queued;           // 排队的请求数
+    uint32_t running;          // 正在执行的请求数
+    uint32_t parked;           // 因超过上限暂停接收的连接数
+    uint64_t running_bytes;    // 执行中的请求要写入的字节数
+    uint64_t served;           // 已交给工作线程的请求数
+    uint64_t throttled;        // 超过上限的次数
+    char label[256];           // SELinux上下文，取不到时为空
+} immutable_client_stats;
+
+typedef struct {
+    uint64_t uptime;              // 服务已运行的秒数
+    uint64_t bytes_written;       // 写入不可变文件的字节数
+    uint64_t auth_failures;       // 认证失败的请求数
+    uint64_t queue_depth;         // 等待工作线程的请求数
+    uint64_t active_connections;  // 当前的连接数(包括本次查询的连接)
+    uint64_t retention_entries;   // 保留表中的路径数
+    uint64_t log_dropped;         // 因日志缓冲区满或syslog不可用而丢弃的日志数
+    immutable_command_stats commands[IMMUTABLE_STATS_COMMANDS];
+    uint32_t client_total;        // 客户端总数(包括本次查询的客户端)，较早的服务为0
+    uint32_t client_count;        // clients中的个数
+    immutable_client_stats clients[IMMUTABLE_STATS_CLIENTS];
+} immutable_stats;
+
+/**
+ * 获取服务的运行统计
+ * 
+ * @param stats 输出统计
+ * @return 成功返回 0，失败返回 -1
+ */
+int immutable_get_stats(immutable_stats *stats);
+
+/**
+ * 按延迟直方图估计耗时的百分位数
+ * 
+ * @param stats 一个命令的统计
+ * @param quantile 0到1之间，如 0.99
+ * @return 百分位数所在桶的上界(微秒)，没有请求时返回 0
+ */
+uint64_t immutable_stats_percentile(const immutable_command_stats *stats, double quantile);
+
+/**
+ * 异步接口：供使用事件循环的程序在一个线程中同时进行大量请求
+ * 
+ * 提交函数只把请求放入发送队列并尽量发送，不会阻塞；结果通过回调返回，
+ * 不打印任何内容。immutable_async_fd返回的描述符在有回应到达或可以继续
+ * 发送时变为可读，调用者把它加入自己的epoll/poll中，可读时调用
+ * immutable_async_process。请求分布在打开时指定数量的连接上，同一路径的
+ * 请求总是走同一个连接，因此按提交顺序执行。
+ * 回调在immutable_async_process(连接出错时也可能在提交函数)中调用，
+ * 回调中可以提交新请求，但不能调用immutable_async_process或关闭句柄。
+ * 句柄不是线程安全的。
+ */
+typedef struct immutable_async immutable_async;
+
+/**
+ * 请求完成的回调
+ * 
+ * @param reply 回应，只在回调期间有效；连接出错时status为IMMUTABLE_FAILED
+ * @param arg 提交时传入的参数
+ */
+typedef void (*immutable_async_callback)(const immutable_reply *reply, void *arg);
+
+/**
+ * 打开异步句柄
+ * 
+ * @param connections 使用的连接数，为 0 时使用 1 个；服务并行处理不同连接上的请求
+ * @return 成功返回句柄，失败返回 NULL(errno说明原因)
+ */
+immutable_async *immutable_async_open(unsigned int connections);
+
+/**
+ * 关闭异步句柄，未完成的请求以IMMUTABLE_FAILED(error为ECANCELED)调用回调
+ * 
+ * @param async 异步句柄
+ */
+void immutable_async_close(immutable_async *async);
+
+/**
+ * 获取可供poll/epoll监听的描述符
+ * 
+ * @param async 异步句柄
+ * @return 描述符，可读时应调用immutable_async_process
+ */
+int immutable_async_fd(immutable_async *async);
+
+/**
+ * 继续发送队列中的请求，接收已到达的回应并调用回调，不会阻塞
+ * 
+ * @param async 异步句柄
+ * @return 本次完成的请求数
+ */
+int immutable_async_process(immutable_async *async);
+
+/**
+ * 获取尚未完成的请求数
+ * 
+ * @param async 异步句柄
+ * @return 已提交但回调尚未调用的请求数
+ */
+size_t immutable_async_pending(immutable_async *async);
+
+/**
+ * 异步修改文件内容
+ * 
+ * @param async 异步句柄
+ * @param path 文件路径
+ * @param data 文件内容，在回调调用之前必须保持有效
+ * @param data_len 内容长度
+ * @param callback 完成时的回调，可以为 NULL
+ * @param arg 传给回调的参数
+ * @return 成功返回请求id，失败返回 0
+ */
+uint32_t immutable_async_modify(immutable_async *async, const char *path, const void *data,
+                                size_t data_len, immutable_async_callback callback, void *arg);
+
+/**
+ * 异步地将已打开的文件传给服务生成不可变文件
+ * 
+ * @param async 异步句柄
+ * @param path 文件路径
+ * @param fd 以可读方式打开的普通文件，函数内部复制一份，调用返回后即可关闭
+ * @param callback 完成时的回调，可以为 NULL
+ * @param arg 传给回调的参数
+ * @return 成功返回请求id，失败返回 0
+ */
+uint32_t immutable_async_ingest_fd(immutable_async *async, const char *path, int fd,
+                                   immutable_async_callback callback, void *arg);
+
+/**
+ * 异步删除文件
+ * 
+ * @param async 异步句柄
+ * @param path 文件路径
+ * @param callback 完成时的回调，可以为 NULL
+ * @param arg 传给回调的参数
+ * @return 成功返回请求id，失败返回 0
+ */
+uint32_t immutable_async_delete(immutable_async *async, const char *path,
+                                immutable_async_callback callback, void *arg);
+
+/**
+ * 异步增量更新
+ * 
+ * @param async 异步句柄
+ * @param src_path 源文件路径
+ * @param dst_path 目标文件路径
+ * @param callback 完成时的回调，可以为 NULL
+ * @param arg 传给回调的参数
+ * @return 成功返回请求id，失败返回 0
+ */
+uint32_t immutable_async_rsync(immutable_async *async, const char *src_path, const char *dst_path,
+                               immutable_async_callback callback, void *arg);
+
+/**
+ * 异步设置保留期限
+ * 
+ * @param async 异步句柄
+ * @param path 文件路径
+ * @param retention_seconds 保留期限(秒)
+ * @param callback 完成时的回调，可以为 NULL
+ * @param arg 传给回调的参数
+ * @return 成功返回请求id，失败返回 0
+ */
+uint32_t immutable_async_set_retention(immutable_async *async, const char *path,
+                                       time_t retention_seconds,
+                                       immutable_async_callback callback, void *arg);
+
+/**
+ * 异步查询保留期限，结果在回调的reply->remaining中
+ * 
+ * @param async 异步句柄
+ * @param path 文件路径
+ * @param callback 完成时的回调，可以为 NULL
+ * @param arg 传给回调的参数
+ * @return 成功返回请求id，失败返回 0
+ */
+uint32_t immutable_async_get_retention(immutable_async *async, const char *path,
+                                       immutable_async_callback callback, void *arg);
+
 #endif /* IMMUTABLE_CLIENT_H */ 
\ No newline at end of file
@@ -0,0 +1,267 @@
+#ifndef IMMUTABLE_PROTOCOL_H
+#define IMMUTABLE_PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// 服务与客户端共用的通信格式
+
+#define MAX_PATH_LEN 4096
+
+typedef enum {
+    CMD_MODIFY = 1,     // 修改文件内容
+    CMD_DELETE = 2,     // 删除文件
+    CMD_RSYNC = 3,      // 使用rsync增量更新
+    CMD_SET_RETENTION = 4,  // 设置保留期限
+    CMD_GET_RETENTION = 5,  // 获取保留期限
+    CMD_INGEST_FD = 6,      // 用客户端通过SCM_RIGHTS传来的文件描述符生成文件
+    CMD_BATCH = 7,          // 批量操作，只能使用版本3
+    CMD_STATS = 8,          // 获取服务的运行统计，回应为RESULT_STATS
+    CMD_APPEND = 9,         // 在文件末尾追加内容，标志为APPEND_FLAG_*
+    CMD_PWRITE = 10,        // 从指定的偏移开始覆盖写入，不能超过文件末尾
+    CMD_VERIFY = 11         // 按记录的校验和检查文件或整个目录树，回应为RESULT_VERIFY
+} command_type;
+
+// CMD_APPEND的标志
+#define APPEND_FLAG_APPEND_ONLY 0x1  // 同时把文件标记为只能追加，之后不能再整个替换或覆盖写入
+
+typedef struct {
+    command_type cmd;
+    char path[MAX_PATH_LEN];
+    char token[128];
+    char src_path[MAX_PATH_LEN]; // 用于rsync源路径
+    time_t retention_time;       // 保留期限 (秒)；旧格式中没有单独的字段，也用于CMD_APPEND的标志和CMD_PWRITE的偏移
+    size_t data_len;
+} request_header;
+
+/*
+ * 会话协议：每个请求和回应前加一个帧头，连接在回应后保持打开，
+ * 客户端可以连续发送多个请求而不等待回应，回应按请求id对应。
+ *
+ * 版本3(当前)：
+ *   请求: frame_header + request_v2 + 令牌 + 路径 + 源路径 + data_len字节的文件内容
+ *         (仅CMD_MODIFY、CMD_APPEND和CMD_PWRITE)
+ *   回应: frame_header + reply_v2 + 结果(类型见reply_v2.result)
+ * 版本1(过渡期间仍然接受)：
+ *   请求: frame_header + request_header + 文件内容
+ *   回应: frame_header + 文本消息，失败时flags带FRAME_FLAG_FAILED
+ * 版本2(不再接受)：request_v2中没有offset、flags和reserved，收到时回应STATUS_UNSUPPORTED
+ *
+ * 旧客户端直接发送request_header，其前4个字节是命令号，不会与PROTOCOL_MAGIC相同，
+ * 服务据此区分；旧格式的连接处理完一个请求后关闭，回应为文本消息。
+ *
+ * 所有整数使用本机字节序(只在本机的Unix socket上使用)。
+ */
+#define PROTOCOL_MAGIC 0x464d4d49u  // 内存中的字节为"IMMF"
+#define PROTOCOL_VERSION 3
+#define PROTOCOL_VERSION_TEXT 1     // 请求为request_header、回应为文本的旧版本
+#define PROTOCOL_VERSION_RETIRED 2  // request_v2较短的旧版本，只回应STATUS_UNSUPPORTED
+
+typedef struct {
+    uint32_t magic;        // PROTOCOL_MAGIC
+    uint16_t version;      // PROTOCOL_VERSION
+    uint16_t flags;        // 请求中必须为0，回应中见FRAME_FLAG_*
+    uint32_t request_id;   // 由客户端分配，回应中原样带回
+    uint32_t length;       // 帧头之后的长度(不含文件内容)
+} frame_header;
+
+#define FRAME_FLAG_FAILED 0x1  // 版本1的回应: 操作失败
+
+#define MAX_REPLY_LEN 4096
+#define MAX_TOKEN_LEN 128
+
+// 版本3请求的定长部分(结构名沿用版本2)，随后依次是令牌、路径、源路径，均不含'\0'
+// CMD_BATCH的请求在源路径之后还有批量清单，见batch_header
+typedef struct {
+    uint16_t cmd;             // command_type
+    uint16_t token_len;       // < MAX_TOKEN_LEN
+    uint16_t path_len;        // < MAX_PATH_LEN
+    uint16_t src_len;         // < MAX_PATH_LEN，只有CMD_RSYNC使用
+    int64_t retention_time;   // CMD_SET_RETENTION的保留期限(秒)
+    uint64_t data_len;        // CMD_MODIFY、CMD_APPEND和CMD_PWRITE随后发送的文件内容长度
+    uint64_t offset;          // CMD_PWRITE开始写入的偏移，不超过INT64_MAX
+    uint32_t flags;           // CMD_APPEND的标志(APPEND_FLAG_*)，其他命令为0
+    uint32_t reserved;        // 必须为0
+} request_v2;
+
+#define MAX_REQUEST_V2_LEN (sizeof(request_v2) + MAX_TOKEN_LEN + 2 * MAX_PATH_LEN)
+
+/*
+ * 批量请求：request_v2.cmd为CMD_BATCH，路径为空，清单为batch_header加count个
+ * (batch_item + 路径)；各CMD_MODIFY项的内容按项的顺序跟在请求之后，
+ * 总长度为request_v2.data_len。回应的结果为RESULT_BATCH。
+ * 项可以是CMD_MODIFY、CMD_DELETE、CMD_SET_RETENTION和CMD_GET_RETENTION，按顺序执行。
+ */
+#define MAX_BATCH_ITEMS 65536
+#define MAX_BATCH_MANIFEST_LEN (16 * 1024 * 1024)
+
+typedef struct {
+    uint32_t count;
+    uint32_t reserved;
+} batch_header;
+
+typedef struct {
+    uint16_t cmd;             // command_type
+    uint16_t path_len;        // < MAX_PATH_LEN
+    uint32_t reserved;
+    int64_t retention_time;   // CMD_SET_RETENTION的保留期限(秒)
+    uint64_t data_len;        // CMD_MODIFY的内容长度
+} batch_item;
+
+// 回应状态，数值与immutable_client.h中的immutable_status一致
+typedef enum {
+    STATUS_OK = 0,
+    STATUS_AUTH_FAILED = 1,       // 令牌错误或路径不允许
+    STATUS_BAD_REQUEST = 2,       // 请求格式错误或缺少参数
+    STATUS_RETENTION_ACTIVE = 3,  // 保留期未到，不能删除
+    STATUS_FAILED = 4,            // 操作失败，原因见error
+    STATUS_UNSUPPORTED = 5        // 未知命令或协议版本
+} reply_status;
+
+// 版本3回应的定长部分，与版本2相同，随后是result指明类型的结果
+typedef struct {
+    uint16_t status;     // reply_status
+    uint16_t result;     // reply_result
+    int32_t error;       // 失败时的errno，未知时为0
+} reply_v2;
+
+typedef enum {
+    RESULT_NONE = 0,
+    RESULT_REMAINING = 1,  // int64_t 剩余保留秒数(查询保留期限，或保留期未到时的删除)
+    RESULT_RSYNC = 2,      // reply_rsync
+    RESULT_INGEST = 3,     // uint32_t ingest_method
+    RESULT_BATCH = 4,      // batch_header + 每项一个batch_item_result
+    RESULT_DELETE = 5,     // reply_delete 删除目录时的统计
+    RESULT_STATS = 6,      // reply_stats + command_count个stats_command + stats_clients + client_count个stats_client
+    RESULT_VERIFY = 7      // reply_verify
+} reply_result;
+
+typedef struct {
+    uint64_t bytes_total;     // 源文件大小
+    uint64_t bytes_literal;   // 从源文件复制的字节数
+    uint64_t bytes_reused;    // 复用目标文件的字节数
+} reply_rsync;
+
+// 校验的统计，有不一致的文件时状态为STATUS_FAILED、error为EBADMSG
+typedef struct {
+    uint64_t verified;        // 内容与记录一致的文件
+    uint64_t mismatched;      // 内容或长度与记录不一致的文件
+    uint64_t unrecorded;      // 没有记录校验和的文件
+    uint64_t failed;          // 无法读取的项
+    uint64_t bytes;           // 读取的字节数
+} reply_verify;
+
+// 删除目录时各项的统计，有保留的项时状态为STATUS_RETENTION_ACTIVE，有失败的项时为STATUS_FAILED
+typedef struct {
+    uint64_t deleted;         // 已删除的文件和目录
+    uint64_t retained;        // 保留期未到而保留的项
+    uint64_t failed;          // 删除失败的项
+} reply_delete;
+
+/*
+ * 运行统计：stats_command按命令号排列(下标0为未知命令)，
+ * 延迟直方图的第i个桶为耗时小于2^i微秒(且不小于2^(i-1)微秒)的请求数，
+ * 最后一个桶包含所有更长的请求。耗时从收齐请求头到发出回应。
+ * 命令之后是各客户端的调度状态：stats_clients加client_count个stats_client，
+ * 较早的服务没有这一部分，回应在命令之后结束。
+ */
+#define STATS_LATENCY_BUCKETS 24
+#define STATS_COMMANDS (CMD_VERIFY + 1)
+
+typedef struct {
+    uint64_t uptime;              // 服务已运行的秒数
+    uint64_t bytes_written;       // 写入不可变文件的字节数
+    uint64_t auth_failures;       // 认证失败的请求数
+    uint64_t queue_depth;         // 等待工作线程的请求数
+    uint64_t active_connections;  // 当前的连接数
+    uint64_t retention_entries;   // 保留表中的路径数
+    uint64_t log_dropped;         // 因日志缓冲区满或syslog不可用而丢弃的日志数
+    uint32_t command_count;       // 随后的stats_command个数
+    uint32_t bucket_count;        // 每个stats_command中的直方图桶数
+} reply_stats;
+
+typedef struct {
+    uint64_t count;               // 请求数
+    uint64_t errors;              // 状态不是STATUS_OK的请求数
+    uint64_t latency_sum_us;      // 耗时总和(微秒)
+    uint64_t latency_buckets[STATS_LATENCY_BUCKETS];
+} stats_command;
+
+#define STATS_MAX_CLIENTS 64      // 回应中最多列出的客户端数
+#define STATS_LABEL_LEN 256
+
+typedef struct {
+    uint32_t client_count;        // 随后的stats_client个数
+    uint32_t client_total;        // 客户端总数，超过STATS_MAX_CLIENTS时大于client_count
+} stats_clients;
+
+// 一个客户端(对端的uid和SELinux上下文)
+typedef struct {
+    uint32_t uid;
+    int32_t pid;                  // 最近一个连接的进程
+    uint32_t weight;              // 调度中的权重
+    uint32_t connections;
+    uint32_t queued;              // 排队的请求数
+    uint32_t running;             // 工作线程正在执行的请求数
+    uint32_t parked;              // 因超过上限暂停接收的连接数
+    uint32_t reserved;
+    uint64_t running_bytes;       // 执行中的请求要写入的字节数
+    uint64_t served;              // 已交给工作线程的请求数
+    uint64_t throttled;           // 超过上限的次数
+    char label[STATS_LABEL_LEN];  // SELinux上下文，以'\0'结尾，取不到时为空
+} stats_client;
+
+typedef struct {
+    uint16_t status;     // reply_status
+    uint16_t reserved;
+    int32_t error;       // 失败时的errno，未知时为0
+    int64_t remaining;   // 查询保留期限，或因保留期未到而删除失败时的剩余秒数
+} batch_item_result;
+
+typedef enum {
+    INGEST_REFLINK = 1,
+    INGEST_COPY_FILE_RANGE = 2,
+    INGEST_SENDFILE = 3
+} ingest_method;
+
+// 非批量回应的最大长度；批量回应和统计回应的长度另计
+#define MAX_REPLY_V2_LEN (sizeof(reply_v2) + sizeof(reply_verify))
+
+/*
+ * 共享内存中的保留表：服务把保留表的只读副本发布在RETENTION_SHM_PATH，
+ * 客户端映射后直接查询，不经过socket。
+ *
+ *   文件: retention_shm_header + slot_count个retention_shm_slot + 路径区
+ *
+ * 开放寻址的哈希表，槽位按路径的64位FNV-1a哈希线性探测，遇到空槽(path_len为0)结束；
+ * 删除的路径保留槽位，retention_time为-1。路径区中的路径写入后不再修改，不以'\0'结尾。
+ * 只有服务写入，每个槽位是一把顺序锁：修改前后各把seq加1，读取方在seq为偶数且
+ * 读取前后相同时才采用读到的值。表满时服务建立新的表改名替换，再把旧表的stale置1，
+ * 读取方看到后重新打开。
+ */
+#define RETENTION_SHM_PATH "/dev/shm/immutable_retention"
+#define RETENTION_SHM_MAGIC 0x54524d49u  // 内存中的字节为"IMRT"
+#define RETENTION_SHM_VERSION 1
+
+typedef struct {
+    uint32_t magic;           // RETENTION_SHM_MAGIC
+    uint32_t version;         // RETENTION_SHM_VERSION
+    uint32_t stale;           // 不为0时表已被替换或服务已停止
+    uint32_t reserved;
+    uint64_t slot_count;      // 2的幂
+    uint64_t slots_offset;
+    uint64_t arena_offset;
+    uint64_t arena_size;
+} retention_shm_header;
+
+typedef struct {
+    uint32_t seq;             // 顺序锁，奇数表示正在修改
+    uint32_t path_len;        // 0表示空槽
+    uint64_t hash;
+    uint64_t path_offset;     // 在路径区中的偏移
+    int64_t creation_time;
+    int64_t retention_time;   // 保留期限(秒)，-1表示已删除
+} retention_shm_slot;
+
+#endif /* IMMUTABLE_PROTOCOL_H */
@@ -14,175 +14,325 @@
 #include <signal.h>
 #include <dirent.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/xattr.h>
+#include <linux/fs.h>
+
+#include "immutable_service.h"
+#include "retention_store.h"
+#include "selinux_label.h"
+#include "delta_sync.h"
+#include "uring_io.h"
+#include "task_pool.h"
+#include "tree_delete.h"
+#include "tree_sync.h"
+#include "metrics.h"
+#include "service_log.h"
+#include "dedup_store.h"
+#include "dir_cache.h"
+#include "integrity.h"
+#include "client_sched.h"
 
 #define SOCKET_PATH "/var/run/immutable_service.sock"
-#define MAX_PATH_LEN 4096
-#define MAX_CMD_LEN 8192
 #define AUTH_TOKEN "test_token_change_me_in_production"  // 生产环境中应使用更安全的认证
-#define METADATA_DIR "/var/lib/immutable_service"
-#define RETENTION_FILE METADATA_DIR "/retention.db"
 
-typedef enum {
-    CMD_MODIFY = 1,     // 修改文件内容
-    CMD_DELETE = 2,     // 删除文件
-    CMD_RSYNC = 3,      // 使用rsync增量更新
-    CMD_SET_RETENTION = 4,  // 设置保留期限
-    CMD_GET_RETENTION = 5   // 获取保留期限
-} command_type;
+#define DEFAULT_BACKLOG 1024      // listen队列长度
+#define DEFAULT_WORKERS 8         // 工作线程数
+#define DEFAULT_QUEUE_SIZE 256    // 待处理请求队列长度
+#define DEFAULT_CLIENT_REQUESTS 32  // 每个客户端排队和执行中的请求数上限
+#define DEFAULT_CLIENT_BYTES (256ULL * 1024 * 1024)  // 每个客户端执行中的请求要写入的字节数上限
+#define PATH_LOCK_STRIPES 1024    // 路径锁分片数
+#define REQUEST_TIMEOUT 30        // 接收请求/发送回应的超时(秒)
+#define SESSION_IDLE_TIMEOUT 300  // 会话在两个请求之间允许的空闲时间(秒)
+#define MAX_EVENTS 64
+#define MAX_PASSED_FDS 4          // 单次接收的文件描述符上限，多余的会被内核截断
+#define MODIFY_CHUNK_SIZE (64 * 1024)  // 流式修改时每次接收的数据量
+#define DEFAULT_COMPACT_INTERVAL 300  // 检查是否需要压缩保留信息文件的间隔(秒)
+#define BATCH_SYNC_DEVS 16        // 批量修改时合并落盘的文件系统数，更多时逐个文件fsync
+#define BATCH_URING_GROUP 64      // 批量请求中一次提交给io_uring的改名和删除操作数
+#define DEFAULT_PURGE_RATE 100    // 到期清理每秒处理的文件数
+#define PURGE_IDLE_WAIT 60        // 到期队列为空时清理线程的最长等待时间(秒)
+#define DEFAULT_TREE_WORKERS 4    // 并行处理目录树的后台线程数
+#define DEDUP_MEMORY_LIMIT (4 * 1024 * 1024)  // 去重时先整个收到内存中、内容已在库中就不写盘的上限
+#define TEMP_FILE_ATTEMPTS 100    // 临时文件名冲突时的重试次数
+#define APPEND_ONLY_XATTR "trusted.immutable.append_only"  // 只能追加的文件带有这个扩展属性
+
+// 服务配置(可通过命令行参数修改)
+typedef struct {
+    const char *socket_path;
+    int backlog;
+    int workers;
+    int queue_size;
+    int compact_interval;
+    const char *file_context;
+    const char *io_backend;      // auto、uring或posix
+    const char *purge_mode;      // off、report或delete
+    int purge_rate;
+    int tree_workers;
+    const char *metadata_dir;    // 保留表等元数据所在的目录
+    int metrics_interval;        // 写出统计文件的间隔(秒)，0为不写
+    const char *dedup;           // off或on
+    const char *retention_sync;  // on: 保留记录落盘后才回应，off: 不等待
+    int convert_retention;       // 只把保留信息文件合并到二进制索引后退出
+    const char *retention_shm;   // 共享内存保留表的路径，off为不发布
+    const char *roots;           // 不可变文件的根目录(逗号分隔)，"/"为不限制
+    const char *integrity;       // on: 写入文件时记录内容校验和，off: 不记录
+    int client_requests;         // 每个客户端排队和执行中的请求数上限
+    uint64_t client_bytes;       // 每个客户端执行中的请求要写入的字节数上限
+    const char *client_weights;  // 各uid在调度中的权重，"uid=权重,..."
+} service_config;
 
+// 批量请求中的一项
 typedef struct {
     command_type cmd;
-    char path[MAX_PATH_LEN];
-    char token[128];
-    char src_path[MAX_PATH_LEN]; // 用于rsync源路径
-    time_t retention_time;       // 保留期限 (秒)
+    const char *path;
+    time_t retention_time;
     size_t data_len;
-} request_header;
+    char *tmp_path;              // 已写入新内容、等待替换目标文件的临时文件
+    dev_t dev;                   // 临时文件所在的文件系统
+    batch_item_result result;
+} batch_entry;
 
+// 批量请求：清单在事件循环中解析，以便按到达顺序领取涉及的所有路径锁
 typedef struct {
-    char path[MAX_PATH_LEN];
-    time_t creation_time;    // 创建时间
-    time_t retention_time;   // 保留期限
-} retention_entry;
+    uint32_t count;
+    batch_entry *items;
+    char *paths;                 // 各项的路径，依次以'\0'结尾存放
+    uint64_t data_total;         // 各修改项的内容总长度
+    size_t stripe_count;         // 涉及的路径锁分片数
+    size_t *stripes;             // 按编号升序
+    unsigned long *tickets;
+} batch_request;
+
+// 客户端连接
+typedef struct client_conn {
+    int fd;
+    int framed;                   // 1: 会话协议(版本见frame.version)，0: 旧格式，-1: 尚未收到足够的数据判断
+    frame_header frame;
+    size_t frame_received;        // 已接收的帧头字节数
+    char *payload;                // 版本3请求中帧头之后的部分，解码后释放
+    request_header req;           // 内部统一使用的请求格式，版本3的请求解码到这里
+    uint64_t write_offset;        // CMD_PWRITE开始写入的偏移
+    uint32_t write_flags;         // CMD_APPEND的标志
+    batch_request *batch;         // 批量请求的清单，其他请求为NULL
+    size_t header_received;       // 已接收的请求头(或payload)字节数
+    int passed_fd;                // 随请求头传来的文件描述符，没有时为-1
+    time_t last_active;           // 最后一次收到数据的时间
+    uint64_t request_start;       // 收齐请求头的时间(CLOCK_MONOTONIC，微秒)，用于统计耗时
+    size_t lock_stripe;           // 所属的路径锁分片
+    unsigned long lock_ticket;    // 在路径锁上的排队号
+    sched_job job;                // 在所属客户端的队列中排队，job.client为连接的对端
+    struct client_conn *prev;     // 尚未收完请求头的连接链表
+    struct client_conn *next;     // 也用于交还事件循环的会话链表
+} client_conn;
+
+#define conn_of_job(j) ((client_conn *)((char *)(j) - offsetof(client_conn, job)))
+
+// 请求的处理结果，按连接使用的协议编码为文本或二进制回应
+typedef struct {
+    reply_v2 head;
+    unsigned char result[sizeof(reply_verify)];
+    size_t result_len;
+    void *extra;                  // 接在result之后的变长结果(批量请求)，由调用者释放
+    size_t extra_len;
+    char text[MAX_REPLY_LEN];     // 旧格式和版本1使用的文本消息
+} request_reply;
+
+// 按路径分片的排队锁：同一路径的请求按到达顺序依次执行，不同路径的请求并行执行
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned long next_ticket;
+    unsigned long now_serving;
+} path_lock;
 
 // 全局变量
 int server_fd = -1;
-pthread_mutex_t retention_mutex = PTHREAD_MUTEX_INITIALIZER;
+service_config config = {
+    .socket_path = SOCKET_PATH,
+    .backlog = DEFAULT_BACKLOG,
+    .workers = DEFAULT_WORKERS,
+    .queue_size = DEFAULT_QUEUE_SIZE,
+    .compact_interval = DEFAULT_COMPACT_INTERVAL,
+    .file_context = NULL,
+    .io_backend = "auto",
+    .purge_mode = "off",
+    .purge_rate = DEFAULT_PURGE_RATE,
+    .tree_workers = DEFAULT_TREE_WORKERS,
+    .metadata_dir = METADATA_DIR,
+    .metrics_interval = 0,
+    .dedup = "off",
+    .retention_sync = "on",
+    .retention_shm = RETENTION_SHM_PATH,
+    .roots = "/",
+    .integrity = "on",
+    .client_requests = DEFAULT_CLIENT_REQUESTS,
+    .client_bytes = DEFAULT_CLIENT_BYTES,
+    .client_weights = NULL,
+};
+volatile sig_atomic_t stop_signal = 0;
+time_t start_time;
+path_lock path_locks[PATH_LOCK_STRIPES];
+// 工作线程按取出请求的顺序领取排队号，批量请求的多个排队号须连续领取
+pthread_mutex_t ticket_mutex = PTHREAD_MUTEX_INITIALIZER;
+client_conn *pending_conns = NULL;
+
+// 工作线程处理完会话中的请求后，将连接放入此链表并通过eventfd通知事件循环
+pthread_mutex_t resumed_mutex = PTHREAD_MUTEX_INITIALIZER;
+client_conn *resumed_conns = NULL;
+int wake_fd = -1;
 
-// 处理终止信号
+// 单调时钟的当前时间(微秒)
+uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 处理终止信号，由主循环负责关闭服务
 void handle_signal(int sig) {
-    syslog(LOG_NOTICE, "接收到信号 %d，关闭服务", sig);
-    if (server_fd != -1) {
-        close(server_fd);
-        unlink(SOCKET_PATH);
-    }
-    closelog();
-    exit(0);
+    stop_signal = sig;
 }
 
-// 设置SELinux上下文(模拟实现，实际需要libselinux)
-int set_immutable_context(const char *path) {
-    // 在真实实现中，使用libselinux中的函数
-    // security_context_t current_context = NULL;
-    // context_t context = context_new(current_context);
-    // context_type_set(context, "immutable_file_t");
-    // setfilecon(path, context_str(context));
-    
-    // 这里只是简单模拟，运行shell命令设置上下文
-    char cmd[MAX_CMD_LEN];
-    snprintf(cmd, sizeof(cmd), "chcon -t immutable_file_t '%s' 2>/dev/null", path);
-    int ret = system(cmd);
+// 为已打开的文件设置SELinux上下文
+int set_immutable_context_fd(int fd, const char *path) {
+    int ret = selinux_label_fd(fd);
     
-    if (ret != 0) {
-        syslog(LOG_ERR, "无法设置文件 %s 的SELinux上下文", path);
+    if (ret < 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法设置文件 %s 的SELinux上下文: %s", path, strerror(errno));
         return -1;
     }
     
-    syslog(LOG_NOTICE, "已设置文件 %s 的SELinux上下文为 immutable_file_t", path);
+    if (ret > 0) {
+        slog(SLOG_AUDIT, LOG_INFO, "已设置文件 %s 的SELinux上下文为 immutable_file_t", path);
+    }
     return 0;
 }
 
-// 验证请求
-int authenticate_request(request_header *req) {
-    // 验证token
+// 验证令牌
+int check_token(const request_header *req) {
     if (strcmp(req->token, AUTH_TOKEN) != 0) {
-        syslog(LOG_WARNING, "认证失败: 错误的令牌");
+        slog(SLOG_AUDIT, LOG_WARNING, "认证失败: 错误的令牌");
         return 0;
     }
-    
-    // 验证路径
-    if (strlen(req->path) == 0 || strlen(req->path) >= MAX_PATH_LEN) {
-        syslog(LOG_WARNING, "认证失败: 无效的文件路径");
+    return 1;
+}
+
+// 验证请求中的文件路径，只读取的命令(校验、查询保留期限)可以作用于根目录本身
+int check_path(const char *path, command_type cmd) {
+    if (strlen(path) == 0 || strlen(path) >= MAX_PATH_LEN) {
+        slog(SLOG_AUDIT, LOG_WARNING, "认证失败: 无效的文件路径");
         return 0;
     }
     
-    // 防止路径遍历攻击
-    if (strstr(req->path, "..") != NULL) {
-        syslog(LOG_WARNING, "认证失败: 路径中包含'..'");
+    // 防止路径遍历攻击：不允许".."这一级，设置了根目录时还必须在根目录之下
+    if (!dir_cache_path_allowed(path, cmd == CMD_VERIFY || cmd == CMD_GET_RETENTION)) {
+        if (errno == EINVAL) {
+            slog(SLOG_AUDIT, LOG_WARNING, "认证失败: 路径中包含'..'");
+        } else {
+            slog(SLOG_AUDIT, LOG_WARNING, "认证失败: %s 不在不可变文件的根目录之下", path);
+        }
         return 0;
     }
     
     return 1;
 }
 
+// 验证请求
+int authenticate_request(request_header *req) {
+    return check_token(req) && check_path(req->path, req->cmd);
+}
+
+// 在文件所在目录的描述符上fstatat，不必从头解析整个路径
+int stat_path(const char *path, struct stat *st, int flags) {
+    const char *name;
+    dir_ref *dir = dir_cache_parent(path, 0, &name);
+    if (!dir) {
+        return -1;
+    }
+    int ret = fstatat(dir_ref_fd(dir), name, st, flags);
+    int err = errno;
+    dir_cache_release(dir);
+    errno = err;
+    return ret;
+}
+
+// 在文件所在目录的描述符上openat，不跟随符号链接
+int open_path(const char *path, int flags) {
+    const char *name;
+    dir_ref *dir = dir_cache_parent(path, 0, &name);
+    if (!dir) {
+        return -1;
+    }
+    int fd = openat(dir_ref_fd(dir), name, flags | O_NOFOLLOW | O_CLOEXEC);
+    int err = errno;
+    dir_cache_release(dir);
+    errno = err;
+    return fd;
+}
+
+// 在文件所在目录的描述符上unlinkat
+int unlink_path(const char *path) {
+    const char *name;
+    dir_ref *dir = dir_cache_parent(path, 0, &name);
+    if (!dir) {
+        return -1;
+    }
+    int ret = unlinkat(dir_ref_fd(dir), name, 0);
+    int err = errno;
+    dir_cache_release(dir);
+    errno = err;
+    return ret;
+}
+
 // 检查路径是否为目录
 int is_directory(const char *path) {
     struct stat st;
-    if (stat(path, &st) != 0) {
+    if (stat_path(path, &st, 0) != 0) {
         return 0;
     }
     return S_ISDIR(st.st_mode);
 }
 
-// 确保目录存在
-void ensure_directory_exists(const char *dir) {
-    struct stat st;
-    if (stat(dir, &st) == 0 && S_ISDIR(st.st_mode)) {
-        return;  // 目录已存在
+// 确保目录存在，不存在时逐级创建
+int ensure_directory_exists(const char *dir) {
+    dir_ref *ref = dir_cache_open(dir, 1);
+    if (!ref) {
+        slog(SLOG_ERROR, LOG_ERR, "无法创建目录 %s: %s", dir, strerror(errno));
+        return -1;
     }
-    
-    char cmd[MAX_CMD_LEN];
-    snprintf(cmd, sizeof(cmd), "mkdir -p '%s'", dir);
-    system(cmd);
+    dir_cache_release(ref);
+    return 0;
 }
 
 // 保存文件的保留期限
 int save_retention_info(const char *path, time_t retention_time) {
-    ensure_directory_exists(METADATA_DIR);
-    
-    pthread_mutex_lock(&retention_mutex);
-    
-    // 打开或创建保留信息文件
-    FILE *f = fopen(RETENTION_FILE, "a+");
-    if (!f) {
-        syslog(LOG_ERR, "无法打开保留信息文件: %s", strerror(errno));
-        pthread_mutex_unlock(&retention_mutex);
-        return -1;
-    }
-    
     // 记录当前时间和保留期限
     time_t now = time(NULL);
-    fprintf(f, "%s|%ld|%ld\n", path, now, retention_time);
-    
-    fclose(f);
-    pthread_mutex_unlock(&retention_mutex);
+    if (retention_store_set(path, now, retention_time) != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法保存 %s 的保留期限", path);
+        return -1;
+    }
     
-    syslog(LOG_NOTICE, "已为 %s 设置保留期限: %ld秒", path, retention_time);
+    slog(SLOG_AUDIT, LOG_NOTICE, "已为 %s 设置保留期限: %ld秒", path, retention_time);
     return 0;
 }
 
 // 获取文件的保留期限
 time_t get_retention_info(const char *path) {
-    pthread_mutex_lock(&retention_mutex);
-    
-    FILE *f = fopen(RETENTION_FILE, "r");
-    if (!f) {
-        pthread_mutex_unlock(&retention_mutex);
-        return 0;  // 默认无保留期限
-    }
-    
-    char line[MAX_PATH_LEN + 100];
     time_t creation_time = 0;
     time_t retention_time = 0;
     
-    // 遍历文件查找最新的保留记录
-    while (fgets(line, sizeof(line), f)) {
-        char file_path[MAX_PATH_LEN];
-        time_t file_ctime, file_rtime;
-        
-        // 解析记录
-        if (sscanf(line, "%[^|]|%ld|%ld", file_path, &file_ctime, &file_rtime) == 3) {
-            if (strcmp(file_path, path) == 0) {
-                // 找到匹配，更新记录
-                creation_time = file_ctime;
-                retention_time = file_rtime;
-            }
-        }
+    if (!retention_store_get(path, &creation_time, &retention_time)) {
+        return 0;  // 默认无保留期限
     }
     
-    fclose(f);
-    pthread_mutex_unlock(&retention_mutex);
-    
     // 如果找到了记录，检查是否过期
     if (retention_time > 0) {
         time_t now = time(NULL);
@@ -197,250 +347,2792 @@ time_t get_retention_info(const char *path) {
     return 0;  // 保留期已过或无保留期
 }
 
+int file_append_only(const char *path) {
+    char value;
+    int fd = open_path(path, O_RDONLY | O_NONBLOCK);
+    if (fd == -1) {
+        return 0;
+    }
+    ssize_t ret = fgetxattr(fd, APPEND_ONLY_XATTR, &value, sizeof(value));
+    close(fd);
+    if (ret < 0) {
+        return 0;
+    }
+    slog(SLOG_AUDIT, LOG_WARNING, "拒绝替换或覆盖只能追加的文件: %s", path);
+    errno = EPERM;
+    return 1;
+}
+
+// 把已打开的文件标记为只能追加，不能撤销
+int mark_append_only(int fd, const char *path) {
+    if (fsetxattr(fd, APPEND_ONLY_XATTR, "1", 1, 0) != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法将 %s 标记为只能追加: %s", path, strerror(errno));
+        return -1;
+    }
+    slog(SLOG_AUDIT, LOG_NOTICE, "已将 %s 标记为只能追加", path);
+    return 0;
+}
+
 // 检查文件是否可以删除
 int can_delete_file(const char *path) {
     time_t remaining_time = get_retention_info(path);
     
     if (remaining_time > 0) {
-        syslog(LOG_WARNING, "文件 %s 还在保留期内，剩余 %ld 秒", path, remaining_time);
+        slog(SLOG_AUDIT, LOG_WARNING, "文件 %s 还在保留期内，剩余 %ld 秒", path, remaining_time);
         return 0;
     }
     
     return 1;
 }
 
-// 修改文件内容
-int modify_file(const char *path, const char *data, size_t data_len) {
-    // 确保目标目录存在
-    char dir_path[MAX_PATH_LEN];
-    strncpy(dir_path, path, sizeof(dir_path));
-    char *last_slash = strrchr(dir_path, '/');
-    if (last_slash) {
-        *last_slash = '\0';
-        ensure_directory_exists(dir_path);
+// 路径中最后一个'/'之后的文件名
+const char *base_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// 生成临时文件名的随机数，每个线程一个
+__thread unsigned int temp_seed = 0;
+
+// 在目标文件所在目录创建临时文件(.文件名.XXXXXX)，不设置上下文
+int open_temp_file(const char *path, char *tmp_path, size_t tmp_len) {
+    if (temp_seed == 0) {
+        temp_seed = (unsigned int)monotonic_us() ^ (unsigned int)(uintptr_t)&temp_seed;
     }
     
-    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd == -1) {
-        syslog(LOG_ERR, "无法打开文件 %s: %s", path, strerror(errno));
+    for (int retry = 0; ; retry++) {
+        const char *name;
+        dir_ref *dir = dir_cache_parent(path, 0, &name);
+        if (!dir) {
+            return -1;
+        }
+        
+        int prefix = (int)(name - path);
+        int fd = -1;
+        for (int i = 0; i < TEMP_FILE_ATTEMPTS; i++) {
+            int n = snprintf(tmp_path, tmp_len, "%.*s.%s.%06x", prefix, path, name,
+                             (unsigned int)rand_r(&temp_seed) & 0xffffff);
+            if (n < 0 || (size_t)n >= tmp_len) {
+                errno = ENAMETOOLONG;
+                break;
+            }
+            fd = openat(dir_ref_fd(dir), tmp_path + prefix, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+            if (fd != -1 || errno != EEXIST) {
+                break;
+            }
+        }
+        
+        // 缓存的目录已被其他程序删除，重新打开一次
+        int err = errno;
+        if (fd == -1 && err == ENOENT && retry == 0) {
+            dir_cache_forget(dir);
+            dir_cache_release(dir);
+            continue;
+        }
+        dir_cache_release(dir);
+        errno = err;
+        return fd;
+    }
+}
+
+int create_temp_file(const char *path, char *tmp_path, size_t tmp_len) {
+    selinux_label_create_begin();
+    int fd = open_temp_file(path, tmp_path, tmp_len);
+    int saved_errno = errno;
+    selinux_label_create_end();
+    
+    errno = saved_errno;
+    return fd;
+}
+
+// 用io_uring链接执行 写入(len不为0时)→落盘→关闭→改名，只需一次系统调用
+// 返回0表示成功，-1表示失败(已关闭fd并删除临时文件)，1表示io_uring不可用、什么都没做
+int commit_temp_file_uring(int fd, const void *data, size_t len, const char *tmp_path,
+                           const char *path) {
+    if (!uring_io_enabled()) {
+        return 1;
+    }
+    const char *name;
+    dir_ref *dir = dir_cache_parent(path, 0, &name);
+    if (!dir) {
+        slog(SLOG_ERROR, LOG_ERR, "无法将 %s 替换为新内容: %s", path, strerror(errno));
+        close(fd);
+        unlink_path(tmp_path);
         return -1;
     }
     
-    ssize_t written = write(fd, data, data_len);
-    close(fd);
+    uring_op ops[4];
+    memset(ops, 0, sizeof(ops));
+    size_t n = 0;
+    if (len > 0) {
+        ops[n].op = URING_WRITE;
+        ops[n].fd = fd;
+        ops[n].buf = data;
+        ops[n].len = len;
+        n++;
+    }
+    uring_op *sync = &ops[n++];
+    uring_op *close_op = &ops[n++];
+    uring_op *rename_op = &ops[n++];
+    sync->op = URING_FSYNC;
+    sync->fd = fd;
+    close_op->op = URING_CLOSE;
+    close_op->fd = fd;
+    rename_op->op = URING_RENAMEAT;
+    rename_op->fd = dir_ref_fd(dir);
+    rename_op->path = base_name(tmp_path);
+    rename_op->path2 = name;
     
-    if (written != data_len) {
-        syslog(LOG_ERR, "写入文件 %s 时出错: %s", path, strerror(errno));
-        return -1;
+    int submitted = uring_io_submit(ops, n, 1);
+    dir_cache_release(dir);
+    if (submitted != 0) {
+        return 1;
+    }
+    if (rename_op->result == 0) {
+        return 0;
     }
     
-    // 设置SELinux上下文
-    set_immutable_context(path);
+    // 写入不完整时链接中断，剩余部分用普通系统调用写完后重新提交
+    if (len > 0 && ops[0].result >= 0 && (size_t)ops[0].result < len) {
+        size_t off = ops[0].result;
+        while (off < len) {
+            ssize_t written = pwrite(fd, (const char *)data + off, len - off, off);
+            if (written == -1 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                break;
+            }
+            off += written;
+        }
+        if (off == len) {
+            return commit_temp_file(fd, tmp_path, path);
+        }
+        ops[0].result = -(errno ? errno : EIO);
+    }
     
-    syslog(LOG_NOTICE, "已成功修改文件: %s", path);
-    return 0;
+    int err = EIO;
+    for (size_t i = 0; i < n; i++) {
+        if (ops[i].result < 0 && ops[i].result != -ECANCELED) {
+            err = -ops[i].result;
+            break;
+        }
+    }
+    if (len > 0 && ops[0].result < 0) {
+        slog(SLOG_ERROR, LOG_ERR, "写入文件 %s 时出错: %s", tmp_path, strerror(err));
+    } else if (sync->result < 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法将 %s 写入磁盘: %s", tmp_path, strerror(err));
+    } else {
+        slog(SLOG_ERROR, LOG_ERR, "无法将 %s 替换为新内容: %s", path, strerror(err));
+    }
+    if (close_op->result == -ECANCELED) {
+        close(fd);
+    }
+    unlink_path(tmp_path);
+    errno = err;
+    return -1;
 }
 
-// 使用rsync进行增量更新
-int rsync_update(const char *src, const char *dst) {
-    if (!src || !dst || strlen(src) == 0 || strlen(dst) == 0) {
-        syslog(LOG_ERR, "rsync更新的源或目标路径无效");
-        return -1;
+int commit_temp_file(int fd, const char *tmp_path, const char *path) {
+    int ret = commit_temp_file_uring(fd, NULL, 0, tmp_path, path);
+    if (ret != 1) {
+        return ret;
     }
     
-    // 构建rsync命令
-    char cmd[MAX_CMD_LEN];
-    snprintf(cmd, sizeof(cmd), "rsync -a --checksum '%s' '%s'", src, dst);
+    if (fsync(fd) != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法将 %s 写入磁盘: %s", tmp_path, strerror(errno));
+        close(fd);
+        unlink_path(tmp_path);
+        return -1;
+    }
+    close(fd);
     
-    // 执行rsync
-    int ret = system(cmd);
+    const char *name;
+    dir_ref *dir = dir_cache_parent(path, 0, &name);
+    ret = dir ? renameat(dir_ref_fd(dir), base_name(tmp_path), dir_ref_fd(dir), name) : -1;
+    int err = errno;
+    if (dir) {
+        dir_cache_release(dir);
+    }
     if (ret != 0) {
-        syslog(LOG_ERR, "rsync更新失败: %s -> %s, 返回码 %d", src, dst, ret);
+        slog(SLOG_ERROR, LOG_ERR, "无法将 %s 替换为新内容: %s", path, strerror(err));
+        unlink_path(tmp_path);
         return -1;
     }
-    
-    // 设置目标文件的SELinux上下文
-    set_immutable_context(dst);
-    
-    syslog(LOG_NOTICE, "已成功使用rsync更新文件: %s -> %s", src, dst);
     return 0;
 }
 
-// 删除文件
-int delete_file(const char *path) {
-    // 检查是否可以删除
-    if (!can_delete_file(path)) {
-        return -1;
+// 确保文件所在的目录存在
+void ensure_parent_exists(const char *path) {
+    const char *name;
+    dir_ref *dir = dir_cache_parent(path, 1, &name);
+    if (!dir) {
+        slog(SLOG_ERROR, LOG_ERR, "无法创建 %s 所在的目录: %s", path, strerror(errno));
+        return;
     }
+    dir_cache_release(dir);
+}
+
+// 开始更新文件：确保目标目录存在，并在其中创建临时文件
+int begin_file_update(const char *path, char *tmp_path, size_t tmp_len) {
+    ensure_parent_exists(path);
     
-    // 检查是文件还是目录
-    if (is_directory(path)) {
-        // 删除目录
-        char cmd[MAX_CMD_LEN];
-        snprintf(cmd, sizeof(cmd), "rm -rf '%s'", path);
-        if (system(cmd) != 0) {
-            syslog(LOG_ERR, "无法删除目录 %s", path);
-            return -1;
-        }
-    } else {
-        // 删除文件
-        if (unlink(path) == -1) {
-            syslog(LOG_ERR, "无法删除文件 %s: %s", path, strerror(errno));
-            return -1;
-        }
+    int fd = create_temp_file(path, tmp_path, tmp_len);
+    if (fd == -1) {
+        slog(SLOG_ERROR, LOG_ERR, "无法为 %s 创建临时文件: %s", path, strerror(errno));
     }
-    
-    syslog(LOG_NOTICE, "已成功删除: %s", path);
-    return 0;
+    return fd;
 }
 
-// 设置保留期限
-int set_retention(const char *path, time_t retention_time) {
-    // 检查文件是否存在
+// 临时文件沿用原文件的权限和属主，并设置上下文
+void prepare_file_update(int fd, const char *tmp_path, const char *path) {
     struct stat st;
-    if (stat(path, &st) != 0) {
-        syslog(LOG_ERR, "要设置保留期的文件不存在: %s", path);
-        return -1;
+    if (stat_path(path, &st, 0) == 0 && S_ISREG(st.st_mode)) {
+        fchmod(fd, st.st_mode & 07777);
+        if (fchown(fd, st.st_uid, st.st_gid) != 0) {
+            slog(SLOG_ERROR, LOG_WARNING, "无法沿用 %s 的属主: %s", path, strerror(errno));
+        }
+    } else {
+        fchmod(fd, 0644);
     }
     
-    return save_retention_info(path, retention_time);
+    set_immutable_context_fd(fd, tmp_path);
 }
 
-int main() {
-    struct sockaddr_un server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    int client_fd;
-    request_header req;
-    char *data_buffer = NULL;
-    
-    // 初始化日志系统
-    openlog("immutable_service", LOG_PID, LOG_DAEMON);
-    syslog(LOG_NOTICE, "不可变文件特权服务启动");
-    
-    // 设置信号处理
-    signal(SIGINT, handle_signal);
-    signal(SIGTERM, handle_signal);
-    
-    // 创建socket
-    server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (server_fd == -1) {
-        syslog(LOG_ERR, "无法创建socket: %s", strerror(errno));
-        return 1;
+// 完成更新：准备好临时文件、记录校验和后原子地替换原文件
+int finish_file_update(int fd, const char *tmp_path, const char *path) {
+    prepare_file_update(fd, tmp_path, path);
+    integrity_record_fd(fd, tmp_path);
+    return commit_temp_file(fd, tmp_path, path);
+}
+
+// 修改文件内容(内容已在内存中)
+int modify_file(const char *path, const char *data, size_t data_len) {
+    ensure_parent_exists(path);
+    if (dedup_store_usable(path)) {
+        int unchanged;
+        if (dedup_store_data(path, data, data_len, &unchanged) != 0) {
+            return -1;
+        }
+        slog(SLOG_AUDIT, LOG_NOTICE, "已成功修改文件: %s (%zu 字节%s)", path, data_len,
+             unchanged ? ", 内容未变化" : "");
+        return 0;
     }
     
-    // 准备地址
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sun_family = AF_UNIX;
-    strncpy(server_addr.sun_path, SOCKET_PATH, sizeof(server_addr.sun_path) - 1);
-    
-    // 删除可能存在的旧socket文件
-    unlink(SOCKET_PATH);
-    
-    // 绑定地址
-    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
-        syslog(LOG_ERR, "无法绑定socket: %s", strerror(errno));
-        close(server_fd);
-        return 1;
+    char tmp_path[MAX_PATH_LEN];
+    int fd = begin_file_update(path, tmp_path, sizeof(tmp_path));
+    if (fd == -1) {
+        return -1;
     }
     
-    // 设置socket权限
-    chmod(SOCKET_PATH, 0600);
-    
-    // 监听连接
-    if (listen(server_fd, 5) == -1) {
-        syslog(LOG_ERR, "无法监听socket: %s", strerror(errno));
-        close(server_fd);
-        unlink(SOCKET_PATH);
-        return 1;
+    // 写入、落盘和替换合并为一次io_uring提交，校验和在写入之前按内存中的内容记录
+    prepare_file_update(fd, tmp_path, path);
+    integrity_record_data(fd, data, data_len, tmp_path);
+    int ret = commit_temp_file_uring(fd, data, data_len, tmp_path, path);
+    if (ret == -1) {
+        return -1;
     }
     
-    // 确保元数据目录存在
-    ensure_directory_exists(METADATA_DIR);
+    if (ret == 1) {
+        for (size_t off = 0; off < data_len; ) {
+            ssize_t written = write(fd, data + off, data_len - off);
+            if (written == -1 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                slog(SLOG_ERROR, LOG_ERR, "写入文件 %s 时出错: %s", path, strerror(errno));
+                close(fd);
+                unlink_path(tmp_path);
+                return -1;
+            }
+            off += written;
+        }
+        if (commit_temp_file(fd, tmp_path, path) != 0) {
+            return -1;
+        }
+    }
     
-    syslog(LOG_NOTICE, "等待连接在 %s", SOCKET_PATH);
+    slog(SLOG_AUDIT, LOG_NOTICE, "已成功修改文件: %s (%zu 字节)", path, data_len);
+    return 0;
+}
+
+// 每个工作线程一个管道，用于将socket中的数据splice到文件
+__thread int splice_pipe[2] = { -1, -1 };
+__thread int splice_unsupported = 0;
+
+void close_splice_pipe(void) {
+    if (splice_pipe[0] != -1) {
+        close(splice_pipe[0]);
+        close(splice_pipe[1]);
+        splice_pipe[0] = splice_pipe[1] = -1;
+    }
+}
+
+// 用splice在内核中将数据从socket移到文件，返回已接收的字节数
+ssize_t splice_to_file(int sock_fd, int fd, size_t len) {
+    if (splice_unsupported) {
+        return 0;
+    }
+    if (splice_pipe[0] == -1 && pipe2(splice_pipe, O_CLOEXEC) != 0) {
+        return 0;
+    }
     
-    // 主循环
-    while (1) {
-        client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
-        if (client_fd == -1) {
-            syslog(LOG_ERR, "接受连接失败: %s", strerror(errno));
+    size_t done = 0;
+    while (done < len) {
+        size_t chunk = len - done < MODIFY_CHUNK_SIZE ? len - done : MODIFY_CHUNK_SIZE;
+        ssize_t n = splice(sock_fd, NULL, splice_pipe[1], NULL, chunk, SPLICE_F_MOVE);
+        if (n == -1 && errno == EINTR) {
             continue;
         }
-        
-        syslog(LOG_NOTICE, "接受新连接");
-        
-        // 接收请求头
-        if (recv(client_fd, &req, sizeof(req), 0) != sizeof(req)) {
-            syslog(LOG_ERR, "接收请求失败");
-            close(client_fd);
-            continue;
+        if (n == -1 && done == 0 && (errno == EINVAL || errno == ENOSYS)) {
+            splice_unsupported = 1;  // socket不支持splice，以后直接使用recv
+            return 0;
+        }
+        if (n <= 0) {
+            close_splice_pipe();
+            return -1;
         }
         
-        // 验证请求
-        if (!authenticate_request(&req)) {
-            const char *msg = "认证失败";
-            send(client_fd, msg, strlen(msg), 0);
-            close(client_fd);
+        while (n > 0) {
+            ssize_t m = splice(splice_pipe[0], NULL, fd, NULL, n, SPLICE_F_MOVE);
+            if (m == -1 && errno == EINTR) {
+                continue;
+            }
+            if (m <= 0) {
+                close_splice_pipe();  // 管道中可能残留数据
+                return -1;
+            }
+            n -= m;
+            done += m;
+        }
+    }
+    return done;
+}
+
+// 从socket接收len字节写入fd，返回0表示全部收到并写入
+// unread返回socket中尚未读取的字节数，无法确定时为SIZE_MAX
+int receive_to_file(int sock_fd, int fd, const char *tmp_path, size_t len, size_t *unread) {
+    ssize_t spliced = splice_to_file(sock_fd, fd, len);
+    if (spliced == -1) {
+        *unread = SIZE_MAX;  // 出错时管道中的数据已被丢弃
+        slog(SLOG_ERROR, LOG_ERR, "接收 %s 的内容时出错: %s", tmp_path, strerror(errno));
+        return -1;
+    }
+    size_t received = spliced;
+    
+    char buf[MODIFY_CHUNK_SIZE];
+    while (received < len) {
+        size_t chunk = len - received < sizeof(buf) ? len - received : sizeof(buf);
+        ssize_t n = recv(sock_fd, buf, chunk, 0);
+        if (n == -1 && errno == EINTR) {
             continue;
         }
+        if (n <= 0) {
+            break;
+        }
         
-        int result = -1;
-        char response[4096] = {0};
-        
-        // 处理命令
-        switch(req.cmd) {
-            case CMD_MODIFY:
-                if (req.data_len > 0) {
-                    data_buffer = malloc(req.data_len);
-                    if (data_buffer) {
-                        if (recv(client_fd, data_buffer, req.data_len, 0) == req.data_len) {
-                            result = modify_file(req.path, data_buffer, req.data_len);
-                        }
-                        free(data_buffer);
-                    }
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t written = write(fd, buf + off, n - off);
+            if (written == -1 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                slog(SLOG_ERROR, LOG_ERR, "写入文件 %s 时出错: %s", tmp_path, strerror(errno));
+                *unread = len - received - n;
+                return -1;
+            }
+            off += written;
+        }
+        received += n;
+    }
+    
+    *unread = len - received;
+    if (received < len) {
+        slog(SLOG_ERROR, LOG_ERR, "接收 %s 的内容不完整: %zu/%zu 字节", tmp_path, received, len);
+        return -1;
+    }
+    return 0;
+}
+
+// 去重时的流式修改：不大的内容先收到内存中，内容已在库中时不写盘；更大的边接收边计算哈希，
+// 写入内容库的临时文件，收完后链接到path
+int modify_file_dedup(int sock_fd, const char *path, size_t data_len, size_t *unread) {
+    if (data_len <= DEDUP_MEMORY_LIMIT) {
+        char *data = malloc(data_len);
+        if (data) {
+            int ret = -1;
+            size_t received = 0;
+            while (received < data_len) {
+                ssize_t n = recv(sock_fd, data + received, data_len - received, 0);
+                if (n == -1 && errno == EINTR) {
+                    continue;
                 }
-                break;
-                
-            case CMD_DELETE:
-                result = delete_file(req.path);
-                break;
-                
-            case CMD_RSYNC:
-                result = rsync_update(req.src_path, req.path);
-                break;
-                
-            case CMD_SET_RETENTION:
-                result = set_retention(req.path, req.retention_time);
-                break;
-                
-            case CMD_GET_RETENTION:
-                {
-                    time_t remain = get_retention_info(req.path);
-                    snprintf(response, sizeof(response), 
-                             "文件 %s 的剩余保留时间: %ld 秒", req.path, remain);
-                    result = 0;
+                if (n <= 0) {
+                    slog(SLOG_ERROR, LOG_ERR, "接收 %s 的内容不完整: %zu/%zu 字节", path, received, data_len);
+                    break;
                 }
-                break;
-                
-            default:
-                syslog(LOG_WARNING, "未知命令: %d", req.cmd);
-                break;
-        }
-        
-        // 返回结果
-        if (response[0] == '\0') {
-            snprintf(response, sizeof(response), 
-                     "%s: %s", (result == 0) ? "操作成功" : "操作失败", req.path);
+                received += n;
+            }
+            *unread = data_len - received;
+            if (received == data_len) {
+                ret = modify_file(path, data, data_len);
+            }
+            free(data);
+            return ret;
         }
-        
-        send(client_fd, response, strlen(response), 0);
-        close(client_fd);
     }
     
-    // 清理(实际上不会执行到这里，除非循环被中断)
-    close(server_fd);
-    unlink(SOCKET_PATH);
-    closelog();
+    dedup_writer *w = dedup_writer_begin();
+    if (!w) {
+        return -1;
+    }
     
-    return 0;
-} 
\ No newline at end of file
+    char buf[MODIFY_CHUNK_SIZE];
+    size_t received = 0;
+    while (received < data_len) {
+        size_t chunk = data_len - received < sizeof(buf) ? data_len - received : sizeof(buf);
+        ssize_t n = recv(sock_fd, buf, chunk, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            slog(SLOG_ERROR, LOG_ERR, "接收 %s 的内容不完整: %zu/%zu 字节", path, received, data_len);
+            dedup_writer_abort(w);
+            return -1;
+        }
+        received += n;
+        *unread = data_len - received;
+        if (dedup_writer_write(w, buf, n) != 0) {
+            dedup_writer_abort(w);
+            return -1;
+        }
+    }
+    
+    int unchanged;
+    if (dedup_writer_commit(w, path, &unchanged) != 0) {
+        return -1;
+    }
+    slog(SLOG_AUDIT, LOG_NOTICE, "已成功修改文件: %s (%zu 字节%s)", path, data_len,
+         unchanged ? ", 内容未变化" : "");
+    return 0;
+}
+
+// 流式修改文件：分块接收内容写入临时文件，全部收到后原子地替换原文件
+// unread返回socket中尚未读取的内容字节数，无法确定时为SIZE_MAX
+int modify_file_stream(int sock_fd, const char *path, size_t data_len, size_t *unread) {
+    *unread = data_len;
+    
+    // 使用io_uring时小文件先收到内存中，写入和提交合并为一次系统调用
+    if (uring_io_enabled() && data_len <= MODIFY_CHUNK_SIZE) {
+        char buf[MODIFY_CHUNK_SIZE];
+        size_t received = 0;
+        while (received < data_len) {
+            ssize_t n = recv(sock_fd, buf + received, data_len - received, 0);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                slog(SLOG_ERROR, LOG_ERR, "接收 %s 的内容不完整: %zu/%zu 字节", path, received, data_len);
+                *unread = data_len - received;
+                return -1;
+            }
+            received += n;
+        }
+        *unread = 0;
+        return modify_file(path, buf, data_len);
+    }
+    
+    ensure_parent_exists(path);
+    if (dedup_store_usable(path)) {
+        return modify_file_dedup(sock_fd, path, data_len, unread);
+    }
+    
+    char tmp_path[MAX_PATH_LEN];
+    int fd = begin_file_update(path, tmp_path, sizeof(tmp_path));
+    if (fd == -1) {
+        return -1;
+    }
+    
+    if (receive_to_file(sock_fd, fd, tmp_path, data_len, unread) != 0) {
+        close(fd);
+        unlink_path(tmp_path);
+        return -1;
+    }
+    
+    if (finish_file_update(fd, tmp_path, path) != 0) {
+        return -1;
+    }
+    
+    slog(SLOG_AUDIT, LOG_NOTICE, "已成功修改文件: %s (%zu 字节)", path, data_len);
+    return 0;
+}
+
+const char *ingest_method_names[] = {
+    [INGEST_REFLINK] = "reflink",
+    [INGEST_COPY_FILE_RANGE] = "copy_file_range",
+    [INGEST_SENDFILE] = "sendfile",
+};
+
+int ingest_file_fd(int src_fd, const char *path, ingest_method *method) {
+    struct stat st;
+    if (fstat(src_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        slog(SLOG_ERROR, LOG_ERR, "传来的文件描述符不是普通文件: %s", path);
+        errno = EINVAL;
+        return -1;
+    }
+    int flags = fcntl(src_fd, F_GETFL);
+    if (flags == -1 || (flags & O_PATH) || (flags & O_ACCMODE) == O_WRONLY) {
+        slog(SLOG_ERROR, LOG_ERR, "传来的文件描述符不可读: %s", path);
+        errno = EBADF;
+        return -1;
+    }
+    
+    char tmp_path[MAX_PATH_LEN];
+    int fd = begin_file_update(path, tmp_path, sizeof(tmp_path));
+    if (fd == -1) {
+        return -1;
+    }
+    
+    *method = INGEST_REFLINK;
+    if (ioctl(fd, FICLONE, src_fd) != 0) {
+        *method = INGEST_COPY_FILE_RANGE;
+        loff_t in_off = 0;
+        while (in_off < st.st_size) {
+            ssize_t n = copy_file_range(src_fd, &in_off, fd, NULL, st.st_size - in_off, 0);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+        }
+        
+        // 跨文件系统等copy_file_range不支持的情况使用sendfile
+        if (in_off < st.st_size) {
+            *method = INGEST_SENDFILE;
+            off_t off = in_off;
+            while (off < st.st_size) {
+                ssize_t n = sendfile(fd, src_fd, &off, st.st_size - off);
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    if (n == 0) {
+                        errno = EIO;
+                    }
+                    slog(SLOG_ERROR, LOG_ERR, "复制到 %s 时出错: %s", tmp_path,
+                           n == 0 ? "源文件被截断" : strerror(errno));
+                    close(fd);
+                    unlink_path(tmp_path);
+                    return -1;
+                }
+            }
+        }
+    }
+    
+    if (finish_file_update(fd, tmp_path, path) != 0) {
+        return -1;
+    }
+    
+    metrics_add(METRIC_BYTES_WRITTEN, st.st_size);
+    slog(SLOG_AUDIT, LOG_NOTICE, "已成功通过文件描述符生成文件: %s (%ld 字节, %s)",
+           path, (long)st.st_size, ingest_method_names[*method]);
+    return 0;
+}
+
+// 去重的文件与内容库中的内容是同一个inode，就地写入前先换成独立的副本
+// (文件系统支持时为reflink)，只在第一次追加或覆盖写入时复制
+int unshare_file(const char *path, const unsigned char *digest) {
+    const char *name;
+    dir_ref *dir = dir_cache_parent(path, 0, &name);
+    if (!dir) {
+        return -1;
+    }
+    int src_fd = openat(dir_ref_fd(dir), name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    int err = errno;
+    dir_cache_release(dir);
+    if (src_fd == -1) {
+        slog(SLOG_ERROR, LOG_ERR, "无法打开 %s: %s", path, strerror(err));
+        errno = err;
+        return -1;
+    }
+    
+    ingest_method method;
+    int ret = ingest_file_fd(src_fd, path, &method);
+    close(src_fd);
+    if (ret == 0) {
+        dedup_store_unref(digest);
+    }
+    return ret;
+}
+
+// 文件不存在时与修改一样在临时文件中生成，新文件直接带有不可变上下文
+int write_new_file(int sock_fd, const char *path, size_t data_len, size_t *unread, int flags) {
+    char tmp_path[MAX_PATH_LEN];
+    int fd = begin_file_update(path, tmp_path, sizeof(tmp_path));
+    if (fd == -1) {
+        return -1;
+    }
+    if (receive_to_file(sock_fd, fd, tmp_path, data_len, unread) != 0 ||
+        ((flags & APPEND_FLAG_APPEND_ONLY) && mark_append_only(fd, path) != 0)) {
+        close(fd);
+        unlink_path(tmp_path);
+        return -1;
+    }
+    return finish_file_update(fd, tmp_path, path);
+}
+
+// 追加(offset为-1)或从offset开始覆盖写入，只写入新的内容，不替换文件：
+// inode、SELinux上下文和保留期限都不变。失败时截掉写到原文件末尾之后的部分，
+// 但覆盖写入已改写的内容不能恢复
+int write_file_range(int sock_fd, const char *path, int64_t offset, size_t data_len,
+                     size_t *unread, int flags) {
+    struct stat st;
+    if (stat_path(path, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        if (errno == ENOENT && offset <= 0) {
+            return write_new_file(sock_fd, path, data_len, unread, flags);
+        }
+        slog(SLOG_ERROR, LOG_ERR, "要写入的文件不存在: %s", path);
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        slog(SLOG_ERROR, LOG_ERR, "要写入的不是普通文件: %s", path);
+        errno = EINVAL;
+        return -1;
+    }
+    // 从文件末尾开始的覆盖写入也是追加
+    if (offset >= 0 && offset != st.st_size && file_append_only(path)) {
+        return -1;
+    }
+    if (offset > st.st_size) {
+        slog(SLOG_ERROR, LOG_ERR, "写入 %s 的偏移 %ld 超过文件末尾 %ld", path, (long)offset,
+             (long)st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    
+    unsigned char digest[DEDUP_DIGEST_LEN];
+    if (dedup_store_ref(path, digest) && unshare_file(path, digest) != 0) {
+        return -1;
+    }
+    
+    const char *name;
+    dir_ref *dir = dir_cache_parent(path, 0, &name);
+    if (!dir) {
+        return -1;
+    }
+    int fd = openat(dir_ref_fd(dir), name, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+    int err = errno;
+    dir_cache_release(dir);
+    if (fd == -1) {
+        slog(SLOG_ERROR, LOG_ERR, "无法打开 %s: %s", path, strerror(err));
+        errno = err;
+        return -1;
+    }
+    
+    // splice不能写入O_APPEND打开的文件，追加时定位到末尾；同一路径的请求依次执行，末尾不会变化
+    off_t start = offset < 0 ? st.st_size : offset;
+    int ret = -1;
+    if (lseek(fd, start, SEEK_SET) != -1 &&
+        receive_to_file(sock_fd, fd, path, data_len, unread) == 0 &&
+        (!(flags & APPEND_FLAG_APPEND_ONLY) || mark_append_only(fd, path) == 0)) {
+        // 校验和与新内容一起落盘；从末尾追加时只计算新写入的部分
+        integrity_update_fd(fd, st.st_size, start == st.st_size, path);
+        ret = fdatasync(fd);
+    }
+    if (ret != 0) {
+        err = errno;
+        if (ftruncate(fd, st.st_size) != 0 || (offset >= 0 && offset < st.st_size)) {
+            slog(SLOG_ERROR, LOG_ERR, "写入 %s 失败，文件中可能留有部分新内容: %s", path, strerror(err));
+        } else {
+            slog(SLOG_ERROR, LOG_ERR, "写入 %s 失败: %s", path, strerror(err));
+        }
+        integrity_update_fd(fd, 0, 0, path);
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    close(fd);
+    
+    if (offset < 0) {
+        slog(SLOG_AUDIT, LOG_NOTICE, "已成功追加文件: %s (%zu 字节)", path, data_len);
+    } else {
+        slog(SLOG_AUDIT, LOG_NOTICE, "已成功写入文件: %s (偏移 %ld, %zu 字节)", path, (long)offset,
+             data_len);
+    }
+    return 0;
+}
+
+// 增量更新：普通文件使用内置的增量同步，目录按树并行同步
+int rsync_update(const char *src, const char *dst, delta_stats *stats) {
+    if (!src || !dst || strlen(src) == 0 || strlen(dst) == 0) {
+        slog(SLOG_ERROR, LOG_ERR, "rsync更新的源或目标路径无效");
+        return -1;
+    }
+    
+    memset(stats, 0, sizeof(*stats));
+    
+    if (!is_directory(src)) {
+        if (delta_sync_file(src, dst, stats) != 0) {
+            slog(SLOG_ERROR, LOG_ERR, "增量更新失败: %s -> %s", src, dst);
+            return -1;
+        }
+        
+        slog(SLOG_AUDIT, LOG_NOTICE, "已成功增量更新文件: %s -> %s (传输 %lu 字节, 复用 %lu 字节%s)",
+               src, dst, (unsigned long)stats->bytes_literal, (unsigned long)stats->bytes_reused,
+               stats->unchanged ? ", 内容未变化" : "");
+        return 0;
+    }
+    
+    // 目录树：并行增量同步其中的每个文件
+    tree_sync_stats tree;
+    int ret = tree_sync(src, dst, &tree);
+    stats->bytes_total = tree.bytes_total;
+    stats->bytes_literal = tree.bytes_literal;
+    stats->bytes_reused = tree.bytes_reused;
+    
+    slog(SLOG_AUDIT, ret == 0 ? LOG_NOTICE : LOG_ERR,
+           "%s同步目录 %s -> %s: 更新 %lu 个文件，未变化 %lu 个，目录 %lu 个，跳过 %lu 项，失败 %lu 项 "
+           "(传输 %lu 字节, 复用 %lu 字节)", ret == 0 ? "已成功" : "未能完整", src, dst,
+           (unsigned long)tree.files_updated, (unsigned long)tree.files_unchanged,
+           (unsigned long)tree.dirs, (unsigned long)tree.skipped, (unsigned long)tree.failed,
+           (unsigned long)tree.bytes_literal, (unsigned long)tree.bytes_reused);
+    return ret;
+}
+
+// 删除文件或目录，不检查path本身的保留期；目录中的各项逐一检查，保留期未到的项不删除
+// tree不为NULL时输出删除目录的统计，path不是目录时全部为0
+int remove_path(const char *path, tree_delete_stats *tree) {
+    tree_delete_stats stats = { 0 };
+    struct stat st;
+    unsigned char digest[DEDUP_DIGEST_LEN];
+    int ret = 0;
+    const char *name;
+    dir_ref *dir = dir_cache_parent(path, 0, &name);
+    
+    // 与rm -rf一样不跟随符号链接，指向目录的链接只删除链接本身
+    if (dir && fstatat(dir_ref_fd(dir), name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)) {
+        ret = tree_delete(dir_ref_fd(dir), name, path, &stats);
+        dir_cache_invalidate(path);
+        if (ret != 0) {
+            int err = errno;
+            slog(SLOG_ERROR, LOG_ERR, "未能完整删除目录 %s: 删除 %lu 项，保留 %lu 项，失败 %lu 项", path,
+                   (unsigned long)stats.deleted, (unsigned long)stats.retained,
+                   (unsigned long)stats.failed);
+            errno = err;
+        }
+    } else {
+        int deduped = dir ? dedup_store_ref(path, digest) : 0;
+        if (!dir || unlinkat(dir_ref_fd(dir), name, 0) == -1) {
+            slog(SLOG_ERROR, LOG_ERR, "无法删除文件 %s: %s", path, strerror(errno));
+            ret = -1;
+        } else if (deduped) {
+            dedup_store_unref(digest);
+        }
+    }
+    if (dir) {
+        int err = errno;
+        dir_cache_release(dir);
+        errno = err;
+    }
+    
+    if (tree) {
+        *tree = stats;
+    }
+    if (ret == 0) {
+        if (stats.deleted > 0) {
+            slog(SLOG_AUDIT, LOG_NOTICE, "已成功删除: %s (%lu 项)", path, (unsigned long)stats.deleted);
+        } else {
+            slog(SLOG_AUDIT, LOG_NOTICE, "已成功删除: %s", path);
+        }
+    }
+    return ret;
+}
+
+// 删除文件
+int delete_file(const char *path, tree_delete_stats *tree) {
+    // 检查是否可以删除
+    if (!can_delete_file(path)) {
+        if (tree) {
+            memset(tree, 0, sizeof(*tree));
+        }
+        return -1;
+    }
+    return remove_path(path, tree);
+}
+
+// 设置保留期限
+int set_retention(const char *path, time_t retention_time) {
+    // 检查文件是否存在
+    struct stat st;
+    if (stat_path(path, &st, 0) != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "要设置保留期的文件不存在: %s", path);
+        return -1;
+    }
+    
+    return save_retention_info(path, retention_time);
+}
+
+
+uint64_t hash_path(const char *path) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+void path_locks_init(void) {
+    for (int i = 0; i < PATH_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&path_locks[i].mutex, NULL);
+        pthread_cond_init(&path_locks[i].cond, NULL);
+        path_locks[i].next_ticket = 0;
+        path_locks[i].now_serving = 0;
+    }
+}
+
+// 领取排队号，请求按领取的顺序执行
+unsigned long path_lock_ticket(size_t stripe) {
+    path_lock *lock = &path_locks[stripe];
+    pthread_mutex_lock(&lock->mutex);
+    unsigned long ticket = lock->next_ticket++;
+    pthread_mutex_unlock(&lock->mutex);
+    return ticket;
+}
+
+// 等待轮到自己的排队号
+void path_lock_acquire(size_t stripe, unsigned long ticket) {
+    path_lock *lock = &path_locks[stripe];
+    pthread_mutex_lock(&lock->mutex);
+    while (lock->now_serving != ticket) {
+        pthread_cond_wait(&lock->cond, &lock->mutex);
+    }
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+void path_lock_release(size_t stripe) {
+    path_lock *lock = &path_locks[stripe];
+    pthread_mutex_lock(&lock->mutex);
+    lock->now_serving++;
+    pthread_cond_broadcast(&lock->cond);
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+// 完整发送缓冲区内容
+int send_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// 工作线程使用阻塞读写，并设置超时防止慢客户端长期占用线程
+void set_blocking_with_timeout(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags != -1) {
+        fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+    
+    struct timeval tv = { .tv_sec = REQUEST_TIMEOUT, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// 按连接使用的协议发送回应：旧格式为文本，版本1为帧头加文本，版本3为帧头加结构化结果
+int send_reply(client_conn *conn, const request_reply *reply) {
+    if (!conn->framed) {
+        return send_all(conn->fd, reply->text, strlen(reply->text));
+    }
+    
+    char buf[sizeof(frame_header) + MAX_REPLY_LEN];
+    frame_header frame = {
+        .magic = PROTOCOL_MAGIC,
+        .version = conn->frame.version,
+        .request_id = conn->frame.request_id
+    };
+    size_t len;
+    if (conn->frame.version == PROTOCOL_VERSION_TEXT) {
+        len = strlen(reply->text);
+        memcpy(buf + sizeof(frame), reply->text, len);
+        frame.flags = reply->head.status != STATUS_OK ? FRAME_FLAG_FAILED : 0;
+    } else {
+        len = sizeof(reply->head) + reply->result_len;
+        memcpy(buf + sizeof(frame), &reply->head, sizeof(reply->head));
+        memcpy(buf + sizeof(frame) + sizeof(reply->head), reply->result, reply->result_len);
+    }
+    frame.length = len + reply->extra_len;
+    memcpy(buf, &frame, sizeof(frame));
+    if (send_all(conn->fd, buf, sizeof(frame) + len) != 0) {
+        return -1;
+    }
+    return reply->extra_len > 0 ? send_all(conn->fd, reply->extra, reply->extra_len) : 0;
+}
+
+void reply_set_result(request_reply *reply, reply_result type, const void *data, size_t len) {
+    reply->head.result = type;
+    memcpy(reply->result, data, len);
+    reply->result_len = len;
+}
+
+// 丢弃请求中未读取的文件内容，使会话中的下一个请求能够对齐
+int discard_body(int sock_fd, size_t len) {
+    char buf[MODIFY_CHUNK_SIZE];
+    while (len > 0) {
+        ssize_t n = recv(sock_fd, buf, len < sizeof(buf) ? len : sizeof(buf), 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+// 请求处理完毕：会话连接在对齐到下一个请求后可以继续使用
+// 返回0表示连接可以继续接收请求
+int finish_request(client_conn *conn, size_t unread, const request_reply *reply) {
+    int keep = conn->framed;
+    if (keep && unread > 0 && (unread == SIZE_MAX || discard_body(conn->fd, unread) != 0)) {
+        keep = 0;
+    }
+    if (send_reply(conn, reply) != 0) {
+        keep = 0;
+    }
+    
+    if (reply->head.status == STATUS_AUTH_FAILED) {
+        metrics_add(METRIC_AUTH_FAILURES, 1);
+    }
+    metrics_request(conn->batch ? CMD_BATCH : conn->req.cmd, reply->head.status != STATUS_OK,
+                    monotonic_us() - conn->request_start);
+    return keep ? 0 : -1;
+}
+
+// 批量请求中按路径查找本批已设置、尚未写入保留表的保留期限
+typedef struct {
+    size_t mask;
+    uint32_t *slots;             // 项的下标加1，0表示空
+} batch_index;
+
+int batch_index_init(batch_index *index, uint32_t count) {
+    size_t size = 16;
+    while (size < (size_t)count * 2) {
+        size *= 2;
+    }
+    index->slots = calloc(size, sizeof(uint32_t));
+    index->mask = size - 1;
+    return index->slots ? 0 : -1;
+}
+
+uint32_t *batch_index_slot(batch_index *index, batch_entry *items, const char *path) {
+    size_t i = hash_path(path) & index->mask;
+    while (index->slots[i] != 0 && strcmp(items[index->slots[i] - 1].path, path) != 0) {
+        i = (i + 1) & index->mask;
+    }
+    return &index->slots[i];
+}
+
+// 剩余保留时间：本批中设置过的以本批为准，否则查保留表
+time_t batch_remaining(batch_index *index, batch_entry *items, const char *path) {
+    uint32_t slot = *batch_index_slot(index, items, path);
+    if (slot != 0) {
+        return items[slot - 1].retention_time > 0 ? items[slot - 1].retention_time : 0;
+    }
+    return get_retention_info(path);
+}
+
+void batch_fail(batch_entry *item, int status, int error) {
+    item->result.status = status;
+    item->result.error = error;
+    if (item->tmp_path) {
+        unlink_path(item->tmp_path);
+        free(item->tmp_path);
+        item->tmp_path = NULL;
+    }
+}
+
+// 记录文件所在的文件系统，之后每个文件系统用一次syncfs代替逐个fsync；记录不下时直接fsync
+int batch_sync_later(int fd, dev_t dev, int *sync_fds, dev_t *sync_devs, size_t *sync_count) {
+    for (size_t d = 0; d < *sync_count; d++) {
+        if (sync_devs[d] == dev) {
+            return 0;
+        }
+    }
+    if (*sync_count < BATCH_SYNC_DEVS) {
+        int dup_fd = dup(fd);
+        if (dup_fd != -1) {
+            sync_fds[*sync_count] = dup_fd;
+            sync_devs[*sync_count] = dev;
+            (*sync_count)++;
+            return 0;
+        }
+    }
+    return fsync(fd);
+}
+
+// 接收各修改项的内容写入临时文件，返回-1表示连接上的数据已无法对齐
+int batch_receive(client_conn *conn, int *sync_fds, dev_t *sync_devs, size_t *sync_count) {
+    batch_request *batch = conn->batch;
+    
+    // 先建好目录，避免目录在设置新建文件上下文期间被创建
+    for (uint32_t i = 0; i < batch->count; i++) {
+        if (batch->items[i].cmd == CMD_MODIFY && batch->items[i].result.status == STATUS_OK) {
+            ensure_parent_exists(batch->items[i].path);
+        }
+    }
+    
+    // 整批只设置一次新建文件的上下文
+    selinux_label_create_begin();
+    int ret = 0;
+    for (uint32_t i = 0; i < batch->count && ret == 0; i++) {
+        batch_entry *item = &batch->items[i];
+        if (item->cmd != CMD_MODIFY) {
+            continue;
+        }
+        
+        size_t unread = item->data_len;
+        char tmp_path[MAX_PATH_LEN];
+        int fd = -1;
+        if (item->result.status == STATUS_OK) {
+            fd = open_temp_file(item->path, tmp_path, sizeof(tmp_path));
+            if (fd == -1) {
+                slog(SLOG_ERROR, LOG_ERR, "无法为 %s 创建临时文件: %s", item->path, strerror(errno));
+                batch_fail(item, STATUS_FAILED, errno);
+            }
+        }
+        if (fd != -1) {
+            struct stat st;
+            if (receive_to_file(conn->fd, fd, tmp_path, item->data_len, &unread) != 0 ||
+                fstat(fd, &st) != 0) {
+                batch_fail(item, STATUS_FAILED, errno ? errno : EIO);
+                unlink_path(tmp_path);
+            } else {
+                prepare_file_update(fd, tmp_path, item->path);
+                integrity_record_fd(fd, tmp_path);
+                item->tmp_path = strdup(tmp_path);
+                item->dev = st.st_dev;
+                if (!item->tmp_path) {
+                    unlink_path(tmp_path);
+                    batch_fail(item, STATUS_FAILED, ENOMEM);
+                } else if (batch_sync_later(fd, st.st_dev, sync_fds, sync_devs, sync_count) != 0) {
+                    batch_fail(item, STATUS_FAILED, errno);
+                }
+            }
+            close(fd);
+        }
+        
+        if (unread == SIZE_MAX || (unread > 0 && discard_body(conn->fd, unread) != 0)) {
+            ret = -1;
+        }
+    }
+    selinux_label_create_end();
+    return ret;
+}
+
+// 批量请求中待提交的一组改名(修改)和删除操作，互不依赖，可以并发执行
+typedef struct {
+    size_t count;
+    uint32_t items[BATCH_URING_GROUP];
+    uring_op ops[BATCH_URING_GROUP];
+    dir_ref *dirs[BATCH_URING_GROUP];  // 各操作所在的目录，执行后释放
+} batch_group;
+
+// 执行一组操作：io_uring可用时一次提交，否则逐个调用
+void batch_group_flush(batch_group *group, batch_request *batch) {
+    if (group->count == 0) {
+        return;
+    }
+    if (uring_io_submit(group->ops, group->count, 0) != 0) {
+        for (size_t i = 0; i < group->count; i++) {
+            uring_op *op = &group->ops[i];
+            int ret = op->op == URING_RENAMEAT ? renameat(op->fd, op->path, op->fd, op->path2) :
+                                                 unlinkat(op->fd, op->path, 0);
+            op->result = ret == 0 ? 0 : -errno;
+        }
+    }
+    for (size_t i = 0; i < group->count; i++) {
+        dir_cache_release(group->dirs[i]);
+    }
+    
+    for (size_t i = 0; i < group->count; i++) {
+        uring_op *op = &group->ops[i];
+        batch_entry *item = &batch->items[group->items[i]];
+        if (op->op == URING_RENAMEAT) {
+            if (op->result != 0) {
+                slog(SLOG_ERROR, LOG_ERR, "无法将 %s 替换为新内容: %s", item->path, strerror(-op->result));
+                batch_fail(item, STATUS_FAILED, -op->result);
+            } else {
+                free(item->tmp_path);
+                item->tmp_path = NULL;
+                metrics_add(METRIC_BYTES_WRITTEN, item->data_len);
+                slog(SLOG_AUDIT, LOG_NOTICE, "已成功修改文件: %s (%zu 字节)", item->path, item->data_len);
+            }
+        } else if (op->result == -EISDIR) {
+            // 目录由remove_path递归删除
+            tree_delete_stats tree;
+            if (remove_path(item->path, &tree) != 0) {
+                if (tree.failed == 0 && tree.retained > 0) {
+                    batch_fail(item, STATUS_RETENTION_ACTIVE, 0);
+                } else {
+                    batch_fail(item, STATUS_FAILED, errno);
+                }
+            }
+        } else if (op->result != 0) {
+            slog(SLOG_ERROR, LOG_ERR, "无法删除文件 %s: %s", item->path, strerror(-op->result));
+            batch_fail(item, STATUS_FAILED, -op->result);
+        } else {
+            slog(SLOG_AUDIT, LOG_NOTICE, "已成功删除: %s", item->path);
+        }
+    }
+    group->count = 0;
+}
+
+// 加入一个操作；同一路径在组中已有操作时先执行已有的，保证同一路径按顺序执行
+void batch_group_add(batch_group *group, batch_request *batch, uint32_t index, uring_op_type type) {
+    batch_entry *item = &batch->items[index];
+    for (size_t i = 0; i < group->count; i++) {
+        if (strcmp(batch->items[group->items[i]].path, item->path) == 0) {
+            batch_group_flush(group, batch);
+            break;
+        }
+    }
+    if (group->count == BATCH_URING_GROUP) {
+        batch_group_flush(group, batch);
+    }
+    
+    const char *name;
+    dir_ref *dir = dir_cache_parent(item->path, 0, &name);
+    if (!dir) {
+        slog(SLOG_ERROR, LOG_ERR, "无法打开 %s 所在的目录: %s", item->path, strerror(errno));
+        batch_fail(item, STATUS_FAILED, errno);
+        return;
+    }
+    
+    uring_op *op = &group->ops[group->count];
+    memset(op, 0, sizeof(*op));
+    op->op = type;
+    op->fd = dir_ref_fd(dir);
+    if (type == URING_RENAMEAT) {
+        op->path = base_name(item->tmp_path);
+        op->path2 = name;
+    } else {
+        op->path = name;
+    }
+    group->dirs[group->count] = dir;
+    group->items[group->count++] = index;
+}
+
+// 把暂存的保留期限一次写入保留表；失败时下标在[from, to)中、已暂存的设置保留期项失败
+void batch_commit_retention(batch_request *batch, retention_update *updates, size_t count,
+                            uint32_t from, uint32_t to) {
+    if (count == 0) {
+        return;
+    }
+    if (retention_store_set_many(updates, count) != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法保存批量请求中的 %zu 个保留期限", count);
+        for (uint32_t i = from; i < to; i++) {
+            if (batch->items[i].cmd == CMD_SET_RETENTION && batch->items[i].result.status == STATUS_OK) {
+                batch_fail(&batch->items[i], STATUS_FAILED, EIO);
+            }
+        }
+    } else {
+        slog(SLOG_AUDIT, LOG_NOTICE, "已为 %zu 个文件设置保留期限", count);
+    }
+}
+
+// 处理批量请求：接收所有内容后合并落盘，按顺序执行各项，保留期限一次写入保留表
+int handle_batch(client_conn *conn, request_reply *reply) {
+    batch_request *batch = conn->batch;
+    time_t now = time(NULL);
+    
+    if (!check_token(&conn->req)) {
+        reply->head.status = STATUS_AUTH_FAILED;
+        reply->head.error = EACCES;
+        return finish_request(conn, conn->req.data_len, reply);
+    }
+    
+    for (uint32_t i = 0; i < batch->count; i++) {
+        batch_entry *item = &batch->items[i];
+        if (!check_path(item->path, item->cmd)) {
+            batch_fail(item, STATUS_AUTH_FAILED, EACCES);
+        } else if (item->cmd != CMD_MODIFY && item->cmd != CMD_DELETE &&
+                   item->cmd != CMD_SET_RETENTION && item->cmd != CMD_GET_RETENTION) {
+            batch_fail(item, STATUS_UNSUPPORTED, 0);
+        } else if (item->cmd == CMD_MODIFY && item->data_len == 0) {
+            batch_fail(item, STATUS_BAD_REQUEST, EINVAL);
+        } else if (item->cmd == CMD_MODIFY && file_append_only(item->path)) {
+            batch_fail(item, STATUS_FAILED, EPERM);
+        }
+    }
+    
+    int sync_fds[BATCH_SYNC_DEVS];
+    dev_t sync_devs[BATCH_SYNC_DEVS];
+    size_t sync_count = 0;
+    int stream_ok = batch_receive(conn, sync_fds, sync_devs, &sync_count) == 0;
+    
+    // 每个文件系统落盘一次
+    for (size_t d = 0; d < sync_count; d++) {
+        if (syncfs(sync_fds[d]) != 0) {
+            int err = errno;
+            slog(SLOG_ERROR, LOG_ERR, "批量修改落盘失败: %s", strerror(err));
+            for (uint32_t i = 0; i < batch->count; i++) {
+                if (batch->items[i].tmp_path && batch->items[i].dev == sync_devs[d]) {
+                    batch_fail(&batch->items[i], STATUS_FAILED, err);
+                }
+            }
+        }
+        close(sync_fds[d]);
+    }
+    
+    batch_index index;
+    retention_update *updates = malloc(batch->count * sizeof(*updates));
+    if (!stream_ok || !updates || batch_index_init(&index, batch->count) != 0) {
+        for (uint32_t i = 0; i < batch->count; i++) {
+            if (batch->items[i].result.status == STATUS_OK) {
+                batch_fail(&batch->items[i], STATUS_FAILED, stream_ok ? ENOMEM : EIO);
+            }
+        }
+        free(updates);
+        updates = NULL;
+        index.slots = NULL;
+    }
+    
+    // 按顺序执行，保留期限先暂存，最后一次写入保留表；改名和删除攒成一组一起提交
+    batch_group group = { .count = 0 };
+    size_t update_count = 0;
+    uint32_t update_from = 0;  // 暂存的保留期限从这一项开始
+    for (uint32_t i = 0; updates && i < batch->count; i++) {
+        batch_entry *item = &batch->items[i];
+        if (item->result.status != STATUS_OK) {
+            continue;
+        }
+        
+        struct stat st;
+        switch (item->cmd) {
+            case CMD_MODIFY:
+                batch_group_add(&group, batch, i, URING_RENAMEAT);
+                break;
+                
+            case CMD_SET_RETENTION:
+                batch_group_flush(&group, batch);
+                if (stat_path(item->path, &st, 0) != 0) {
+                    slog(SLOG_ERROR, LOG_ERR, "要设置保留期的文件不存在: %s", item->path);
+                    batch_fail(item, STATUS_FAILED, errno);
+                } else {
+                    updates[update_count].path = item->path;
+                    updates[update_count].creation_time = now;
+                    updates[update_count].retention_time = item->retention_time;
+                    update_count++;
+                    *batch_index_slot(&index, batch->items, item->path) = i + 1;
+                }
+                break;
+                
+            case CMD_GET_RETENTION:
+                item->result.remaining = batch_remaining(&index, batch->items, item->path);
+                break;
+                
+            case CMD_DELETE:
+                item->result.remaining = batch_remaining(&index, batch->items, item->path);
+                if (item->result.remaining > 0) {
+                    slog(SLOG_AUDIT, LOG_WARNING, "文件 %s 还在保留期内，剩余 %ld 秒",
+                           item->path, (long)item->result.remaining);
+                    batch_fail(item, STATUS_RETENTION_ACTIVE, 0);
+                    break;
+                }
+                // 删除目录时tree_delete逐项查保留表，本批暂存的保留期限须先写入，
+                // 否则刚设置了保留期的目录中的文件会被删除
+                if (update_count > 0 && stat_path(item->path, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                    S_ISDIR(st.st_mode)) {
+                    batch_group_flush(&group, batch);
+                    batch_commit_retention(batch, updates, update_count, update_from, i);
+                    update_count = 0;
+                    update_from = i;
+                }
+                batch_group_add(&group, batch, i, URING_UNLINKAT);
+                break;
+                
+            default:
+                break;
+        }
+    }
+    
+    batch_group_flush(&group, batch);
+    batch_commit_retention(batch, updates, update_count, update_from, batch->count);
+    free(updates);
+    free(index.slots);
+    
+    // 回应: batch_header + 每项的结果
+    size_t len = sizeof(batch_header) + batch->count * sizeof(batch_item_result);
+    unsigned char *results = malloc(len);
+    if (!results) {
+        reply->head.status = STATUS_FAILED;
+        reply->head.error = ENOMEM;
+        return finish_request(conn, stream_ok ? 0 : SIZE_MAX, reply);
+    }
+    batch_header header = { .count = batch->count };
+    memcpy(results, &header, sizeof(header));
+    uint32_t succeeded = 0;
+    for (uint32_t i = 0; i < batch->count; i++) {
+        succeeded += batch->items[i].result.status == STATUS_OK;
+        memcpy(results + sizeof(header) + i * sizeof(batch_item_result),
+               &batch->items[i].result, sizeof(batch_item_result));
+    }
+    slog(SLOG_INFO, LOG_NOTICE, "批量请求完成: 共 %u 项，成功 %u 项", batch->count, succeeded);
+    
+    reply->head.result = RESULT_BATCH;
+    reply->extra = results;
+    reply->extra_len = len;
+    snprintf(reply->text, sizeof(reply->text), "批量请求完成: 共 %u 项，成功 %u 项",
+             batch->count, succeeded);
+    int keep = finish_request(conn, stream_ok ? 0 : SIZE_MAX, reply);
+    free(results);
+    return keep;
+}
+
+// 汇总运行统计，commands为STATS_COMMANDS个
+void collect_stats(reply_stats *head, stats_command *commands) {
+    uint64_t counters[METRIC_COUNTERS];
+    metrics_collect(commands, counters);
+    memset(head, 0, sizeof(*head));
+    head->uptime = time(NULL) - start_time;
+    head->bytes_written = counters[METRIC_BYTES_WRITTEN];
+    head->auth_failures = counters[METRIC_AUTH_FAILURES];
+    head->queue_depth = client_sched_depth();
+    // 关闭和接受可能在不同线程中计数，读取的先后会使差值暂时为负
+    head->active_connections = counters[METRIC_CONN_OPENED] > counters[METRIC_CONN_CLOSED] ?
+                               counters[METRIC_CONN_OPENED] - counters[METRIC_CONN_CLOSED] : 0;
+    head->retention_entries = retention_store_count();
+    head->log_dropped = slog_dropped();
+    head->command_count = STATS_COMMANDS;
+    head->bucket_count = STATS_LATENCY_BUCKETS;
+}
+
+// 处理统计请求：版本3回应reply_stats和各命令的统计，文本回应只有汇总
+int handle_stats(client_conn *conn, request_reply *reply) {
+    if (!check_token(&conn->req)) {
+        reply->head.status = STATUS_AUTH_FAILED;
+        reply->head.error = EACCES;
+        snprintf(reply->text, sizeof(reply->text), "认证失败");
+        return finish_request(conn, 0, reply);
+    }
+    
+    struct {
+        reply_stats head;
+        stats_command commands[STATS_COMMANDS];
+        stats_clients clients_head;
+        stats_client clients[STATS_MAX_CLIENTS];
+    } stats;
+    collect_stats(&stats.head, stats.commands);
+    
+    sched_client_stats clients[STATS_MAX_CLIENTS];
+    size_t total = client_sched_snapshot(clients, STATS_MAX_CLIENTS);
+    size_t count = total < STATS_MAX_CLIENTS ? total : STATS_MAX_CLIENTS;
+    stats.clients_head.client_count = count;
+    stats.clients_head.client_total = total;
+    for (size_t i = 0; i < count; i++) {
+        stats_client *c = &stats.clients[i];
+        memset(c, 0, sizeof(*c));
+        c->uid = clients[i].uid;
+        c->pid = clients[i].pid;
+        c->weight = clients[i].weight;
+        c->connections = clients[i].connections;
+        c->queued = clients[i].queued;
+        c->running = clients[i].running;
+        c->parked = clients[i].parked;
+        c->running_bytes = clients[i].running_bytes;
+        c->served = clients[i].served;
+        c->throttled = clients[i].throttled;
+        snprintf(c->label, sizeof(c->label), "%s", clients[i].label);
+    }
+    
+    uint64_t requests = 0, errors = 0;
+    for (int i = 0; i < STATS_COMMANDS; i++) {
+        requests += stats.commands[i].count;
+        errors += stats.commands[i].errors;
+    }
+    snprintf(reply->text, sizeof(reply->text),
+             "运行 %lu 秒，请求 %lu 个，失败 %lu 个，认证失败 %lu 个，写入 %lu 字节，"
+             "连接 %lu 个，队列中 %lu 个，客户端 %zu 个，保留表 %lu 条",
+             (unsigned long)stats.head.uptime, (unsigned long)requests, (unsigned long)errors,
+             (unsigned long)stats.head.auth_failures, (unsigned long)stats.head.bytes_written,
+             (unsigned long)stats.head.active_connections, (unsigned long)stats.head.queue_depth,
+             total, (unsigned long)stats.head.retention_entries);
+    if (conn->framed == 1 && conn->frame.version == PROTOCOL_VERSION) {
+        reply->head.result = RESULT_STATS;
+        reply->extra = &stats;
+        reply->extra_len = (size_t)((char *)&stats.clients[count] - (char *)&stats);
+    }
+    return finish_request(conn, 0, reply);
+}
+
+// 传递文件和增量同步没有随请求发送内容，入队时只按固定开销调度；认证之后在工作线程中
+// 按源文件的大小补计，不在事件循环中访问客户端给出的路径。增量同步实际写入的通常更少，
+// 源为目录时只计目录本身的大小
+void charge_source_bytes(client_conn *conn) {
+    struct stat st;
+    if (conn->req.cmd == CMD_INGEST_FD && conn->passed_fd != -1 && fstat(conn->passed_fd, &st) == 0) {
+        client_sched_charge(&conn->job, st.st_size);
+    } else if (conn->req.cmd == CMD_RSYNC && stat(conn->req.src_path, &st) == 0) {
+        client_sched_charge(&conn->job, st.st_size);
+    }
+}
+
+// 处理一个已接收完请求头的请求，返回0表示连接可以继续接收请求
+int handle_request(client_conn *conn) {
+    request_header *req = &conn->req;
+    int client_fd = conn->fd;
+    request_reply reply = { .head = { .status = STATUS_OK } };
+    
+    set_blocking_with_timeout(client_fd);
+    
+    if (conn->batch) {
+        return handle_batch(conn, &reply);
+    }
+    if (req->cmd == CMD_STATS) {
+        return handle_stats(conn, &reply);
+    }
+    
+    // 请求附带的文件内容中尚未读取的字节数
+    size_t unread = req->cmd == CMD_MODIFY || req->cmd == CMD_APPEND || req->cmd == CMD_PWRITE ?
+                    req->data_len : 0;
+    
+    // 验证请求
+    if (!authenticate_request(req)) {
+        reply.head.status = STATUS_AUTH_FAILED;
+        reply.head.error = EACCES;
+        snprintf(reply.text, sizeof(reply.text), "认证失败");
+        return finish_request(conn, unread, &reply);
+    }
+    charge_source_bytes(conn);
+    
+    int result = -1;
+    errno = 0;
+    
+    // 处理命令
+    switch(req->cmd) {
+        case CMD_MODIFY:
+            if (req->data_len == 0) {
+                reply.head.status = STATUS_BAD_REQUEST;
+            } else if (!file_append_only(req->path)) {
+                result = modify_file_stream(client_fd, req->path, req->data_len, &unread);
+                if (result == 0) {
+                    metrics_add(METRIC_BYTES_WRITTEN, req->data_len);
+                }
+            }
+            break;
+            
+        case CMD_APPEND:
+        case CMD_PWRITE:
+            if (req->data_len == 0 || (req->cmd == CMD_PWRITE && conn->write_offset > INT64_MAX) ||
+                (req->cmd == CMD_APPEND && (conn->write_flags & ~APPEND_FLAG_APPEND_ONLY))) {
+                reply.head.status = STATUS_BAD_REQUEST;
+            } else {
+                result = write_file_range(client_fd, req->path,
+                                          req->cmd == CMD_APPEND ? -1 : (off_t)conn->write_offset,
+                                          req->data_len, &unread,
+                                          req->cmd == CMD_APPEND ? (int)conn->write_flags : 0);
+                if (result == 0) {
+                    metrics_add(METRIC_BYTES_WRITTEN, req->data_len);
+                }
+            }
+            break;
+            
+        case CMD_INGEST_FD:
+            if (conn->passed_fd == -1) {
+                slog(SLOG_ERROR, LOG_WARNING, "请求 %s 没有附带文件描述符", req->path);
+                reply.head.status = STATUS_BAD_REQUEST;
+                reply.head.error = EBADF;
+            } else if (!file_append_only(req->path)) {
+                ingest_method method = INGEST_REFLINK;
+                result = ingest_file_fd(conn->passed_fd, req->path, &method);
+                if (result == 0) {
+                    uint32_t value = method;
+                    reply_set_result(&reply, RESULT_INGEST, &value, sizeof(value));
+                    snprintf(reply.text, sizeof(reply.text), "操作成功: %.3900s (%s)",
+                             req->path, ingest_method_names[method]);
+                }
+            }
+            break;
+            
+        case CMD_DELETE:
+            {
+                tree_delete_stats tree;
+                result = delete_file(req->path, &tree);
+                int err = errno;
+                int64_t remain = result != 0 ? get_retention_info(req->path) : 0;
+                if (remain > 0) {
+                    reply.head.status = STATUS_RETENTION_ACTIVE;
+                    reply_set_result(&reply, RESULT_REMAINING, &remain, sizeof(remain));
+                } else if (tree.deleted + tree.retained + tree.failed > 0) {
+                    // 删除了目录：回应各项的统计，只因保留而未删完时状态为保留期内
+                    reply_delete value = {
+                        .deleted = tree.deleted,
+                        .retained = tree.retained,
+                        .failed = tree.failed
+                    };
+                    reply_set_result(&reply, RESULT_DELETE, &value, sizeof(value));
+                    if (result != 0 && tree.failed == 0) {
+                        reply.head.status = STATUS_RETENTION_ACTIVE;
+                    }
+                    snprintf(reply.text, sizeof(reply.text),
+                             "%s: %.3900s (删除 %lu 项，保留 %lu 项，失败 %lu 项)",
+                             result == 0 ? "操作成功" : "操作失败", req->path,
+                             (unsigned long)tree.deleted, (unsigned long)tree.retained,
+                             (unsigned long)tree.failed);
+                }
+                errno = err;
+            }
+            break;
+            
+        case CMD_RSYNC:
+            {
+                delta_stats stats;
+                result = rsync_update(req->src_path, req->path, &stats);
+                if (result == 0) {
+                    metrics_add(METRIC_BYTES_WRITTEN, stats.bytes_literal);
+                }
+                if (result == 0 && stats.bytes_total > 0) {
+                    reply_rsync value = {
+                        .bytes_total = stats.bytes_total,
+                        .bytes_literal = stats.bytes_literal,
+                        .bytes_reused = stats.bytes_reused
+                    };
+                    reply_set_result(&reply, RESULT_RSYNC, &value, sizeof(value));
+                    snprintf(reply.text, sizeof(reply.text),
+                             "操作成功: %.3900s (传输 %lu 字节, 复用 %lu 字节)", req->path,
+                             (unsigned long)stats.bytes_literal, (unsigned long)stats.bytes_reused);
+                }
+            }
+            break;
+            
+        case CMD_SET_RETENTION:
+            result = set_retention(req->path, req->retention_time);
+            break;
+            
+        case CMD_VERIFY:
+            {
+                integrity_stats check;
+                result = integrity_verify(req->path, &check);
+                int err = errno;
+                reply_verify value = {
+                    .verified = check.verified,
+                    .mismatched = check.mismatched,
+                    .unrecorded = check.unrecorded,
+                    .failed = check.failed,
+                    .bytes = check.bytes
+                };
+                reply_set_result(&reply, RESULT_VERIFY, &value, sizeof(value));
+                snprintf(reply.text, sizeof(reply.text),
+                         "%s: %.3900s (一致 %lu 个，不一致 %lu 个，无记录 %lu 个，失败 %lu 项)",
+                         result == 0 ? "校验通过" : "校验失败", req->path,
+                         (unsigned long)check.verified, (unsigned long)check.mismatched,
+                         (unsigned long)check.unrecorded, (unsigned long)check.failed);
+                errno = err;
+            }
+            break;
+            
+        case CMD_GET_RETENTION:
+            {
+                int64_t remain = get_retention_info(req->path);
+                reply_set_result(&reply, RESULT_REMAINING, &remain, sizeof(remain));
+                snprintf(reply.text, sizeof(reply.text), 
+                         "文件 %.3900s 的剩余保留时间: %ld 秒", req->path, (long)remain);
+                result = 0;
+            }
+            break;
+            
+        default:
+            slog(SLOG_ERROR, LOG_WARNING, "未知命令: %d", req->cmd);
+            reply.head.status = STATUS_UNSUPPORTED;
+            break;
+    }
+    
+    // 返回结果
+    if (result != 0 && reply.head.status == STATUS_OK) {
+        reply.head.status = STATUS_FAILED;
+        reply.head.error = errno;
+    }
+    if (reply.text[0] == '\0') {
+        snprintf(reply.text, sizeof(reply.text), 
+                 "%s: %.4000s", (result == 0) ? "操作成功" : "操作失败", req->path);
+    }
+    
+    return finish_request(conn, unread, &reply);
+}
+
+void free_batch(batch_request *batch) {
+    if (!batch) {
+        return;
+    }
+    for (uint32_t i = 0; batch->items && i < batch->count; i++) {
+        if (batch->items[i].tmp_path) {
+            unlink_path(batch->items[i].tmp_path);
+            free(batch->items[i].tmp_path);
+        }
+    }
+    free(batch->items);
+    free(batch->paths);
+    free(batch->stripes);
+    free(batch->tickets);
+    free(batch);
+}
+
+// 将处理完请求的会话交还事件循环，等待下一个请求
+void session_resume(client_conn *conn) {
+    if (conn->passed_fd != -1) {
+        close(conn->passed_fd);
+        conn->passed_fd = -1;
+    }
+    conn->frame_received = 0;
+    conn->header_received = 0;
+    
+    int flags = fcntl(conn->fd, F_GETFL);
+    if (flags != -1) {
+        fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK);
+    }
+    
+    pthread_mutex_lock(&resumed_mutex);
+    conn->next = resumed_conns;
+    resumed_conns = conn;
+    pthread_mutex_unlock(&resumed_mutex);
+    
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) != sizeof(one)) {
+        slog(SLOG_ERROR, LOG_ERR, "无法唤醒事件循环: %s", strerror(errno));
+    }
+}
+
+// 交还因客户端的请求数达到上限而暂停接收的连接
+void resume_parked(sched_job *parked) {
+    while (parked) {
+        sched_job *next = parked->next;
+        session_resume(conn_of_job(parked));
+        parked = next;
+    }
+}
+
+void free_conn(client_conn *conn) {
+    metrics_add(METRIC_CONN_CLOSED, 1);
+    resume_parked(client_sched_detach(&conn->job));
+    if (conn->passed_fd != -1) {
+        close(conn->passed_fd);
+    }
+    free(conn->payload);
+    free_batch(conn->batch);
+    close(conn->fd);
+    free(conn);
+}
+
+// 到期清理的统计
+typedef struct {
+    size_t deleted;      // 已删除的文件
+    size_t reported;     // report方式下已到期、未删除的文件
+    size_t missing;      // 文件已不存在，只删除了保留记录
+    size_t skipped;      // 保留期被延长、是目录或删除失败
+} purge_stats;
+
+// 处理一个已到期的路径，持有该路径的排队锁，与同一路径上的请求按顺序执行
+void purge_path(const char *path, int dry_run, purge_stats *stats) {
+    size_t stripe = hash_path(path) % PATH_LOCK_STRIPES;
+    path_lock_acquire(stripe, path_lock_ticket(stripe));
+    
+    // 取出后可能已被重新设置了保留期限
+    time_t creation_time, retention_time;
+    struct stat st;
+    if (!retention_store_get(path, &creation_time, &retention_time) || retention_time <= 0 ||
+        creation_time + retention_time > time(NULL)) {
+        stats->skipped++;
+    } else if (stat_path(path, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        if (errno == ENOENT && !dry_run && retention_store_remove(path) == 0) {
+            stats->missing++;
+        } else {
+            stats->skipped++;
+        }
+    } else if (S_ISDIR(st.st_mode)) {
+        slog(SLOG_ERROR, LOG_WARNING, "到期清理跳过目录: %s", path);
+        stats->skipped++;
+    } else if (dry_run) {
+        slog(SLOG_AUDIT, LOG_NOTICE, "已过保留期(未删除): %s，到期于 %ld", path,
+               (long)(creation_time + retention_time));
+        stats->reported++;
+    } else {
+        unsigned char digest[DEDUP_DIGEST_LEN];
+        int deduped = dedup_store_ref(path, digest);
+        if (unlink_path(path) != 0) {
+            slog(SLOG_ERROR, LOG_ERR, "到期清理无法删除 %s: %s", path, strerror(errno));
+            stats->skipped++;
+        } else {
+            if (deduped) {
+                dedup_store_unref(digest);
+            }
+            retention_store_remove(path);
+            slog(SLOG_AUDIT, LOG_NOTICE, "已删除过保留期的文件: %s", path);
+            stats->deleted++;
+        }
+    }
+    
+    path_lock_release(stripe);
+}
+
+// 到期清理线程：按到期时间取出记录，每秒最多处理purge_rate个
+void *purge_thread(void *arg) {
+    (void)arg;
+    int dry_run = strcmp(config.purge_mode, "report") == 0;
+    size_t rate = config.purge_rate;
+    char **paths = malloc(rate * sizeof(char *));
+    if (!paths) {
+        slog(SLOG_ERROR, LOG_ERR, "无法启动到期清理: 内存不足");
+        return NULL;
+    }
+    
+    while (!stop_signal) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        
+        time_t now = time(NULL);
+        size_t n = retention_store_take_expired(now, paths, rate);
+        if (n == 0) {
+            retention_store_wait_expiry(now + PURGE_IDLE_WAIT);
+            continue;
+        }
+        
+        purge_stats stats = { 0 };
+        for (size_t i = 0; i < n; i++) {
+            purge_path(paths[i], dry_run, &stats);
+            free(paths[i]);
+        }
+        slog(SLOG_INFO, LOG_NOTICE, "到期清理: 删除 %zu 个，已到期未删除 %zu 个，文件已不存在 %zu 个，跳过 %zu 个，"
+               "队列中还有 %zu 条", stats.deleted, stats.reported, stats.missing, stats.skipped,
+               retention_store_expiry_pending());
+        
+        // 一批处理完不足一秒时等到满一秒，限制删除速率
+        if (n == rate) {
+            struct timespec end;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            long elapsed_ns = (end.tv_sec - start.tv_sec) * 1000000000L + end.tv_nsec - start.tv_nsec;
+            if (elapsed_ns < 1000000000L) {
+                struct timespec pause = { 0, 1000000000L - elapsed_ns };
+                nanosleep(&pause, NULL);
+            }
+        }
+    }
+    free(paths);
+    return NULL;
+}
+
+// 定期以Prometheus文本格式写出统计，供node_exporter等读取
+void *metrics_thread(void *arg) {
+    (void)arg;
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", config.metadata_dir, METRICS_FILE_NAME);
+    
+    int failing = 0;
+    while (!stop_signal) {
+        sleep(config.metrics_interval);
+        
+        struct {
+            reply_stats head;
+            stats_command commands[STATS_COMMANDS];
+        } stats;
+        collect_stats(&stats.head, stats.commands);
+        
+        // 客户端数可能在两次调用之间变化，增加的客户端下次再输出
+        size_t client_count = client_sched_snapshot(NULL, 0);
+        sched_client_stats *clients = calloc(client_count + 1, sizeof(*clients));
+        if (clients) {
+            size_t total = client_sched_snapshot(clients, client_count);
+            client_count = total < client_count ? total : client_count;
+        } else {
+            client_count = 0;
+        }
+        int ret = metrics_write_prometheus(path, &stats.head, stats.commands, clients, client_count);
+        free(clients);
+        if (ret != 0) {
+            // 只记录第一次失败，恢复后再记录
+            if (!failing) {
+                slog(SLOG_ERROR, LOG_ERR, "无法写出统计文件 %s: %s", path, strerror(errno));
+            }
+            failing = 1;
+        } else {
+            failing = 0;
+        }
+    }
+    return NULL;
+}
+
+void *worker_thread(void *arg) {
+    (void)arg;
+    
+    while (1) {
+        sched_job *job = client_sched_pop();
+        client_conn *conn = conn_of_job(job);
+        
+        // 排队号在取出请求后领取：比它小的排队号都属于已取出的请求，等待路径锁不会死锁
+        batch_request *batch = conn->batch;
+        pthread_mutex_lock(&ticket_mutex);
+        if (batch) {
+            for (size_t i = 0; i < batch->stripe_count; i++) {
+                batch->tickets[i] = path_lock_ticket(batch->stripes[i]);
+            }
+        } else {
+            conn->lock_ticket = path_lock_ticket(conn->lock_stripe);
+        }
+        pthread_mutex_unlock(&ticket_mutex);
+        
+        // 批量请求按分片编号升序等待涉及的所有路径锁
+        if (batch) {
+            for (size_t i = 0; i < batch->stripe_count; i++) {
+                path_lock_acquire(batch->stripes[i], batch->tickets[i]);
+            }
+        } else {
+            path_lock_acquire(conn->lock_stripe, conn->lock_ticket);
+        }
+        
+        int keep = handle_request(conn);
+        
+        if (batch) {
+            for (size_t i = 0; i < batch->stripe_count; i++) {
+                path_lock_release(batch->stripes[i]);
+            }
+            free_batch(batch);
+            conn->batch = NULL;
+        } else {
+            path_lock_release(conn->lock_stripe);
+        }
+        
+        // 客户端降到上限以下时，重新接收因此暂停的连接上的请求
+        sched_job *parked = client_sched_done(job);
+        if (keep == 0) {
+            session_resume(conn);
+        } else {
+            free_conn(conn);
+        }
+        resume_parked(parked);
+    }
+    
+    return NULL;
+}
+
+void pending_list_add(client_conn *conn) {
+    conn->prev = NULL;
+    conn->next = pending_conns;
+    if (pending_conns) {
+        pending_conns->prev = conn;
+    }
+    pending_conns = conn;
+}
+
+void pending_list_remove(client_conn *conn) {
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        pending_conns = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    conn->prev = conn->next = NULL;
+}
+
+// 关闭一个尚未交给工作线程的连接(close会自动将其移出epoll)
+void drop_pending_conn(client_conn *conn) {
+    pending_list_remove(conn);
+    free_conn(conn);
+}
+
+// 重新监听工作线程交还的会话
+void rearm_resumed_conns(int epoll_fd) {
+    uint64_t count;
+    if (read(wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        slog(SLOG_ERROR, LOG_ERR, "读取eventfd失败: %s", strerror(errno));
+    }
+    
+    pthread_mutex_lock(&resumed_mutex);
+    client_conn *conn = resumed_conns;
+    resumed_conns = NULL;
+    pthread_mutex_unlock(&resumed_mutex);
+    
+    time_t now = time(NULL);
+    while (conn) {
+        client_conn *next = conn->next;
+        conn->last_active = now;
+        
+        // 客户端可能已经发来了下一个请求，水平触发的epoll会立即报告
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) == -1) {
+            slog(SLOG_ERROR, LOG_ERR, "无法监听会话: %s", strerror(errno));
+            free_conn(conn);
+        } else {
+            pending_list_add(conn);
+        }
+        conn = next;
+    }
+}
+
+// 接受所有已就绪的新连接
+void accept_connections(int epoll_fd) {
+    while (1) {
+        int client_fd = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                slog(SLOG_ERROR, LOG_ERR, "接受连接失败: %s", strerror(errno));
+            }
+            return;
+        }
+        
+        slog(SLOG_CONN, LOG_NOTICE, "接受新连接");
+        
+        client_conn *conn = calloc(1, sizeof(client_conn));
+        if (!conn) {
+            slog(SLOG_ERROR, LOG_ERR, "无法为新连接分配内存");
+            close(client_fd);
+            continue;
+        }
+        conn->fd = client_fd;
+        conn->framed = -1;
+        conn->passed_fd = -1;
+        conn->last_active = time(NULL);
+        conn->job.client = client_sched_attach(client_fd);
+        if (!conn->job.client) {
+            slog(SLOG_ERROR, LOG_ERR, "无法取得连接的对端身份: %s", strerror(errno));
+            close(client_fd);
+            free(conn);
+            continue;
+        }
+        
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
+            slog(SLOG_ERROR, LOG_ERR, "无法监听新连接: %s", strerror(errno));
+            client_sched_detach(&conn->job);
+            close(client_fd);
+            free(conn);
+            continue;
+        }
+        metrics_add(METRIC_CONN_OPENED, 1);
+        pending_list_add(conn);
+    }
+}
+
+// 保存随请求头传来的文件描述符，只保留第一个
+void take_passed_fds(client_conn *conn, struct msghdr *msg) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *fds = (int *)CMSG_DATA(cmsg);
+        for (size_t i = 0; i < count; i++) {
+            if (conn->passed_fd == -1) {
+                conn->passed_fd = fds[i];
+            } else {
+                close(fds[i]);
+            }
+        }
+    }
+}
+
+// 检查会话请求的帧头，返回STATUS_OK或拒绝的原因
+int check_frame(const frame_header *frame) {
+    if (frame->magic != PROTOCOL_MAGIC || frame->flags != 0) {
+        slog(SLOG_CONN, LOG_WARNING, "会话中收到无效的帧头");
+        return STATUS_BAD_REQUEST;
+    }
+    if (frame->version == PROTOCOL_VERSION) {
+        if (frame->length < sizeof(request_v2) ||
+            frame->length > MAX_REQUEST_V2_LEN + MAX_BATCH_MANIFEST_LEN) {
+            slog(SLOG_CONN, LOG_WARNING, "请求长度无效: %u", frame->length);
+            return STATUS_BAD_REQUEST;
+        }
+        return STATUS_OK;
+    }
+    if (frame->version == PROTOCOL_VERSION_TEXT) {
+        if (frame->length != sizeof(request_header)) {
+            slog(SLOG_CONN, LOG_WARNING, "请求长度无效: %u", frame->length);
+            return STATUS_BAD_REQUEST;
+        }
+        return STATUS_OK;
+    }
+    if (frame->version == PROTOCOL_VERSION_RETIRED) {
+        slog(SLOG_CONN, LOG_WARNING, "客户端使用旧的协议版本%u，需要按当前的头文件重新编译",
+             frame->version);
+        return STATUS_UNSUPPORTED;
+    }
+    slog(SLOG_CONN, LOG_WARNING, "不支持的协议版本: %u", frame->version);
+    return STATUS_UNSUPPORTED;
+}
+
+// 告诉客户端请求被拒绝的原因，随后由调用者关闭连接
+void reject_frame(client_conn *conn, int status) {
+    char buf[sizeof(frame_header) + sizeof(reply_v2)];
+    // 版本2的回应格式与当前相同，按其版本号回应，旧客户端才能认出STATUS_UNSUPPORTED
+    frame_header frame = {
+        .magic = PROTOCOL_MAGIC,
+        .version = conn->frame.version == PROTOCOL_VERSION_RETIRED ? PROTOCOL_VERSION_RETIRED
+                                                                     : PROTOCOL_VERSION,
+        .request_id = conn->frame.request_id,
+        .length = sizeof(reply_v2)
+    };
+    reply_v2 head = { .status = status, .error = EPROTO };
+    memcpy(buf, &frame, sizeof(frame));
+    memcpy(buf + sizeof(frame), &head, sizeof(head));
+    if (send(conn->fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+        slog(SLOG_CONN, LOG_WARNING, "无法发送拒绝回应: %s", strerror(errno));
+    }
+}
+
+// 解析批量请求的清单，领取排队号由调用者负责
+batch_request *parse_batch(const char *manifest, size_t len) {
+    batch_header header;
+    if (len < sizeof(header)) {
+        return NULL;
+    }
+    memcpy(&header, manifest, sizeof(header));
+    if (header.count == 0 || header.count > MAX_BATCH_ITEMS) {
+        return NULL;
+    }
+    
+    batch_request *batch = calloc(1, sizeof(*batch));
+    if (!batch) {
+        return NULL;
+    }
+    batch->count = header.count;
+    batch->items = calloc(header.count, sizeof(batch_entry));
+    batch->paths = malloc(len);  // 每项的定长部分足够容纳路径结尾的'\0'
+    if (!batch->items || !batch->paths) {
+        free_batch(batch);
+        return NULL;
+    }
+    
+    static unsigned char used[PATH_LOCK_STRIPES];  // 只在事件循环线程中调用
+    memset(used, 0, sizeof(used));
+    
+    const char *p = manifest + sizeof(header);
+    const char *end = manifest + len;
+    char *q = batch->paths;
+    for (uint32_t i = 0; i < header.count; i++) {
+        batch_item item;
+        if ((size_t)(end - p) < sizeof(item)) {
+            free_batch(batch);
+            return NULL;
+        }
+        memcpy(&item, p, sizeof(item));
+        p += sizeof(item);
+        if (item.path_len >= MAX_PATH_LEN || (size_t)(end - p) < item.path_len) {
+            free_batch(batch);
+            return NULL;
+        }
+        
+        batch_entry *entry = &batch->items[i];
+        memcpy(q, p, item.path_len);
+        q[item.path_len] = '\0';
+        entry->path = q;
+        q += item.path_len + 1;
+        p += item.path_len;
+        
+        entry->cmd = item.cmd;
+        entry->retention_time = item.retention_time;
+        if (item.cmd == CMD_MODIFY) {
+            entry->data_len = item.data_len;
+            batch->data_total += item.data_len;
+        }
+        used[hash_path(entry->path) % PATH_LOCK_STRIPES] = 1;
+    }
+    if (p != end) {
+        free_batch(batch);
+        return NULL;
+    }
+    
+    for (size_t i = 0; i < PATH_LOCK_STRIPES; i++) {
+        batch->stripe_count += used[i];
+    }
+    batch->stripes = malloc(batch->stripe_count * sizeof(size_t));
+    batch->tickets = malloc(batch->stripe_count * sizeof(unsigned long));
+    if (!batch->stripes || !batch->tickets) {
+        free_batch(batch);
+        return NULL;
+    }
+    for (size_t i = 0, n = 0; i < PATH_LOCK_STRIPES; i++) {
+        if (used[i]) {
+            batch->stripes[n++] = i;
+        }
+    }
+    return batch;
+}
+
+// 将版本3的请求解码为request_header，批量请求的清单解析到conn->batch
+int decode_request_v2(client_conn *conn) {
+    request_v2 head;
+    memcpy(&head, conn->payload, sizeof(head));
+    size_t fields = sizeof(head) + head.token_len + head.path_len + head.src_len;
+    if (head.token_len >= sizeof(conn->req.token) || head.path_len >= MAX_PATH_LEN ||
+        head.src_len >= MAX_PATH_LEN || fields > conn->frame.length ||
+        (fields != conn->frame.length && head.cmd != CMD_BATCH) || head.reserved != 0) {
+        slog(SLOG_CONN, LOG_WARNING, "请求中的字段长度无效");
+        return -1;
+    }
+    
+    if (head.cmd == CMD_BATCH) {
+        conn->batch = parse_batch(conn->payload + fields, conn->frame.length - fields);
+        if (!conn->batch || conn->batch->data_total != head.data_len) {
+            slog(SLOG_CONN, LOG_WARNING, "批量请求的清单无效");
+            free_batch(conn->batch);
+            conn->batch = NULL;
+            return -1;
+        }
+    }
+    
+    request_header *req = &conn->req;
+    const char *p = conn->payload + sizeof(head);
+    req->cmd = head.cmd;
+    memcpy(req->token, p, head.token_len);
+    req->token[head.token_len] = '\0';
+    p += head.token_len;
+    memcpy(req->path, p, head.path_len);
+    req->path[head.path_len] = '\0';
+    p += head.path_len;
+    memcpy(req->src_path, p, head.src_len);
+    req->src_path[head.src_len] = '\0';
+    req->retention_time = head.retention_time;
+    req->data_len = head.data_len;
+    conn->write_offset = head.offset;
+    conn->write_flags = head.flags;
+    return 0;
+}
+
+// 接收连接的下一个请求之前占用所属客户端的名额；客户端未完成的请求已达上限时暂停接收该连接，
+// 由工作线程在客户端有请求完成后交还，返回0
+int admit_conn(int epoll_fd, client_conn *conn) {
+    if (client_sched_admit(&conn->job)) {
+        return 1;
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    pending_list_remove(conn);
+    if (client_sched_park(&conn->job)) {
+        return 0;
+    }
+    // 期间有请求完成，继续接收
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) == -1) {
+        slog(SLOG_ERROR, LOG_ERR, "无法监听会话: %s", strerror(errno));
+        free_conn(conn);
+        return 0;
+    }
+    pending_list_add(conn);
+    return 1;
+}
+
+// 非阻塞地接收请求头，收齐后放入所属客户端的队列
+void read_request_header(int epoll_fd, client_conn *conn) {
+    if (!conn->job.admitted && !admit_conn(epoll_fd, conn)) {
+        return;
+    }
+    
+    // 先按帧头接收，前4个字节不是协议标识时按旧格式的请求头继续接收
+    int in_frame = conn->framed != 0 && conn->frame_received < sizeof(conn->frame);
+    char *buf;
+    size_t received, total;
+    if (in_frame) {
+        buf = (char *)&conn->frame;
+        received = conn->frame_received;
+        total = sizeof(conn->frame);
+    } else if (conn->payload) {
+        buf = conn->payload;
+        received = conn->header_received;
+        total = conn->frame.length;
+    } else {
+        buf = (char *)&conn->req;
+        received = conn->header_received;
+        total = sizeof(conn->req);
+    }
+    
+    struct iovec iov = {
+        .iov_base = buf + received,
+        .iov_len = total - received
+    };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf)
+    };
+    
+    // 用recvmsg读取，使随请求头传来的文件描述符不会被丢弃
+    ssize_t n = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (n > 0) {
+        take_passed_fds(conn, &msg);
+    }
+    if (n <= 0) {
+        // 会话在两个请求之间关闭是正常结束
+        if (n == -1 || conn->framed != 1 || conn->frame_received > 0) {
+            slog(SLOG_CONN, LOG_ERR, "接收请求失败");
+        }
+        drop_pending_conn(conn);
+        return;
+    }
+    conn->last_active = time(NULL);
+    
+    if (in_frame) {
+        conn->frame_received += n;
+        if (conn->framed == -1 && conn->frame_received >= sizeof(conn->frame.magic)) {
+            conn->framed = conn->frame.magic == PROTOCOL_MAGIC;
+            if (!conn->framed) {
+                // 旧格式：已收到的字节属于请求头
+                memcpy(&conn->req, &conn->frame, conn->frame_received);
+                conn->header_received = conn->frame_received;
+            }
+        }
+        if (conn->framed == 1 && conn->frame_received == sizeof(conn->frame)) {
+            int status = check_frame(&conn->frame);
+            if (status != STATUS_OK) {
+                reject_frame(conn, status);
+                drop_pending_conn(conn);
+            } else if (conn->frame.version == PROTOCOL_VERSION) {
+                conn->payload = malloc(conn->frame.length);
+                if (!conn->payload) {
+                    slog(SLOG_ERROR, LOG_ERR, "无法为请求分配内存");
+                    drop_pending_conn(conn);
+                }
+            }
+        }
+        return;
+    }
+    
+    conn->header_received += n;
+    if (conn->header_received < total) {
+        return;
+    }
+    
+    if (conn->payload) {
+        int ret = decode_request_v2(conn);
+        free(conn->payload);
+        conn->payload = NULL;
+        if (ret != 0) {
+            reject_frame(conn, STATUS_BAD_REQUEST);
+            drop_pending_conn(conn);
+            return;
+        }
+    } else {
+        // 客户端传来的字符串不一定以'\0'结尾
+        conn->req.path[MAX_PATH_LEN - 1] = '\0';
+        conn->req.src_path[MAX_PATH_LEN - 1] = '\0';
+        conn->req.token[sizeof(conn->req.token) - 1] = '\0';
+        // 旧格式没有单独的字段，偏移和标志放在retention_time中；负数的偏移和超出范围的标志被拒绝
+        time_t value = conn->req.retention_time;
+        conn->write_offset = (uint64_t)value;
+        conn->write_flags = value >= 0 && value <= UINT32_MAX ? (uint32_t)value : UINT32_MAX;
+    }
+    
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    pending_list_remove(conn);
+    conn->request_start = monotonic_us();
+    
+    // 保留期限的查询、运行统计是廉价请求，排在同一客户端的写入之前；
+    // 设置保留期限要落盘，按普通请求轮转
+    sched_job *job = &conn->job;
+    if (conn->batch) {
+        job->bytes = conn->batch->data_total;
+        job->priority = 0;
+    } else {
+        conn->lock_stripe = hash_path(conn->req.path) % PATH_LOCK_STRIPES;
+        job->bytes = conn->req.data_len;
+        job->priority = conn->req.cmd == CMD_GET_RETENTION || conn->req.cmd == CMD_STATS;
+    }
+    client_sched_push(job);
+}
+
+// 关闭长时间未发送完整请求头的连接和长时间空闲的会话
+void expire_pending_conns(void) {
+    time_t now = time(NULL);
+    client_conn *conn = pending_conns;
+    while (conn) {
+        client_conn *next = conn->next;
+        int idle_session = conn->framed == 1 && conn->frame_received == 0;
+        if (now - conn->last_active > (idle_session ? SESSION_IDLE_TIMEOUT : REQUEST_TIMEOUT)) {
+            slog(SLOG_CONN, LOG_WARNING, "连接超时未发送完整请求，已关闭");
+            drop_pending_conn(conn);
+        }
+        conn = next;
+    }
+}
+
+void print_usage(const char *prog) {
+    printf("用法: %s [选项]\n", prog);
+    printf("  -s, --socket <路径>      监听的socket路径 (默认 %s)\n", SOCKET_PATH);
+    printf("  -b, --backlog <数量>     listen队列长度 (默认 %d)\n", DEFAULT_BACKLOG);
+    printf("  -w, --workers <数量>     工作线程数 (默认 %d)\n", DEFAULT_WORKERS);
+    printf("  -q, --queue-size <数量>  待处理请求队列长度 (默认 %d)\n", DEFAULT_QUEUE_SIZE);
+    printf("  -A, --client-requests <数量> 每个客户端(uid和SELinux上下文)排队和执行中的请求数上限 (默认 %d)\n",
+           DEFAULT_CLIENT_REQUESTS);
+    printf("  -B, --client-bytes <字节> 每个客户端执行中的请求要写入的字节数上限，可加K、M、G (默认 %lluM)\n",
+           DEFAULT_CLIENT_BYTES >> 20);
+    printf("  -W, --client-weights <uid=权重,...> 客户端在调度中的权重，uid也可以是用户名 (默认都为1)\n");
+    printf("  -c, --compact-interval <秒> 检查是否需要压缩保留信息文件的间隔 (默认 %d)\n",
+           DEFAULT_COMPACT_INTERVAL);
+    printf("  -C, --file-context <上下文> 不可变文件的SELinux上下文 (默认由服务进程的上下文推导)\n");
+    printf("  -I, --io-backend <方式>  文件操作使用的接口: auto、uring或posix (默认 auto)\n");
+    printf("  -P, --purge-expired <方式> 保留期已过的文件: off不处理、report只记录、delete删除 (默认 off)\n");
+    printf("  -R, --purge-rate <数量>  到期清理每秒处理的文件数 (默认 %d)\n", DEFAULT_PURGE_RATE);
+    printf("  -T, --tree-workers <数量> 并行删除和同步目录树的后台线程数 (默认 %d)\n", DEFAULT_TREE_WORKERS);
+    printf("  -M, --metadata-dir <目录> 保留表等元数据所在的目录 (默认 %s)\n", METADATA_DIR);
+    printf("  -r, --roots <目录,...>   不可变文件的根目录，请求中的路径必须是其下的绝对路径，/为不限制 (默认 /)\n");
+    printf("  -L, --log-levels <类别=级别,...> 各类日志的记录级别，类别为conn、audit、error、info或all，\n"
+           "                           级别为off、err、warning、notice、info或debug (默认都为notice)\n");
+    printf("  -D, --dedup <方式>       on时文件内容按SHA-256存入元数据目录中的内容库，相同内容只存一份 (默认 off)\n");
+    printf("  -S, --retention-sync <方式> on时保留记录落盘后才回应，并发的请求共用一次fdatasync (默认 on)\n");
+    printf("  -H, --retention-shm <路径> 发布只读的共享内存保留表，客户端不经过socket查询，off为不发布 (默认 %s)\n",
+           RETENTION_SHM_PATH);
+    printf("  -X, --convert-retention  把元数据目录中的保留信息文件(包括旧的文本格式)合并到%s后退出\n",
+           RETENTION_INDEX_NAME);
+    printf("  -V, --integrity <方式>   on时写入文件时记录内容的CRC32C校验和，供verify检查 (默认 on)\n");
+    printf("  -m, --metrics-interval <秒> 定期在元数据目录中写出Prometheus格式的%s，0为不写 (默认 0)\n",
+           METRICS_FILE_NAME);
+    printf("  -h, --help               显示帮助\n");
+}
+
+// 解析字节数，可以带K、M、G后缀
+int parse_size(const char *arg, uint64_t *size) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(arg, &end, 10);
+    if (errno != 0 || end == arg || *arg == '-') {
+        return -1;
+    }
+    int shift = 0;
+    switch (*end) {
+        case 'K': case 'k': shift = 10; end++; break;
+        case 'M': case 'm': shift = 20; end++; break;
+        case 'G': case 'g': shift = 30; end++; break;
+    }
+    if (*end != '\0' || value > (UINT64_MAX >> shift)) {
+        return -1;
+    }
+    *size = (uint64_t)value << shift;
+    return 0;
+}
+
+// 解析命令行参数，返回0表示继续运行
+int parse_options(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "socket",     required_argument, NULL, 's' },
+        { "backlog",    required_argument, NULL, 'b' },
+        { "workers",    required_argument, NULL, 'w' },
+        { "queue-size", required_argument, NULL, 'q' },
+        { "client-requests", required_argument, NULL, 'A' },
+        { "client-bytes", required_argument, NULL, 'B' },
+        { "client-weights", required_argument, NULL, 'W' },
+        { "compact-interval", required_argument, NULL, 'c' },
+        { "file-context", required_argument, NULL, 'C' },
+        { "io-backend", required_argument, NULL, 'I' },
+        { "purge-expired", required_argument, NULL, 'P' },
+        { "purge-rate", required_argument, NULL, 'R' },
+        { "tree-workers", required_argument, NULL, 'T' },
+        { "metadata-dir", required_argument, NULL, 'M' },
+        { "roots",      required_argument, NULL, 'r' },
+        { "metrics-interval", required_argument, NULL, 'm' },
+        { "log-levels", required_argument, NULL, 'L' },
+        { "dedup",      required_argument, NULL, 'D' },
+        { "retention-sync", required_argument, NULL, 'S' },
+        { "retention-shm", required_argument, NULL, 'H' },
+        { "integrity",  required_argument, NULL, 'V' },
+        { "convert-retention", no_argument, NULL, 'X' },
+        { "help",       no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:b:w:q:A:B:W:c:C:I:P:R:T:M:r:m:L:D:S:H:V:Xh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                config.socket_path = optarg;
+                break;
+            case 'b':
+                config.backlog = atoi(optarg);
+                break;
+            case 'w':
+                config.workers = atoi(optarg);
+                break;
+            case 'q':
+                config.queue_size = atoi(optarg);
+                break;
+            case 'A':
+                config.client_requests = atoi(optarg);
+                break;
+            case 'B':
+                if (parse_size(optarg, &config.client_bytes) != 0) {
+                    fprintf(stderr, "无效的字节数: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'W':
+                config.client_weights = optarg;
+                break;
+            case 'c':
+                config.compact_interval = atoi(optarg);
+                break;
+            case 'C':
+                config.file_context = optarg;
+                break;
+            case 'I':
+                config.io_backend = optarg;
+                break;
+            case 'P':
+                config.purge_mode = optarg;
+                break;
+            case 'R':
+                config.purge_rate = atoi(optarg);
+                break;
+            case 'T':
+                config.tree_workers = atoi(optarg);
+                break;
+            case 'M':
+                config.metadata_dir = optarg;
+                break;
+            case 'r':
+                config.roots = optarg;
+                break;
+            case 'm':
+                config.metrics_interval = atoi(optarg);
+                break;
+            case 'D':
+                config.dedup = optarg;
+                break;
+            case 'S':
+                config.retention_sync = optarg;
+                break;
+            case 'H':
+                config.retention_shm = optarg;
+                break;
+            case 'V':
+                config.integrity = optarg;
+                break;
+            case 'X':
+                config.convert_retention = 1;
+                break;
+            case 'L':
+                if (slog_set_levels(optarg) != 0) {
+                    fprintf(stderr, "无效的日志级别设置: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+            default:
+                print_usage(argv[0]);
+                return -1;
+        }
+    }
+    
+    if (config.backlog <= 0 || config.workers <= 0 || config.queue_size <= 0 ||
+        config.compact_interval <= 0 || config.purge_rate <= 0 || config.tree_workers <= 0 ||
+        config.client_requests <= 0 || config.client_bytes == 0) {
+        fprintf(stderr, "backlog、workers、queue-size、compact-interval、purge-rate、tree-workers、"
+                "client-requests和client-bytes必须为正数\n");
+        return -1;
+    }
+    if (client_sched_init(config.queue_size, config.client_requests, config.client_bytes,
+                          config.client_weights) != 0) {
+        fprintf(stderr, "无效的客户端权重: %s\n", config.client_weights);
+        return -1;
+    }
+    if (config.metrics_interval < 0) {
+        fprintf(stderr, "metrics-interval不能为负数\n");
+        return -1;
+    }
+    if (strcmp(config.purge_mode, "off") != 0 && strcmp(config.purge_mode, "report") != 0 &&
+        strcmp(config.purge_mode, "delete") != 0) {
+        fprintf(stderr, "purge-expired必须为off、report或delete\n");
+        return -1;
+    }
+    if (strcmp(config.dedup, "off") != 0 && strcmp(config.dedup, "on") != 0) {
+        fprintf(stderr, "dedup必须为off或on\n");
+        return -1;
+    }
+    if (strcmp(config.retention_sync, "off") != 0 && strcmp(config.retention_sync, "on") != 0) {
+        fprintf(stderr, "retention-sync必须为off或on\n");
+        return -1;
+    }
+    if (strcmp(config.integrity, "off") != 0 && strcmp(config.integrity, "on") != 0) {
+        fprintf(stderr, "integrity必须为off或on\n");
+        return -1;
+    }
+    if (strcmp(config.io_backend, "auto") != 0 && strcmp(config.io_backend, "uring") != 0 &&
+        strcmp(config.io_backend, "posix") != 0) {
+        fprintf(stderr, "io-backend必须为auto、uring或posix\n");
+        return -1;
+    }
+    if (strlen(config.socket_path) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+        fprintf(stderr, "socket路径过长: %s\n", config.socket_path);
+        return -1;
+    }
+    if (strlen(config.metadata_dir) + sizeof(RETENTION_INDEX_NAME) + sizeof(METRICS_FILE_NAME) +
+        sizeof(DEDUP_DIR_NAME) + 2 * DEDUP_DIGEST_LEN + 8 > MAX_PATH_LEN) {
+        fprintf(stderr, "元数据目录路径过长: %s\n", config.metadata_dir);
+        return -1;
+    }
+    return 0;
+}
+
+// 打开元数据目录中的保留索引和保留信息文件
+static int open_retention_store(void) {
+    char retention_file[MAX_PATH_LEN];
+    char index_file[MAX_PATH_LEN];
+    snprintf(retention_file, sizeof(retention_file), "%s/%s", config.metadata_dir, RETENTION_FILE_NAME);
+    snprintf(index_file, sizeof(index_file), "%s/%s", config.metadata_dir, RETENTION_INDEX_NAME);
+    return retention_store_open(retention_file, index_file);
+}
+
+// --convert-retention: 离线把保留信息文件合并到二进制索引，服务不能同时运行
+static int convert_retention(void) {
+    if (open_retention_store() != 0 || retention_store_compact() != 0) {
+        fprintf(stderr, "转换保留信息失败，详见系统日志\n");
+        return -1;
+    }
+    printf("已将 %zu 条保留记录写入 %s/%s\n", retention_store_count(),
+           config.metadata_dir, RETENTION_INDEX_NAME);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_un server_addr;
+    
+    if (parse_options(argc, argv) != 0) {
+        return 1;
+    }
+    
+    // 初始化日志系统
+    openlog("immutable_service", LOG_PID, LOG_DAEMON);
+    if (slog_start("immutable_service") == 0) {
+        atexit(slog_stop);  // 启动失败等提前退出时也写出缓冲区中的日志
+    }
+    if (config.convert_retention) {
+        return convert_retention() == 0 ? 0 : 1;
+    }
+    slog(SLOG_INFO, LOG_NOTICE, "不可变文件特权服务启动");
+    start_time = time(NULL);
+    
+    integrity_set_enabled(strcmp(config.integrity, "on") == 0);
+    
+    // 打开不可变文件的根目录，之后的文件操作都相对于缓存的目录描述符
+    if (dir_cache_init(config.roots) != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法打开不可变文件的根目录 %s: %s", config.roots, strerror(errno));
+        return 1;
+    }
+    
+    // 设置信号处理(不使用SA_RESTART，使epoll_wait被信号中断)
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    
+    // 创建socket
+    server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_fd == -1) {
+        slog(SLOG_ERROR, LOG_ERR, "无法创建socket: %s", strerror(errno));
+        return 1;
+    }
+    
+    // 准备地址
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sun_family = AF_UNIX;
+    strncpy(server_addr.sun_path, config.socket_path, sizeof(server_addr.sun_path) - 1);
+    
+    // 删除可能存在的旧socket文件
+    unlink(config.socket_path);
+    
+    // 绑定地址
+    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
+        slog(SLOG_ERROR, LOG_ERR, "无法绑定socket: %s", strerror(errno));
+        close(server_fd);
+        return 1;
+    }
+    
+    // 设置socket权限
+    chmod(config.socket_path, 0600);
+    
+    // 监听连接
+    if (listen(server_fd, config.backlog) == -1) {
+        slog(SLOG_ERROR, LOG_ERR, "无法监听socket: %s", strerror(errno));
+        close(server_fd);
+        unlink(config.socket_path);
+        return 1;
+    }
+    
+    // 确保元数据目录存在
+    ensure_directory_exists(config.metadata_dir);
+    
+    // 计算不可变文件的SELinux上下文
+    if (selinux_label_init(config.file_context) != 0) {
+        close(server_fd);
+        unlink(config.socket_path);
+        return 1;
+    }
+    
+    // 检查io_uring，不可用时(包括指定了uring的情况)使用普通系统调用
+    if (strcmp(config.io_backend, "posix") != 0 && uring_io_init() != 0 &&
+        strcmp(config.io_backend, "uring") == 0) {
+        slog(SLOG_ERROR, LOG_WARNING, "指定了io_uring，但当前内核无法使用，改用普通系统调用");
+    }
+    
+    // 加载保留表
+    retention_store_set_durable(strcmp(config.retention_sync, "on") == 0);
+    if (open_retention_store() != 0 ||
+        retention_store_start_compactor(config.compact_interval) != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法初始化保留表");
+        close(server_fd);
+        unlink(config.socket_path);
+        return 1;
+    }
+    
+    // 共享内存保留表，发布失败时客户端使用socket查询
+    if (strcmp(config.retention_shm, "off") != 0 && retention_store_publish(config.retention_shm) != 0) {
+        slog(SLOG_ERROR, LOG_WARNING, "无法发布共享内存保留表 %s: %s", config.retention_shm,
+             strerror(errno));
+    }
+    
+    // 内容去重的内容库
+    if (strcmp(config.dedup, "on") == 0) {
+        char dedup_dir[MAX_PATH_LEN];
+        snprintf(dedup_dir, sizeof(dedup_dir), "%s/%s", config.metadata_dir, DEDUP_DIR_NAME);
+        if (dedup_store_init(dedup_dir) != 0 ||
+            dedup_store_start_collector(config.compact_interval) != 0) {
+            slog(SLOG_ERROR, LOG_ERR, "无法初始化内容库 %s: %s", dedup_dir, strerror(errno));
+            close(server_fd);
+            unlink(config.socket_path);
+            return 1;
+        }
+    }
+    
+    // 启动工作线程池
+    path_locks_init();
+    for (int i = 0; i < config.workers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_thread, NULL) != 0) {
+            slog(SLOG_ERROR, LOG_ERR, "无法创建工作线程: %s", strerror(errno));
+            close(server_fd);
+            unlink(config.socket_path);
+            return 1;
+        }
+        pthread_detach(tid);
+    }
+    
+    // 启动处理目录树的后台线程池
+    if (task_pool_start(config.tree_workers) != 0) {
+        close(server_fd);
+        unlink(config.socket_path);
+        return 1;
+    }
+    
+    // 启动到期清理线程
+    if (strcmp(config.purge_mode, "off") != 0) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, purge_thread, NULL) != 0) {
+            slog(SLOG_ERROR, LOG_ERR, "无法创建到期清理线程: %s", strerror(errno));
+            close(server_fd);
+            unlink(config.socket_path);
+            return 1;
+        }
+        pthread_detach(tid);
+        slog(SLOG_INFO, LOG_NOTICE, "到期清理已启用(%s)，每秒最多 %d 个文件，到期队列中有 %zu 条记录",
+               config.purge_mode, config.purge_rate, retention_store_expiry_pending());
+    }
+    
+    // 启动写出统计文件的线程
+    if (config.metrics_interval > 0) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, metrics_thread, NULL) != 0) {
+            slog(SLOG_ERROR, LOG_ERR, "无法创建统计线程: %s", strerror(errno));
+            close(server_fd);
+            unlink(config.socket_path);
+            return 1;
+        }
+        pthread_detach(tid);
+    }
+    
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd == -1 || wake_fd == -1) {
+        slog(SLOG_ERROR, LOG_ERR, "无法创建epoll: %s", strerror(errno));
+        close(server_fd);
+        unlink(config.socket_path);
+        return 1;
+    }
+    
+    // data.ptr为NULL表示监听socket，&wake_fd表示有会话交还，其余为client_conn
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    struct epoll_event wake_ev = { .events = EPOLLIN, .data.ptr = &wake_fd };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) == -1 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &wake_ev) == -1) {
+        slog(SLOG_ERROR, LOG_ERR, "无法监听socket事件: %s", strerror(errno));
+        close(epoll_fd);
+        close(server_fd);
+        unlink(config.socket_path);
+        return 1;
+    }
+    
+    slog(SLOG_INFO, LOG_NOTICE, "等待连接在 %s (工作线程 %d 个)", config.socket_path, config.workers);
+    
+    // 主循环：接收请求头，交给工作线程处理
+    struct epoll_event events[MAX_EVENTS];
+    while (!stop_signal) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            slog(SLOG_ERROR, LOG_ERR, "epoll_wait失败: %s", strerror(errno));
+            break;
+        }
+        
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_connections(epoll_fd);
+            } else if (events[i].data.ptr == &wake_fd) {
+                rearm_resumed_conns(epoll_fd);
+            } else {
+                read_request_header(epoll_fd, events[i].data.ptr);
+            }
+        }
+        
+        expire_pending_conns();
+    }
+    
+    if (stop_signal) {
+        slog(SLOG_INFO, LOG_NOTICE, "接收到信号 %d，关闭服务", (int)stop_signal);
+    }
+    
+    // 清理
+    close(wake_fd);
+    close(epoll_fd);
+    close(server_fd);
+    unlink(config.socket_path);
+    retention_store_unpublish();
+    slog_stop();
+    closelog();
+    
+    return 0;
+}
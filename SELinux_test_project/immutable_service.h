@@ -0,0 +1,88 @@
+#ifndef IMMUTABLE_SERVICE_H
+#define IMMUTABLE_SERVICE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "immutable_protocol.h"
+
+// 服务内部各模块共用的定义
+
+#define METADATA_DIR "/var/lib/immutable_service"  // 默认的元数据目录，可用--metadata-dir修改
+#define RETENTION_FILE_NAME "retention.db"   // 上次合并后的保留记录(日志)
+#define RETENTION_INDEX_NAME "retention.idx" // 合并后的二进制保留索引，启动时直接映射
+#define METRICS_FILE_NAME "metrics.prom"  // --metrics-interval写出的统计文件
+#define DEDUP_DIR_NAME "blobs"            // --dedup的内容库目录
+
+/**
+ * 计算路径的哈希值(FNV-1a)
+ * 
+ * @param path 文件路径
+ * @return 64位哈希值
+ */
+uint64_t hash_path(const char *path);
+
+/**
+ * 在路径所在目录的描述符上fstatat，所在目录经由目录缓存打开，设置了根目录时不会离开根目录
+ * 
+ * @param path 路径
+ * @param st 输出属性
+ * @param flags fstatat的标志，如AT_SYMLINK_NOFOLLOW
+ * @return 成功返回 0，失败返回 -1
+ */
+int stat_path(const char *path, struct stat *st, int flags);
+
+/**
+ * 在路径所在目录的描述符上unlinkat，所在目录经由目录缓存打开
+ * 
+ * @param path 文件路径
+ * @return 成功返回 0，失败返回 -1
+ */
+int unlink_path(const char *path);
+
+/**
+ * 在路径所在目录的描述符上openat，最后一级不跟随符号链接
+ * 
+ * 所在目录经由目录缓存打开，中间的各级和最后一级一样不会经由符号链接离开根目录。
+ * 
+ * @param path 路径
+ * @param flags open的标志，总是加上O_NOFOLLOW和O_CLOEXEC
+ * @return 成功返回文件描述符，失败返回 -1
+ */
+int open_path(const char *path, int flags);
+
+/**
+ * 在目标文件所在目录创建临时文件，新文件直接带有不可变上下文
+ * 
+ * @param path 目标文件路径
+ * @param tmp_path 输出临时文件路径
+ * @param tmp_len tmp_path缓冲区长度
+ * @return 成功返回文件描述符，失败返回 -1
+ */
+int create_temp_file(const char *path, char *tmp_path, size_t tmp_len);
+
+/**
+ * 将临时文件落盘后原子地替换目标文件
+ * 
+ * 无论成功与否都会关闭fd，失败时删除临时文件。
+ * 
+ * @param fd 临时文件描述符
+ * @param tmp_path 临时文件路径
+ * @param path 目标文件路径
+ * @return 成功返回 0，失败返回 -1
+ */
+int commit_temp_file(int fd, const char *tmp_path, const char *path);
+
+/**
+ * 检查文件是否被标记为只能追加(CMD_APPEND的APPEND_FLAG_APPEND_ONLY)
+ * 
+ * 只能追加的文件不能被整个替换或覆盖已有的内容，删除仍只受保留期限限制。
+ * 是时记录审计日志并将errno设为EPERM。
+ * 
+ * @param path 文件路径
+ * @return 只能追加返回 1，否则返回 0
+ */
+int file_append_only(const char *path);
+
+#endif /* IMMUTABLE_SERVICE_H */
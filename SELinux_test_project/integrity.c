@@ -0,0 +1,519 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "integrity.h"
+#include "task_pool.h"
+#include "service_log.h"
+
+#define CRC32C_POLY 0x82f63b78       // 反转表示的Castagnoli多项式
+#define CRC_LONG 8192                // 三路交错时每路的长度
+#define CRC_SHORT 256                // 剩余不足三个CRC_LONG时每路的长度
+#define HASH_BUFFER_SIZE (256 * 1024)
+#define DENTS_BUF_SIZE (32 * 1024)
+#define VERIFY_INLINE_DEPTH 32       // 当前线程连续深入的层数上限，更深的目录总是交给线程池
+#define VERIFY_RETRIES 3             // 校验期间文件被就地写入时重新校验的次数
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static int record_enabled = 1;
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+static uint32_t crc_table[8][256];   // 查表实现，每次处理8字节
+#if defined(__x86_64__)
+static int have_sse42;
+static uint32_t crc_long[4][256];    // 把CRC移过CRC_LONG个零字节
+static uint32_t crc_short[4][256];   // 把CRC移过CRC_SHORT个零字节
+#endif
+
+void integrity_set_enabled(int enabled) {
+    record_enabled = enabled;
+}
+
+#if defined(__x86_64__)
+// GF(2)上32x32矩阵乘向量，矩阵按列存放
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, mat++) {
+        if (vec & 1) {
+            sum ^= *mat;
+        }
+    }
+    return sum;
+}
+
+static void gf2_square(uint32_t *square, const uint32_t *mat) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2_times(mat, mat[n]);
+    }
+}
+
+// 生成把CRC移过len(2的幂)个零字节的表，用于合并各路的结果
+static void crc_zeros_table(uint32_t zeros[4][256], size_t len) {
+    uint32_t odd[32], even[32];
+    odd[0] = CRC32C_POLY;            // 移过一个零位的算子
+    for (int n = 1; n < 32; n++) {
+        odd[n] = 1u << (n - 1);
+    }
+    gf2_square(even, odd);           // 两个零位
+    gf2_square(odd, even);           // 四个零位
+    uint32_t *op = odd;
+    for (;;) {
+        gf2_square(even, odd);       // 第一次为一个零字节
+        op = even;
+        len >>= 1;
+        if (len == 0) {
+            break;
+        }
+        gf2_square(odd, even);
+        op = odd;
+        len >>= 1;
+        if (len == 0) {
+            break;
+        }
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        zeros[0][n] = gf2_times(op, n);
+        zeros[1][n] = gf2_times(op, n << 8);
+        zeros[2][n] = gf2_times(op, n << 16);
+        zeros[3][n] = gf2_times(op, n << 24);
+    }
+}
+
+static inline uint32_t crc_shift(uint32_t zeros[4][256], uint32_t crc) {
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+           zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+#endif
+
+static void tables_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc_table[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = crc_table[0][n];
+        for (int k = 1; k < 8; k++) {
+            c = crc_table[0][c & 0xff] ^ (c >> 8);
+            crc_table[k][n] = c;
+        }
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    have_sse42 = __builtin_cpu_supports("sse4.2");
+    if (have_sse42) {
+        crc_zeros_table(crc_long, CRC_LONG);
+        crc_zeros_table(crc_short, CRC_SHORT);
+    }
+#endif
+}
+
+static inline uint64_t load64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// 查表实现(slicing-by-8)，crc为取反后的中间值
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    for (; len && ((uintptr_t)p & 7); len--) {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t v = load64(p) ^ crc;
+        crc = crc_table[7][v & 0xff] ^ crc_table[6][(v >> 8) & 0xff] ^
+              crc_table[5][(v >> 16) & 0xff] ^ crc_table[4][(v >> 24) & 0xff] ^
+              crc_table[3][(v >> 32) & 0xff] ^ crc_table[2][(v >> 40) & 0xff] ^
+              crc_table[1][(v >> 48) & 0xff] ^ crc_table[0][v >> 56];
+    }
+    for (; len; len--) {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// 三路交错的crc32指令：指令延迟为3个周期，三个互不依赖的CRC可以同时计算，
+// 每段结束后用移位表把前一路的结果移到后一路之前再合并
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t crc0 = crc;
+    for (; len && ((uintptr_t)p & 7); len--) {
+        crc0 = _mm_crc32_u8(crc0, *p++);
+    }
+    while (len >= CRC_LONG * 3) {
+        uint64_t crc1 = 0, crc2 = 0;
+        const unsigned char *end = p + CRC_LONG;
+        do {
+            crc0 = _mm_crc32_u64(crc0, load64(p));
+            crc1 = _mm_crc32_u64(crc1, load64(p + CRC_LONG));
+            crc2 = _mm_crc32_u64(crc2, load64(p + CRC_LONG * 2));
+            p += 8;
+        } while (p < end);
+        crc0 = crc_shift(crc_long, crc0) ^ crc1;
+        crc0 = crc_shift(crc_long, crc0) ^ crc2;
+        p += CRC_LONG * 2;
+        len -= CRC_LONG * 3;
+    }
+    while (len >= CRC_SHORT * 3) {
+        uint64_t crc1 = 0, crc2 = 0;
+        const unsigned char *end = p + CRC_SHORT;
+        do {
+            crc0 = _mm_crc32_u64(crc0, load64(p));
+            crc1 = _mm_crc32_u64(crc1, load64(p + CRC_SHORT));
+            crc2 = _mm_crc32_u64(crc2, load64(p + CRC_SHORT * 2));
+            p += 8;
+        } while (p < end);
+        crc0 = crc_shift(crc_short, crc0) ^ crc1;
+        crc0 = crc_shift(crc_short, crc0) ^ crc2;
+        p += CRC_SHORT * 2;
+        len -= CRC_SHORT * 3;
+    }
+    for (; len >= 8; len -= 8, p += 8) {
+        crc0 = _mm_crc32_u64(crc0, load64(p));
+    }
+    for (; len; len--) {
+        crc0 = _mm_crc32_u8(crc0, *p++);
+    }
+    return (uint32_t)crc0;
+}
+#endif
+
+uint32_t integrity_crc32c(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&tables_once, tables_init);
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (have_sse42) {
+        return ~crc32c_hw(crc, data, len);
+    }
+#endif
+    return ~crc32c_sw(crc, data, len);
+}
+
+int integrity_hash_fd(int fd, uint64_t offset, uint32_t *crc, uint64_t *size) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    // 小文件只分配文件大小的缓冲区；文件在读取期间变长时分多次读完
+    uint64_t remaining = (uint64_t)st.st_size > offset ? st.st_size - offset : 0;
+    size_t cap = remaining < HASH_BUFFER_SIZE ? (remaining > 4096 ? remaining : 4096) : HASH_BUFFER_SIZE;
+    unsigned char *buf = malloc(cap);
+    if (!buf) {
+        return -1;
+    }
+    posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+
+    uint32_t c = *crc;
+    for (;;) {
+        ssize_t n = pread(fd, buf, cap, offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            int err = errno;
+            free(buf);
+            errno = err;
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        c = integrity_crc32c(c, buf, n);
+        offset += n;
+    }
+    free(buf);
+    *crc = c;
+    *size = offset;
+    return 0;
+}
+
+int integrity_get(int fd, integrity_record *rec) {
+    return fgetxattr(fd, INTEGRITY_XATTR, rec, sizeof(*rec)) == (ssize_t)sizeof(*rec);
+}
+
+static void record_set(int fd, uint32_t crc, uint64_t size, const char *path) {
+    integrity_record rec = { .crc = crc, .size = size };
+    if (fsetxattr(fd, INTEGRITY_XATTR, &rec, sizeof(rec), 0) != 0) {
+        // 不支持扩展属性的文件系统上每次写入都会失败，只在调试级别记录
+        slog(SLOG_ERROR, errno == EOPNOTSUPP ? LOG_DEBUG : LOG_WARNING,
+             "无法记录 %s 的校验和: %s", path, strerror(errno));
+    }
+}
+
+void integrity_record_fd(int fd, const char *path) {
+    if (!record_enabled) {
+        return;
+    }
+    uint32_t crc = 0;
+    uint64_t size;
+    if (integrity_hash_fd(fd, 0, &crc, &size) != 0) {
+        slog(SLOG_ERROR, LOG_WARNING, "无法计算 %s 的校验和: %s", path, strerror(errno));
+        return;
+    }
+    record_set(fd, crc, size, path);
+}
+
+void integrity_record_data(int fd, const void *data, size_t len, const char *path) {
+    if (record_enabled) {
+        record_set(fd, integrity_crc32c(0, data, len), len, path);
+    }
+}
+
+void integrity_update_fd(int fd, uint64_t old_size, int appended, const char *path) {
+    if (!record_enabled) {
+        fremovexattr(fd, INTEGRITY_XATTR);
+        return;
+    }
+    integrity_record rec;
+    uint32_t crc = 0;
+    uint64_t offset = 0;
+    if (appended && integrity_get(fd, &rec) && rec.size == old_size) {
+        crc = rec.crc;
+        offset = old_size;
+    }
+    uint64_t size;
+    if (integrity_hash_fd(fd, offset, &crc, &size) != 0) {
+        slog(SLOG_ERROR, LOG_WARNING, "无法计算 %s 的校验和: %s", path, strerror(errno));
+        fremovexattr(fd, INTEGRITY_XATTR);
+        return;
+    }
+    record_set(fd, crc, size, path);
+}
+
+// 一次校验的共享状态
+typedef struct {
+    integrity_stats stats;
+    int error;                  // 第一个失败的errno
+    int pending;                // 尚未完成的任务数(包括调用者自己)
+    int done;
+    pthread_mutex_t mutex;
+    pthread_cond_t done_cond;
+} verify_job;
+
+// 交给线程池的一项：已打开的文件或目录
+typedef struct {
+    verify_job *job;
+    int fd;
+    int is_dir;
+    char *path;
+} verify_task;
+
+static void verify_dir(verify_job *job, int fd, const char *path, int depth);
+
+static void job_fail(verify_job *job, const char *path, int err) {
+    slog(SLOG_ERROR, LOG_ERR, "无法校验 %s: %s", path, strerror(err));
+    __atomic_add_fetch(&job->stats.failed, 1, __ATOMIC_RELAXED);
+    int expected = 0;
+    __atomic_compare_exchange_n(&job->error, &expected, err, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static void job_release(verify_job *job) {
+    if (__atomic_sub_fetch(&job->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&job->mutex);
+        job->done = 1;
+        pthread_cond_broadcast(&job->done_cond);
+        pthread_mutex_unlock(&job->mutex);
+    }
+}
+
+// 校验一个已打开的普通文件，关闭fd
+static void verify_file(verify_job *job, int fd, const char *path) {
+    integrity_record rec;
+    int attempt = 0;
+    for (;;) {
+        if (!integrity_get(fd, &rec)) {
+            __atomic_add_fetch(&job->stats.unrecorded, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        uint32_t crc = 0;
+        uint64_t size;
+        if (integrity_hash_fd(fd, 0, &crc, &size) != 0) {
+            job_fail(job, path, errno);
+            break;
+        }
+        __atomic_add_fetch(&job->stats.bytes, size, __ATOMIC_RELAXED);
+        if (crc == rec.crc && size == rec.size) {
+            __atomic_add_fetch(&job->stats.verified, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        // 追加和覆盖写入在写完内容之后才更新记录，记录在校验期间变化时重新校验
+        integrity_record now;
+        if (++attempt < VERIFY_RETRIES && integrity_get(fd, &now) &&
+            memcmp(&now, &rec, sizeof(now)) != 0) {
+            continue;
+        }
+        slog(SLOG_AUDIT, LOG_WARNING, "文件内容与记录的校验和不一致: %s (长度 %lu/%lu, CRC32C %08x/%08x)",
+             path, (unsigned long)size, (unsigned long)rec.size, crc, rec.crc);
+        __atomic_add_fetch(&job->stats.mismatched, 1, __ATOMIC_RELAXED);
+        break;
+    }
+    close(fd);
+}
+
+static void verify_task_run(void *arg) {
+    verify_task *task = arg;
+    if (task->is_dir) {
+        verify_dir(task->job, task->fd, task->path, 0);
+    } else {
+        verify_file(task->job, task->fd, task->path);
+    }
+    verify_job *job = task->job;
+    free(task->path);
+    free(task);
+    job_release(job);
+}
+
+// 处理已打开的一项：线程池有空闲线程(或目录已深入太多层)时交给线程池，否则直接处理
+static void verify_spawn(verify_job *job, int fd, int is_dir, const char *path, int depth) {
+    if (task_pool_hungry() || (is_dir && depth >= VERIFY_INLINE_DEPTH)) {
+        verify_task *task = malloc(sizeof(*task));
+        char *copy = strdup(path);
+        if (task && copy) {
+            *task = (verify_task){ .job = job, .fd = fd, .is_dir = is_dir, .path = copy };
+            __atomic_add_fetch(&job->pending, 1, __ATOMIC_RELAXED);
+            if (task_pool_submit(verify_task_run, task) == 0) {
+                return;
+            }
+            __atomic_sub_fetch(&job->pending, 1, __ATOMIC_RELAXED);
+        }
+        free(task);
+        free(copy);
+    }
+    if (is_dir) {
+        verify_dir(job, fd, path, depth + 1);
+    } else {
+        verify_file(job, fd, path);
+    }
+}
+
+// 列出已打开的目录，打开其中的普通文件和子目录逐个处理，关闭fd
+static void verify_dir(verify_job *job, int fd, const char *path, int depth) {
+    size_t path_len = strlen(path);
+    char *buf = malloc(DENTS_BUF_SIZE);
+    char *child = malloc(path_len + NAME_MAX + 2);
+    if (!buf || !child) {
+        job_fail(job, path, ENOMEM);
+        goto out;
+    }
+    memcpy(child, path, path_len);
+    child[path_len] = '/';
+
+    for (;;) {
+        long n = syscall(SYS_getdents64, fd, buf, DENTS_BUF_SIZE);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            job_fail(job, path, errno);
+            break;
+        }
+
+        for (long off = 0; off < n; ) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + off);
+            off += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            unsigned char type = d->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                    continue;
+                }
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type != DT_REG && type != DT_DIR) {
+                continue;  // 符号链接、设备等不检查
+            }
+            memcpy(child + path_len + 1, name, strlen(name) + 1);
+
+            // 列出之后可能被换成了符号链接，O_NOFOLLOW使其打开失败(ELOOP)
+            int child_fd = openat(fd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+            struct stat st;
+            if (child_fd == -1) {
+                if (errno != ENOENT && errno != ELOOP) {
+                    job_fail(job, child, errno);
+                }
+                continue;
+            }
+            if (fstat(child_fd, &st) != 0 || (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))) {
+                close(child_fd);
+                continue;
+            }
+            verify_spawn(job, child_fd, S_ISDIR(st.st_mode), child, depth);
+        }
+    }
+
+out:
+    free(buf);
+    free(child);
+    close(fd);
+}
+
+int integrity_verify(const char *path, integrity_stats *stats) {
+    verify_job job = { .pending = 1 };
+    pthread_mutex_init(&job.mutex, NULL);
+    pthread_cond_init(&job.done_cond, NULL);
+
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        job_fail(&job, path, errno);
+        if (fd != -1) {
+            close(fd);
+        }
+    } else if (S_ISDIR(st.st_mode)) {
+        verify_dir(&job, fd, path, 0);
+    } else if (S_ISREG(st.st_mode)) {
+        verify_file(&job, fd, path);
+    } else {
+        job_fail(&job, path, EINVAL);
+        close(fd);
+    }
+
+    // 当前线程处理完自己的部分后，等待线程池中的任务完成
+    job_release(&job);
+    pthread_mutex_lock(&job.mutex);
+    while (!job.done) {
+        pthread_cond_wait(&job.done_cond, &job.mutex);
+    }
+    pthread_mutex_unlock(&job.mutex);
+    pthread_cond_destroy(&job.done_cond);
+    pthread_mutex_destroy(&job.mutex);
+
+    *stats = job.stats;
+    if (job.stats.failed > 0) {
+        errno = job.error;
+        return -1;
+    }
+    if (job.stats.mismatched > 0) {
+        errno = EBADMSG;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,111 @@
+#ifndef INTEGRITY_H
+#define INTEGRITY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 内容校验和：服务写入不可变文件时计算整个文件的CRC32C，与文件长度一起记录在文件的
+// 扩展属性中，CMD_VERIFY据此检查文件是否在服务之外被改动。CPU支持SSE4.2时使用crc32指令，
+// 三路交错计算；否则使用查表实现。
+
+#define INTEGRITY_XATTR "trusted.immutable.crc32c"
+
+// 扩展属性中的记录(本机字节序)
+typedef struct {
+    uint32_t crc;        // 整个文件的CRC32C
+    uint32_t reserved;
+    uint64_t size;       // 记录时的文件长度
+} integrity_record;
+
+// 一次校验的统计
+typedef struct {
+    uint64_t verified;   // 内容与记录一致的文件
+    uint64_t mismatched; // 内容或长度与记录不一致的文件
+    uint64_t unrecorded; // 没有记录的文件(启用之前写入的，或不是由服务写入的)
+    uint64_t failed;     // 无法打开或读取的项
+    uint64_t bytes;      // 读取的字节数
+} integrity_stats;
+
+/**
+ * 设置是否在写入文件时记录校验和，默认记录
+ *
+ * 不记录时就地写入的文件删除已有的记录，避免记录与内容不一致。
+ *
+ * @param enabled 0为不记录
+ */
+void integrity_set_enabled(int enabled);
+
+/**
+ * 计算CRC32C(Castagnoli)
+ *
+ * @param crc 之前部分的结果，从头开始时为0
+ * @param data 数据
+ * @param len 数据长度
+ * @return 包含data在内的CRC32C
+ */
+uint32_t integrity_crc32c(uint32_t crc, const void *data, size_t len);
+
+/**
+ * 从offset开始读到文件末尾，接着crc计算CRC32C
+ *
+ * @param fd 可读的文件描述符，不改变其文件偏移
+ * @param offset 开始读取的位置
+ * @param crc 输入之前部分的结果，输出包含读到的内容在内的结果
+ * @param size 输出文件长度(offset加上读到的字节数)
+ * @return 成功返回 0，失败返回 -1
+ */
+int integrity_hash_fd(int fd, uint64_t offset, uint32_t *crc, uint64_t *size);
+
+/**
+ * 读取文件的校验和记录
+ *
+ * @param fd 文件描述符
+ * @param rec 输出记录
+ * @return 有记录返回 1，否则返回 0
+ */
+int integrity_get(int fd, integrity_record *rec);
+
+/**
+ * 计算整个文件的校验和并记录，用于替换目标文件之前的临时文件
+ *
+ * 失败时只记录日志，文件照常使用，校验时算作没有记录。
+ *
+ * @param fd 可读的文件描述符
+ * @param path 文件路径，用于日志
+ */
+void integrity_record_fd(int fd, const char *path);
+
+/**
+ * 记录内容已在内存中的文件的校验和，不读取文件
+ *
+ * @param fd 文件描述符
+ * @param data 文件的全部内容
+ * @param len 内容长度
+ * @param path 文件路径，用于日志
+ */
+void integrity_record_data(int fd, const void *data, size_t len, const char *path);
+
+/**
+ * 就地写入之后更新记录：记录与原长度一致时只计算追加的部分，否则重新计算整个文件
+ *
+ * @param fd 可读的文件描述符
+ * @param old_size 写入前的文件长度
+ * @param appended 是否只在old_size之后写入
+ * @param path 文件路径，用于日志
+ */
+void integrity_update_fd(int fd, uint64_t old_size, int appended, const char *path);
+
+/**
+ * 检查文件或整个目录树的内容是否与记录一致
+ *
+ * 目录由后台任务线程池(task_pool)并行遍历，不跟随符号链接，只检查普通文件。
+ * 不一致的文件记录审计日志。
+ *
+ * @param path 文件或目录路径
+ * @param stats 输出统计信息
+ * @return 都一致(或没有记录)返回 0；有不一致的文件时返回 -1，errno为EBADMSG；
+ *         有无法读取的项时返回 -1，errno为第一个失败的原因
+ */
+int integrity_verify(const char *path, integrity_stats *stats);
+
+#endif /* INTEGRITY_H */
@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "metrics.h"
+#include "service_log.h"
+
+// 每个线程的计数区，按缓存行对齐，避免不同线程的计数互相干扰
+typedef struct metrics_slot {
+    stats_command commands[STATS_COMMANDS];
+    uint64_t counters[METRIC_COUNTERS];
+    int shared;                  // 多个线程共用(分配失败时)，需要原子加
+    struct metrics_slot *next;
+} __attribute__((aligned(64))) metrics_slot;
+
+static metrics_slot *slots = NULL;          // 所有线程的计数区，只增加不释放
+static metrics_slot shared_slot = { .shared = 1 };
+static int shared_slot_listed = 0;
+static __thread metrics_slot *thread_slot = NULL;
+
+static const char *command_names[STATS_COMMANDS] = {
+    [0] = "unknown",
+    [CMD_MODIFY] = "modify",
+    [CMD_DELETE] = "delete",
+    [CMD_RSYNC] = "rsync",
+    [CMD_SET_RETENTION] = "set_retention",
+    [CMD_GET_RETENTION] = "get_retention",
+    [CMD_INGEST_FD] = "ingest_fd",
+    [CMD_BATCH] = "batch",
+    [CMD_STATS] = "stats",
+    [CMD_APPEND] = "append",
+    [CMD_PWRITE] = "pwrite",
+    [CMD_VERIFY] = "verify",
+};
+
+static void slot_push(metrics_slot *slot) {
+    slot->next = __atomic_load_n(&slots, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&slots, &slot->next, slot, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+}
+
+// 取得当前线程的计数区，第一次使用时分配
+static metrics_slot *slot_get(void) {
+    if (thread_slot) {
+        return thread_slot;
+    }
+    metrics_slot *slot;
+    if (posix_memalign((void **)&slot, 64, sizeof(*slot)) != 0) {
+        slog(SLOG_ERROR, LOG_WARNING, "无法为线程分配统计计数区，使用共用的计数区");
+        thread_slot = &shared_slot;
+        if (!__atomic_exchange_n(&shared_slot_listed, 1, __ATOMIC_RELAXED)) {
+            slot_push(&shared_slot);
+        }
+        return thread_slot;
+    }
+    memset(slot, 0, sizeof(*slot));
+    slot_push(slot);
+    thread_slot = slot;
+    return slot;
+}
+
+// 只有所属线程写入：普通的读和写即可，用原子访问使读取方不会读到撕裂的值
+static inline void slot_add(const metrics_slot *slot, uint64_t *value, uint64_t n) {
+    if (slot->shared) {
+        __atomic_add_fetch(value, n, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+    }
+}
+
+// 耗时所在的桶：小于2^i微秒的第一个i
+static inline unsigned int latency_bucket(uint64_t latency_us) {
+    unsigned int bucket = latency_us == 0 ? 0 : 64 - __builtin_clzll(latency_us);
+    return bucket < STATS_LATENCY_BUCKETS ? bucket : STATS_LATENCY_BUCKETS - 1;
+}
+
+void metrics_request(unsigned int cmd, int failed, uint64_t latency_us) {
+    metrics_slot *slot = slot_get();
+    stats_command *c = &slot->commands[cmd < STATS_COMMANDS ? cmd : 0];
+    slot_add(slot, &c->count, 1);
+    if (failed) {
+        slot_add(slot, &c->errors, 1);
+    }
+    slot_add(slot, &c->latency_sum_us, latency_us);
+    slot_add(slot, &c->latency_buckets[latency_bucket(latency_us)], 1);
+}
+
+void metrics_add(metric_counter counter, uint64_t value) {
+    metrics_slot *slot = slot_get();
+    slot_add(slot, &slot->counters[counter], value);
+}
+
+void metrics_collect(stats_command *commands, uint64_t *counters) {
+    memset(commands, 0, STATS_COMMANDS * sizeof(stats_command));
+    memset(counters, 0, METRIC_COUNTERS * sizeof(uint64_t));
+    for (metrics_slot *slot = __atomic_load_n(&slots, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+        for (int i = 0; i < STATS_COMMANDS; i++) {
+            const stats_command *c = &slot->commands[i];
+            commands[i].count += __atomic_load_n(&c->count, __ATOMIC_RELAXED);
+            commands[i].errors += __atomic_load_n(&c->errors, __ATOMIC_RELAXED);
+            commands[i].latency_sum_us += __atomic_load_n(&c->latency_sum_us, __ATOMIC_RELAXED);
+            for (int b = 0; b < STATS_LATENCY_BUCKETS; b++) {
+                commands[i].latency_buckets[b] +=
+                    __atomic_load_n(&c->latency_buckets[b], __ATOMIC_RELAXED);
+            }
+        }
+        for (int i = 0; i < METRIC_COUNTERS; i++) {
+            counters[i] += __atomic_load_n(&slot->counters[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// 输出标签值，转义反斜杠、引号和换行
+static void write_label(FILE *fp, const char *value) {
+    for (const char *p = value; *p; p++) {
+        if (*p == '\\' || *p == '"') {
+            fputc('\\', fp);
+            fputc(*p, fp);
+        } else if (*p == '\n') {
+            fputs("\\n", fp);
+        } else {
+            fputc(*p, fp);
+        }
+    }
+}
+
+int metrics_write_prometheus(const char *path, const reply_stats *head,
+                             const stats_command *commands,
+                             const sched_client_stats *clients, size_t client_count) {
+    char tmp_path[4096];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    FILE *fp = fopen(tmp_path, "we");
+    if (!fp) {
+        return -1;
+    }
+
+    fprintf(fp, "# HELP immutable_requests_total 处理完的请求数\n");
+    fprintf(fp, "# TYPE immutable_requests_total counter\n");
+    for (int i = 0; i < STATS_COMMANDS; i++) {
+        fprintf(fp, "immutable_requests_total{command=\"%s\"} %lu\n",
+                command_names[i], (unsigned long)commands[i].count);
+    }
+    fprintf(fp, "# HELP immutable_request_errors_total 失败的请求数\n");
+    fprintf(fp, "# TYPE immutable_request_errors_total counter\n");
+    for (int i = 0; i < STATS_COMMANDS; i++) {
+        fprintf(fp, "immutable_request_errors_total{command=\"%s\"} %lu\n",
+                command_names[i], (unsigned long)commands[i].errors);
+    }
+    fprintf(fp, "# HELP immutable_request_duration_seconds 从收齐请求头到发出回应的耗时\n");
+    fprintf(fp, "# TYPE immutable_request_duration_seconds histogram\n");
+    for (int i = 0; i < STATS_COMMANDS; i++) {
+        if (commands[i].count == 0) {
+            continue;
+        }
+        uint64_t cumulative = 0;
+        for (int b = 0; b < STATS_LATENCY_BUCKETS - 1; b++) {
+            cumulative += commands[i].latency_buckets[b];
+            fprintf(fp, "immutable_request_duration_seconds_bucket{command=\"%s\",le=\"%g\"} %lu\n",
+                    command_names[i], (double)(1UL << b) / 1e6, (unsigned long)cumulative);
+        }
+        fprintf(fp, "immutable_request_duration_seconds_bucket{command=\"%s\",le=\"+Inf\"} %lu\n",
+                command_names[i], (unsigned long)commands[i].count);
+        fprintf(fp, "immutable_request_duration_seconds_sum{command=\"%s\"} %.6f\n",
+                command_names[i], commands[i].latency_sum_us / 1e6);
+        fprintf(fp, "immutable_request_duration_seconds_count{command=\"%s\"} %lu\n",
+                command_names[i], (unsigned long)commands[i].count);
+    }
+
+    static const struct {
+        const char *name;
+        const char *type;
+        const char *help;
+        size_t offset;
+    } values[] = {
+        { "immutable_uptime_seconds", "gauge", "服务已运行的秒数", offsetof(reply_stats, uptime) },
+        { "immutable_bytes_written_total", "counter", "写入不可变文件的字节数",
+          offsetof(reply_stats, bytes_written) },
+        { "immutable_auth_failures_total", "counter", "认证失败的请求数",
+          offsetof(reply_stats, auth_failures) },
+        { "immutable_queue_depth", "gauge", "等待工作线程的请求数",
+          offsetof(reply_stats, queue_depth) },
+        { "immutable_active_connections", "gauge", "当前的连接数",
+          offsetof(reply_stats, active_connections) },
+        { "immutable_retention_entries", "gauge", "保留表中的路径数",
+          offsetof(reply_stats, retention_entries) },
+        { "immutable_log_dropped_total", "counter", "丢弃的日志数",
+          offsetof(reply_stats, log_dropped) },
+    };
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        uint64_t value;
+        memcpy(&value, (const char *)head + values[i].offset, sizeof(value));
+        fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n", values[i].name, values[i].help,
+                values[i].name, values[i].type, values[i].name, (unsigned long)value);
+    }
+
+    static const struct {
+        const char *name;
+        const char *type;
+        const char *help;
+        size_t offset;
+        size_t size;
+    } client_values[] = {
+        { "immutable_client_connections", "gauge", "客户端的连接数",
+          offsetof(sched_client_stats, connections), sizeof(uint32_t) },
+        { "immutable_client_queue_depth", "gauge", "客户端排队等待工作线程的请求数",
+          offsetof(sched_client_stats, queued), sizeof(uint32_t) },
+        { "immutable_client_running", "gauge", "客户端正在执行的请求数",
+          offsetof(sched_client_stats, running), sizeof(uint32_t) },
+        { "immutable_client_running_bytes", "gauge", "客户端正在执行的请求要写入的字节数",
+          offsetof(sched_client_stats, running_bytes), sizeof(uint64_t) },
+        { "immutable_client_parked_connections", "gauge", "因客户端未完成的请求达到上限而暂停接收的连接数",
+          offsetof(sched_client_stats, parked), sizeof(uint32_t) },
+        { "immutable_client_requests_total", "counter", "交给工作线程的请求数",
+          offsetof(sched_client_stats, served), sizeof(uint64_t) },
+        { "immutable_client_throttled_total", "counter", "因未完成的请求达到上限而暂停接收的次数",
+          offsetof(sched_client_stats, throttled), sizeof(uint64_t) },
+    };
+    for (size_t i = 0; i < sizeof(client_values) / sizeof(client_values[0]) && client_count > 0; i++) {
+        fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", client_values[i].name, client_values[i].help,
+                client_values[i].name, client_values[i].type);
+        for (size_t c = 0; c < client_count; c++) {
+            const char *field = (const char *)&clients[c] + client_values[i].offset;
+            uint64_t value;
+            if (client_values[i].size == sizeof(uint32_t)) {
+                uint32_t v32;
+                memcpy(&v32, field, sizeof(v32));
+                value = v32;
+            } else {
+                memcpy(&value, field, sizeof(value));
+            }
+            fprintf(fp, "%s{uid=\"%u\",context=\"", client_values[i].name, (unsigned int)clients[c].uid);
+            write_label(fp, clients[c].label);
+            fprintf(fp, "\"} %lu\n", (unsigned long)value);
+        }
+    }
+
+    if (fflush(fp) != 0 || ferror(fp)) {
+        int err = errno;
+        fclose(fp);
+        unlink(tmp_path);
+        errno = err;
+        return -1;
+    }
+    fclose(fp);
+    if (rename(tmp_path, path) != 0) {
+        int err = errno;
+        unlink(tmp_path);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,62 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#include "immutable_protocol.h"
+#include "client_sched.h"
+
+// 只增不减的计数器
+typedef enum {
+    METRIC_BYTES_WRITTEN = 0,   // 写入不可变文件的字节数
+    METRIC_AUTH_FAILURES,       // 认证失败的请求数
+    METRIC_CONN_OPENED,         // 接受的连接数
+    METRIC_CONN_CLOSED,         // 关闭的连接数
+    METRIC_COUNTERS
+} metric_counter;
+
+/**
+ * 记录一个处理完的请求
+ *
+ * 每个线程第一次调用时分配自己的计数区，之后只写自己的计数区，不加锁也不使用
+ * 带锁前缀的原子操作；读取时把所有线程的计数相加。
+ *
+ * @param cmd 命令号，超出范围的记为未知命令(下标0)
+ * @param failed 请求是否失败
+ * @param latency_us 耗时(微秒)
+ */
+void metrics_request(unsigned int cmd, int failed, uint64_t latency_us);
+
+/**
+ * 增加一个计数器
+ *
+ * @param counter 计数器
+ * @param value 增加的值
+ */
+void metrics_add(metric_counter counter, uint64_t value);
+
+/**
+ * 汇总所有线程的计数
+ *
+ * 各线程可能正在更新，读到的是各计数在读取时刻的值，不同计数之间不保证一致。
+ *
+ * @param commands 输出STATS_COMMANDS个按命令号排列的统计
+ * @param counters 输出METRIC_COUNTERS个计数器的值
+ */
+void metrics_collect(stats_command *commands, uint64_t *counters);
+
+/**
+ * 以Prometheus文本格式写出统计，先写临时文件再改名，读取方不会看到写了一半的文件
+ *
+ * @param path 输出文件路径
+ * @param head 服务的状态(uptime等)
+ * @param commands STATS_COMMANDS个按命令号排列的统计
+ * @param clients 各客户端的调度状态，按uid和SELinux上下文输出
+ * @param client_count clients的个数
+ * @return 成功返回 0，失败返回 -1
+ */
+int metrics_write_prometheus(const char *path, const reply_stats *head,
+                             const stats_command *commands,
+                             const sched_client_stats *clients, size_t client_count);
+
+#endif /* METRICS_H */
@@ -0,0 +1,204 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "immutable_protocol.h"
+#include "retention_shm.h"
+
+#define SHM_MIN_SLOTS 1024
+#define SHM_MIN_ARENA (1 << 20)
+
+typedef struct {
+    char *map;
+    size_t size;
+    retention_shm_header *head;
+    retention_shm_slot *slots;
+    char *arena;
+    uint64_t mask;
+    uint64_t used;           // 已占用的槽位，包括已删除的路径
+    uint64_t arena_used;
+} shm_table;
+
+static shm_table current;    // 已发布的表
+static shm_table building;   // 正在建立、尚未改名的表
+static char shm_path[MAX_PATH_LEN];
+static char tmp_path[MAX_PATH_LEN + 8];
+
+static void table_unmap(shm_table *t) {
+    if (t->map) {
+        munmap(t->map, t->size);
+    }
+    memset(t, 0, sizeof(*t));
+}
+
+int retention_shm_begin(const char *path, size_t entries, size_t path_bytes) {
+    if (snprintf(shm_path, sizeof(shm_path), "%s", path) >= (int)sizeof(shm_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    retention_shm_abort();
+
+    uint64_t slot_count = SHM_MIN_SLOTS;
+    while (slot_count < entries * 2) {
+        slot_count *= 2;
+    }
+    uint64_t slots_offset = (sizeof(retention_shm_header) + 63) & ~(uint64_t)63;
+    uint64_t arena_offset = slots_offset + slot_count * sizeof(retention_shm_slot);
+    uint64_t arena_size = path_bytes * 2 + SHM_MIN_ARENA;
+    size_t size = arena_offset + arena_size;
+
+    // 表中只有保留期限，允许所有用户读取
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    char *map = MAP_FAILED;
+    if (fchmod(fd, 0644) == 0 && ftruncate(fd, size) == 0) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    int err = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        unlink(tmp_path);
+        errno = err;
+        return -1;
+    }
+
+    building.map = map;
+    building.size = size;
+    building.head = (retention_shm_header *)map;
+    building.slots = (retention_shm_slot *)(map + slots_offset);
+    building.arena = map + arena_offset;
+    building.mask = slot_count - 1;
+    building.head->magic = RETENTION_SHM_MAGIC;
+    building.head->version = RETENTION_SHM_VERSION;
+    building.head->slot_count = slot_count;
+    building.head->slots_offset = slots_offset;
+    building.head->arena_offset = arena_offset;
+    building.head->arena_size = arena_size;
+    return 0;
+}
+
+// 顺序锁的写入：seq变为奇数后再修改，修改完成后变为偶数
+static void slot_write(retention_shm_slot *slot, time_t creation_time, time_t retention_time) {
+    uint32_t seq = slot->seq;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->creation_time, (int64_t)creation_time, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->retention_time, (int64_t)retention_time, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+int retention_shm_put(uint64_t hash, const char *path, time_t creation_time, time_t retention_time) {
+    shm_table *t = building.map ? &building : &current;
+    if (!t->map) {
+        return 0;
+    }
+
+    size_t len = strlen(path);
+    uint64_t i = hash & t->mask;
+    retention_shm_slot *slot;
+    for (;; i = (i + 1) & t->mask) {
+        slot = &t->slots[i];
+        if (slot->path_len == 0) {
+            break;
+        }
+        if (slot->hash == hash && slot->path_len == len &&
+            memcmp(t->arena + slot->path_offset, path, len) == 0) {
+            slot_write(slot, creation_time, retention_time);
+            return 0;
+        }
+    }
+    if (retention_time < 0) {
+        return 0;  // 表中没有的路径不需要记录删除
+    }
+    // 装载率超过70%后探测变长，由调用者换用更大的表
+    if ((t->used + 1) * 10 > (t->mask + 1) * 7 || t->arena_used + len > t->head->arena_size) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    // 路径先写入路径区，槽位在seq变为偶数时才对读取方可见
+    memcpy(t->arena + t->arena_used, path, len);
+    uint32_t seq = slot->seq;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->hash, hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->path_offset, t->arena_used, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->creation_time, (int64_t)creation_time, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->retention_time, (int64_t)retention_time, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->path_len, (uint32_t)len, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    t->arena_used += len;
+    t->used++;
+    return 0;
+}
+
+// 标记文件中的表已失效，用于上次运行留下的表
+static void mark_file_stale(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(retention_shm_header)) {
+        return;
+    }
+    retention_shm_header *head = mmap(NULL, sizeof(*head), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (head == MAP_FAILED) {
+        return;
+    }
+    if (head->magic == RETENTION_SHM_MAGIC) {
+        __atomic_store_n(&head->stale, 1, __ATOMIC_RELEASE);
+    }
+    munmap(head, sizeof(*head));
+}
+
+int retention_shm_commit(void) {
+    if (!building.map) {
+        errno = EINVAL;
+        return -1;
+    }
+    int old_fd = current.map ? -1 : open(shm_path, O_RDWR | O_CLOEXEC | O_NOFOLLOW);
+    if (rename(tmp_path, shm_path) != 0) {
+        int err = errno;
+        if (old_fd != -1) {
+            close(old_fd);
+        }
+        retention_shm_abort();
+        errno = err;
+        return -1;
+    }
+
+    // 新表已在原路径上，读取方看到旧表失效后重新打开即得到新表
+    if (old_fd != -1) {
+        mark_file_stale(old_fd);
+        close(old_fd);
+    }
+    if (current.map) {
+        __atomic_store_n(&current.head->stale, 1, __ATOMIC_RELEASE);
+    }
+    table_unmap(&current);
+    current = building;
+    memset(&building, 0, sizeof(building));
+    return 0;
+}
+
+void retention_shm_abort(void) {
+    if (building.map) {
+        table_unmap(&building);
+        unlink(tmp_path);
+    }
+}
+
+void retention_shm_close(void) {
+    retention_shm_abort();
+    if (current.map) {
+        __atomic_store_n(&current.head->stale, 1, __ATOMIC_RELEASE);
+        unlink(shm_path);
+        table_unmap(&current);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef RETENTION_SHM_H
+#define RETENTION_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// 共享内存中的保留表(格式见immutable_protocol.h)的写入方，调用者保证同一时间只有一个线程调用
+
+/**
+ * 建立新的表，之后的retention_shm_put写入新表，retention_shm_commit之前客户端看不到
+ *
+ * 新表按预计的大小留出一倍的空间，放不下时retention_shm_put返回失败，由调用者重建。
+ *
+ * @param path 表的路径，通常在/dev/shm中；先写入path.tmp
+ * @param entries 预计的路径数
+ * @param path_bytes 这些路径的总长度
+ * @return 成功返回 0，失败返回 -1
+ */
+int retention_shm_begin(const char *path, size_t entries, size_t path_bytes);
+
+/**
+ * 在表中记录路径的保留期限，读取方不加锁，通过槽位的顺序锁读到一致的值
+ *
+ * 有正在建立的表时写入新表，否则写入已发布的表；都没有时什么都不做。
+ *
+ * @param hash 路径的哈希(hash_path)
+ * @param path 文件路径
+ * @param creation_time 保留期开始时间
+ * @param retention_time 保留期限(秒)，-1表示删除
+ * @return 成功返回 0，表已满返回 -1
+ */
+int retention_shm_put(uint64_t hash, const char *path, time_t creation_time, time_t retention_time);
+
+/**
+ * 发布新建立的表：改名替换旧表，再标记旧表已失效，客户端随后改用新表
+ *
+ * 第一次发布时也标记上次运行留下的表，客户端不会继续使用其中的旧数据。
+ *
+ * @return 成功返回 0，失败返回 -1(新表被丢弃)
+ */
+int retention_shm_commit(void);
+
+/**
+ * 丢弃正在建立的表
+ */
+void retention_shm_abort(void);
+
+/**
+ * 停止发布：标记表已失效并删除，客户端改用socket查询
+ */
+void retention_shm_close(void);
+
+#endif /* RETENTION_SHM_H */
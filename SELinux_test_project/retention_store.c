@@ -0,0 +1,1287 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "immutable_service.h"
+#include "retention_store.h"
+#include "retention_shm.h"
+#include "integrity.h"
+#include "service_log.h"
+
+#define STORE_STRIPES 256             // 分片数，每个分片一把读写锁
+#define STRIPE_INITIAL_BUCKETS 64
+#define COMPACT_MIN_JOURNAL 4096      // 日志中的记录少于此数时不合并
+#define COMPACT_MAX_JOURNAL 65536     // 日志中的记录多于此数时总是合并，限制启动时重放的记录数
+#define INDEX_MAGIC "IMRIDX01"
+#define INDEX_VERSION 1
+#define RECORD_MAX_LEN (MAX_PATH_LEN + 80)
+#define CHECKSUM_MARK '~'             // 记录末尾"|~校验和"字段的标记，没有此字段的是旧格式的记录
+
+// 保留表由三层组成：上次合并时写出的二进制索引(只读映射)；正在合并到新索引的变更(冻结层，
+// 对应改名为retention.db.merge的旧日志)；之后日志中的变更(覆盖层)。
+// 查询依次查覆盖层、冻结层和索引；保留期限为-1的记录表示已删除下层中的路径
+
+// 索引文件的格式(本机字节序)：文件头、开放寻址的哈希表、按到期时间排序的到期表、路径字符串区
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_crc;     // header_crc为0时文件头的CRC32C
+    uint64_t file_size;
+    uint64_t slot_count;     // 2的幂
+    uint64_t entry_count;
+    uint64_t expiry_count;
+    uint64_t slots_offset;
+    uint64_t expiry_offset;
+    uint64_t arena_offset;
+} index_header;
+
+typedef struct {
+    uint64_t hash;
+    int64_t creation_time;
+    int64_t retention_time;
+    uint64_t path_offset;    // 在路径字符串区中的偏移，字符串以'\0'结尾
+    uint32_t path_len;       // 0表示空槽
+    uint32_t reserved;
+} index_slot;
+
+typedef struct {
+    int64_t expiry;
+    uint64_t slot;
+} index_expiry;
+
+typedef struct {
+    void *map;
+    size_t size;
+    uint64_t slot_count;
+    uint64_t entry_count;
+    uint64_t expiry_count;
+    const index_slot *slots;
+    const index_expiry *expiries;
+    const char *arena;
+} mapped_index;
+
+typedef struct retention_record {
+    struct retention_record *next;
+    uint64_t hash;
+    time_t creation_time;    // 创建时间
+    time_t retention_time;   // 保留期限，-1表示已删除(索引中有该路径)
+    time_t expiry;           // 到期时间，由expiry_mutex保护
+    size_t heap_index;       // 在到期队列中的位置，不在队列中时为HEAP_NONE
+    char path[];
+} retention_record;
+
+#define HEAP_NONE SIZE_MAX
+
+// 保留表按哈希值分片，查询只锁一个分片的读锁，互不阻塞
+typedef struct {
+    pthread_rwlock_t lock;
+    retention_record **buckets;
+    size_t bucket_count;     // 2的幂
+    size_t count;
+    retention_record **frozen;    // 冻结层，不合并时为NULL；只读，合并完成后释放
+    size_t frozen_count;          // 冻结层的桶数
+} store_stripe;
+
+static store_stripe stripes[STORE_STRIPES];
+static atomic_size_t record_count;   // 保留表中的路径数(各层合并后)
+
+// 合并完成时持有所有分片的写锁和expiry_mutex替换，读取方持有任一分片锁或expiry_mutex即可使用
+static mapped_index index_map;
+static char index_path[MAX_PATH_LEN];
+
+// 同一时间只有一个线程合并，index_map和冻结层只由持有它的线程替换
+static pthread_mutex_t compact_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int merge_pending;    // 冻结层还没有写入索引，由compact_mutex保护
+
+// 保护日志文件，修改覆盖层也需持有
+static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char store_path[MAX_PATH_LEN];
+static char merge_path[MAX_PATH_LEN];  // 冻结层对应的旧日志
+static int store_fd = -1;
+static size_t file_records;  // 日志中的记录数
+static char shm_path[MAX_PATH_LEN];   // 共享内存保留表，由file_mutex保护
+static int shm_published;
+
+// 组提交：每次追加得到一个序号，落盘的线程一次fdatasync覆盖此前追加的所有记录
+// 以下变量由file_mutex保护
+static int durable = 1;               // 为0时追加后不等待落盘
+static uint64_t append_seq;           // 已追加的次数
+static uint64_t synced_seq;           // 已落盘的追加序号
+static uint64_t failed_seq;           // 不超过此序号的追加落盘失败
+static int sync_running;              // 有线程正在fdatasync
+static pthread_cond_t synced_cond = PTHREAD_COND_INITIALIZER;
+
+// 到期队列：保留期限大于0的记录按到期时间排成最小堆
+// 加锁顺序为先分片锁后expiry_mutex
+static pthread_mutex_t expiry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t expiry_changed = PTHREAD_COND_INITIALIZER;
+static retention_record **expiry_heap;
+static size_t expiry_count;
+static size_t expiry_capacity;
+static uint64_t expiry_cursor;  // 索引的到期表中下一条未取出的记录
+
+static store_stripe *stripe_for(uint64_t hash) {
+    return &stripes[hash >> 56 & (STORE_STRIPES - 1)];
+}
+
+static void stripe_grow(store_stripe *s) {
+    size_t new_count = s->bucket_count * 2;
+    retention_record **buckets = calloc(new_count, sizeof(*buckets));
+    if (!buckets) {
+        return;  // 扩容失败只影响查询速度
+    }
+
+    for (size_t i = 0; i < s->bucket_count; i++) {
+        retention_record *r = s->buckets[i];
+        while (r) {
+            retention_record *next = r->next;
+            size_t b = r->hash & (new_count - 1);
+            r->next = buckets[b];
+            buckets[b] = r;
+            r = next;
+        }
+    }
+
+    free(s->buckets);
+    s->buckets = buckets;
+    s->bucket_count = new_count;
+}
+
+static void heap_set(size_t i, retention_record *r) {
+    expiry_heap[i] = r;
+    r->heap_index = i;
+}
+
+static void heap_sift_up(size_t i) {
+    retention_record *r = expiry_heap[i];
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (expiry_heap[parent]->expiry <= r->expiry) {
+            break;
+        }
+        heap_set(i, expiry_heap[parent]);
+        i = parent;
+    }
+    heap_set(i, r);
+}
+
+static void heap_sift_down(size_t i) {
+    retention_record *r = expiry_heap[i];
+    while (1) {
+        size_t child = 2 * i + 1;
+        if (child >= expiry_count) {
+            break;
+        }
+        if (child + 1 < expiry_count && expiry_heap[child + 1]->expiry < expiry_heap[child]->expiry) {
+            child++;
+        }
+        if (r->expiry <= expiry_heap[child]->expiry) {
+            break;
+        }
+        heap_set(i, expiry_heap[child]);
+        i = child;
+    }
+    heap_set(i, r);
+}
+
+static void heap_remove(retention_record *r) {
+    size_t i = r->heap_index;
+    r->heap_index = HEAP_NONE;
+    expiry_count--;
+    if (i == expiry_count) {
+        return;
+    }
+    retention_record *moved = expiry_heap[expiry_count];
+    heap_set(i, moved);
+    heap_sift_up(i);
+    heap_sift_down(moved->heap_index);
+}
+
+// 记录的保留期限变化后调整其在到期队列中的位置
+static void expiry_update(retention_record *r) {
+    pthread_mutex_lock(&expiry_mutex);
+    if (r->retention_time <= 0) {
+        if (r->heap_index != HEAP_NONE) {
+            heap_remove(r);
+        }
+        pthread_mutex_unlock(&expiry_mutex);
+        return;
+    }
+    
+    r->expiry = r->creation_time + r->retention_time;
+    if (r->heap_index == HEAP_NONE) {
+        if (expiry_count == expiry_capacity) {
+            size_t capacity = expiry_capacity ? expiry_capacity * 2 : 1024;
+            retention_record **heap = realloc(expiry_heap, capacity * sizeof(*heap));
+            if (!heap) {
+                slog(SLOG_ERROR, LOG_WARNING, "内存不足，%s 不会被加入到期队列", r->path);
+                pthread_mutex_unlock(&expiry_mutex);
+                return;
+            }
+            expiry_heap = heap;
+            expiry_capacity = capacity;
+        }
+        heap_set(expiry_count++, r);
+    }
+    heap_sift_up(r->heap_index);
+    heap_sift_down(r->heap_index);
+    
+    // 最早的到期时间可能提前了，唤醒等待的清理线程
+    if (r->heap_index == 0) {
+        pthread_cond_broadcast(&expiry_changed);
+    }
+    pthread_mutex_unlock(&expiry_mutex);
+}
+
+// 在索引中查找路径，调用者持有任一分片锁或expiry_mutex
+static const index_slot *index_find(uint64_t hash, const char *path) {
+    if (index_map.slot_count == 0) {
+        return NULL;
+    }
+    uint64_t mask = index_map.slot_count - 1;
+    for (uint64_t i = hash & mask; ; i = (i + 1) & mask) {
+        const index_slot *slot = &index_map.slots[i];
+        if (slot->path_len == 0) {
+            return NULL;
+        }
+        if (slot->hash == hash && strcmp(index_map.arena + slot->path_offset, path) == 0) {
+            return slot;
+        }
+    }
+}
+
+static retention_record *overlay_find(store_stripe *s, uint64_t hash, const char *path) {
+    for (retention_record *r = s->buckets[hash & (s->bucket_count - 1)]; r; r = r->next) {
+        if (r->hash == hash && strcmp(r->path, path) == 0) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+typedef void (*record_fn)(void *arg, uint64_t hash, const char *path,
+                          time_t creation_time, time_t retention_time);
+
+// 在冻结层中查找路径，冻结层只读，不需要加锁
+static int frozen_contains(uint64_t hash, const char *path) {
+    store_stripe *s = stripe_for(hash);
+    if (!s->frozen) {
+        return 0;
+    }
+    for (retention_record *r = s->frozen[hash & (s->frozen_count - 1)]; r; r = r->next) {
+        if (r->hash == hash && strcmp(r->path, path) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// 在覆盖层之下(冻结层和索引)查找路径，存在时返回1并取出保留期限，调用者持有分片锁
+static int lower_find(store_stripe *s, uint64_t hash, const char *path,
+                      time_t *creation_time, time_t *retention_time) {
+    if (s->frozen) {
+        for (retention_record *r = s->frozen[hash & (s->frozen_count - 1)]; r; r = r->next) {
+            if (r->hash == hash && strcmp(r->path, path) == 0) {
+                *creation_time = r->creation_time;
+                *retention_time = r->retention_time;
+                return r->retention_time >= 0;
+            }
+        }
+    }
+    const index_slot *slot = index_find(hash, path);
+    if (slot) {
+        *creation_time = slot->creation_time;
+        *retention_time = slot->retention_time;
+        return 1;
+    }
+    return 0;
+}
+
+// 删除覆盖层中的记录
+static void overlay_unlink(store_stripe *s, retention_record *r) {
+    retention_record **p = &s->buckets[r->hash & (s->bucket_count - 1)];
+    while (*p != r) {
+        p = &(*p)->next;
+    }
+    *p = r->next;
+    s->count--;
+    pthread_mutex_lock(&expiry_mutex);
+    if (r->heap_index != HEAP_NONE) {
+        heap_remove(r);
+    }
+    pthread_mutex_unlock(&expiry_mutex);
+    free(r);
+}
+
+// 在覆盖层中记录路径的新值，retention_time为-1表示删除，调用者持有file_mutex和分片的写锁
+static int overlay_set(store_stripe *s, uint64_t hash, const char *path,
+                       time_t creation_time, time_t retention_time) {
+    retention_record *r = overlay_find(s, hash, path);
+    time_t lower_creation, lower_retention;
+    int in_lower = lower_find(s, hash, path, &lower_creation, &lower_retention);
+    int existed = r ? r->retention_time >= 0 : in_lower;
+    int exists = retention_time >= 0;
+
+    if (!exists && !in_lower) {
+        // 下层中没有的路径不需要墓碑
+        if (r) {
+            overlay_unlink(s, r);
+        }
+    } else if (r) {
+        r->creation_time = creation_time;
+        r->retention_time = retention_time;
+        expiry_update(r);
+    } else {
+        size_t len = strlen(path);
+        r = malloc(sizeof(*r) + len + 1);
+        if (!r) {
+            return -1;
+        }
+        r->hash = hash;
+        r->creation_time = creation_time;
+        r->retention_time = retention_time;
+        r->heap_index = HEAP_NONE;
+        memcpy(r->path, path, len + 1);
+        size_t b = hash & (s->bucket_count - 1);
+        r->next = s->buckets[b];
+        s->buckets[b] = r;
+        s->count++;
+        expiry_update(r);
+
+        if (s->count > s->bucket_count) {
+            stripe_grow(s);
+        }
+    }
+
+    if (exists && !existed) {
+        atomic_fetch_add(&record_count, 1);
+    } else if (!exists && existed) {
+        atomic_fetch_sub(&record_count, 1);
+    }
+    return 0;
+}
+
+// 格式化一条记录"路径|创建时间|保留期限|~校验和\n"，返回长度，过长时返回-1
+static int format_record(char *buf, size_t cap, const char *path, time_t creation_time,
+                         time_t retention_time) {
+    int len = snprintf(buf, cap, "%s|%ld|%ld", path, creation_time, retention_time);
+    if (len < 0 || (size_t)len + 12 >= cap) {
+        return -1;
+    }
+    return len + snprintf(buf + len, cap - len, "|%c%08x\n", CHECKSUM_MARK, integrity_crc32c(0, buf, len));
+}
+
+// 解析一行"路径|创建时间|保留期限|~校验和"，路径中可能含有'|'，因此从右向左解析
+// 返回0表示有效，-1表示格式错误或校验和不符
+static int parse_record(char *line, time_t *creation_time, time_t *retention_time) {
+    line[strcspn(line, "\n")] = '\0';
+
+    char *sep2 = strrchr(line, '|');
+    if (sep2 && sep2[1] == CHECKSUM_MARK) {
+        char *end;
+        unsigned long crc = strtoul(sep2 + 2, &end, 16);
+        if (*end != '\0' || end != sep2 + 10 || crc != integrity_crc32c(0, line, sep2 - line)) {
+            return -1;
+        }
+        *sep2 = '\0';
+        sep2 = strrchr(line, '|');
+    }
+    if (!sep2) {
+        return -1;
+    }
+    *sep2 = '\0';
+    char *sep1 = strrchr(line, '|');
+    if (!sep1 || sep1 == line) {
+        return -1;
+    }
+    *sep1 = '\0';
+
+    char *end;
+    *creation_time = strtol(sep1 + 1, &end, 10);
+    if (*end != '\0') {
+        return -1;
+    }
+    *retention_time = strtol(sep2 + 1, &end, 10);
+    if (*end != '\0') {
+        return -1;
+    }
+    return 0;
+}
+
+static int load_records(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    size_t bad = 0;
+    off_t offset = 0;
+    off_t good_end = 0;      // 最后一条有效记录的结尾
+    size_t bad_tail = 0;     // good_end之后的无效记录数
+    ssize_t n;
+    while ((n = getline(&line, &cap, f)) != -1) {
+        offset += n;
+        time_t ctime_val, rtime_val;
+        if (line[n - 1] != '\n' || parse_record(line, &ctime_val, &rtime_val) != 0) {
+            bad_tail++;
+            continue;
+        }
+        bad += bad_tail;
+        bad_tail = 0;
+        good_end = offset;
+        uint64_t h = hash_path(line);
+        if (overlay_set(stripe_for(h), h, line, rtime_val < 0 ? 0 : ctime_val,
+                        rtime_val < 0 ? -1 : rtime_val) != 0) {
+            free(line);
+            fclose(f);
+            return -1;
+        }
+        file_records++;
+    }
+
+    free(line);
+    fclose(f);
+
+    if (bad > 0) {
+        slog(SLOG_ERROR, LOG_WARNING, "保留信息文件中有 %zu 条无法解析的记录", bad);
+    }
+    // 末尾写了一半的记录(崩溃时正在追加)截掉，否则之后追加的记录会接在它后面
+    if (good_end < offset) {
+        slog(SLOG_ERROR, LOG_WARNING, "截掉保留信息文件末尾 %zu 条不完整的记录 (%ld 字节)", bad_tail,
+             (long)(offset - good_end));
+        if (truncate(path, good_end) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// 使目录中新建或改名的文件在崩溃后仍然存在
+static int sync_parent_dir(const char *path) {
+    char dir[MAX_PATH_LEN];
+    const char *slash = strrchr(path, '/');
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (slash == path ? 1 : (int)(slash - path)) : 1,
+             slash ? path : ".");
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+// 追加一段记录，调用者持有file_mutex；返回追加的序号，失败返回0
+static uint64_t append_records(const char *buf, size_t len) {
+    // 整段一次追加，写入不完整时截掉，避免留下半条记录
+    off_t start = lseek(store_fd, 0, SEEK_END);
+    ssize_t written = write(store_fd, buf, len);
+    if (written != (ssize_t)len) {
+        slog(SLOG_ERROR, LOG_ERR, "无法写入保留信息文件: %s", written == -1 ? strerror(errno) : "写入不完整");
+        if (written > 0 && start != -1 && ftruncate(store_fd, start) != 0) {
+            slog(SLOG_ERROR, LOG_ERR, "无法截掉不完整的保留记录: %s", strerror(errno));
+        }
+        return 0;
+    }
+    return ++append_seq;
+}
+
+// 等待序号不超过seq的追加都已落盘，调用者持有file_mutex
+// 没有线程在落盘时，由当前线程对此前追加的所有记录执行一次fdatasync；落盘期间到达的追加
+// 等它完成后由其中一个线程合并落盘，并发的请求因此共用一次fdatasync
+static int wait_durable(uint64_t seq) {
+    while (durable) {
+        if (seq <= failed_seq) {
+            errno = EIO;
+            return -1;
+        }
+        if (seq <= synced_seq) {
+            break;
+        }
+        if (sync_running) {
+            pthread_cond_wait(&synced_cond, &file_mutex);
+            continue;
+        }
+
+        uint64_t target = append_seq;
+        int fd = store_fd;
+        sync_running = 1;
+        pthread_mutex_unlock(&file_mutex);
+        int ret = fdatasync(fd);
+        int err = errno;
+        pthread_mutex_lock(&file_mutex);
+        sync_running = 0;
+        if (ret != 0) {
+            // 出错后内核可能已丢弃这些数据，再次fdatasync也不会报告，覆盖的记录都视为失败
+            slog(SLOG_ERROR, LOG_ERR, "无法将保留信息文件写入磁盘: %s", strerror(err));
+            failed_seq = target;
+        } else if (target > synced_seq) {
+            synced_seq = target;
+        }
+        pthread_cond_broadcast(&synced_cond);
+    }
+    return 0;
+}
+
+void retention_store_set_durable(int enabled) {
+    durable = enabled;
+}
+
+static uint32_t header_checksum(const index_header *head) {
+    index_header copy = *head;
+    copy.header_crc = 0;
+    return integrity_crc32c(0, &copy, sizeof(copy));
+}
+
+// 映射索引文件，文件不存在时为空索引；只检查文件头，映射与保留记录的数量无关
+static int index_open(const char *path, mapped_index *out) {
+    memset(out, 0, sizeof(*out));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    void *map = MAP_FAILED;
+    if ((size_t)st.st_size >= sizeof(index_header)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const index_header *head = map;
+    uint64_t slots_end = head->slots_offset + head->slot_count * sizeof(index_slot);
+    uint64_t expiry_end = head->expiry_offset + head->expiry_count * sizeof(index_expiry);
+    if (memcmp(head->magic, INDEX_MAGIC, sizeof(head->magic)) != 0 || head->version != INDEX_VERSION ||
+        head->header_crc != header_checksum(head) || head->file_size != (uint64_t)st.st_size ||
+        head->slot_count == 0 || (head->slot_count & (head->slot_count - 1)) != 0 ||
+        head->entry_count >= head->slot_count || slots_end > head->expiry_offset ||
+        expiry_end > head->arena_offset || head->arena_offset > head->file_size) {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    out->map = map;
+    out->size = st.st_size;
+    out->slot_count = head->slot_count;
+    out->entry_count = head->entry_count;
+    out->expiry_count = head->expiry_count;
+    out->slots = (const index_slot *)((const char *)map + head->slots_offset);
+    out->expiries = (const index_expiry *)((const char *)map + head->expiry_offset);
+    out->arena = (const char *)map + head->arena_offset;
+    return 0;
+}
+
+// 把覆盖层移到冻结层，之后的变更记入新的覆盖层，调用者持有file_mutex且当前没有冻结层
+// 每个分片移动前后查到的内容相同，逐个分片加锁即可
+static int overlay_freeze(void) {
+    retention_record **fresh[STORE_STRIPES];
+    for (int i = 0; i < STORE_STRIPES; i++) {
+        fresh[i] = calloc(STRIPE_INITIAL_BUCKETS, sizeof(retention_record *));
+        if (!fresh[i]) {
+            while (i-- > 0) {
+                free(fresh[i]);
+            }
+            return -1;
+        }
+    }
+    for (int i = 0; i < STORE_STRIPES; i++) {
+        store_stripe *s = &stripes[i];
+        pthread_rwlock_wrlock(&s->lock);
+        s->frozen = s->buckets;
+        s->frozen_count = s->bucket_count;
+        s->buckets = fresh[i];
+        s->bucket_count = STRIPE_INITIAL_BUCKETS;
+        s->count = 0;
+        pthread_rwlock_unlock(&s->lock);
+    }
+    return 0;
+}
+
+int retention_store_open(const char *db_path, const char *idx_path) {
+    if (strlen(db_path) + 7 >= sizeof(store_path) || strlen(idx_path) + 8 >= sizeof(index_path)) {
+        return -1;
+    }
+    strcpy(store_path, db_path);
+    snprintf(merge_path, sizeof(merge_path), "%s.merge", db_path);
+    strcpy(index_path, idx_path);
+
+    for (int i = 0; i < STORE_STRIPES; i++) {
+        pthread_rwlock_init(&stripes[i].lock, NULL);
+        stripes[i].buckets = calloc(STRIPE_INITIAL_BUCKETS, sizeof(retention_record *));
+        if (!stripes[i].buckets) {
+            return -1;
+        }
+        stripes[i].bucket_count = STRIPE_INITIAL_BUCKETS;
+        stripes[i].count = 0;
+    }
+
+    // 索引损坏时不启动：日志在上次合并后已清空，只用日志会丢失保留记录
+    if (index_open(index_path, &index_map) != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法打开保留索引 %s: %s", index_path, strerror(errno));
+        return -1;
+    }
+    atomic_store(&record_count, index_map.entry_count);
+
+    // 上次的合并没有完成：旧日志重新作为冻结层，由合并线程写入索引
+    if (access(merge_path, F_OK) == 0) {
+        if (load_records(merge_path) != 0 || overlay_freeze() != 0) {
+            slog(SLOG_ERROR, LOG_ERR, "无法加载保留信息文件 %s: %s", merge_path, strerror(errno));
+            return -1;
+        }
+        merge_pending = 1;
+        file_records = 0;
+    }
+
+    if (load_records(store_path) != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法加载保留信息文件 %s: %s", store_path, strerror(errno));
+        return -1;
+    }
+
+    store_fd = open(store_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (store_fd == -1) {
+        slog(SLOG_ERROR, LOG_ERR, "无法打开保留信息文件 %s: %s", store_path, strerror(errno));
+        return -1;
+    }
+    if (durable && (fdatasync(store_fd) != 0 || sync_parent_dir(store_path) != 0)) {
+        slog(SLOG_ERROR, LOG_ERR, "无法将保留信息文件 %s 写入磁盘: %s", store_path, strerror(errno));
+        return -1;
+    }
+
+    slog(SLOG_INFO, LOG_NOTICE, "已加载 %zu 条保留记录(索引中 %lu 条，日志中 %zu 条)",
+           retention_store_count(), (unsigned long)index_map.entry_count, file_records);
+    return 0;
+}
+
+// 依次访问各层合并后的每条记录，调用者持有file_mutex和所有分片的读锁
+static void for_each_live_record(record_fn fn, void *arg) {
+    for (uint64_t i = 0; i < index_map.slot_count; i++) {
+        const index_slot *slot = &index_map.slots[i];
+        if (slot->path_len == 0) {
+            continue;
+        }
+        const char *path = index_map.arena + slot->path_offset;
+        if (!frozen_contains(slot->hash, path) && !overlay_find(stripe_for(slot->hash), slot->hash, path)) {
+            fn(arg, slot->hash, path, slot->creation_time, slot->retention_time);
+        }
+    }
+    for (int i = 0; i < STORE_STRIPES; i++) {
+        store_stripe *s = &stripes[i];
+        for (size_t b = 0; b < s->frozen_count; b++) {
+            for (retention_record *r = s->frozen[b]; r; r = r->next) {
+                if (r->retention_time >= 0 && !overlay_find(s, r->hash, r->path)) {
+                    fn(arg, r->hash, r->path, r->creation_time, r->retention_time);
+                }
+            }
+        }
+        for (size_t b = 0; b < s->bucket_count; b++) {
+            for (retention_record *r = s->buckets[b]; r; r = r->next) {
+                if (r->retention_time >= 0) {
+                    fn(arg, r->hash, r->path, r->creation_time, r->retention_time);
+                }
+            }
+        }
+    }
+}
+
+typedef struct {
+    size_t entries;
+    size_t path_bytes;
+    int failed;
+} shm_fill;
+
+static void shm_count(void *arg, uint64_t hash, const char *path,
+                      time_t creation_time, time_t retention_time) {
+    shm_fill *fill = arg;
+    (void)hash;
+    (void)creation_time;
+    (void)retention_time;
+    fill->entries++;
+    fill->path_bytes += strlen(path);
+}
+
+static void shm_add(void *arg, uint64_t hash, const char *path,
+                    time_t creation_time, time_t retention_time) {
+    shm_fill *fill = arg;
+    if (!fill->failed && retention_shm_put(hash, path, creation_time, retention_time) != 0) {
+        fill->failed = 1;
+    }
+}
+
+// 按当前的保留表建立新的共享内存表并替换旧表，调用者持有file_mutex，不持有分片锁
+static int shm_rebuild(void) {
+    for (int i = 0; i < STORE_STRIPES; i++) {
+        pthread_rwlock_rdlock(&stripes[i].lock);
+    }
+    shm_fill fill = { 0 };
+    for_each_live_record(shm_count, &fill);
+    int ret = retention_shm_begin(shm_path, fill.entries, fill.path_bytes);
+    if (ret == 0) {
+        for_each_live_record(shm_add, &fill);
+        if (fill.failed) {
+            retention_shm_abort();
+            ret = -1;
+        } else {
+            ret = retention_shm_commit();
+        }
+    }
+    for (int i = 0; i < STORE_STRIPES; i++) {
+        pthread_rwlock_unlock(&stripes[i].lock);
+    }
+    return ret;
+}
+
+// 把路径的新值写入共享内存表，表满时重建；重建失败时停止发布，客户端改用socket查询
+// 调用者持有file_mutex，不持有分片锁
+static void shm_update(uint64_t hash, const char *path, time_t creation_time, time_t retention_time) {
+    if (!shm_published || retention_shm_put(hash, path, creation_time, retention_time) == 0) {
+        return;
+    }
+    if (shm_rebuild() != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法重建共享内存保留表 %s: %s，停止发布", shm_path, strerror(errno));
+        retention_shm_close();
+        shm_published = 0;
+    }
+}
+
+int retention_store_publish(const char *path) {
+    if (strlen(path) + 4 >= sizeof(shm_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    pthread_mutex_lock(&file_mutex);
+    strcpy(shm_path, path);
+    int ret = shm_rebuild();
+    shm_published = ret == 0;
+    pthread_mutex_unlock(&file_mutex);
+    return ret;
+}
+
+void retention_store_unpublish(void) {
+    pthread_mutex_lock(&file_mutex);
+    if (shm_published) {
+        retention_shm_close();
+        shm_published = 0;
+    }
+    pthread_mutex_unlock(&file_mutex);
+}
+
+int retention_store_set(const char *path, time_t creation_time, time_t retention_time) {
+    char line[RECORD_MAX_LEN];
+    int len = format_record(line, sizeof(line), path, creation_time, retention_time);
+    if (len < 0) {
+        return -1;
+    }
+
+    uint64_t h = hash_path(path);
+    store_stripe *s = stripe_for(h);
+
+    pthread_mutex_lock(&file_mutex);
+
+    // 先追加到日志再更新覆盖层，覆盖层与日志中记录的顺序一致
+    uint64_t seq = append_records(line, len);
+    if (seq == 0) {
+        pthread_mutex_unlock(&file_mutex);
+        return -1;
+    }
+    file_records++;
+
+    pthread_rwlock_wrlock(&s->lock);
+    int ret = overlay_set(s, h, path, creation_time, retention_time);
+    pthread_rwlock_unlock(&s->lock);
+    if (ret == 0) {
+        shm_update(h, path, creation_time, retention_time);
+    }
+
+    // 落盘后才返回，调用者之后的回应不会早于记录落盘
+    if (wait_durable(seq) != 0) {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&file_mutex);
+    return ret;
+}
+
+int retention_store_set_many(const retention_update *updates, size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+    
+    size_t cap = 0;
+    for (size_t i = 0; i < count; i++) {
+        cap += strlen(updates[i].path) + RECORD_MAX_LEN - MAX_PATH_LEN;
+    }
+    char *buf = malloc(cap);
+    if (!buf) {
+        return -1;
+    }
+    size_t len = 0;
+    for (size_t i = 0; i < count; i++) {
+        int n = format_record(buf + len, cap - len, updates[i].path, updates[i].creation_time,
+                              updates[i].retention_time);
+        if (n < 0) {
+            free(buf);
+            return -1;
+        }
+        len += n;
+    }
+    
+    pthread_mutex_lock(&file_mutex);
+    
+    // 整批记录一次追加，共用一次落盘
+    uint64_t seq = append_records(buf, len);
+    free(buf);
+    if (seq == 0) {
+        pthread_mutex_unlock(&file_mutex);
+        return -1;
+    }
+    file_records += count;
+    
+    int ret = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t h = hash_path(updates[i].path);
+        store_stripe *s = stripe_for(h);
+        pthread_rwlock_wrlock(&s->lock);
+        int set = overlay_set(s, h, updates[i].path, updates[i].creation_time,
+                              updates[i].retention_time);
+        pthread_rwlock_unlock(&s->lock);
+        if (set == 0) {
+            shm_update(h, updates[i].path, updates[i].creation_time, updates[i].retention_time);
+        } else {
+            ret = -1;
+        }
+    }
+    
+    if (wait_durable(seq) != 0) {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&file_mutex);
+    return ret;
+}
+
+int retention_store_get(const char *path, time_t *creation_time, time_t *retention_time) {
+    uint64_t h = hash_path(path);
+    store_stripe *s = stripe_for(h);
+    int found = 0;
+
+    pthread_rwlock_rdlock(&s->lock);
+    retention_record *r = overlay_find(s, h, path);
+    if (r) {
+        if (r->retention_time >= 0) {
+            *creation_time = r->creation_time;
+            *retention_time = r->retention_time;
+            found = 1;
+        }
+    } else {
+        found = lower_find(s, h, path, creation_time, retention_time);
+    }
+    pthread_rwlock_unlock(&s->lock);
+
+    return found;
+}
+
+int retention_store_remove(const char *path) {
+    char line[RECORD_MAX_LEN];
+    int len = format_record(line, sizeof(line), path, 0, -1);
+    if (len < 0) {
+        return -1;
+    }
+
+    uint64_t h = hash_path(path);
+    store_stripe *s = stripe_for(h);
+
+    // 墓碑不等待落盘，由之后的落盘一并写入：崩溃时丢失只会使已删除文件的记录重新出现，
+    // 不会使文件提前变得可以删除
+    pthread_mutex_lock(&file_mutex);
+    if (append_records(line, len) == 0) {
+        pthread_mutex_unlock(&file_mutex);
+        return -1;
+    }
+    file_records++;
+
+    pthread_rwlock_wrlock(&s->lock);
+    overlay_set(s, h, path, 0, -1);
+    pthread_rwlock_unlock(&s->lock);
+    shm_update(h, path, 0, -1);
+
+    pthread_mutex_unlock(&file_mutex);
+    return 0;
+}
+
+// 索引的到期表中下一条记录的到期时间，没有时返回-1，调用者持有expiry_mutex
+// 到期表是合并时的状态，其中的路径之后可能已被修改或删除，由调用者取出后重新检查
+static time_t index_next_expiry(void) {
+    return expiry_cursor < index_map.expiry_count ? index_map.expiries[expiry_cursor].expiry : -1;
+}
+
+size_t retention_store_take_expired(time_t now, char **paths, size_t max) {
+    size_t n = 0;
+    pthread_mutex_lock(&expiry_mutex);
+    while (n < max) {
+        // 合并覆盖层的到期队列和索引的到期表，先取更早到期的
+        time_t index_expiry = index_next_expiry();
+        int from_heap = expiry_count > 0 && expiry_heap[0]->expiry <= now &&
+                        (index_expiry < 0 || expiry_heap[0]->expiry <= index_expiry);
+        if (!from_heap && (index_expiry < 0 || index_expiry > now)) {
+            break;
+        }
+        const char *src = from_heap ? expiry_heap[0]->path :
+            index_map.arena + index_map.slots[index_map.expiries[expiry_cursor].slot].path_offset;
+        char *path = strdup(src);
+        if (!path) {
+            break;
+        }
+        if (from_heap) {
+            heap_remove(expiry_heap[0]);
+        } else {
+            expiry_cursor++;
+        }
+        paths[n++] = path;
+    }
+    pthread_mutex_unlock(&expiry_mutex);
+    return n;
+}
+
+void retention_store_wait_expiry(time_t limit) {
+    pthread_mutex_lock(&expiry_mutex);
+    time_t deadline = limit;
+    if (expiry_count > 0 && expiry_heap[0]->expiry < deadline) {
+        deadline = expiry_heap[0]->expiry;
+    }
+    time_t index_expiry = index_next_expiry();
+    if (index_expiry >= 0 && index_expiry < deadline) {
+        deadline = index_expiry;
+    }
+    if (deadline > time(NULL)) {
+        struct timespec ts = { .tv_sec = deadline, .tv_nsec = 0 };
+        pthread_cond_timedwait(&expiry_changed, &expiry_mutex, &ts);
+    }
+    pthread_mutex_unlock(&expiry_mutex);
+}
+
+size_t retention_store_expiry_pending(void) {
+    pthread_mutex_lock(&expiry_mutex);
+    size_t n = expiry_count + (index_map.expiry_count - expiry_cursor);
+    pthread_mutex_unlock(&expiry_mutex);
+    return n;
+}
+
+size_t retention_store_count(void) {
+    return atomic_load(&record_count);
+}
+
+// 依次访问冻结层和索引合并后的每条记录，调用者持有compact_mutex，两层都不会变化
+static void for_each_record(record_fn fn, void *arg) {
+    for (uint64_t i = 0; i < index_map.slot_count; i++) {
+        const index_slot *slot = &index_map.slots[i];
+        if (slot->path_len == 0) {
+            continue;
+        }
+        const char *path = index_map.arena + slot->path_offset;
+        if (!frozen_contains(slot->hash, path)) {
+            fn(arg, slot->hash, path, slot->creation_time, slot->retention_time);
+        }
+    }
+    for (int i = 0; i < STORE_STRIPES; i++) {
+        store_stripe *s = &stripes[i];
+        for (size_t b = 0; b < s->frozen_count; b++) {
+            for (retention_record *r = s->frozen[b]; r; r = r->next) {
+                if (r->retention_time >= 0) {
+                    fn(arg, r->hash, r->path, r->creation_time, r->retention_time);
+                }
+            }
+        }
+    }
+}
+
+// 写出新索引时的状态，第一遍只计数
+typedef struct {
+    index_slot *slots;
+    uint64_t mask;
+    index_expiry *expiries;
+    char *arena;
+    uint64_t entries;
+    uint64_t expiry_count;
+    uint64_t arena_len;
+} index_builder;
+
+static void builder_add(void *arg, uint64_t hash, const char *path,
+                        time_t creation_time, time_t retention_time) {
+    index_builder *b = arg;
+    size_t len = strlen(path);
+    if (b->slots) {
+        uint64_t i = hash & b->mask;
+        while (b->slots[i].path_len != 0) {
+            i = (i + 1) & b->mask;
+        }
+        memcpy(b->arena + b->arena_len, path, len + 1);
+        b->slots[i].hash = hash;
+        b->slots[i].creation_time = creation_time;
+        b->slots[i].retention_time = retention_time;
+        b->slots[i].path_offset = b->arena_len;
+        b->slots[i].path_len = len;
+        if (retention_time > 0) {
+            b->expiries[b->expiry_count].expiry = creation_time + retention_time;
+            b->expiries[b->expiry_count].slot = i;
+        }
+    }
+    b->entries++;
+    b->arena_len += len + 1;
+    if (retention_time > 0) {
+        b->expiry_count++;
+    }
+}
+
+static int expiry_compare(const void *a, const void *b) {
+    const index_expiry *x = a, *y = b;
+    return x->expiry < y->expiry ? -1 : x->expiry > y->expiry;
+}
+
+// 写出两层合并后的索引，先写临时文件，落盘后改名
+static int index_write(const char *tmp_path) {
+    index_builder b = { 0 };
+    for_each_record(builder_add, &b);
+
+    uint64_t slot_count = 16;
+    while (slot_count < b.entries * 2) {
+        slot_count *= 2;
+    }
+    index_header head = { .version = INDEX_VERSION };
+    memcpy(head.magic, INDEX_MAGIC, sizeof(head.magic));
+    head.slot_count = slot_count;
+    head.entry_count = b.entries;
+    head.expiry_count = b.expiry_count;
+    head.slots_offset = (sizeof(index_header) + 63) & ~(uint64_t)63;
+    head.expiry_offset = head.slots_offset + slot_count * sizeof(index_slot);
+    head.arena_offset = head.expiry_offset + b.expiry_count * sizeof(index_expiry);
+    head.file_size = head.arena_offset + b.arena_len;
+    head.header_crc = header_checksum(&head);
+
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+    char *map = MAP_FAILED;
+    if (ftruncate(fd, head.file_size) == 0) {
+        map = mmap(NULL, head.file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        int err = errno;
+        close(fd);
+        unlink(tmp_path);
+        errno = err;
+        return -1;
+    }
+
+    b.slots = (index_slot *)(map + head.slots_offset);
+    b.mask = slot_count - 1;
+    b.expiries = (index_expiry *)(map + head.expiry_offset);
+    b.arena = map + head.arena_offset;
+    b.entries = b.expiry_count = b.arena_len = 0;
+    for_each_record(builder_add, &b);
+    qsort(b.expiries, b.expiry_count, sizeof(index_expiry), expiry_compare);
+    memcpy(map, &head, sizeof(head));
+    munmap(map, head.file_size);
+
+    if (fsync(fd) != 0) {
+        int err = errno;
+        close(fd);
+        unlink(tmp_path);
+        errno = err;
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// 冻结覆盖层并换用新的日志，旧日志改名为merge_path，合并完成后删除
+static int journal_rotate(void) {
+    pthread_mutex_lock(&file_mutex);
+    // 旧日志中还没有落盘的记录先落盘，之后的组提交只同步新日志
+    while (sync_running) {
+        pthread_cond_wait(&synced_cond, &file_mutex);
+    }
+    if (fdatasync(store_fd) != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法将保留信息文件写入磁盘: %s", strerror(errno));
+        pthread_mutex_unlock(&file_mutex);
+        return -1;
+    }
+    if (append_seq > synced_seq) {
+        synced_seq = append_seq;
+        pthread_cond_broadcast(&synced_cond);
+    }
+
+    if (rename(store_path, merge_path) != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法改名保留信息文件: %s", strerror(errno));
+        pthread_mutex_unlock(&file_mutex);
+        return -1;
+    }
+    int fd = open(store_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd == -1 || overlay_freeze() != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法创建新的保留信息文件: %s", strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        rename(merge_path, store_path);
+        pthread_mutex_unlock(&file_mutex);
+        return -1;
+    }
+    if (sync_parent_dir(store_path) != 0) {
+        slog(SLOG_ERROR, LOG_WARNING, "无法将保留信息文件的改名写入磁盘: %s", strerror(errno));
+    }
+    close(store_fd);
+    store_fd = fd;
+    file_records = 0;
+    pthread_mutex_unlock(&file_mutex);
+    return 0;
+}
+
+// 换用新索引并释放冻结层，此时冻结层中的记录都已在新索引中
+static void index_replace(const mapped_index *fresh) {
+    for (int i = 0; i < STORE_STRIPES; i++) {
+        pthread_rwlock_wrlock(&stripes[i].lock);
+    }
+    pthread_mutex_lock(&expiry_mutex);
+    mapped_index old = index_map;
+    index_map = *fresh;
+    expiry_cursor = 0;
+    for (int i = 0; i < STORE_STRIPES; i++) {
+        store_stripe *s = &stripes[i];
+        for (size_t b = 0; b < s->frozen_count; b++) {
+            retention_record *r = s->frozen[b];
+            while (r) {
+                retention_record *next = r->next;
+                if (r->heap_index != HEAP_NONE) {
+                    heap_remove(r);
+                }
+                free(r);
+                r = next;
+            }
+        }
+        free(s->frozen);
+        s->frozen = NULL;
+        s->frozen_count = 0;
+    }
+    pthread_cond_broadcast(&expiry_changed);
+    pthread_mutex_unlock(&expiry_mutex);
+    for (int i = 0; i < STORE_STRIPES; i++) {
+        pthread_rwlock_unlock(&stripes[i].lock);
+    }
+    if (old.map) {
+        munmap(old.map, old.size);
+    }
+}
+
+int retention_store_compact(void) {
+    char tmp_path[MAX_PATH_LEN + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index_path);
+
+    pthread_mutex_lock(&compact_mutex);
+    // 上次合并失败时冻结层还在，直接重试写出索引
+    if (!merge_pending) {
+        if (journal_rotate() != 0) {
+            pthread_mutex_unlock(&compact_mutex);
+            return -1;
+        }
+        merge_pending = 1;
+    }
+
+    // 冻结层和索引都不再变化，写出新索引期间记录保留期限的调用不受影响
+    if (index_write(tmp_path) != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "写入 %s 失败: %s", tmp_path, strerror(errno));
+        pthread_mutex_unlock(&compact_mutex);
+        return -1;
+    }
+    if (rename(tmp_path, index_path) != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法替换保留索引: %s", strerror(errno));
+        unlink(tmp_path);
+        pthread_mutex_unlock(&compact_mutex);
+        return -1;
+    }
+    if (sync_parent_dir(index_path) != 0) {
+        slog(SLOG_ERROR, LOG_WARNING, "无法将保留索引的改名写入磁盘: %s", strerror(errno));
+    }
+
+    mapped_index fresh;
+    if (index_open(index_path, &fresh) != 0) {
+        // 继续使用旧索引和冻结层，它们与新索引的内容相同
+        slog(SLOG_ERROR, LOG_ERR, "无法映射新的保留索引: %s", strerror(errno));
+        pthread_mutex_unlock(&compact_mutex);
+        return -1;
+    }
+    index_replace(&fresh);
+
+    // 删除前崩溃时，启动会在新索引上重放旧日志，结果相同
+    if (unlink(merge_path) != 0 && errno != ENOENT) {
+        slog(SLOG_ERROR, LOG_WARNING, "无法删除 %s: %s", merge_path, strerror(errno));
+    }
+    merge_pending = 0;
+    pthread_mutex_unlock(&compact_mutex);
+
+    slog(SLOG_INFO, LOG_NOTICE, "保留索引合并完成: %lu 条记录", (unsigned long)fresh.entry_count);
+    return 0;
+}
+
+// 日志中的记录多到影响启动时间时才值得重写索引
+static int needs_compaction(void) {
+    pthread_mutex_lock(&compact_mutex);
+    int pending = merge_pending;
+    uint64_t indexed = index_map.entry_count;
+    pthread_mutex_unlock(&compact_mutex);
+
+    pthread_mutex_lock(&file_mutex);
+    size_t journal = file_records;
+    pthread_mutex_unlock(&file_mutex);
+    return pending || (journal >= COMPACT_MIN_JOURNAL &&
+                       (journal >= COMPACT_MAX_JOURNAL || journal * 4 >= indexed));
+}
+
+static void *compactor_thread(void *arg) {
+    int interval = *(int *)arg;
+    free(arg);
+
+    while (1) {
+        sleep(interval);
+        if (needs_compaction()) {
+            retention_store_compact();
+        }
+    }
+    return NULL;
+}
+
+int retention_store_start_compactor(int interval_seconds) {
+    if (needs_compaction()) {
+        retention_store_compact();
+    }
+
+    int *arg = malloc(sizeof(int));
+    if (!arg) {
+        return -1;
+    }
+    *arg = interval_seconds;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, compactor_thread, arg) != 0) {
+        free(arg);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
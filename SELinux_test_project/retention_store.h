@@ -0,0 +1,147 @@
+#ifndef RETENTION_STORE_H
+#define RETENTION_STORE_H
+
+#include <stddef.h>
+#include <time.h>
+
+/**
+ * 映射二进制保留索引，并把保留信息文件中的记录加载到内存
+ * 
+ * 索引是上次合并时的全部记录，直接映射使用，启动时间与记录数无关；保留信息文件是
+ * 此后追加的记录(日志)，同一路径可能有多条，以最后一条为准。校验和不符的记录被忽略，
+ * 末尾不完整的记录(追加时崩溃)被截掉。旧版本的文本格式文件也作为日志加载。
+ * 
+ * @param db_path 保留信息文件路径，不存在时自动创建
+ * @param index_path 保留索引路径，不存在时为空索引；已损坏时返回失败
+ * @return 成功返回 0，失败返回 -1
+ */
+int retention_store_open(const char *db_path, const char *index_path);
+
+/**
+ * 设置记录是否等待落盘，在retention_store_open之前调用，默认等待
+ * 
+ * 等待时retention_store_set等函数在记录落盘后才返回；并发的调用组成一组，
+ * 共用一次fdatasync。不等待时记录只写入页缓存，崩溃时可能丢失。
+ * 
+ * @param enabled 1为等待落盘，0为不等待
+ */
+void retention_store_set_durable(int enabled);
+
+/**
+ * 记录文件的保留期限，覆盖该路径之前的记录
+ * 
+ * 记录(带有校验和)先追加到文件，再更新内存索引，落盘后返回。
+ * 
+ * @param path 文件路径
+ * @param creation_time 保留期开始时间
+ * @param retention_time 保留期限(秒)
+ * @return 成功返回 0，失败返回 -1
+ */
+int retention_store_set(const char *path, time_t creation_time, time_t retention_time);
+
+typedef struct {
+    const char *path;
+    time_t creation_time;
+    time_t retention_time;
+} retention_update;
+
+/**
+ * 在一次写入中记录多个文件的保留期限
+ * 
+ * 所有记录拼接后一次追加到文件，再依次更新内存索引，共用一次落盘；写入失败时都不生效。
+ * 同一路径出现多次时以最后一条为准。
+ * 
+ * @param updates 要记录的保留期限
+ * @param count 记录数
+ * @return 成功返回 0，失败返回 -1
+ */
+int retention_store_set_many(const retention_update *updates, size_t count);
+
+/**
+ * 查询文件的保留记录
+ * 
+ * @param path 文件路径
+ * @param creation_time 输出保留期开始时间
+ * @param retention_time 输出保留期限(秒)
+ * @return 找到返回 1，未找到返回 0
+ */
+int retention_store_get(const char *path, time_t *creation_time, time_t *retention_time);
+
+/**
+ * 删除文件的保留记录
+ * 
+ * 文件中追加一条保留期限为-1的记录作为墓碑，加载时遇到墓碑即删除该路径的记录。
+ * 墓碑不等待落盘，由之后的落盘一并写入。
+ * 
+ * @param path 文件路径
+ * @return 成功返回 0，失败返回 -1
+ */
+int retention_store_remove(const char *path);
+
+/**
+ * 从到期队列中取出已到期的记录
+ * 
+ * 保留期限大于0的记录按到期时间排成最小堆；取出的记录离开到期队列，
+ * 但仍留在保留表中，再次设置保留期限时重新加入。
+ * 
+ * @param now 当前时间，到期时间不晚于此时间的记录被取出
+ * @param paths 输出路径，由调用者free
+ * @param max 最多取出的条数
+ * @return 取出的条数
+ */
+size_t retention_store_take_expired(time_t now, char **paths, size_t max);
+
+/**
+ * 等待到期队列中最早的记录到期
+ * 
+ * 有更早到期的记录加入时提前返回。
+ * 
+ * @param limit 最多等待到此时间
+ */
+void retention_store_wait_expiry(time_t limit);
+
+/**
+ * @return 到期队列中的记录数
+ */
+size_t retention_store_expiry_pending(void);
+
+/**
+ * 在共享内存中发布保留表的只读副本，之后的变更在回应之前同步写入
+ * 
+ * 客户端映射后不经过socket直接查询(格式见immutable_protocol.h)。表满时建立
+ * 更大的表替换；无法替换时停止发布，客户端改用socket查询。
+ * 
+ * @param path 表的路径，通常在/dev/shm中
+ * @return 成功返回 0，失败返回 -1
+ */
+int retention_store_publish(const char *path);
+
+/**
+ * 停止发布共享内存中的保留表并删除，服务退出时调用
+ */
+void retention_store_unpublish(void);
+
+/**
+ * @return 保留表中的路径数
+ */
+size_t retention_store_count(void);
+
+/**
+ * 把日志中的记录合并到新的保留索引，改名替换旧索引
+ * 
+ * 开始时日志改名为db_path.merge，之后的记录写入新的日志；写出索引期间查询和
+ * 记录保留期限的调用都不受影响，只在换用新索引时短暂等待。
+ * 
+ * @return 成功返回 0，失败返回 -1
+ */
+int retention_store_compact(void);
+
+/**
+ * 启动后台合并线程，定期检查日志中的记录是否多到需要合并到索引
+ * 
+ * @param interval_seconds 检查间隔(秒)
+ * @return 成功返回 0，失败返回 -1
+ */
+int retention_store_start_compactor(int interval_seconds);
+
+#endif /* RETENTION_STORE_H */
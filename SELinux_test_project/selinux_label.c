@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/xattr.h>
+
+#ifdef HAVE_SELINUX
+#include <selinux/selinux.h>
+#endif
+
+#include "selinux_label.h"
+#include "service_log.h"
+
+#define IMMUTABLE_FILE_TYPE "immutable_file_t"
+#define FILE_ROLE "object_r"
+#define MAX_CONTEXT_LEN 256
+
+#ifndef HAVE_SELINUX
+// 没有libselinux时直接读写内核接口
+#define XATTR_NAME_SELINUX "security.selinux"
+#define SELINUXFS_ENFORCE "/sys/fs/selinux/enforce"
+#define PROC_CURRENT "/proc/self/attr/current"
+#define PROC_FSCREATE "/proc/thread-self/attr/fscreate"
+#endif
+
+static int label_enabled = 0;
+static char target_context[MAX_CONTEXT_LEN];
+
+static int selinux_is_enabled(void) {
+#ifdef HAVE_SELINUX
+    return is_selinux_enabled() > 0;
+#else
+    return access(SELINUXFS_ENFORCE, F_OK) == 0;
+#endif
+}
+
+static int get_process_context(char *buf, size_t len) {
+#ifdef HAVE_SELINUX
+    char *con = NULL;
+    if (getcon(&con) != 0) {
+        return -1;
+    }
+    int n = snprintf(buf, len, "%s", con);
+    freecon(con);
+    return (n < 0 || (size_t)n >= len) ? -1 : 0;
+#else
+    int fd = open(PROC_CURRENT, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t n = read(fd, buf, len - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+#endif
+}
+
+// user:role:type[:range] -> user:object_r:immutable_file_t[:range的低级别]
+static int build_file_context(const char *process_context, char *out, size_t len) {
+    char buf[MAX_CONTEXT_LEN];
+    snprintf(buf, sizeof(buf), "%s", process_context);
+
+    char *user = buf;
+    char *role = strchr(user, ':');
+    if (!role) {
+        return -1;
+    }
+    *role++ = '\0';
+    char *type = strchr(role, ':');
+    if (!type) {
+        return -1;
+    }
+    *type++ = '\0';
+    char *range = strchr(type, ':');
+
+    int n;
+    if (range) {
+        range++;
+        range[strcspn(range, "-")] = '\0';
+        n = snprintf(out, len, "%s:%s:%s:%s", user, FILE_ROLE, IMMUTABLE_FILE_TYPE, range);
+    } else {
+        n = snprintf(out, len, "%s:%s:%s", user, FILE_ROLE, IMMUTABLE_FILE_TYPE);
+    }
+    return (n < 0 || (size_t)n >= len) ? -1 : 0;
+}
+
+int selinux_label_init(const char *file_context) {
+    if (!selinux_is_enabled()) {
+        slog(SLOG_ERROR, LOG_WARNING, "SELinux未启用，不会为文件设置 %s 上下文", IMMUTABLE_FILE_TYPE);
+        label_enabled = 0;
+        target_context[0] = '\0';
+        return 0;
+    }
+
+    if (file_context) {
+        if (strlen(file_context) >= sizeof(target_context)) {
+            slog(SLOG_ERROR, LOG_ERR, "SELinux上下文过长: %s", file_context);
+            return -1;
+        }
+        strcpy(target_context, file_context);
+    } else {
+        char process_context[MAX_CONTEXT_LEN];
+        if (get_process_context(process_context, sizeof(process_context)) != 0 ||
+            build_file_context(process_context, target_context, sizeof(target_context)) != 0) {
+            slog(SLOG_ERROR, LOG_ERR, "无法根据服务进程的上下文推导 %s 上下文", IMMUTABLE_FILE_TYPE);
+            return -1;
+        }
+    }
+
+    label_enabled = 1;
+    slog(SLOG_INFO, LOG_NOTICE, "不可变文件的SELinux上下文: %s", target_context);
+    return 0;
+}
+
+int selinux_label_enabled(void) {
+    return label_enabled;
+}
+
+const char *selinux_label_context(void) {
+    return target_context;
+}
+
+int selinux_label_fd(int fd) {
+    if (!label_enabled) {
+        return 0;
+    }
+
+#ifdef HAVE_SELINUX
+    char *con = NULL;
+    if (fgetfilecon(fd, &con) >= 0) {
+        int same = strcmp(con, target_context) == 0;
+        freecon(con);
+        if (same) {
+            return 0;
+        }
+    }
+    if (fsetfilecon(fd, target_context) != 0) {
+        return -1;
+    }
+#else
+    char con[MAX_CONTEXT_LEN];
+    ssize_t n = fgetxattr(fd, XATTR_NAME_SELINUX, con, sizeof(con) - 1);
+    if (n > 0) {
+        con[n] = '\0';
+        if (strcmp(con, target_context) == 0) {
+            return 0;
+        }
+    }
+    if (fsetxattr(fd, XATTR_NAME_SELINUX, target_context, strlen(target_context) + 1, 0) != 0) {
+        return -1;
+    }
+#endif
+    return 1;
+}
+
+#ifndef HAVE_SELINUX
+static void write_fscreate(const char *context) {
+    int fd = open(PROC_FSCREATE, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    // 写入空内容表示恢复默认上下文
+    size_t len = context ? strlen(context) + 1 : 0;
+    if (write(fd, context, len) == -1) {
+        slog(SLOG_ERROR, LOG_ERR, "无法设置新建文件的SELinux上下文: %s", strerror(errno));
+    }
+    close(fd);
+}
+#endif
+
+void selinux_label_create_begin(void) {
+    if (!label_enabled) {
+        return;
+    }
+#ifdef HAVE_SELINUX
+    if (setfscreatecon(target_context) != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法设置新建文件的SELinux上下文: %s", strerror(errno));
+    }
+#else
+    write_fscreate(target_context);
+#endif
+}
+
+void selinux_label_create_end(void) {
+    if (!label_enabled) {
+        return;
+    }
+#ifdef HAVE_SELINUX
+    setfscreatecon(NULL);
+#else
+    write_fscreate(NULL);
+#endif
+}
@@ -0,0 +1,47 @@
+#ifndef SELINUX_LABEL_H
+#define SELINUX_LABEL_H
+
+/**
+ * 计算并缓存不可变文件的SELinux上下文
+ * 
+ * 未指定上下文时，由服务进程自身的上下文推导，
+ * 例如 system_u:system_r:immutable_service_t:s0 推导为
+ * system_u:object_r:immutable_file_t:s0。
+ * SELinux未启用时后续标记操作都不做任何事。
+ * 
+ * @param file_context 指定的上下文，为NULL时自动推导
+ * @return 成功返回 0，失败返回 -1
+ */
+int selinux_label_init(const char *file_context);
+
+/**
+ * @return SELinux已启用返回 1，否则返回 0
+ */
+int selinux_label_enabled(void);
+
+/**
+ * @return 缓存的不可变文件上下文，SELinux未启用时为空字符串
+ */
+const char *selinux_label_context(void);
+
+/**
+ * 为已打开的文件设置不可变上下文，上下文已正确时不做修改
+ * 
+ * @param fd 文件描述符
+ * @return 设置了新上下文返回 1，无需修改返回 0，失败返回 -1
+ */
+int selinux_label_fd(int fd);
+
+/**
+ * 使当前线程之后新建的文件直接带有不可变上下文
+ * 
+ * 必须与 selinux_label_create_end() 成对调用。
+ */
+void selinux_label_create_begin(void);
+
+/**
+ * 恢复当前线程新建文件的默认上下文
+ */
+void selinux_label_create_end(void);
+
+#endif /* SELINUX_LABEL_H */
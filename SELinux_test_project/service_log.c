@@ -0,0 +1,400 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+#include "service_log.h"
+
+#define SLOG_RING_SIZE 4096       // 缓冲区中的记录数，必须是2的幂
+#define SLOG_MSG_MAX 1000         // 一条记录的最大长度，更长的记录直接写入syslog
+#define SLOG_BATCH 64             // 后台线程一次sendmmsg发送的记录数
+#define SLOG_PATH "/dev/log"
+#define SLOG_RECONNECT_INTERVAL 1 // syslog不可用时重新连接的最短间隔(秒)
+
+// 缓冲区中的一条记录；seq为pos+1时已写好可以发送，为pos+SLOG_RING_SIZE时可以再次写入
+typedef struct {
+    uint64_t seq;
+    time_t time;
+    int priority;
+    int audit;
+    char msg[SLOG_MSG_MAX];
+} slog_cell;
+
+static int levels[SLOG_CATEGORIES] = { LOG_NOTICE, LOG_NOTICE, LOG_NOTICE, LOG_NOTICE };
+static const char *category_names[SLOG_CATEGORIES] = { "conn", "audit", "error", "info" };
+
+static slog_cell *ring = NULL;
+static uint64_t ring_tail = 0;     // 下一个要写入的位置，写入方用CAS领取
+static uint64_t ring_head = 0;     // 下一个要发送的位置，只有后台线程使用
+static int running = 0;            // 后台线程在运行，slog写入缓冲区
+static int stopping = 0;
+static int flusher_idle = 0;       // 后台线程准备等待，写入方需要唤醒它
+static int wake_fd = -1;
+static uint64_t dropped = 0;
+static pthread_t flusher;
+
+// 以下只在后台线程中使用
+static const char *log_ident = "";
+static pid_t log_pid;
+static int log_fd = -1;
+static int log_stream = 0;          // /dev/log是流式socket，每条记录以'\0'结尾
+static time_t log_retry_at = 0;
+
+static int parse_level(const char *name) {
+    static const struct { const char *name; int level; } names[] = {
+        { "off", -1 }, { "err", LOG_ERR }, { "warning", LOG_WARNING },
+        { "notice", LOG_NOTICE }, { "info", LOG_INFO }, { "debug", LOG_DEBUG },
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(name, names[i].name) == 0) {
+            return names[i].level;
+        }
+    }
+    return -2;
+}
+
+int slog_set_levels(const char *spec) {
+    char *copy = strdup(spec);
+    if (!copy) {
+        return -1;
+    }
+    int new_levels[SLOG_CATEGORIES];
+    memcpy(new_levels, levels, sizeof(levels));
+
+    int ret = 0;
+    char *save = NULL;
+    for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        int level = eq ? parse_level(eq + 1) : -2;
+        if (level == -2) {
+            ret = -1;
+            break;
+        }
+        *eq = '\0';
+        int found = 0;
+        for (int c = 0; c < SLOG_CATEGORIES; c++) {
+            if (strcmp(item, "all") == 0 || strcmp(item, category_names[c]) == 0) {
+                new_levels[c] = level;
+                found = 1;
+            }
+        }
+        if (!found) {
+            ret = -1;
+            break;
+        }
+    }
+    free(copy);
+    if (ret == 0) {
+        memcpy(levels, new_levels, sizeof(levels));
+    }
+    return ret;
+}
+
+uint64_t slog_dropped(void) {
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+// 唤醒等待中的后台线程；eventfd的计数不会溢出，写入失败时后台线程最迟在超时后醒来
+static void wake_flusher(void) {
+    uint64_t one = 1;
+    ssize_t ret = write(wake_fd, &one, sizeof(one));
+    (void)ret;
+}
+
+// 领取一个可写入的位置，缓冲区满时返回NULL
+static slog_cell *ring_claim(uint64_t *pos_out) {
+    uint64_t pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+    for (;;) {
+        slog_cell *cell = &ring[pos & (SLOG_RING_SIZE - 1)];
+        uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring_tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *pos_out = pos;
+                return cell;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void slog(slog_category category, int priority, const char *fmt, ...) {
+    if (priority > levels[category]) {
+        return;
+    }
+
+    va_list ap;
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        va_start(ap, fmt);
+        vsyslog(priority, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    uint64_t pos;
+    slog_cell *cell = ring_claim(&pos);
+    if (!cell) {
+        // 缓冲区满：审计记录在当前线程中直接写入，其他记录丢弃
+        if (category == SLOG_AUDIT) {
+            va_start(ap, fmt);
+            vsyslog(priority, fmt, ap);
+            va_end(ap);
+        } else {
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+
+    va_start(ap, fmt);
+    int len = vsnprintf(cell->msg, sizeof(cell->msg), fmt, ap);
+    va_end(ap);
+    cell->time = time(NULL);
+    cell->priority = priority;
+    cell->audit = category == SLOG_AUDIT;
+    if (len < 0 || len >= (int)sizeof(cell->msg)) {
+        // 过长的记录(通常是很长的路径)不截断，直接写入，位置留空
+        cell->msg[0] = '\0';
+        va_start(ap, fmt);
+        vsyslog(priority, fmt, ap);
+        va_end(ap);
+    }
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    // 后台线程在等待时才需要唤醒，平时不产生系统调用
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&flusher_idle, __ATOMIC_RELAXED)) {
+        wake_flusher();
+    }
+}
+
+// 连接/dev/log，失败后一段时间内不再重试
+static int log_connect(void) {
+    if (log_fd != -1) {
+        return 0;
+    }
+    time_t now = time(NULL);
+    if (now < log_retry_at) {
+        return -1;
+    }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy(addr.sun_path, SLOG_PATH);
+    int types[] = { SOCK_DGRAM, SOCK_STREAM };
+    for (int i = 0; i < 2; i++) {
+        log_fd = socket(AF_UNIX, types[i] | SOCK_CLOEXEC, 0);
+        if (log_fd == -1) {
+            break;
+        }
+        if (connect(log_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            log_stream = types[i] == SOCK_STREAM;
+            return 0;
+        }
+        int err = errno;
+        close(log_fd);
+        log_fd = -1;
+        if (err != EPROTOTYPE) {
+            break;
+        }
+    }
+    log_retry_at = now + SLOG_RECONNECT_INTERVAL;
+    return -1;
+}
+
+// syslog不可用时审计记录写到标准错误(systemd会将其送入日志)，其他记录丢弃
+static void log_fallback(slog_cell **cells, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (cells[i]->audit) {
+            fprintf(stderr, "%s[%d]: %s\n", log_ident, (int)log_pid, cells[i]->msg);
+        } else {
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// 按syslog的格式(与glibc的syslog相同)成批发送
+static void log_send(slog_cell **cells, size_t count) {
+    static time_t stamp_time = 0;
+    static char stamp[32];
+    char heads[SLOG_BATCH][128];
+    struct iovec iov[SLOG_BATCH][3];
+    struct mmsghdr msgs[SLOG_BATCH];
+
+    for (size_t i = 0; i < count; i++) {
+        if (cells[i]->time != stamp_time) {
+            struct tm tm;
+            localtime_r(&cells[i]->time, &tm);
+            strftime(stamp, sizeof(stamp), "%b %e %T", &tm);
+            stamp_time = cells[i]->time;
+        }
+        int head_len = snprintf(heads[i], sizeof(heads[i]), "<%d>%s %s[%d]: ",
+                                LOG_DAEMON | cells[i]->priority, stamp, log_ident, (int)log_pid);
+        iov[i][0] = (struct iovec){ heads[i], head_len };
+        iov[i][1] = (struct iovec){ cells[i]->msg, strlen(cells[i]->msg) };
+        iov[i][2] = (struct iovec){ "", 1 };
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = iov[i];
+    }
+
+    size_t sent = 0;
+    int retried = 0;
+    while (sent < count) {
+        if (log_connect() != 0) {
+            log_fallback(cells + sent, count - sent);
+            return;
+        }
+        for (size_t i = sent; i < count; i++) {
+            msgs[i].msg_hdr.msg_iovlen = log_stream ? 3 : 2;
+        }
+        int n = sendmmsg(log_fd, msgs + sent, count - sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        // syslog重启等情况下重新连接一次
+        close(log_fd);
+        log_fd = -1;
+        if (retried) {
+            log_fallback(cells + sent, count - sent);
+            return;
+        }
+        retried = 1;
+        log_retry_at = 0;
+    }
+}
+
+// 发送缓冲区中已写好的记录，返回发送的条数
+static size_t flush_batch(void) {
+    slog_cell *cells[SLOG_BATCH];
+    size_t count = 0;
+    uint64_t pos = ring_head;
+    while (count < SLOG_BATCH) {
+        slog_cell *cell = &ring[pos & (SLOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+            break;
+        }
+        pos++;
+        if (cell->msg[0] != '\0') {
+            cells[count++] = cell;
+        }
+    }
+    if (count > 0) {
+        log_send(cells, count);
+    }
+    // 发送完才归还位置，此前记录的内容仍被引用
+    for (; ring_head < pos; ring_head++) {
+        slog_cell *cell = &ring[ring_head & (SLOG_RING_SIZE - 1)];
+        __atomic_store_n(&cell->seq, ring_head + SLOG_RING_SIZE, __ATOMIC_RELEASE);
+    }
+    return count;
+}
+
+static int ring_ready(void) {
+    slog_cell *cell = &ring[ring_head & (SLOG_RING_SIZE - 1)];
+    return __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) == ring_head + 1;
+}
+
+static void *flusher_thread(void *arg) {
+    (void)arg;
+    uint64_t reported = 0;
+    for (;;) {
+        if (flush_batch() > 0) {
+            continue;
+        }
+
+        uint64_t lost = slog_dropped();
+        if (lost != reported) {
+            static slog_cell note;
+            slog_cell *cells[1] = { &note };
+            note.time = time(NULL);
+            note.priority = LOG_WARNING;
+            snprintf(note.msg, sizeof(note.msg), "日志缓冲区已满或syslog不可用，累计丢弃 %lu 条日志",
+                     (unsigned long)lost);
+            log_send(cells, 1);
+            reported = slog_dropped();  // syslog不可用时这条提示本身也会被计入
+        }
+
+        if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+            // 等已领取位置的写入方写完
+            if (ring_head == __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            struct timespec pause = { 0, 1000000 };
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        __atomic_store_n(&flusher_idle, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!ring_ready()) {
+            struct pollfd pfd = { .fd = wake_fd, .events = POLLIN };
+            if (poll(&pfd, 1, 1000) > 0) {
+                uint64_t count;
+                ssize_t ret = read(wake_fd, &count, sizeof(count));
+                (void)ret;
+            }
+        }
+        __atomic_store_n(&flusher_idle, 0, __ATOMIC_RELAXED);
+    }
+    if (log_fd != -1) {
+        close(log_fd);
+        log_fd = -1;
+    }
+    return NULL;
+}
+
+int slog_start(const char *ident) {
+    ring = malloc(SLOG_RING_SIZE * sizeof(slog_cell));
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!ring || wake_fd == -1) {
+        syslog(LOG_ERR, "无法启动日志线程，直接写入syslog: %s", strerror(errno));
+        free(ring);
+        ring = NULL;
+        if (wake_fd != -1) {
+            close(wake_fd);
+            wake_fd = -1;
+        }
+        return -1;
+    }
+    for (uint64_t i = 0; i < SLOG_RING_SIZE; i++) {
+        ring[i].seq = i;
+    }
+    log_ident = ident;
+    log_pid = getpid();
+    if (pthread_create(&flusher, NULL, flusher_thread, NULL) != 0) {
+        syslog(LOG_ERR, "无法启动日志线程，直接写入syslog");
+        free(ring);
+        ring = NULL;
+        close(wake_fd);
+        wake_fd = -1;
+        return -1;
+    }
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void slog_stop(void) {
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    // 之后的记录直接写入syslog；缓冲区和eventfd不释放，可能还有线程正在写入
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    wake_flusher();
+    pthread_join(flusher, NULL);
+}
@@ -0,0 +1,59 @@
+#ifndef SERVICE_LOG_H
+#define SERVICE_LOG_H
+
+#include <stdint.h>
+#include <syslog.h>
+
+// 日志的类别，每个类别可以单独设置记录的级别
+typedef enum {
+    SLOG_CONN = 0,   // 连接的建立、关闭、超时和协议错误
+    SLOG_AUDIT,      // 认证失败、修改、删除和保留期变更等安全相关的记录，缓冲区满时也不丢弃
+    SLOG_ERROR,      // 其他错误和警告
+    SLOG_INFO,       // 启动、配置和统计等一般信息
+    SLOG_CATEGORIES
+} slog_category;
+
+/**
+ * 设置各类别记录的级别
+ *
+ * 格式为逗号分隔的"类别=级别"，类别为conn、audit、error、info或all，
+ * 级别为off、err、warning、notice、info或debug，未提到的类别不变。
+ * 默认每个类别都记录notice及更重要的日志。
+ *
+ * @param spec 如 "conn=warning,audit=info"
+ * @return 成功返回 0，格式错误返回 -1
+ */
+int slog_set_levels(const char *spec);
+
+/**
+ * 启动后台写日志的线程，之后slog只把记录放入缓冲区
+ *
+ * 启动前(和启动失败时)slog直接调用syslog。记录由后台线程成批用sendmmsg发给
+ * /dev/log；缓冲区满时丢弃记录并计数，审计记录则改为在调用线程中直接写入syslog。
+ *
+ * @param ident 日志中的程序名，与openlog的一致
+ * @return 成功返回 0，失败返回 -1
+ */
+int slog_start(const char *ident);
+
+/**
+ * 写出缓冲区中的所有记录并停止后台线程，之后slog直接调用syslog
+ */
+void slog_stop(void);
+
+/**
+ * 记录一条日志，级别低于该类别的设置时直接返回，不格式化
+ *
+ * @param category 类别
+ * @param priority syslog的级别，如 LOG_ERR
+ * @param fmt printf格式
+ */
+void slog(slog_category category, int priority, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/**
+ * @return 因缓冲区满而丢弃的记录数
+ */
+uint64_t slog_dropped(void);
+
+#endif /* SERVICE_LOG_H */
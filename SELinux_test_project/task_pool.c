@@ -0,0 +1,101 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include "task_pool.h"
+#include "service_log.h"
+
+typedef struct task {
+    task_fn fn;
+    void *arg;
+    struct task *next;
+} task;
+
+// 不限长度的任务队列：任务由正在执行的任务产生，不能因队列满而阻塞
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static task *queue_head = NULL;
+static task *queue_tail = NULL;
+// queued和idle在锁内修改，task_pool_hungry不加锁读取
+static int queued = 0;       // 排队的任务数
+static int idle = 0;         // 等待任务的线程数
+static int started = 0;      // 已启动的线程数
+
+static void *task_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&pool_mutex);
+    for (;;) {
+        while (!queue_head) {
+            __atomic_add_fetch(&idle, 1, __ATOMIC_RELAXED);
+            pthread_cond_wait(&pool_cond, &pool_mutex);
+            __atomic_sub_fetch(&idle, 1, __ATOMIC_RELAXED);
+        }
+        task *t = queue_head;
+        queue_head = t->next;
+        if (!queue_head) {
+            queue_tail = NULL;
+        }
+        __atomic_sub_fetch(&queued, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&pool_mutex);
+        
+        t->fn(t->arg);
+        free(t);
+        
+        pthread_mutex_lock(&pool_mutex);
+    }
+    return NULL;
+}
+
+int task_pool_start(int threads) {
+    for (int i = 0; i < threads; i++) {
+        pthread_t tid;
+        int err = pthread_create(&tid, NULL, task_thread, NULL);
+        if (err != 0) {
+            slog(SLOG_ERROR, LOG_ERR, "无法创建后台任务线程: %s", strerror(err));
+            return -1;
+        }
+        pthread_detach(tid);
+        pthread_mutex_lock(&pool_mutex);
+        started++;
+        pthread_mutex_unlock(&pool_mutex);
+    }
+    return 0;
+}
+
+int task_pool_submit(task_fn fn, void *arg) {
+    task *t = malloc(sizeof(*t));
+    if (!t) {
+        return -1;
+    }
+    t->fn = fn;
+    t->arg = arg;
+    t->next = NULL;
+    
+    pthread_mutex_lock(&pool_mutex);
+    if (started == 0) {
+        pthread_mutex_unlock(&pool_mutex);
+        free(t);
+        errno = ENOSYS;
+        return -1;
+    }
+    if (queue_tail) {
+        queue_tail->next = t;
+    } else {
+        queue_head = t;
+    }
+    queue_tail = t;
+    __atomic_add_fetch(&queued, 1, __ATOMIC_RELAXED);
+    if (idle > 0) {
+        pthread_cond_signal(&pool_cond);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return 0;
+}
+
+int task_pool_hungry(void) {
+    // 只用于调度上的判断，读到旧值也没有关系
+    return __atomic_load_n(&queued, __ATOMIC_RELAXED) < __atomic_load_n(&idle, __ATOMIC_RELAXED);
+}
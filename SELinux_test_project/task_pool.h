@@ -0,0 +1,32 @@
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+
+typedef void (*task_fn)(void *arg);
+
+/**
+ * 启动后台任务线程池，供目录树操作等可以拆分的工作并行执行
+ * 
+ * @param threads 线程数
+ * @return 成功返回 0，失败返回 -1(已启动的线程继续使用)
+ */
+int task_pool_start(int threads);
+
+/**
+ * 提交一个任务，由空闲的线程执行
+ * 
+ * 任务不应阻塞等待其他任务完成，否则线程都在等待时会死锁。
+ * 
+ * @param fn 任务函数
+ * @param arg 传给任务函数的参数
+ * @return 成功返回 0；线程池未启动或内存不足时返回 -1，调用者应自己执行该任务
+ */
+int task_pool_submit(task_fn fn, void *arg);
+
+/**
+ * 检查线程池是否有空闲的线程，调用者据此决定提交任务还是自己执行
+ * 
+ * @return 排队的任务少于空闲线程时返回 1，否则返回 0
+ */
+int task_pool_hungry(void);
+
+#endif /* TASK_POOL_H */
@@ -0,0 +1,45 @@
+#!/bin/bash
+# 回归测试：批量请求中先设置目录中文件的保留期、再删除该目录时，
+# 该文件必须保留，目录中的其他文件照常删除
+#
+# 用法: tests/batch_retention.sh [服务程序] [客户端程序]
+
+SERVICE=$(realpath "${1:-./immutable_service}")
+CLIENT=$(realpath "${2:-./immutable_client}")
+WORK=$(mktemp -d /tmp/immutable_batch.XXXXXX)
+FAILED=0
+
+cleanup() {
+    [ -n "$SERVICE_PID" ] && kill "$SERVICE_PID" 2>/dev/null && wait "$SERVICE_PID" 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "失败: $*"
+    FAILED=1
+}
+
+mkdir -p "$WORK/data/d" "$WORK/meta"
+echo "kept" > "$WORK/data/d/kept"
+echo "gone" > "$WORK/data/d/gone"
+
+"$SERVICE" -s "$WORK/s.sock" -M "$WORK/meta" -H off -r "$WORK/data" > /dev/null 2>&1 &
+SERVICE_PID=$!
+export IMMUTABLE_SOCKET="$WORK/s.sock"
+for _ in $(seq 50); do
+    [ -S "$WORK/s.sock" ] && break
+    sleep 0.1
+done
+
+printf 'setretention %s 3600\ndelete %s\n' "$WORK/data/d/kept" "$WORK/data/d" |
+    "$CLIENT" batch - > /dev/null
+
+[ -e "$WORK/data/d/kept" ] || fail "刚设置了保留期的文件随目录被删除"
+[ -e "$WORK/data/d/gone" ] && fail "目录中没有保留期的文件没有被删除"
+"$CLIENT" getretention "$WORK/data/d/kept" | grep -q "[1-9][0-9]* 秒" || fail "保留期没有记录"
+
+if [ $FAILED -eq 0 ]; then
+    echo "通过"
+fi
+exit $FAILED
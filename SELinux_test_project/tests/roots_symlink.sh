@@ -0,0 +1,74 @@
+#!/bin/bash
+# 回归测试：设置--roots时，路径中间一级是指向根目录之外的符号链接，
+# 各种写入都必须失败，根目录之外的文件不被修改
+#
+# 用法: tests/roots_symlink.sh [服务程序] [客户端程序]
+
+SERVICE=$(realpath "${1:-./immutable_service}")
+CLIENT=$(realpath "${2:-./immutable_client}")
+WORK=$(mktemp -d /tmp/immutable_roots.XXXXXX)
+FAILED=0
+
+cleanup() {
+    [ -n "$SERVICE_PID" ] && kill "$SERVICE_PID" 2>/dev/null && wait "$SERVICE_PID" 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "失败: $*"
+    FAILED=1
+}
+
+# 期望客户端命令失败
+expect_refused() {
+    if "$CLIENT" "$@" > /dev/null 2>&1; then
+        fail "$* 没有被拒绝"
+    fi
+}
+
+mkdir -p "$WORK/data/sub" "$WORK/outside/tree" "$WORK/meta" "$WORK/src/d"
+ln -s "$WORK/outside" "$WORK/data/sub/esc"
+echo "same content" > "$WORK/outside/f"
+chmod 600 "$WORK/outside/f"
+echo "same content" > "$WORK/src/f"
+chmod 666 "$WORK/src/f"
+echo "tree file" > "$WORK/src/d/g"
+echo "old" > "$WORK/outside/tree/victim"
+
+# 启用内容去重，modify经由内容库的硬链接写入
+"$SERVICE" -s "$WORK/s.sock" -M "$WORK/meta" -H off -D on -r "$WORK/data" > /dev/null 2>&1 &
+SERVICE_PID=$!
+export IMMUTABLE_SOCKET="$WORK/s.sock"
+for _ in $(seq 50); do
+    [ -S "$WORK/s.sock" ] && break
+    sleep 0.1
+done
+
+# 内容相同的增量同步只设置属性，曾经作用于根目录之外的文件
+expect_refused rsync "$WORK/src/f" "$WORK/data/sub/esc/f"
+# 目标为中间一级经由符号链接的已存在目录
+expect_refused rsync "$WORK/src/f" "$WORK/data/sub/esc"
+expect_refused rsync "$WORK/src/d" "$WORK/data/sub/esc/tree"
+expect_refused modify "$WORK/data/sub/esc/f" "new content"
+expect_refused modifyfrom "$WORK/data/sub/esc/f" "$WORK/src/f"
+expect_refused append "$WORK/data/sub/esc/f" "tail"
+expect_refused pwrite "$WORK/data/sub/esc/f" 0 "x"
+expect_refused delete "$WORK/data/sub/esc/tree/victim"
+expect_refused delete "$WORK/data/sub/esc/tree"
+
+[ "$(stat -c %a "$WORK/outside/f")" = "600" ] || fail "根目录之外的文件的权限被修改"
+[ "$(cat "$WORK/outside/f")" = "same content" ] || fail "根目录之外的文件的内容被修改"
+[ "$(cat "$WORK/outside/tree/victim")" = "old" ] || fail "根目录之外的文件被删除或修改"
+[ -e "$WORK/outside/tree/d" ] && fail "在根目录之外创建了目录"
+[ -e "$WORK/outside/tree/f" ] && fail "在根目录之外创建了文件"
+
+# 根目录之下的同样操作照常进行
+"$CLIENT" rsync "$WORK/src/f" "$WORK/data/sub/f" > /dev/null || fail "根目录之下的增量同步失败"
+"$CLIENT" rsync "$WORK/src/d" "$WORK/data/sub/t" > /dev/null || fail "根目录之下的目录同步失败"
+[ "$(cat "$WORK/data/sub/t/d/g" 2>/dev/null)" = "tree file" ] || fail "目录同步的内容不对"
+
+if [ $FAILED -eq 0 ]; then
+    echo "通过"
+fi
+exit $FAILED
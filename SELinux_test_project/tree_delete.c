@@ -0,0 +1,327 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "tree_delete.h"
+#include "task_pool.h"
+#include "retention_store.h"
+#include "service_log.h"
+
+#define DENTS_BUF_SIZE (32 * 1024)  // 每次getdents64读取的缓冲区
+#define TREE_INLINE_DEPTH 32        // 当前线程连续深入的层数上限，更深的目录总是交给线程池
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// 一次删除的共享状态
+typedef struct {
+    uint64_t deleted;
+    uint64_t retained;
+    uint64_t failed;
+    int error;                  // 第一个失败的errno
+    int done;
+    int root_dirfd;             // 要删除的目录所在的目录
+    pthread_mutex_t mutex;
+    pthread_cond_t done_cond;
+} tree_job;
+
+// 一个待删除的目录：列出内容后等所有子目录处理完，由最后完成的一方删除该目录
+typedef struct tree_dir {
+    tree_job *job;
+    struct tree_dir *parent;
+    char *path;                 // 完整路径，用于检查保留期
+    const char *name;           // 在父目录中的名称，指向path中
+    int fd;                     // 列出内容时打开，删除该目录时关闭
+    int pending;                // 1(自身的列出) + 尚未完成的子目录数
+    int blocked;                // 子树中有保留或删除失败的项，该目录不能删除
+    int has_record;             // 该目录有已过期的保留记录
+} tree_dir;
+
+static void tree_dir_run(tree_dir *dir, int depth);
+
+static void job_fail(tree_job *job, int err) {
+    __atomic_add_fetch(&job->failed, 1, __ATOMIC_RELAXED);
+    int expected = 0;
+    __atomic_compare_exchange_n(&job->error, &expected, err, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+// 检查路径的保留期：未到返回 1；has_record输出是否有(已过期的)保留记录
+static int retention_active(const char *path, time_t now, int *has_record) {
+    time_t creation_time, retention_time;
+    if (!retention_store_get(path, &creation_time, &retention_time)) {
+        *has_record = 0;
+        return 0;
+    }
+    *has_record = 1;
+    return retention_time > 0 && creation_time + retention_time > now;
+}
+
+// 标记目录不能删除，子目录的处理可能在其他线程中
+static void dir_block(tree_dir *dir) {
+    __atomic_store_n(&dir->blocked, 1, __ATOMIC_RELEASE);
+}
+
+static tree_dir *tree_dir_new(tree_job *job, tree_dir *parent, const char *path, size_t len,
+                              size_t name_offset) {
+    tree_dir *dir = calloc(1, sizeof(*dir));
+    if (!dir) {
+        return NULL;
+    }
+    dir->path = malloc(len + 1);
+    if (!dir->path) {
+        free(dir);
+        return NULL;
+    }
+    memcpy(dir->path, path, len);
+    dir->path[len] = '\0';
+    dir->name = dir->path + name_offset;
+    dir->job = job;
+    dir->parent = parent;
+    dir->fd = -1;
+    dir->pending = 1;
+    return dir;
+}
+
+// 释放对目录的一个引用；最后一个引用删除该目录，再释放对父目录的引用
+static void tree_dir_release(tree_dir *dir) {
+    while (dir && __atomic_sub_fetch(&dir->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        tree_job *job = dir->job;
+        tree_dir *parent = dir->parent;
+
+        if (dir->fd != -1) {
+            close(dir->fd);
+        }
+        if (!__atomic_load_n(&dir->blocked, __ATOMIC_ACQUIRE)) {
+            int dirfd = parent ? parent->fd : job->root_dirfd;
+            if (unlinkat(dirfd, dir->name, AT_REMOVEDIR) == 0) {
+                __atomic_add_fetch(&job->deleted, 1, __ATOMIC_RELAXED);
+                if (dir->has_record) {
+                    retention_store_remove(dir->path);
+                }
+            } else {
+                slog(SLOG_ERROR, LOG_ERR, "无法删除目录 %s: %s", dir->path, strerror(errno));
+                job_fail(job, errno);
+                if (parent) {
+                    dir_block(parent);
+                }
+            }
+        } else if (parent) {
+            dir_block(parent);
+        }
+
+        free(dir->path);
+        free(dir);
+        if (!parent) {
+            pthread_mutex_lock(&job->mutex);
+            job->done = 1;
+            pthread_cond_broadcast(&job->done_cond);
+            pthread_mutex_unlock(&job->mutex);
+        }
+        dir = parent;
+    }
+}
+
+static void tree_dir_task(void *arg) {
+    tree_dir_run(arg, 0);
+}
+
+// 处理一个子目录：线程池有空闲线程或已深入太多层时交给线程池，否则直接处理
+static void tree_dir_spawn(tree_dir *dir, int depth) {
+    __atomic_add_fetch(&dir->parent->pending, 1, __ATOMIC_RELAXED);
+    if ((task_pool_hungry() || depth >= TREE_INLINE_DEPTH) &&
+        task_pool_submit(tree_dir_task, dir) == 0) {
+        return;
+    }
+    tree_dir_run(dir, depth + 1);
+}
+
+// 删除目录中的一项(目录以外的类型)，path为其完整路径
+static void tree_unlink_entry(tree_dir *dir, const char *name, const char *path, int has_record) {
+    tree_job *job = dir->job;
+    if (unlinkat(dir->fd, name, 0) == 0) {
+        __atomic_add_fetch(&job->deleted, 1, __ATOMIC_RELAXED);
+        if (has_record) {
+            retention_store_remove(path);
+        }
+        return;
+    }
+    if (errno == ENOENT) {
+        return;  // 已被其他请求删除
+    }
+    slog(SLOG_ERROR, LOG_ERR, "无法删除文件 %s: %s", path, strerror(errno));
+    job_fail(job, errno);
+    dir_block(dir);
+}
+
+// 打开并列出目录，删除其中的文件，子目录另行处理；完成后释放自身的引用
+static void tree_dir_run(tree_dir *dir, int depth) {
+    tree_job *job = dir->job;
+    char *buf = NULL;
+    char *child = NULL;
+
+    if (dir->fd == -1) {
+        dir->fd = openat(dir->parent->fd, dir->name,
+                         O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dir->fd == -1) {
+            slog(SLOG_ERROR, LOG_ERR, "无法打开目录 %s: %s", dir->path, strerror(errno));
+            job_fail(job, errno);
+            dir_block(dir);
+            goto out;
+        }
+    }
+
+    size_t path_len = strlen(dir->path);
+    buf = malloc(DENTS_BUF_SIZE);
+    child = malloc(path_len + NAME_MAX + 2);
+    if (!buf || !child) {
+        job_fail(job, ENOMEM);
+        dir_block(dir);
+        goto out;
+    }
+    memcpy(child, dir->path, path_len);
+    child[path_len] = '/';
+
+    time_t now = time(NULL);
+    for (;;) {
+        long n = syscall(SYS_getdents64, dir->fd, buf, DENTS_BUF_SIZE);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            slog(SLOG_ERROR, LOG_ERR, "无法读取目录 %s: %s", dir->path, strerror(errno));
+            job_fail(job, errno);
+            dir_block(dir);
+            break;
+        }
+
+        for (long off = 0; off < n; ) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + off);
+            off += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            size_t name_len = strlen(name);
+            memcpy(child + path_len + 1, name, name_len + 1);
+
+            int has_record;
+            if (retention_active(child, now, &has_record)) {
+                slog(SLOG_AUDIT, LOG_WARNING, "%s 还在保留期内，不删除", child);
+                __atomic_add_fetch(&job->retained, 1, __ATOMIC_RELAXED);
+                dir_block(dir);
+                continue;
+            }
+
+            unsigned char type = d->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                    if (errno != ENOENT) {
+                        slog(SLOG_ERROR, LOG_ERR, "无法获取 %s 的状态: %s", child, strerror(errno));
+                        job_fail(job, errno);
+                        dir_block(dir);
+                    }
+                    continue;
+                }
+                type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+            }
+
+            if (type != DT_DIR) {
+                tree_unlink_entry(dir, name, child, has_record);
+                continue;
+            }
+            tree_dir *sub = tree_dir_new(job, dir, child, path_len + 1 + name_len, path_len + 1);
+            if (!sub) {
+                job_fail(job, ENOMEM);
+                dir_block(dir);
+                continue;
+            }
+            sub->has_record = has_record;
+            tree_dir_spawn(sub, depth);
+        }
+    }
+
+out:
+    free(buf);
+    free(child);
+    tree_dir_release(dir);
+}
+
+int tree_delete(int dirfd, const char *name, const char *path, tree_delete_stats *stats) {
+    tree_job job = { 0 };
+    job.root_dirfd = dirfd;
+    pthread_mutex_init(&job.mutex, NULL);
+    pthread_cond_init(&job.done_cond, NULL);
+
+    // 去掉末尾的'/'，使拼接出的路径与保留记录中的一致，最后一级也不会跟随符号链接
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') {
+        len--;
+    }
+    size_t name_len = strlen(name);
+    while (name_len > 1 && name[name_len - 1] == '/') {
+        name_len--;
+    }
+    tree_dir *root = tree_dir_new(&job, NULL, path, len, 0);
+    char *root_name = strndup(name, name_len);
+    if (!root || !root_name) {
+        if (root) {
+            free(root->path);
+            free(root);
+        }
+        job_fail(&job, ENOMEM);
+        job.done = 1;
+    } else {
+        root->name = root_name;
+        root->fd = openat(dirfd, root_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (root->fd == -1) {
+            slog(SLOG_ERROR, LOG_ERR, "无法打开目录 %s: %s", path, strerror(errno));
+            job_fail(&job, errno);
+            free(root->path);
+            free(root);
+            job.done = 1;
+        } else {
+            tree_dir_run(root, 0);
+        }
+    }
+
+    // 当前线程处理完自己的部分后，等待线程池中的子目录完成
+    pthread_mutex_lock(&job.mutex);
+    while (!job.done) {
+        pthread_cond_wait(&job.done_cond, &job.mutex);
+    }
+    pthread_mutex_unlock(&job.mutex);
+    pthread_cond_destroy(&job.done_cond);
+    pthread_mutex_destroy(&job.mutex);
+    free(root_name);
+
+    stats->deleted = job.deleted;
+    stats->retained = job.retained;
+    stats->failed = job.failed;
+    if (job.failed > 0) {
+        errno = job.error;
+        return -1;
+    }
+    if (job.retained > 0) {
+        errno = EBUSY;
+        return -1;
+    }
+    return 0;
+}
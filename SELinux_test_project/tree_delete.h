@@ -0,0 +1,33 @@
+#ifndef TREE_DELETE_H
+#define TREE_DELETE_H
+
+#include <stdint.h>
+
+// 一次目录树删除的统计，目录和文件都按项计数
+typedef struct {
+    uint64_t deleted;    // 已删除的项
+    uint64_t retained;   // 保留期未到而保留的项(保留的目录不再深入)
+    uint64_t failed;     // 删除失败的项
+} tree_delete_stats;
+
+/**
+ * 删除目录及其中的所有内容
+ * 
+ * 用getdents64列出目录，相对于目录的文件描述符用unlinkat删除，不跟随符号链接。
+ * 每一项都按完整路径检查保留期，保留期未到的项及其所在的各级目录被保留，
+ * 其余的照常删除；已过期的保留记录随文件一起删除。
+ * 子目录在有空闲线程时交给后台任务线程池(task_pool)并行处理，否则由当前线程处理。
+ * 不检查path本身的保留期，由调用者检查。
+ * 目录本身相对于dirfd打开和删除，调用者应经由目录缓存(dir_cache)打开所在的目录，
+ * 使设置了根目录时删除不会经由符号链接离开根目录。
+ * 
+ * @param dirfd 目录所在的目录
+ * @param name 目录在dirfd中的名称，末尾可以有'/'
+ * @param path 目录的完整路径，用于检查保留期和日志
+ * @param stats 输出统计信息
+ * @return 全部删除返回 0，有保留或失败的项返回 -1，errno为第一个失败的原因，
+ *         只有保留的项时为EBUSY
+ */
+int tree_delete(int dirfd, const char *name, const char *path, tree_delete_stats *stats);
+
+#endif /* TREE_DELETE_H */
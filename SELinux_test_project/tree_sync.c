@@ -0,0 +1,698 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <syslog.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "immutable_service.h"
+#include "tree_sync.h"
+#include "task_pool.h"
+#include "delta_sync.h"
+#include "selinux_label.h"
+#include "uring_io.h"
+#include "dir_cache.h"
+#include "service_log.h"
+
+#define DENTS_BUF_SIZE (32 * 1024)  // 每次getdents64读取的缓冲区
+#define TREE_INLINE_DEPTH 32        // 当前线程连续深入的层数上限，更深的目录总是交给线程池
+#define FILE_GROUP_SIZE 32          // 一个任务同步的文件数，同一目录中的文件也可以并行同步
+#define COMMIT_BATCH 4096           // 积累多少项后落盘并提交一批
+#define RENAME_GROUP 64             // 一次提交给io_uring的改名操作数
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// 等待提交的一项：替换文件，或在目录中的所有项提交之后设置目录的属性
+typedef struct commit_entry {
+    struct commit_entry *next;
+    int is_dir;
+    dev_t dev;                  // 临时文件所在的文件系统
+    char *tmp_path;             // 文件: 已写入新内容的临时文件
+    char *path;                 // 目标路径
+    struct stat st;             // 目录: 源目录的属性
+} commit_entry;
+
+// 一次同步的共享状态
+typedef struct {
+    tree_sync_stats stats;      // 各计数用原子操作更新
+    int error;                  // 第一个失败的errno
+    int root_fd;                // 目标根目录，用于syncfs
+    dev_t root_dev;
+    unsigned long tmp_counter;  // 符号链接临时名称的序号
+
+    pthread_mutex_t list_mutex; // 保护提交队列
+    commit_entry *head;
+    commit_entry *tail;
+    size_t count;
+    pthread_mutex_t flush_mutex;  // 同一时间只有一个线程提交，保证各批按顺序执行
+
+    int done;
+    pthread_mutex_t done_mutex;
+    pthread_cond_t done_cond;
+} sync_job;
+
+// 一个正在同步的目录，最后一个引用释放时排入设置属性的提交项
+typedef struct sync_dir {
+    sync_job *job;
+    struct sync_dir *parent;
+    char *src;                  // 源目录完整路径
+    char *dst;                  // 目标目录完整路径
+    const char *name;           // 在父目录中的名称，指向dst中
+    int src_fd;
+    int dst_fd;
+    dev_t dst_dev;
+    struct stat st;             // 源目录的属性
+    int ok;                     // 源和目标目录都已打开
+    int pending;                // 1(自身的列出) + 尚未完成的子目录和文件组
+} sync_dir;
+
+// 同一目录中一组待同步的文件
+typedef struct {
+    sync_dir *dir;
+    int count;
+    char *names[FILE_GROUP_SIZE];
+} file_group;
+
+static void sync_dir_run(sync_dir *dir, int depth);
+
+static void stat_add(uint64_t *counter, uint64_t value) {
+    __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+static void job_fail(sync_job *job, int err) {
+    stat_add(&job->stats.failed, 1);
+    int expected = 0;
+    __atomic_compare_exchange_n(&job->error, &expected, err, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static char *join_path(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    char *path = malloc(dir_len + name_len + 2);
+    if (path) {
+        memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
+        memcpy(path + dir_len + 1, name, name_len + 1);
+    }
+    return path;
+}
+
+// 设置目录的权限、属主和修改时间，与rsync -a一样在目录中的内容同步完之后进行
+static void apply_dir_metadata(const commit_entry *e) {
+    int fd = open_path(e->path, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        slog(SLOG_ERROR, LOG_WARNING, "无法打开目录 %s 设置属性: %s", e->path, strerror(errno));
+        return;
+    }
+    if (fchown(fd, e->st.st_uid, e->st.st_gid) != 0 && errno != EPERM) {
+        slog(SLOG_ERROR, LOG_WARNING, "无法设置目录 %s 的属主: %s", e->path, strerror(errno));
+    }
+    fchmod(fd, e->st.st_mode & 07777);
+    struct timespec times[2] = {
+        { .tv_sec = 0, .tv_nsec = UTIME_OMIT },
+        e->st.st_mtim
+    };
+    futimens(fd, times);
+    close(fd);
+}
+
+// 执行一组改名，io_uring不可用时逐个renameat。临时文件与目标在同一目录中，
+// 改名相对于经由目录缓存打开的该目录进行
+static void rename_group(sync_job *job, commit_entry **entries, size_t count) {
+    uring_op ops[RENAME_GROUP];
+    dir_ref *dirs[RENAME_GROUP];
+    commit_entry *renamed[RENAME_GROUP];
+    size_t n = 0;
+    memset(ops, 0, sizeof(ops));
+    for (size_t i = 0; i < count; i++) {
+        const char *name;
+        dir_ref *dir = dir_cache_parent(entries[i]->path, 0, &name);
+        if (!dir) {
+            slog(SLOG_ERROR, LOG_ERR, "无法将 %s 替换为新内容: %s", entries[i]->path, strerror(errno));
+            job_fail(job, errno);
+            continue;
+        }
+        dirs[n] = dir;
+        renamed[n] = entries[i];
+        ops[n].op = URING_RENAMEAT;
+        ops[n].fd = dir_ref_fd(dir);
+        ops[n].path = strrchr(entries[i]->tmp_path, '/') + 1;
+        ops[n].path2 = name;
+        n++;
+    }
+    if (uring_io_submit(ops, n, 0) != 0) {
+        for (size_t i = 0; i < n; i++) {
+            ops[i].result = renameat(ops[i].fd, ops[i].path, ops[i].fd, ops[i].path2) == 0 ? 0 : -errno;
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (ops[i].result != 0) {
+            slog(SLOG_ERROR, LOG_ERR, "无法将 %s 替换为新内容: %s", renamed[i]->path, strerror(-ops[i].result));
+            unlinkat(ops[i].fd, ops[i].path, 0);
+            job_fail(job, -ops[i].result);
+        }
+        dir_cache_release(dirs[i]);
+    }
+}
+
+// 提交队列中已有的项：先落盘临时文件的内容，再按排队的顺序替换目标文件和设置目录属性
+static void commit_flush(sync_job *job) {
+    pthread_mutex_lock(&job->flush_mutex);
+    pthread_mutex_lock(&job->list_mutex);
+    commit_entry *list = job->head;
+    job->head = job->tail = NULL;
+    job->count = 0;
+    pthread_mutex_unlock(&job->list_mutex);
+
+    if (list) {
+        if (syncfs(job->root_fd) != 0) {
+            slog(SLOG_ERROR, LOG_WARNING, "syncfs失败，逐个文件落盘: %s", strerror(errno));
+        }
+        // 不在目标根目录所在文件系统上的临时文件单独落盘
+        for (commit_entry *e = list; e; e = e->next) {
+            if (!e->is_dir && e->dev != job->root_dev) {
+                int fd = open_path(e->tmp_path, O_RDONLY);
+                if (fd != -1) {
+                    fsync(fd);
+                    close(fd);
+                }
+            }
+        }
+
+        commit_entry *group[RENAME_GROUP];
+        size_t n = 0;
+        for (commit_entry *e = list; e; e = e->next) {
+            if (e->is_dir) {
+                rename_group(job, group, n);
+                n = 0;
+                apply_dir_metadata(e);
+                continue;
+            }
+            group[n++] = e;
+            if (n == RENAME_GROUP) {
+                rename_group(job, group, n);
+                n = 0;
+            }
+        }
+        rename_group(job, group, n);
+    }
+    pthread_mutex_unlock(&job->flush_mutex);
+
+    while (list) {
+        commit_entry *next = list->next;
+        free(list->tmp_path);
+        free(list->path);
+        free(list);
+        list = next;
+    }
+}
+
+// 加入提交队列，积累到一批时由当前线程提交
+static void commit_push(sync_job *job, commit_entry *e) {
+    e->next = NULL;
+    pthread_mutex_lock(&job->list_mutex);
+    if (job->tail) {
+        job->tail->next = e;
+    } else {
+        job->head = e;
+    }
+    job->tail = e;
+    int full = ++job->count >= COMMIT_BATCH;
+    pthread_mutex_unlock(&job->list_mutex);
+
+    if (full) {
+        commit_flush(job);
+    }
+}
+
+// 把已写好的临时文件(或符号链接)加入提交队列
+static void commit_file(sync_job *job, dev_t dev, const char *tmp_path, const char *path) {
+    commit_entry *e = calloc(1, sizeof(*e));
+    if (e) {
+        e->dev = dev;
+        e->tmp_path = strdup(tmp_path);
+        e->path = strdup(path);
+    }
+    if (!e || !e->tmp_path || !e->path) {
+        if (e) {
+            free(e->tmp_path);
+            free(e->path);
+            free(e);
+        }
+        unlink_path(tmp_path);
+        job_fail(job, ENOMEM);
+        return;
+    }
+    stat_add(&job->stats.files_updated, 1);
+    commit_push(job, e);
+}
+
+static sync_dir *sync_dir_new(sync_job *job, sync_dir *parent, const char *name) {
+    sync_dir *dir = calloc(1, sizeof(*dir));
+    if (!dir) {
+        return NULL;
+    }
+    dir->src = join_path(parent->src, name);
+    dir->dst = join_path(parent->dst, name);
+    if (!dir->src || !dir->dst) {
+        free(dir->src);
+        free(dir->dst);
+        free(dir);
+        return NULL;
+    }
+    dir->name = dir->dst + strlen(parent->dst) + 1;
+    dir->job = job;
+    dir->parent = parent;
+    dir->src_fd = dir->dst_fd = -1;
+    dir->pending = 1;
+    return dir;
+}
+
+// 释放对目录的一个引用；最后一个引用排入目录属性的提交项，再释放对父目录的引用
+static void sync_dir_release(sync_dir *dir) {
+    while (dir && __atomic_sub_fetch(&dir->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        sync_job *job = dir->job;
+        sync_dir *parent = dir->parent;
+
+        if (dir->ok) {
+            commit_entry *e = calloc(1, sizeof(*e));
+            if (e) {
+                e->is_dir = 1;
+                e->path = dir->dst;
+                e->st = dir->st;
+                dir->dst = NULL;
+                commit_push(job, e);
+            }
+        }
+        if (dir->src_fd != -1) {
+            close(dir->src_fd);
+        }
+        if (dir->dst_fd != -1) {
+            close(dir->dst_fd);
+        }
+        free(dir->src);
+        free(dir->dst);
+        free(dir);
+
+        if (!parent) {
+            pthread_mutex_lock(&job->done_mutex);
+            job->done = 1;
+            pthread_cond_broadcast(&job->done_cond);
+            pthread_mutex_unlock(&job->done_mutex);
+        }
+        dir = parent;
+    }
+}
+
+static void sync_dir_task(void *arg) {
+    sync_dir_run(arg, 0);
+}
+
+static void file_group_run(file_group *group) {
+    sync_dir *dir = group->dir;
+    sync_job *job = dir->job;
+    char tmp_path[PATH_MAX];
+
+    for (int i = 0; i < group->count; i++) {
+        char *src = join_path(dir->src, group->names[i]);
+        char *dst = join_path(dir->dst, group->names[i]);
+        if (!src || !dst) {
+            job_fail(job, ENOMEM);
+        } else {
+            delta_stats stats;
+            int ret = delta_sync_file_deferred(src, dst, tmp_path, sizeof(tmp_path), &stats);
+            if (ret < 0) {
+                job_fail(job, errno);
+            } else {
+                stat_add(&job->stats.bytes_total, stats.bytes_total);
+                stat_add(&job->stats.bytes_literal, stats.bytes_literal);
+                stat_add(&job->stats.bytes_reused, stats.bytes_reused);
+                if (ret == 1) {
+                    commit_file(job, dir->dst_dev, tmp_path, dst);
+                } else {
+                    stat_add(&job->stats.files_unchanged, 1);
+                }
+            }
+        }
+        free(src);
+        free(dst);
+        free(group->names[i]);
+    }
+    free(group);
+    sync_dir_release(dir);
+}
+
+static void file_group_task(void *arg) {
+    file_group_run(arg);
+}
+
+// 交出一组文件：线程池有空闲线程时并行同步，否则由当前线程同步
+static void file_group_spawn(file_group *group) {
+    __atomic_add_fetch(&group->dir->pending, 1, __ATOMIC_RELAXED);
+    if (task_pool_hungry() && task_pool_submit(file_group_task, group) == 0) {
+        return;
+    }
+    file_group_run(group);
+}
+
+// 处理一个子目录：线程池有空闲线程或已深入太多层时交给线程池，否则直接处理
+static void sync_dir_spawn(sync_dir *dir, int depth) {
+    __atomic_add_fetch(&dir->parent->pending, 1, __ATOMIC_RELAXED);
+    if ((task_pool_hungry() || depth >= TREE_INLINE_DEPTH) &&
+        task_pool_submit(sync_dir_task, dir) == 0) {
+        return;
+    }
+    sync_dir_run(dir, depth + 1);
+}
+
+// 打开(不存在时创建)目标目录，新建的目录直接带有不可变上下文
+static int open_dst_dir(int parent_fd, const char *name, const char *path, mode_t mode) {
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd != -1) {
+        selinux_label_fd(fd);
+        return fd;
+    }
+    if (errno != ENOENT) {
+        return -1;
+    }
+
+    selinux_label_create_begin();
+    int ret = mkdirat(parent_fd, name, mode);
+    int err = errno;
+    selinux_label_create_end();
+    if (ret != 0 && err != EEXIST) {
+        errno = err;
+        return -1;
+    }
+    fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        slog(SLOG_ERROR, LOG_ERR, "无法打开新建的目录 %s: %s", path, strerror(errno));
+    }
+    return fd;
+}
+
+// 同步符号链接：目标与源相同时不做修改，否则在同一目录中建立新链接后替换
+static void sync_symlink(sync_dir *dir, const char *name) {
+    sync_job *job = dir->job;
+    char target[PATH_MAX];
+    char current[PATH_MAX];
+
+    ssize_t len = readlinkat(dir->src_fd, name, target, sizeof(target) - 1);
+    if (len < 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法读取符号链接 %s/%s: %s", dir->src, name, strerror(errno));
+        job_fail(job, errno);
+        return;
+    }
+    target[len] = '\0';
+
+    ssize_t cur_len = readlinkat(dir->dst_fd, name, current, sizeof(current) - 1);
+    if (cur_len == len && memcmp(current, target, len) == 0) {
+        stat_add(&job->stats.files_unchanged, 1);
+        return;
+    }
+
+    char tmp_name[NAME_MAX + 1];
+    int ret;
+    do {
+        unsigned long seq = __atomic_add_fetch(&job->tmp_counter, 1, __ATOMIC_RELAXED);
+        snprintf(tmp_name, sizeof(tmp_name), ".%.200s.%lx.%lx", name, (unsigned long)getpid(), seq);
+        selinux_label_create_begin();
+        ret = symlinkat(target, dir->dst_fd, tmp_name);
+        int err = errno;
+        selinux_label_create_end();
+        errno = err;
+    } while (ret != 0 && errno == EEXIST);
+    if (ret != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法在 %s 中建立符号链接: %s", dir->dst, strerror(errno));
+        job_fail(job, errno);
+        return;
+    }
+
+    struct stat st;
+    if (fstatat(dir->src_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        fchownat(dir->dst_fd, tmp_name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW);
+        struct timespec times[2] = {
+            { .tv_sec = 0, .tv_nsec = UTIME_OMIT },
+            st.st_mtim
+        };
+        utimensat(dir->dst_fd, tmp_name, times, AT_SYMLINK_NOFOLLOW);
+    }
+
+    char *tmp_path = join_path(dir->dst, tmp_name);
+    char *path = join_path(dir->dst, name);
+    if (!tmp_path || !path) {
+        unlinkat(dir->dst_fd, tmp_name, 0);
+        job_fail(job, ENOMEM);
+    } else {
+        commit_file(job, dir->dst_dev, tmp_path, path);
+    }
+    free(tmp_path);
+    free(path);
+}
+
+// 打开源目录和目标目录，列出源目录，文件分组同步，子目录另行处理；完成后释放自身的引用
+static void sync_dir_run(sync_dir *dir, int depth) {
+    sync_job *job = dir->job;
+    char *buf = NULL;
+    file_group *group = NULL;
+
+    if (dir->src_fd == -1) {
+        dir->src_fd = openat(dir->parent->src_fd, dir->name,
+                             O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dir->src_fd == -1 || fstat(dir->src_fd, &dir->st) != 0) {
+            slog(SLOG_ERROR, LOG_ERR, "无法打开源目录 %s: %s", dir->src, strerror(errno));
+            job_fail(job, errno);
+            goto out;
+        }
+        // 先只允许服务自己访问，同步完内容后再设置源目录的权限
+        dir->dst_fd = open_dst_dir(dir->parent->dst_fd, dir->name, dir->dst, 0700);
+        if (dir->dst_fd == -1) {
+            slog(SLOG_ERROR, LOG_ERR, "无法创建目标目录 %s: %s", dir->dst, strerror(errno));
+            job_fail(job, errno);
+            goto out;
+        }
+        struct stat dst_st;
+        dir->dst_dev = fstat(dir->dst_fd, &dst_st) == 0 ? dst_st.st_dev : job->root_dev;
+    }
+    dir->ok = 1;
+    stat_add(&job->stats.dirs, 1);
+
+    buf = malloc(DENTS_BUF_SIZE);
+    if (!buf) {
+        job_fail(job, ENOMEM);
+        goto out;
+    }
+
+    for (;;) {
+        long n = syscall(SYS_getdents64, dir->src_fd, buf, DENTS_BUF_SIZE);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            slog(SLOG_ERROR, LOG_ERR, "无法读取目录 %s: %s", dir->src, strerror(errno));
+            job_fail(job, errno);
+            break;
+        }
+
+        for (long off = 0; off < n; ) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + off);
+            off += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+
+            unsigned char type = d->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(dir->src_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                    if (errno != ENOENT) {
+                        job_fail(job, errno);
+                    }
+                    continue;
+                }
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG :
+                       S_ISLNK(st.st_mode) ? DT_LNK : DT_FIFO;
+            }
+
+            if (type == DT_DIR) {
+                sync_dir *sub = sync_dir_new(job, dir, name);
+                if (!sub) {
+                    job_fail(job, ENOMEM);
+                    continue;
+                }
+                sync_dir_spawn(sub, depth);
+            } else if (type == DT_REG) {
+                if (!group) {
+                    group = calloc(1, sizeof(*group));
+                    if (!group) {
+                        job_fail(job, ENOMEM);
+                        continue;
+                    }
+                    group->dir = dir;
+                }
+                group->names[group->count] = strdup(name);
+                if (!group->names[group->count]) {
+                    job_fail(job, ENOMEM);
+                    continue;
+                }
+                if (++group->count == FILE_GROUP_SIZE) {
+                    file_group_spawn(group);
+                    group = NULL;
+                }
+            } else if (type == DT_LNK) {
+                sync_symlink(dir, name);
+            } else {
+                slog(SLOG_ERROR, LOG_WARNING, "跳过不支持的文件类型: %s/%s", dir->src, name);
+                stat_add(&job->stats.skipped, 1);
+            }
+        }
+    }
+    if (group && group->count > 0) {
+        file_group_spawn(group);
+        group = NULL;
+    }
+
+out:
+    free(group);
+    free(buf);
+    sync_dir_release(dir);
+}
+
+int tree_sync(const char *src, const char *dst, tree_sync_stats *stats) {
+    sync_job job;
+    char *dst_base = NULL;
+    memset(&job, 0, sizeof(job));
+    job.root_fd = -1;
+    pthread_mutex_init(&job.list_mutex, NULL);
+    pthread_mutex_init(&job.flush_mutex, NULL);
+    pthread_mutex_init(&job.done_mutex, NULL);
+    pthread_cond_init(&job.done_cond, NULL);
+
+    sync_dir *root = calloc(1, sizeof(*root));
+    if (!root) {
+        job_fail(&job, ENOMEM);
+        goto out;
+    }
+    root->job = &job;
+    root->src_fd = root->dst_fd = -1;
+    root->pending = 1;
+
+    // 与rsync一样，源路径以'/'结尾时同步其中的内容，否则同步到目标下的同名目录
+    size_t src_len = strlen(src);
+    int contents = src_len > 1 && src[src_len - 1] == '/';
+    while (src_len > 1 && src[src_len - 1] == '/') {
+        src_len--;
+    }
+    root->src = strndup(src, src_len);
+    const char *base = root->src ? strrchr(root->src, '/') : NULL;
+    base = base ? base + 1 : root->src;
+    // 目标路径末尾的'/'不影响含义，去掉后最后一级才能不跟随符号链接地打开
+    size_t dst_len = strlen(dst);
+    while (dst_len > 1 && dst[dst_len - 1] == '/') {
+        dst_len--;
+    }
+    dst_base = strndup(dst, dst_len);
+    root->dst = !root->src || !dst_base ? NULL : contents ? strdup(dst_base) : join_path(dst_base, base);
+    if (!root->src || !root->dst) {
+        job_fail(&job, ENOMEM);
+        goto fail_root;
+    }
+
+    root->src_fd = open(root->src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root->src_fd == -1 || fstat(root->src_fd, &root->st) != 0) {
+        slog(SLOG_ERROR, LOG_ERR, "无法打开源目录 %s: %s", root->src, strerror(errno));
+        job_fail(&job, errno);
+        goto fail_root;
+    }
+    // 目标目录所在的目录经由目录缓存打开(不存在时逐级创建)，设置了根目录时不会离开根目录；
+    // 之下的各级目录都用openat相对于上一级打开，不跟随符号链接
+    const char *dst_name;
+    dir_ref *dst_dir = dir_cache_parent(dst_base, 1, &dst_name);
+    int dst_parent = dst_dir ? open_dst_dir(dir_ref_fd(dst_dir), dst_name, dst_base, 0755) : -1;
+    if (dst_dir) {
+        int err = errno;
+        dir_cache_release(dst_dir);
+        errno = err;
+    }
+    if (dst_parent == -1) {
+        slog(SLOG_ERROR, LOG_ERR, "无法创建目标目录 %s: %s", dst_base, strerror(errno));
+        job_fail(&job, errno);
+        goto fail_root;
+    }
+    root->dst_fd = contents ? dst_parent : open_dst_dir(dst_parent, base, root->dst, 0700);
+    if (!contents) {
+        close(dst_parent);
+    }
+    if (root->dst_fd == -1) {
+        slog(SLOG_ERROR, LOG_ERR, "无法创建目标目录 %s: %s", root->dst, strerror(errno));
+        job_fail(&job, errno);
+        goto fail_root;
+    }
+    job.root_fd = dup(root->dst_fd);
+    struct stat dst_st;
+    if (job.root_fd == -1 || fstat(job.root_fd, &dst_st) != 0) {
+        job_fail(&job, errno);
+        goto fail_root;
+    }
+    job.root_dev = root->dst_dev = dst_st.st_dev;
+
+    // 当前线程处理根目录，再等待线程池中的其余部分完成
+    sync_dir_run(root, 0);
+    pthread_mutex_lock(&job.done_mutex);
+    while (!job.done) {
+        pthread_cond_wait(&job.done_cond, &job.done_mutex);
+    }
+    pthread_mutex_unlock(&job.done_mutex);
+
+    // 提交剩余的项，再落盘一次使替换和目录属性持久化
+    commit_flush(&job);
+    if (syncfs(job.root_fd) != 0) {
+        slog(SLOG_ERROR, LOG_WARNING, "syncfs失败: %s", strerror(errno));
+    }
+    goto out;
+
+fail_root:
+    if (root->src_fd != -1) {
+        close(root->src_fd);
+    }
+    if (root->dst_fd != -1) {
+        close(root->dst_fd);
+    }
+    free(root->src);
+    free(root->dst);
+    free(root);
+
+out:
+    free(dst_base);
+    if (job.root_fd != -1) {
+        close(job.root_fd);
+    }
+    pthread_cond_destroy(&job.done_cond);
+    pthread_mutex_destroy(&job.done_mutex);
+    pthread_mutex_destroy(&job.flush_mutex);
+    pthread_mutex_destroy(&job.list_mutex);
+
+    *stats = job.stats;
+    if (job.stats.failed > 0) {
+        errno = job.error;
+        return -1;
+    }
+    return 0;
+}
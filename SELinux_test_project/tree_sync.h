@@ -0,0 +1,34 @@
+#ifndef TREE_SYNC_H
+#define TREE_SYNC_H
+
+#include <stdint.h>
+
+// 一次目录树同步的统计
+typedef struct {
+    uint64_t files_updated;    // 内容有变化、已替换的文件(含新建的文件和符号链接)
+    uint64_t files_unchanged;  // 内容未变化的文件
+    uint64_t dirs;             // 同步的目录(含新建的)
+    uint64_t skipped;          // 不支持的类型(设备、管道、socket)
+    uint64_t failed;           // 失败的项
+    uint64_t bytes_total;      // 源文件总大小
+    uint64_t bytes_literal;    // 从源文件复制的字节数
+    uint64_t bytes_reused;     // 复用目标文件的字节数
+} tree_sync_stats;
+
+/**
+ * 将源目录树同步到目标目录，语义与rsync -a --checksum相同
+ * 
+ * 源路径以'/'结尾时同步其中的内容到dst，否则同步到dst下的同名目录；目标中多出的项不删除。
+ * 源目录树由后台任务线程池(task_pool)并行遍历，普通文件按块增量同步到临时文件，
+ * 新建的文件、目录和符号链接创建时即带有不可变上下文，已存在的项也重新设置。
+ * 临时文件分批提交：每批先对目标文件系统落盘一次(syncfs)，再按生成的顺序替换目标文件；
+ * 目录的权限、属主和修改时间在其中所有项提交之后设置。全部完成后再落盘一次才返回。
+ * 
+ * @param src 源目录路径
+ * @param dst 目标目录路径，不存在时创建
+ * @param stats 输出统计信息
+ * @return 全部成功返回 0，有失败的项返回 -1，errno为第一个失败的原因
+ */
+int tree_sync(const char *src, const char *dst, tree_sync_stats *stats);
+
+#endif /* TREE_SYNC_H */
@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring_io.h"
+#include "service_log.h"
+
+#define URING_ENTRIES 64  // 每个线程的提交队列长度，也是一次链接执行的操作数上限
+
+// 直接使用系统调用，不依赖liburing
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;
+    size_t cq_ring_len;
+    size_t sqes_len;
+} uring;
+
+static int uring_available = 0;
+static __thread uring *thread_ring = NULL;
+static __thread int thread_ring_failed = 0;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_free(uring *ring) {
+    if (ring->sqes && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_len);
+    }
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_len);
+    }
+    if (ring->fd != -1) {
+        close(ring->fd);
+    }
+    free(ring);
+}
+
+static uring *uring_create(void) {
+    uring *ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        return NULL;
+    }
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (ring->fd == -1) {
+        int err = errno;
+        free(ring);
+        errno = err;
+        return NULL;
+    }
+    fcntl(ring->fd, F_SETFD, FD_CLOEXEC);
+    ring->entries = p.sq_entries;
+
+    ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && ring->cq_ring_len > ring->sq_ring_len) {
+        ring->sq_ring_len = ring->cq_ring_len;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            goto fail;
+        }
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto fail;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return ring;
+
+fail:
+    {
+        int err = errno;
+        uring_free(ring);
+        errno = err;
+    }
+    return NULL;
+}
+
+// 检查所需的操作是否都被支持(RENAMEAT和UNLINKAT需要5.11以上的内核)
+static int uring_probe_ops(uring *ring) {
+    static const int required[] = {
+        IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_CLOSE, IORING_OP_RENAMEAT, IORING_OP_UNLINKAT
+    };
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (!probe) {
+        return -1;
+    }
+    int ret = 0;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) != 0) {
+        ret = -1;
+    }
+    for (size_t i = 0; ret == 0 && i < sizeof(required) / sizeof(required[0]); i++) {
+        if (required[i] > probe->last_op ||
+            !(probe->ops[required[i]].flags & IO_URING_OP_SUPPORTED)) {
+            errno = EOPNOTSUPP;
+            ret = -1;
+        }
+    }
+    free(probe);
+    return ret;
+}
+
+int uring_io_init(void) {
+    uring *ring = uring_create();
+    if (!ring) {
+        slog(SLOG_INFO, LOG_NOTICE, "io_uring不可用，使用普通系统调用: %s", strerror(errno));
+        return -1;
+    }
+    if (uring_probe_ops(ring) != 0) {
+        slog(SLOG_INFO, LOG_NOTICE, "内核的io_uring不支持所需的操作，使用普通系统调用");
+        uring_free(ring);
+        return -1;
+    }
+    uring_free(ring);
+    uring_available = 1;
+    slog(SLOG_INFO, LOG_NOTICE, "文件操作使用io_uring");
+    return 0;
+}
+
+int uring_io_enabled(void) {
+    return uring_available;
+}
+
+// 取得当前线程的io_uring实例，第一次使用时创建
+static uring *uring_get(void) {
+    if (!uring_available || thread_ring_failed) {
+        return NULL;
+    }
+    if (!thread_ring) {
+        thread_ring = uring_create();
+        if (!thread_ring) {
+            slog(SLOG_ERROR, LOG_WARNING, "无法为工作线程创建io_uring，该线程使用普通系统调用: %s",
+                   strerror(errno));
+            thread_ring_failed = 1;
+        }
+    }
+    return thread_ring;
+}
+
+static void uring_prep(struct io_uring_sqe *sqe, const uring_op *op, unsigned index) {
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = index;
+    switch (op->op) {
+        case URING_WRITE:
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = op->fd;
+            sqe->addr = (unsigned long)op->buf;
+            sqe->len = op->len;
+            sqe->off = 0;
+            break;
+        case URING_FSYNC:
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fd = op->fd;
+            break;
+        case URING_CLOSE:
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = op->fd;
+            break;
+        case URING_RENAME:
+            sqe->opcode = IORING_OP_RENAMEAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (unsigned long)op->path;
+            sqe->len = AT_FDCWD;
+            sqe->addr2 = (unsigned long)op->path2;
+            break;
+        case URING_UNLINK:
+            sqe->opcode = IORING_OP_UNLINKAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (unsigned long)op->path;
+            sqe->unlink_flags = op->flags;
+            break;
+        case URING_RENAMEAT:
+            sqe->opcode = IORING_OP_RENAMEAT;
+            sqe->fd = op->fd;
+            sqe->addr = (unsigned long)op->path;
+            sqe->len = op->fd;
+            sqe->addr2 = (unsigned long)op->path2;
+            break;
+        case URING_UNLINKAT:
+            sqe->opcode = IORING_OP_UNLINKAT;
+            sqe->fd = op->fd;
+            sqe->addr = (unsigned long)op->path;
+            sqe->unlink_flags = op->flags;
+            break;
+    }
+}
+
+// 提交最多一个队列长度的操作并收齐完成事件
+static int uring_run(uring *ring, uring_op *ops, size_t count, int linked) {
+    unsigned tail = *ring->sq_tail;
+    for (size_t i = 0; i < count; i++) {
+        unsigned slot = tail & *ring->sq_mask;
+        uring_prep(&ring->sqes[slot], &ops[i], i);
+        if (linked && i + 1 < count) {
+            ring->sqes[slot].flags |= IOSQE_IO_LINK;
+        }
+        ring->sq_array[slot] = slot;
+        tail++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    size_t submitted = 0;
+    size_t completed = 0;
+    int failed = 0;
+    while (completed < submitted || (!failed && submitted < count)) {
+        unsigned to_submit = failed ? 0 : count - submitted;
+        int n = sys_io_uring_enter(ring->fd, to_submit, completed < count ? 1 : 0,
+                                   IORING_ENTER_GETEVENTS);
+        if (n > 0) {
+            submitted += n;
+        } else if (n == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            if (submitted == 0) {
+                // 一个都没有提交：撤回提交队列中的项
+                __atomic_store_n(ring->sq_tail, tail - count, __ATOMIC_RELEASE);
+                return -1;
+            }
+            // 撤回未提交的项，等待已提交的完成
+            __atomic_store_n(ring->sq_tail, tail - (count - submitted), __ATOMIC_RELEASE);
+            for (size_t i = submitted; i < count; i++) {
+                ops[i].result = -ECANCELED;
+            }
+            failed = 1;
+        }
+
+        unsigned head = *ring->cq_head;
+        unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != cq_tail) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->user_data < count) {
+                ops[cqe->user_data].result = cqe->res;
+            }
+            head++;
+            completed++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+int uring_io_submit(uring_op *ops, size_t count, int linked) {
+    uring *ring = uring_get();
+    if (!ring) {
+        return -1;
+    }
+    if (linked && count > ring->entries) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (size_t done = 0; done < count; ) {
+        size_t n = count - done < ring->entries ? count - done : ring->entries;
+        if (uring_run(ring, ops + done, n, linked) != 0) {
+            if (done == 0) {
+                return -1;
+            }
+            // 前面的操作已执行，之后的标为取消
+            for (size_t i = done; i < count; i++) {
+                ops[i].result = -ECANCELED;
+            }
+            return 0;
+        }
+        done += n;
+    }
+    return 0;
+}
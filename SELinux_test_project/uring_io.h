@@ -0,0 +1,56 @@
+#ifndef URING_IO_H
+#define URING_IO_H
+
+#include <stddef.h>
+
+// 通过io_uring批量提交的文件操作
+typedef enum {
+    URING_WRITE = 1,    // 从偏移0写入buf的len字节到fd
+    URING_FSYNC = 2,    // fsync(fd)
+    URING_CLOSE = 3,    // close(fd)
+    URING_RENAME = 4,   // rename(path, path2)
+    URING_UNLINK = 5,   // unlink(path)，flags可为AT_REMOVEDIR
+    URING_RENAMEAT = 6, // renameat(fd, path, fd, path2)，fd为两者所在的目录
+    URING_UNLINKAT = 7  // unlinkat(fd, path, flags)，fd为所在的目录
+} uring_op_type;
+
+typedef struct {
+    uring_op_type op;
+    int fd;
+    const void *buf;
+    size_t len;
+    const char *path;
+    const char *path2;
+    int flags;
+    int result;         // 输出: 与对应系统调用相同的返回值，失败时为 -errno；被取消时为 -ECANCELED
+} uring_op;
+
+/**
+ * 检查内核是否支持所需的io_uring操作
+ *
+ * 内核不支持io_uring、被sysctl或seccomp禁用、或缺少所需的操作时返回失败，
+ * 之后uring_io_submit总是返回 -1，调用者应使用普通的系统调用。
+ *
+ * @return 可用返回 0，不可用返回 -1
+ */
+int uring_io_init(void);
+
+/**
+ * @return io_uring可用返回 1，否则返回 0
+ */
+int uring_io_enabled(void);
+
+/**
+ * 提交一组操作并等待全部完成，每个线程使用自己的io_uring实例
+ *
+ * linked不为0时各操作依次链接(IOSQE_IO_LINK)：前一个操作失败或写入不完整时，
+ * 之后的操作不执行，result为 -ECANCELED；为0时各操作互不依赖，可能并发执行。
+ *
+ * @param ops 操作数组，结果写回各项的result
+ * @param count 操作数
+ * @param linked 是否链接执行
+ * @return 已执行返回 0(各项结果见result)，io_uring不可用返回 -1，此时没有任何操作被执行
+ */
+int uring_io_submit(uring_op *ops, size_t count, int linked);
+
+#endif /* URING_IO_H */